@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+"""
+BLE / USB Benchmark Runner for XIAO ESP32S3
+
+Drives the firmware's 'ping' and 'bench' commands and measures on the host:
+round-trip time of command/reply pairs, and throughput, packet loss and
+ordering of the benchmark packets. The device's own figures (stalls, stack
+rejections, congestion, packets per connection event) are fetched with
+'bench' at the end of each run and printed next to the host view.
+
+Examples:
+    python ble_benchmark.py                          # BLE, find device by name
+    python ble_benchmark.py --address B8:F8:62:FB:87:6D --sizes 20 100 244
+    python ble_benchmark.py --usb COM9 --sizes 256 1024
+    python ble_benchmark.py --json results.json      # keep results for comparison
+
+Requirements: bleak (BLE) and/or pyserial (USB).
+"""
+
+import argparse
+import asyncio
+import json
+import statistics
+import struct
+import sys
+import time
+
+SERVICE_UUID = "12345678-1234-1234-1234-123456789abc"
+CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654321"
+STREAM_CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654322"
+DEVICE_NAME = "XIAO-ESP32S3-Test"
+
+STREAM_PKT_BENCH = 0x10
+STREAM_HEADER = struct.Struct('<BBHI')     # type, count, seq, t0_us
+STREAM_SYNC = b'\xa5\x5a'
+
+
+def crc16_ccitt(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, matching crc16Ccitt() in the firmware"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+        crc &= 0xFFFF
+    return crc
+
+
+def rtt_summary(rtts_ms):
+    if not rtts_ms:
+        return {'count': 0}
+    ordered = sorted(rtts_ms)
+    return {
+        'count': len(ordered),
+        'min_ms': ordered[0],
+        'mean_ms': statistics.mean(ordered),
+        'p50_ms': ordered[len(ordered) // 2],
+        'p95_ms': ordered[min(len(ordered) - 1, int(len(ordered) * 0.95))],
+        'max_ms': ordered[-1],
+    }
+
+
+def print_rtt(summary):
+    if summary['count'] == 0:
+        print("   ❌ No ping replies received")
+        return
+    print(f"   {summary['count']} pings: min {summary['min_ms']:.1f} ms, mean {summary['mean_ms']:.1f} ms, "
+          f"p50 {summary['p50_ms']:.1f} ms, p95 {summary['p95_ms']:.1f} ms, max {summary['max_ms']:.1f} ms")
+
+
+class BenchReceiver:
+    """Checks benchmark packets for size, order and loss"""
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.packets = 0
+        self.bytes = 0
+        self.lost = 0
+        self.bad = 0
+        self.last_seq = None
+        self.first_time = None
+        self.last_time = None
+
+    def feed(self, payload):
+        if len(payload) < STREAM_HEADER.size:
+            self.bad += 1
+            return
+        pkt_type, _count, seq, _t0_us = STREAM_HEADER.unpack_from(payload, 0)
+        if pkt_type != STREAM_PKT_BENCH:
+            self.bad += 1
+            return
+        if any(payload[i] != (seq + i) & 0xFF for i in range(STREAM_HEADER.size, len(payload))):
+            self.bad += 1
+        if self.last_seq is not None:
+            self.lost += (seq - self.last_seq - 1) & 0xFFFF
+        self.last_seq = seq
+        now = time.perf_counter()
+        if self.first_time is None:
+            self.first_time = now
+        self.last_time = now
+        self.packets += 1
+        self.bytes += len(payload)
+
+    def summary(self):
+        elapsed = (self.last_time - self.first_time) if self.packets > 1 else 0
+        return {
+            'packets': self.packets,
+            'bytes': self.bytes,
+            'lost': self.lost,
+            'bad': self.bad,
+            'seconds': elapsed,
+            'bytes_per_s': self.bytes / elapsed if elapsed else 0,
+        }
+
+
+def print_run(size, host, device_line):
+    print(f"   Host:   {host['bytes_per_s']:.0f} B/s, {host['packets']} packets, "
+          f"{host['lost']} lost, {host['bad']} malformed over {host['seconds']:.1f} s")
+    print(f"   Device: {device_line or '(no result reply)'}")
+
+
+# ---------------------------------------------------------------- BLE
+
+async def run_ble(args):
+    from bleak import BleakClient, BleakScanner
+
+    address = args.address
+    if not address:
+        print(f"🔍 Scanning for '{args.name}'...")
+        device = await BleakScanner.find_device_by_name(args.name, timeout=10.0)
+        if not device:
+            print("❌ Device not found")
+            return None
+        address = device.address
+
+    results = {'transport': 'ble', 'address': address, 'runs': []}
+    replies = asyncio.Queue()
+    receiver = BenchReceiver()
+
+    def on_reply(_sender, data):
+        replies.put_nowait(data.decode('utf-8', errors='ignore'))
+
+    def on_stream(_sender, data):
+        receiver.feed(bytes(data))
+
+    async def command(client, text, expect, timeout=3.0):
+        """Send a command, return (reply, round-trip seconds) for the first reply starting with expect"""
+        while not replies.empty():
+            replies.get_nowait()
+        start = time.perf_counter()
+        await client.write_gatt_char(CHARACTERISTIC_UUID, text.encode(), response=True)
+        deadline = start + timeout
+        while True:
+            remaining = deadline - time.perf_counter()
+            if remaining <= 0:
+                return None, None
+            try:
+                reply = await asyncio.wait_for(replies.get(), remaining)
+            except asyncio.TimeoutError:
+                return None, None
+            if reply.startswith(expect):
+                return reply, time.perf_counter() - start
+
+    print(f"🔗 Connecting to {address}...")
+    async with BleakClient(address) as client:
+        mtu = getattr(client, 'mtu_size', 23)
+        print(f"✅ Connected, MTU {mtu}")
+        results['mtu'] = mtu
+        await client.start_notify(CHARACTERISTIC_UUID, on_reply)
+        await client.start_notify(STREAM_CHARACTERISTIC_UUID, on_stream)
+
+        print(f"\n⏱️  Round trip ({args.pings} pings)")
+        rtts = []
+        for i in range(args.pings):
+            token = f"{i}".ljust(args.ping_size, '.')
+            _reply, rtt = await command(client, f"ping {token}", f"pong {i}")
+            if rtt is not None:
+                rtts.append(rtt * 1000)
+        results['rtt'] = rtt_summary(rtts)
+        print_rtt(results['rtt'])
+
+        for size in args.sizes:
+            print(f"\n📶 Throughput, {size or 'max'}-byte packets for {args.seconds} s")
+            receiver.reset()
+            reply, _ = await command(client, f"bench ble {size} {args.seconds}", "")
+            if not reply or 'started' not in reply:
+                print(f"   ❌ Device refused: {reply}")
+                continue
+            await asyncio.sleep(args.seconds + 1.0)
+            device_line, _ = await command(client, "bench", "bench ble")
+            host = receiver.summary()
+            print_run(size, host, device_line)
+            results['runs'].append({'size': size, 'host': host, 'device': device_line})
+
+        await client.stop_notify(STREAM_CHARACTERISTIC_UUID)
+        await client.stop_notify(CHARACTERISTIC_UUID)
+    return results
+
+
+# ---------------------------------------------------------------- USB
+
+class SerialLink:
+    """Splits the CDC byte stream into text lines and CRC-checked frames"""
+
+    def __init__(self, port, receiver):
+        import serial
+        self.port = serial.Serial(port, 115200, timeout=0.05)
+        self.buffer = bytearray()
+        self.pending = bytearray()
+        self.lines = []
+        self.receiver = receiver
+
+    def poll(self):
+        data = self.port.read(self.port.in_waiting or 1)
+        self.buffer += data
+        while True:
+            idx = self.buffer.find(STREAM_SYNC)
+            text_end = idx if idx >= 0 else max(0, len(self.buffer) - 1)
+            self._text(self.buffer[:text_end])
+            del self.buffer[:text_end]
+            if idx < 0 or len(self.buffer) < 4:
+                return
+            length = self.buffer[2] | (self.buffer[3] << 8)
+            total = 4 + length + 2
+            if len(self.buffer) < total:
+                return
+            crc = self.buffer[4 + length] | (self.buffer[5 + length] << 8)
+            if length >= STREAM_HEADER.size and crc16_ccitt(self.buffer[2:4 + length]) == crc:
+                self.receiver.feed(bytes(self.buffer[4:4 + length]))
+                del self.buffer[:total]
+            else:
+                self._text(self.buffer[:1])
+                del self.buffer[:1]
+
+    def _text(self, data):
+        self.pending += data
+        while b'\n' in self.pending:
+            line, _, rest = self.pending.partition(b'\n')
+            self.pending = bytearray(rest)
+            self.lines.append(line.decode('utf-8', errors='ignore').strip())
+
+    def command(self, text, expect, timeout=3.0):
+        self.lines.clear()
+        start = time.perf_counter()
+        self.port.write((text + '\n').encode())
+        while time.perf_counter() - start < timeout:
+            self.poll()
+            for line in self.lines:
+                if line.startswith(expect):
+                    return line, time.perf_counter() - start
+            self.lines.clear()
+        return None, None
+
+
+def run_usb(args):
+    receiver = BenchReceiver()
+    link = SerialLink(args.usb, receiver)
+    results = {'transport': 'usb', 'port': args.usb, 'runs': []}
+    time.sleep(0.5)
+    link.port.reset_input_buffer()
+
+    print(f"\n⏱️  Round trip ({args.pings} pings)")
+    rtts = []
+    for i in range(args.pings):
+        token = f"{i}".ljust(args.ping_size, '.')
+        _line, rtt = link.command(f"ping {token}", f"pong {i}")
+        if rtt is not None:
+            rtts.append(rtt * 1000)
+    results['rtt'] = rtt_summary(rtts)
+    print_rtt(results['rtt'])
+
+    for size in args.sizes:
+        print(f"\n📶 Throughput, {size or 'max'}-byte packets for {args.seconds} s")
+        receiver.reset()
+        line, _ = link.command(f"bench usb {size} {args.seconds}", "[Bench]")
+        if not line:
+            print("   ❌ Device did not start the run")
+            continue
+        end = time.perf_counter() + args.seconds + 1.0
+        while time.perf_counter() < end:
+            link.poll()
+        # The firmware prints the full report when the run ends; fetch the summary line
+        link.port.write(b"bench\n")
+        device_line = None
+        end = time.perf_counter() + 2.0
+        while time.perf_counter() < end and device_line is None:
+            link.poll()
+            device_line = next((l for l in link.lines if l.startswith("Throughput:")), None)
+        host = receiver.summary()
+        print_run(size, host, device_line)
+        results['runs'].append({'size': size, 'host': host, 'device': device_line})
+
+    link.port.close()
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description="XIAO ESP32S3 BLE/USB benchmark runner")
+    parser.add_argument('--address', help="BLE address (default: scan by name)")
+    parser.add_argument('--name', default=DEVICE_NAME, help="BLE device name to scan for")
+    parser.add_argument('--usb', metavar='PORT', help="benchmark USB CDC on this serial port instead of BLE")
+    parser.add_argument('--sizes', type=int, nargs='+', default=[0],
+                        help="packet sizes in bytes, 0 = largest the link allows")
+    parser.add_argument('--seconds', type=int, default=10, help="duration of each throughput run")
+    parser.add_argument('--pings', type=int, default=50, help="round trips to time")
+    parser.add_argument('--ping-size', type=int, default=16, help="ping payload length")
+    parser.add_argument('--json', metavar='FILE', help="write the results to a JSON file")
+    args = parser.parse_args()
+
+    print("=" * 50)
+    print("XIAO ESP32S3 Benchmark")
+    print("=" * 50)
+
+    if args.usb:
+        results = run_usb(args)
+    else:
+        results = asyncio.run(run_ble(args))
+    if results is None:
+        return 1
+
+    if args.json:
+        results['timestamp'] = time.strftime('%Y-%m-%d %H:%M:%S')
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+        print(f"\n💾 Results written to {args.json}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
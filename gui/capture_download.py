@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""
+Capture Downloader for XIAO ESP32S3
+
+Pulls a PSRAM capture ('cap start' / 'cap stop' on the device) over BLE or
+USB with 'cap get' and writes the records to a CSV file. Every packet names
+the capture index of its first record, so a lost notification, a stalled
+link or a dropped BLE connection is repaired by asking again from the
+first missing index; records already received are kept.
+
+Examples:
+    python capture_download.py capture.csv                  # BLE, find device by name
+    python capture_download.py capture.csv --stop           # end the recording first
+    python capture_download.py capture.csv --usb COM9
+    python capture_download.py capture.csv --first 20000 --count 5000
+
+Requirements: bleak (BLE) and/or pyserial (USB).
+"""
+
+import argparse
+import asyncio
+import csv
+import re
+import struct
+import sys
+import time
+
+from ble_benchmark import (CHARACTERISTIC_UUID, DEVICE_NAME, STREAM_CHARACTERISTIC_UUID,
+                           SerialLink)
+
+STREAM_PKT_CAPTURE = 0x20
+CAPTURE_HEADER = struct.Struct('<BBHI')        # type, count, seq, first index
+CAPTURE_RECORD = struct.Struct('<I10h')        # timestamp_us, acc xyz, gyr xyz, mag xyz, tmp
+STALL_SECONDS = 2.0
+
+
+class CaptureReceiver:
+    """Collects capture records in index order and tracks what is still missing"""
+
+    def __init__(self):
+        self.next = 0
+        self.end = 0
+        self.records = []
+        self.done = False
+        self.gap = False
+        self.last_time = time.perf_counter()
+
+    def feed(self, payload):
+        if len(payload) < CAPTURE_HEADER.size or payload[0] != STREAM_PKT_CAPTURE:
+            return
+        _type, count, _seq, index = CAPTURE_HEADER.unpack_from(payload, 0)
+        if len(payload) != CAPTURE_HEADER.size + count * CAPTURE_RECORD.size:
+            self.gap = True
+            return
+        self.last_time = time.perf_counter()
+        if count == 0:
+            # End of transfer: complete only if nothing went missing before it
+            if index == self.next:
+                self.done = True
+            else:
+                self.gap = True
+            return
+        if index > self.next:
+            self.gap = True
+            return
+        skip = self.next - index
+        for i in range(skip, count):
+            record = CAPTURE_RECORD.unpack_from(payload, CAPTURE_HEADER.size + i * CAPTURE_RECORD.size)
+            self.records.append((index + i,) + record)
+        self.next = max(self.next, index + count)
+
+    def select(self, held, first, count):
+        """Pick the range to fetch from the held range (first, end) reported by the device"""
+        self.next = min(max(first, held[0]), held[1])
+        self.end = min(self.next + count, held[1]) if count else held[1]
+
+    def request(self):
+        return f"cap get {self.next} {self.end - self.next}"
+
+    def stalled(self):
+        return self.gap or time.perf_counter() - self.last_time > STALL_SECONDS
+
+    def restart(self):
+        self.gap = False
+        self.last_time = time.perf_counter()
+
+
+def parse_held(reply):
+    """'... <first>..<end>' from 'cap status' -> (first, end), or None"""
+    match = re.search(r'(\d+)\.\.(\d+)', reply or '')
+    return (int(match.group(1)), int(match.group(2))) if match else None
+
+
+def write_csv(path, records):
+    with open(path, 'w', newline='') as f:
+        writer = csv.writer(f)
+        writer.writerow(['index', 'timestamp_us', 'ax', 'ay', 'az', 'gx', 'gy', 'gz', 'mx', 'my', 'mz', 'tmp'])
+        writer.writerows(records)
+
+
+def print_progress(receiver, started):
+    elapsed = time.perf_counter() - started
+    rate = len(receiver.records) / elapsed if elapsed else 0
+    print(f"\r   {receiver.next}/{receiver.end}, {len(receiver.records)} records, {rate:.0f} records/s",
+          end='', flush=True)
+
+
+# ---------------------------------------------------------------- BLE
+
+async def run_ble(args):
+    from bleak import BleakClient, BleakScanner
+
+    address = args.address
+    if not address:
+        print(f"🔍 Scanning for '{args.name}'...")
+        device = await BleakScanner.find_device_by_name(args.name, timeout=10.0)
+        if not device:
+            print("❌ Device not found")
+            return None
+        address = device.address
+
+    receiver = CaptureReceiver()
+    replies = asyncio.Queue()
+    started = time.perf_counter()
+
+    def on_reply(_sender, data):
+        replies.put_nowait(data.decode('utf-8', errors='ignore'))
+
+    def on_stream(_sender, data):
+        receiver.feed(bytes(data))
+
+    async def command(client, text, expect, timeout=3.0):
+        while not replies.empty():
+            replies.get_nowait()
+        await client.write_gatt_char(CHARACTERISTIC_UUID, text.encode(), response=True)
+        try:
+            while True:
+                reply = await asyncio.wait_for(replies.get(), timeout)
+                if reply.startswith(expect):
+                    return reply
+        except asyncio.TimeoutError:
+            return None
+
+    for attempt in range(args.retries + 1):
+        if attempt:
+            print(f"\n🔁 Resuming from index {receiver.next} (attempt {attempt + 1})")
+        try:
+            async with BleakClient(address) as client:
+                print(f"✅ Connected to {address}, MTU {getattr(client, 'mtu_size', 23)}")
+                await client.start_notify(CHARACTERISTIC_UUID, on_reply)
+                await client.start_notify(STREAM_CHARACTERISTIC_UUID, on_stream)
+                if attempt == 0:
+                    if args.stop:
+                        await command(client, "cap stop", "cap")
+                    held = parse_held(await command(client, "cap status", "cap"))
+                    if held is None:
+                        print("❌ No capture status reply")
+                        return None
+                    receiver.select(held, args.first, args.count)
+                    print(f"📦 Device holds {held[0]}..{held[1]}, fetching {receiver.next}..{receiver.end}")
+                while not receiver.done:
+                    reply = await command(client, receiver.request(), "cap")
+                    if not reply or not reply.startswith("cap get"):
+                        print(f"\n❌ Device refused the download: {reply}")
+                        return receiver
+                    receiver.restart()
+                    while not receiver.done and not receiver.stalled() and client.is_connected:
+                        await asyncio.sleep(0.25)
+                        print_progress(receiver, started)
+                    if not client.is_connected:
+                        break
+                    if not receiver.done:
+                        await command(client, "cap get stop", "cap")
+                if receiver.done:
+                    await client.stop_notify(STREAM_CHARACTERISTIC_UUID)
+                    await client.stop_notify(CHARACTERISTIC_UUID)
+                    break
+        except Exception as e:
+            print(f"\n⚠️  Link error: {e}")
+    return receiver
+
+
+# ---------------------------------------------------------------- USB
+
+def run_usb(args):
+    receiver = CaptureReceiver()
+    link = SerialLink(args.usb, receiver)
+    started = time.perf_counter()
+    time.sleep(0.5)
+    link.port.reset_input_buffer()
+    if args.stop:
+        link.command("cap stop", "[Capture]")
+    line, _ = link.command("cap status", "Records:")
+    held = parse_held(line)
+    if held is None:
+        print("❌ No capture status reply")
+        link.port.close()
+        return None
+    receiver.select(held, args.first, args.count)
+    print(f"📦 Device holds {held[0]}..{held[1]}, fetching {receiver.next}..{receiver.end}")
+
+    while not receiver.done:
+        line, _ = link.command(receiver.request(), "cap get")
+        if not line:
+            print("\n❌ Device refused the download (recording, ustream on or nothing captured?)")
+            break
+        receiver.restart()
+        shown = time.perf_counter()
+        while not receiver.done and not receiver.stalled():
+            link.poll()
+            if time.perf_counter() - shown > 0.25:
+                print_progress(receiver, started)
+                shown = time.perf_counter()
+        if not receiver.done:
+            link.command("cap get stop", "[Capture]")
+            print(f"\n🔁 Resuming from index {receiver.next}")
+
+    link.port.close()
+    return receiver
+
+
+def main():
+    parser = argparse.ArgumentParser(description="XIAO ESP32S3 PSRAM capture downloader")
+    parser.add_argument('output', help="CSV file to write")
+    parser.add_argument('--address', help="BLE address (default: scan by name)")
+    parser.add_argument('--name', default=DEVICE_NAME, help="BLE device name to scan for")
+    parser.add_argument('--usb', metavar='PORT', help="download over USB CDC on this serial port instead of BLE")
+    parser.add_argument('--first', type=int, default=0, help="first capture index (default: oldest held)")
+    parser.add_argument('--count', type=int, default=0, help="records to fetch, 0 = all")
+    parser.add_argument('--stop', action='store_true', help="send 'cap stop' before downloading")
+    parser.add_argument('--retries', type=int, default=5, help="BLE reconnect attempts")
+    args = parser.parse_args()
+
+    print("=" * 50)
+    print("XIAO ESP32S3 Capture Download")
+    print("=" * 50)
+
+    started = time.perf_counter()
+    if args.usb:
+        receiver = run_usb(args)
+    else:
+        receiver = asyncio.run(run_ble(args))
+    if receiver is None or not receiver.records:
+        return 1
+
+    elapsed = time.perf_counter() - started
+    write_csv(args.output, receiver.records)
+    span = (receiver.records[-1][1] - receiver.records[0][1]) & 0xFFFFFFFF
+    print(f"\n💾 {len(receiver.records)} records ({span / 1e6:.3f} s of data) in {elapsed:.1f} s -> {args.output}")
+    return 0 if receiver.done else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
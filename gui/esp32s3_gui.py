@@ -9,12 +9,14 @@ Features:
 - Command sending interface
 - Connection status monitoring
 - Device information display
+- Live plot and .npy recording of the binary sensor stream (numpy)
 
 Requirements:
 - Python 3.7+
 - tkinter (usually included with Python)
 - pyserial
 - bleak (for BLE communication)
+- numpy (for the live plot and recording)
 
 Author: GitHub Copilot
 Date: November 2025
@@ -32,6 +34,9 @@ import json
 import os
 import concurrent.futures
 
+from stream_pipeline import AGMT_COLUMNS, NUMPY_AVAILABLE, QUAT_COLUMNS, StreamPipeline
+from stream_protocol import CLOCK_SYNC_OP_PING, CLOCK_SYNC_PING, decode_sync_reply, host_clock_us
+
 try:
     from bleak import BleakClient, BleakScanner
     BLEAK_AVAILABLE = True
@@ -40,6 +45,28 @@ except ImportError:
     print("Warning: bleak not installed. BLE functionality will be disabled.")
     print("Install with: pip install bleak")
 
+if NUMPY_AVAILABLE:
+    import numpy as np
+else:
+    print("Warning: numpy not installed. Live plot and recording will be disabled.")
+    print("Install with: pip install numpy")
+
+UI_FPS = 25                     # message and plot refresh rate
+UI_MESSAGES_PER_FRAME = 500     # queued lines moved into the displays per refresh
+MAX_MESSAGE_LINES = 5000        # older lines are dropped from the displays
+
+# Plot channel -> (sample kind, sample columns)
+PLOT_CHANNELS = {
+    "Accelerometer": ('agmt', (1, 2, 3)),
+    "Gyroscope": ('agmt', (4, 5, 6)),
+    "Magnetometer": ('agmt', (7, 8, 9)),
+    "Quaternion": ('quat', (1, 2, 3, 4)),
+}
+PLOT_COLORS = ('#d62728', '#2ca02c', '#1f77b4', '#ff7f0e')
+
+CLOCK_SYNC_PERIOD_S = 1.0       # BLE clock sync ping interval
+CLOCK_SYNC_REPORT_EVERY = 10    # pings between estimates written back to the node
+
 class AsyncioManager:
     """Manages asyncio operations in a separate thread to avoid conflicts with tkinter"""
     
@@ -92,6 +119,14 @@ class ESP32S3_GUI:
         # BLE UUIDs (matching your ESP32S3 code)
         self.SERVICE_UUID = "12345678-1234-1234-1234-123456789abc"
         self.CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654321"
+        self.STREAM_CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654322"
+        self.SYNC_CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654324"
+        self.SPECTRUM_CHARACTERISTIC_UUID = "87654321-4321-4321-4321-cba987654325"
+        
+        # Binary stream decoding and recording run on the pipeline's threads
+        self.pipeline = StreamPipeline()
+        self.is_recording = False
+        self.sync_sent = {}         # clock sync seq -> host send time
         
         # Threading
         self.serial_thread = None
@@ -104,6 +139,7 @@ class ESP32S3_GUI:
         # Setup GUI
         self.setup_gui()
         self.refresh_serial_ports()
+        self.refresh_ui()
         
         # Auto-scan for BLE devices if bleak is available (disabled to prevent asyncio issues)
         # if BLEAK_AVAILABLE:
@@ -122,6 +158,10 @@ class ESP32S3_GUI:
         if BLEAK_AVAILABLE:
             self.setup_ble_tab()
         
+        # Live Plot Tab
+        if NUMPY_AVAILABLE:
+            self.setup_plot_tab()
+        
         # Settings Tab
         self.setup_settings_tab()
         
@@ -184,6 +224,8 @@ class ESP32S3_GUI:
         ttk.Button(quick_frame, text="Test (t)", command=lambda: self.send_serial_command_direct("t")).pack(side='left', padx=2)
         ttk.Button(quick_frame, text="IMU (i)", command=lambda: self.send_serial_command_direct("i")).pack(side='left', padx=2)
         ttk.Button(quick_frame, text="Memory (m)", command=lambda: self.send_serial_command_direct("m")).pack(side='left', padx=2)
+        ttk.Button(quick_frame, text="Stream On", command=lambda: self.send_serial_command_direct("ustream on")).pack(side='left', padx=2)
+        ttk.Button(quick_frame, text="Stream Off", command=lambda: self.send_serial_command_direct("ustream off")).pack(side='left', padx=2)
         ttk.Button(quick_frame, text="Send", command=self.send_serial_command).pack(side='left', padx=2)
     
     def setup_ble_tab(self):
@@ -236,6 +278,40 @@ class ESP32S3_GUI:
         
         ttk.Button(ble_cmd_frame, text="Send BLE", command=self.send_ble_message).pack(side='right')
     
+    def setup_plot_tab(self):
+        """Setup live stream plot tab"""
+        self.plot_frame = ttk.Frame(self.notebook)
+        self.notebook.add(self.plot_frame, text="Live Plot")
+        
+        # Plot controls
+        ctrl_frame = ttk.LabelFrame(self.plot_frame, text="Stream Plot", padding=10)
+        ctrl_frame.pack(fill='x', padx=5, pady=5)
+        
+        ttk.Label(ctrl_frame, text="Channel:").grid(row=0, column=0, sticky='w', padx=(0,5))
+        self.plot_channel_var = tk.StringVar(value="Accelerometer")
+        ttk.Combobox(ctrl_frame, textvariable=self.plot_channel_var, width=14, state='readonly',
+                     values=list(PLOT_CHANNELS)).grid(row=0, column=1, padx=(0,5))
+        
+        ttk.Label(ctrl_frame, text="Window (s):").grid(row=0, column=2, sticky='w', padx=(10,5))
+        self.plot_window_var = tk.StringVar(value="5")
+        ttk.Combobox(ctrl_frame, textvariable=self.plot_window_var, width=5,
+                     values=["1", "2", "5", "10", "30", "60"]).grid(row=0, column=3, padx=(0,5))
+        
+        # Recording
+        self.record_btn = ttk.Button(ctrl_frame, text="Start Recording", command=self.toggle_recording)
+        self.record_btn.grid(row=0, column=4, padx=(10,5))
+        self.record_var = tk.StringVar(value="Not recording")
+        ttk.Label(ctrl_frame, textvariable=self.record_var).grid(row=0, column=5, sticky='w', padx=(5,0))
+        
+        # Plot area: the items are created once and moved with coords() every frame
+        canvas_frame = ttk.LabelFrame(self.plot_frame, text="Samples", padding=10)
+        canvas_frame.pack(fill='both', expand=True, padx=5, pady=5)
+        
+        self.plot_canvas = tk.Canvas(canvas_frame, background='white', highlightthickness=0)
+        self.plot_canvas.pack(fill='both', expand=True)
+        self.plot_lines = [self.plot_canvas.create_line(0, 0, 0, 0, fill=color) for color in PLOT_COLORS]
+        self.plot_label = self.plot_canvas.create_text(5, 5, anchor='nw', text="No stream data")
+    
     def setup_settings_tab(self):
         """Setup settings and information tab"""
         settings_frame = ttk.Frame(self.notebook)
@@ -254,7 +330,9 @@ class ESP32S3_GUI:
                                       "• Real-time message monitoring\n"
                                       "• Interactive command interface\n\n"
                                       "BLE Service UUID: 12345678-1234-1234-1234-123456789abc\n"
-                                      "BLE Characteristic UUID: 87654321-4321-4321-4321-cba987654321\n")
+                                      "BLE Characteristic UUID: 87654321-4321-4321-4321-cba987654321\n"
+                                      "BLE Stream Characteristic UUID: 87654321-4321-4321-4321-cba987654322\n"
+                                      "BLE Sync Characteristic UUID: 87654321-4321-4321-4321-cba987654324\n")
         
         # Settings frame
         settings_inner_frame = ttk.LabelFrame(settings_frame, text="Application Settings", padding=10)
@@ -340,16 +418,18 @@ class ESP32S3_GUI:
         self.update_connection_status()
     
     def read_serial_messages(self):
-        """Read messages from serial port in separate thread"""
+        """Read raw bytes from serial port in separate thread; the pipeline splits text from stream frames"""
+        self.pipeline.reset('serial')
         while not self.stop_threads and self.is_connected_serial:
             try:
-                if self.serial_connection and self.serial_connection.in_waiting:
-                    message = self.serial_connection.readline().decode('utf-8', errors='ignore').strip()
-                    if message:
-                        self.root.after(0, lambda: self.add_serial_message(message, "received"))
-                time.sleep(0.1)
+                waiting = self.serial_connection.in_waiting if self.serial_connection else 0
+                if not waiting:
+                    time.sleep(0.01)
+                    continue
+                
+                self.pipeline.feed_serial(self.serial_connection.read(waiting))
             except Exception as e:
-                self.root.after(0, lambda: self.update_status(f"Serial read error: {str(e)}"))
+                self.root.after(0, lambda err=e: self.update_status(f"Serial read error: {str(err)}"))
                 break
     
     def send_serial_command(self, event=None):
@@ -641,6 +721,9 @@ class ESP32S3_GUI:
                 services = self.ble_client.services
                 service_found = False
                 characteristic_found = False
+                stream_found = False
+                sync_found = False
+                spectrum_found = False
                 
                 for service in services:
                     if service.uuid.lower() == self.SERVICE_UUID.lower():
@@ -648,7 +731,12 @@ class ESP32S3_GUI:
                         for char in service.characteristics:
                             if char.uuid.lower() == self.CHARACTERISTIC_UUID.lower():
                                 characteristic_found = True
-                                break
+                            elif char.uuid.lower() == self.STREAM_CHARACTERISTIC_UUID.lower():
+                                stream_found = True
+                            elif char.uuid.lower() == self.SYNC_CHARACTERISTIC_UUID.lower():
+                                sync_found = True
+                            elif char.uuid.lower() == self.SPECTRUM_CHARACTERISTIC_UUID.lower():
+                                spectrum_found = True
                         break
                 
                 if not service_found:
@@ -670,7 +758,22 @@ class ESP32S3_GUI:
                 # Subscribe to notifications
                 await self.ble_client.start_notify(self.CHARACTERISTIC_UUID, self._ble_notification_handler)
                 
+                # Binary samples ("bstream on") arrive on their own characteristic
+                if stream_found:
+                    self.pipeline.reset('ble')
+                    await self.ble_client.start_notify(self.STREAM_CHARACTERISTIC_UUID, self._ble_stream_handler)
+                
+                # Spectral features ("spec on") decode through the same pipeline
+                if spectrum_found:
+                    await self.ble_client.start_notify(self.SPECTRUM_CHARACTERISTIC_UUID, self._ble_stream_handler)
+                
+                # Clock sync replies, to put this node's samples on the host clock
+                if sync_found:
+                    await self.ble_client.start_notify(self.SYNC_CHARACTERISTIC_UUID, self._ble_sync_handler)
+                
                 self.is_connected_ble = True
+                if sync_found:
+                    asyncio.ensure_future(self._clock_sync_loop(self.ble_client))
                 self.root.after(0, lambda: self._ble_connected(device))
                 return  # Success!
                 
@@ -737,10 +840,41 @@ class ESP32S3_GUI:
         """Handle BLE notifications"""
         try:
             message = data.decode('utf-8', errors='ignore').strip()
-            self.root.after(0, lambda: self.add_ble_message(f"[BLE] {message}", "received"))
+            self.pipeline.messages.put(('ble', f"[BLE] {message}", "received"))
         except Exception as e:
             print(f"BLE notification error: {e}")
     
+    def _ble_stream_handler(self, sender, data):
+        """Handle BLE stream notifications, one binary packet each"""
+        self.pipeline.feed_ble(data)
+    
+    def _ble_sync_handler(self, sender, data):
+        """Handle clock sync replies; the arrival time is taken first"""
+        t4_us = host_clock_us()
+        reply = decode_sync_reply(bytes(data))
+        t1_us = self.sync_sent.pop(reply['seq'], None) if reply else None
+        if t1_us is not None:
+            self.pipeline.feed_sync('ble', t1_us, reply, t4_us)
+    
+    async def _clock_sync_loop(self, client):
+        """Ping the node's clock every CLOCK_SYNC_PERIOD_S and write the fit back now and then"""
+        seq = 0
+        while self.is_connected_ble and self.ble_client is client:
+            seq = (seq + 1) & 0xFFFF
+            self.sync_sent.pop((seq - 32) & 0xFFFF, None)   # its reply never came
+            self.sync_sent[seq] = host_clock_us()
+            try:
+                await client.write_gatt_char(self.SYNC_CHARACTERISTIC_UUID,
+                                             CLOCK_SYNC_PING.pack(CLOCK_SYNC_OP_PING, 0, seq), response=True)
+                if seq % CLOCK_SYNC_REPORT_EVERY == 0:
+                    report = self.pipeline.clock('ble').report()
+                    if report:
+                        await client.write_gatt_char(self.SYNC_CHARACTERISTIC_UUID, report, response=True)
+            except Exception as e:
+                print(f"BLE clock sync error: {e}")
+                break
+            await asyncio.sleep(CLOCK_SYNC_PERIOD_S)
+    
     def send_ble_message(self, event=None):
         """Send message via BLE"""
         if not self.is_connected_ble:
@@ -771,8 +905,8 @@ class ESP32S3_GUI:
         if self.ble_client:
             await self.ble_client.write_gatt_char(self.CHARACTERISTIC_UUID, message.encode())
     
-    def add_serial_message(self, message, msg_type):
-        """Add message to serial display"""
+    def format_message(self, message, msg_type):
+        """Format one display line with timestamp and direction prefix"""
         timestamp = datetime.now().strftime("%H:%M:%S") if self.timestamp_var.get() else ""
         
         if msg_type == "sent":
@@ -782,32 +916,112 @@ class ESP32S3_GUI:
         else:
             prefix = "● "
         
-        full_message = f"{timestamp} {prefix}{message}\n" if timestamp else f"{prefix}{message}\n"
-        
-        self.serial_messages.insert(tk.END, full_message)
+        return f"{timestamp} {prefix}{message}\n" if timestamp else f"{prefix}{message}\n"
+    
+    def insert_messages(self, widget, text):
+        """Append formatted lines to a display, dropping the oldest beyond MAX_MESSAGE_LINES"""
+        widget.insert(tk.END, text)
+        lines = int(widget.index('end-1c').split('.')[0])
+        if lines > MAX_MESSAGE_LINES:
+            widget.delete('1.0', f"{lines - MAX_MESSAGE_LINES + 1}.0")
         if self.auto_scroll_var.get():
-            self.serial_messages.see(tk.END)
-        
+            widget.see(tk.END)
+    
+    def add_serial_message(self, message, msg_type):
+        """Add message to serial display"""
+        self.insert_messages(self.serial_messages, self.format_message(message, msg_type))
         self.message_count += 1
     
     def add_ble_message(self, message, msg_type):
         """Add message to BLE display"""
-        timestamp = datetime.now().strftime("%H:%M:%S") if self.timestamp_var.get() else ""
-        
-        if msg_type == "sent":
-            prefix = "→ "
-        elif msg_type == "received":
-            prefix = "← "
-        else:
-            prefix = "● "
-        
-        full_message = f"{timestamp} {prefix}{message}\n" if timestamp else f"{prefix}{message}\n"
+        self.insert_messages(self.ble_messages, self.format_message(message, msg_type))
+        self.message_count += 1
+    
+    def refresh_ui(self):
+        """Move queued messages into the displays and redraw the plot, once per frame"""
+        batches = {'serial': [], 'ble': []}
+        for source, message, msg_type in self.pipeline.drain_messages(UI_MESSAGES_PER_FRAME):
+            batches[source].append(self.format_message(message, msg_type))
+        
+        # One insert per display and frame, however fast lines arrive
+        if batches['serial']:
+            self.insert_messages(self.serial_messages, ''.join(batches['serial']))
+        if batches['ble'] and hasattr(self, 'ble_messages'):
+            self.insert_messages(self.ble_messages, ''.join(batches['ble']))
+        self.message_count += len(batches['serial']) + len(batches['ble'])
+        
+        if NUMPY_AVAILABLE:
+            if self.is_recording:
+                self.record_var.set(f"Recording: {self.pipeline.recorded_rows} samples")
+            if self.notebook.select() == str(self.plot_frame):
+                self.draw_plot()
+        
+        self.root.after(1000 // UI_FPS, self.refresh_ui)
+    
+    def draw_plot(self):
+        """Draw the last window of stream samples, decimated to min/max per pixel column"""
+        channel = self.plot_channel_var.get()
+        kind, columns = PLOT_CHANNELS[channel]
+        try:
+            window = max(0.1, float(self.plot_window_var.get()))
+        except ValueError:
+            window = 5.0
+        width = self.plot_canvas.winfo_width()
+        height = self.plot_canvas.winfo_height()
+        
+        rows = self.pipeline.snapshot(kind, window)
+        if rows is None or len(rows) < 2 or width < 2 or height < 40:
+            for line in self.plot_lines:
+                self.plot_canvas.coords(line, 0, 0, 0, 0)
+            self.plot_canvas.itemconfigure(self.plot_label, text="No stream data")
+            return
         
-        self.ble_messages.insert(tk.END, full_message)
-        if self.auto_scroll_var.get():
-            self.ble_messages.see(tk.END)
+        # Each sample's pixel column; a run of samples in one column is drawn
+        # as a vertical stroke from its minimum to its maximum
+        t_us = rows[:, 0]
+        pixel = (((t_us - t_us[-1]) / (window * 1e6) + 1.0) * (width - 1)).astype(np.int64)
+        starts = np.flatnonzero(np.diff(pixel, prepend=-1))
+        values = rows[:, columns].astype(np.float64)
+        lows = np.minimum.reduceat(values, starts, axis=0)
+        highs = np.maximum.reduceat(values, starts, axis=0)
+        
+        low, high = lows.min(), highs.max()
+        scale = (height - 30) / ((high - low) or 1.0)
+        xs = np.repeat(pixel[starts].astype(np.float64), 2)
+        ys = np.empty(len(xs))
+        for i, line in enumerate(self.plot_lines):
+            if i >= len(columns):
+                self.plot_canvas.coords(line, 0, 0, 0, 0)
+                continue
+            ys[0::2] = lows[:, i]
+            ys[1::2] = highs[:, i]
+            points = np.column_stack((xs, height - 5 - (ys - low) * scale))
+            self.plot_canvas.coords(line, points.ravel().tolist())
+        
+        names = AGMT_COLUMNS if kind == 'agmt' else QUAT_COLUMNS
+        legend = ", ".join(names[c] for c in columns)
+        self.plot_canvas.itemconfigure(self.plot_label,
+            text=f"{channel} ({legend}): {len(rows)} samples, {low:.4g} to {high:.4g}")
+    
+    def toggle_recording(self):
+        """Start or stop recording the stream to .npy files"""
+        if self.is_recording:
+            self.pipeline.stop_recording()
+            self.is_recording = False
+            self.record_btn.config(text="Start Recording")
+            self.record_var.set("Not recording")
+            return
         
-        self.message_count += 1
+        filename = filedialog.asksaveasfilename(
+            defaultextension=".npy",
+            initialfile=f"stream_{datetime.now().strftime('%Y%m%d_%H%M%S')}.npy",
+            filetypes=[("NumPy arrays", "*.npy"), ("All files", "*.*")]
+        )
+        if filename:
+            self.pipeline.start_recording(filename)
+            self.is_recording = True
+            self.record_btn.config(text="Stop Recording")
+            self.update_status(f"Recording stream to {os.path.splitext(filename)[0]}_<link>_<kind>.npy")
     
     def clear_all_messages(self):
         """Clear all message displays"""
@@ -854,6 +1068,7 @@ Features:
 • USB Serial communication with configurable baud rates
 • BLE device scanning and GATT communication
 • Real-time message monitoring and logging
+• Live plot and .npy recording of the sensor stream
 • Interactive command interface with quick buttons
 • Message saving and timestamps
 • Cross-platform compatibility
@@ -862,6 +1077,7 @@ Requirements:
 • Python 3.7 or newer
 • pyserial library for USB Serial communication
 • bleak library for BLE communication (optional)
+• numpy for the live plot and recording (optional)
 • tkinter (included with most Python installations)
 
 Created with GitHub Copilot
@@ -901,6 +1117,9 @@ November 2025"""
         if self.asyncio_manager:
             self.asyncio_manager.shutdown()
         
+        # Finish any recording
+        self.pipeline.stop()
+        
         # Wait a moment for cleanup
         time.sleep(0.5)
         self.root.destroy()
@@ -13,6 +13,7 @@ def install_requirements():
     requirements = [
         'pyserial',
         'bleak',
+        'numpy',
     ]
     
     print("Installing required packages...")
@@ -63,7 +64,7 @@ def main():
                 print(f"Error launching GUI: {e}")
     else:
         print("\n✗ Setup failed. Please install packages manually:")
-        print("  pip install pyserial bleak")
+        print("  pip install pyserial bleak numpy")
     
     input("\nPress Enter to exit...")
 
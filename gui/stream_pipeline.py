@@ -0,0 +1,442 @@
+"""
+High-rate receiver pipeline for the binary sensor stream
+
+Raw bytes from the serial reader, BLE stream notifications and Wi-Fi UDP
+datagrams go into a queue; one decoder thread frames, CRC-checks and decodes them into numpy
+arrays, unwraps the 32-bit device timestamps, keeps a ring of recent
+samples per link and sample kind for plotting and hands samples to the
+recorders. Clock sync exchanges go through the same thread: they keep a
+ClockSync fit per link and, once one has run, put the unwrapped sample
+timestamps on the node's full 64-bit clock that the fit maps to the host. The GUI thread only drains text and takes ring snapshots at its
+own frame rate, so neither the link rate nor disk speed reach the UI loop.
+
+Without numpy the pipeline still decodes and summarises the stream, but
+keeps no sample history and cannot record.
+"""
+
+import queue
+import struct
+import threading
+import time
+
+try:
+    import numpy as np
+    NUMPY_AVAILABLE = True
+except ImportError:
+    np = None
+    NUMPY_AVAILABLE = False
+
+from stream_protocol import (STREAM_HEADER, STREAM_PKT_AGMT, STREAM_PKT_DELTA, STREAM_PKT_SPECTRUM,
+                             STREAM_RECORDS, ClockSync, StreamFrameDecoder, StreamStats,
+                             _decode_delta_records, decode_spectrum_packet, decode_stream_packet,
+                             format_spectrum)
+
+RING_ROWS = 1 << 17             # per link and kind: about two minutes at 1.1 kHz
+RECORD_FLUSH_ROWS = 4096        # rows gathered before one write
+RECORD_FLUSH_SECONDS = 0.5      # ... or this long after the last write
+NPY_HEADER_BYTES = 128          # fixed, so the final shape can be written in place
+
+AGMT_COLUMNS = ('t_us', 'ax', 'ay', 'az', 'gx', 'gy', 'gz', 'mx', 'my', 'mz', 'tmp')
+QUAT_COLUMNS = ('t_us', 'w', 'x', 'y', 'z', 'accuracy')
+SYNC_COLUMNS = ('t1_host_us', 't2_node_us', 't3_node_us', 't4_host_us', 'seq', 'node_id')
+
+if NUMPY_AVAILABLE:
+    # Mirrors STREAM_RECORD / STREAM_QUAT_RECORD
+    AGMT_DTYPE = np.dtype([('dt', '<u2'), ('v', '<i2', (10,))])
+    QUAT_DTYPE = np.dtype([('dt', '<u2'), ('q', '<i4', (3,)), ('acc', '<i2')])
+
+def decode_packet_array(payload):
+    """Like decode_stream_packet, but 'samples' is a 2-D array with the same columns.
+
+    AGMT packets give an int64 (n, 11) array laid out as AGMT_COLUMNS,
+    quaternion packets a float64 (n, 6) array laid out as QUAT_COLUMNS.
+    Timestamps are t0_us plus the accumulated dt_us and are not wrapped to
+    32 bits, so a packet that crosses the wrap stays monotonic. Spectral
+    feature packets decode as decode_spectrum_packet().
+    """
+    if payload[:1] == bytes((STREAM_PKT_SPECTRUM,)):
+        return decode_spectrum_packet(payload)
+    if len(payload) < STREAM_HEADER.size:
+        return None
+    pkt_type, count, seq, t0_us = STREAM_HEADER.unpack_from(payload, 0)
+    delta = bool(pkt_type & STREAM_PKT_DELTA)
+    pkt_type &= ~STREAM_PKT_DELTA
+    record_fmt = STREAM_RECORDS.get(pkt_type)
+    if record_fmt is None:
+        return None
+    agmt = pkt_type == STREAM_PKT_AGMT
+    n_values = 10 if agmt else 4
+
+    if delta:
+        try:
+            records = _decode_delta_records(payload, pkt_type, count)
+        except ValueError:
+            return None
+        table = np.array(records, dtype=np.int64).reshape(count, 1 + n_values)
+        dt = table[:, 0]
+        values = table[:, 1:]
+    else:
+        if len(payload) != STREAM_HEADER.size + count * record_fmt.size:
+            return None
+        dtype = AGMT_DTYPE if agmt else QUAT_DTYPE
+        records = np.frombuffer(payload, dtype, count, STREAM_HEADER.size) if count else np.zeros(0, dtype)
+        dt = records['dt']
+        values = records['v'] if agmt else np.column_stack((records['q'], records['acc']))
+
+    t_us = t0_us + np.cumsum(dt, dtype=np.int64)
+    if agmt:
+        samples = np.empty((count, 1 + n_values), dtype=np.int64)
+        samples[:, 0] = t_us
+        samples[:, 1:] = values
+    else:
+        samples = np.empty((count, 6), dtype=np.float64)
+        samples[:, 0] = t_us
+        xyz = values[:, :3] / 1073741824.0
+        samples[:, 1] = np.sqrt(np.maximum(0.0, 1.0 - np.sum(xyz * xyz, axis=1)))
+        samples[:, 2:5] = xyz
+        samples[:, 5] = values[:, 3]
+    return {'type': pkt_type, 'delta': delta, 'seq': seq, 't0_us': t0_us, 'samples': samples,
+            'bytes': len(payload)}
+
+class SampleRing:
+    """Fixed-size ring of sample rows, written by the decoder thread and read by the GUI"""
+
+    def __init__(self, width, dtype, capacity=RING_ROWS):
+        self.data = np.zeros((capacity, width), dtype=dtype)
+        self.capacity = capacity
+        self.written = 0
+        self.lock = threading.Lock()
+
+    def extend(self, rows):
+        rows = rows[-self.capacity:]
+        n = len(rows)
+        with self.lock:
+            start = self.written % self.capacity
+            first = min(n, self.capacity - start)
+            self.data[start:start + first] = rows[:first]
+            self.data[:n - first] = rows[first:]
+            self.written += n
+
+    def since(self, t_min):
+        """Copy of the rows with a timestamp of at least t_min, oldest first"""
+        with self.lock:
+            end = self.written % self.capacity
+            if self.written <= self.capacity:
+                segments = (self.data[:self.written],)
+            else:
+                segments = (self.data[end:], self.data[:end])
+            # Timestamps ascend within each segment
+            parts = [seg[np.searchsorted(seg[:, 0], t_min):] for seg in segments]
+            return np.concatenate(parts)
+
+class NpyRecorder:
+    """Appends sample rows to a .npy file from a writer thread, in batches.
+
+    The header is written with a row count of zero and fixed at
+    NPY_HEADER_BYTES, then rewritten with the final shape on close, so the
+    file loads with np.load() (mmap_mode='r' for long captures).
+    """
+
+    def __init__(self, path, width, dtype):
+        self.path = path
+        self.width = width
+        self.dtype = np.dtype(dtype)
+        self.rows = 0
+        self.error = None
+        self.file = open(path, 'wb')
+        self.file.write(self._header(0))
+        self._queue = queue.SimpleQueue()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def _header(self, rows):
+        # Format 1.0: magic, version, u16 header length, padded dict, newline
+        text = "{'descr': %r, 'fortran_order': False, 'shape': (%d, %d), }" % (
+            self.dtype.str, rows, self.width)
+        length = NPY_HEADER_BYTES - 10
+        return b'\x93NUMPY\x01\x00' + struct.pack('<H', length) + text.ljust(length - 1).encode() + b'\n'
+
+    def append(self, rows):
+        self._queue.put(rows)
+
+    def close(self):
+        """Writes what is queued, finalises the header and waits for the writer"""
+        self._queue.put(None)
+        self._thread.join()
+        return self.error
+
+    def _run(self):
+        pending = []
+        pending_rows = 0
+        last_write = time.monotonic()
+        done = False
+        while not done:
+            try:
+                rows = self._queue.get(timeout=RECORD_FLUSH_SECONDS)
+            except queue.Empty:
+                rows = ()
+            if rows is None:
+                done = True
+            elif len(rows):
+                pending.append(rows)
+                pending_rows += len(rows)
+            now = time.monotonic()
+            if pending and (done or pending_rows >= RECORD_FLUSH_ROWS
+                            or now - last_write >= RECORD_FLUSH_SECONDS):
+                self._write(np.concatenate(pending))
+                pending = []
+                pending_rows = 0
+                last_write = now
+        try:
+            self.file.seek(0)
+            self.file.write(self._header(self.rows))
+            self.file.close()
+        except OSError as e:
+            self.error = self.error or e
+
+    def _write(self, block):
+        if self.error:
+            return
+        try:
+            block.astype(self.dtype, copy=False).tofile(self.file)
+            self.rows += len(block)
+        except OSError as e:
+            self.error = e
+
+class StreamPipeline:
+    """Decoder thread between the links and the GUI.
+
+    Text lines and once-per-second stream summaries come out of messages as
+    (source, text, msg_type) tuples; source is 'serial', 'ble' or 'wifi'.
+    """
+
+    SOURCES = ('serial', 'ble', 'wifi')
+
+    def __init__(self):
+        self.messages = queue.SimpleQueue()
+        self.recording = False
+        self.recorded_rows = 0
+        self._input = queue.SimpleQueue()
+        self._packet_decoder = decode_packet_array if NUMPY_AVAILABLE else decode_stream_packet
+        self._decoders = {}
+        self._stats = {}
+        self._epoch = {}
+        self._last_t0 = {}
+        self._clocks = {}
+        self._node_now = {}         # source -> node time of its latest sync reply
+        self._rings = {}
+        self._latest = {}           # kind -> source that last delivered samples
+        self._recorders = {}
+        self._record_base = None
+        for source in self.SOURCES:
+            self._reset(source)
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    # Producer side, callable from any thread
+
+    def feed_serial(self, data):
+        """Raw bytes from the serial port: text and framed packets"""
+        self._input.put(('serial', 'serial', data))
+
+    def feed_ble(self, data):
+        """One stream characteristic notification: one unframed packet"""
+        self._input.put(('ble', 'ble', data))
+
+    def feed_wifi(self, data):
+        """One UDP datagram from the node: an unframed packet or a command reply"""
+        self._input.put(('wifi', 'wifi', data))
+
+    def feed_sync(self, source, t1_us, reply, t4_us):
+        """One clock sync exchange: host send time, decode_sync_reply() result, host receive time"""
+        self._input.put(('sync', source, (t1_us, reply, t4_us)))
+
+    def clock(self, source):
+        """The link's ClockSync fit; its estimate is None until an exchange completed"""
+        return self._clocks[source]
+
+    def reset(self, source):
+        """Forget framing state, stats and history of a link, e.g. on reconnect"""
+        self._input.put(('reset', source, None))
+
+    def start_recording(self, base_path):
+        """Record every link and kind to <base_path>_<source>_<kind>.npy from now on.
+
+        Kinds are 'agmt' and 'quat' samples and 'sync' exchanges
+        (SYNC_COLUMNS), from which ClockSync.from_exchanges() refits the
+        node clock offline.
+        """
+        self._input.put(('record', None, base_path))
+
+    def stop_recording(self):
+        self._input.put(('record', None, None))
+
+    def stop(self):
+        self.stop_recording()
+        self._input.put(None)
+        self._thread.join(timeout=2.0)
+
+    # Consumer side, for the GUI thread
+
+    def drain_messages(self, limit):
+        out = []
+        while len(out) < limit:
+            try:
+                out.append(self.messages.get_nowait())
+            except queue.Empty:
+                break
+        return out
+
+    def snapshot(self, kind, seconds):
+        """Rows of the last seconds of 'agmt' or 'quat' samples of the busiest link, or None"""
+        source = self._latest.get(kind)
+        ring = self._rings.get((source, kind))
+        if ring is None or not ring.written:
+            return None
+        with ring.lock:
+            newest = ring.data[(ring.written - 1) % ring.capacity, 0]
+        return ring.since(newest - seconds * 1e6)
+
+    # Decoder thread
+
+    def _run(self):
+        while True:
+            item = self._input.get()
+            if item is None:
+                break
+            op, source, data = item
+            if op == 'serial':
+                for kind, value in self._decoders[source].feed(data):
+                    if kind == 'text':
+                        self.messages.put((source, value, 'received'))
+                    else:
+                        self._packet(source, value)
+            elif op == 'ble':
+                packet = self._packet_decoder(bytes(data))
+                if packet:
+                    self._packet(source, packet)
+            elif op == 'wifi':
+                # Replies are text; a sample packet starts with its type byte
+                data = bytes(data)
+                packet = None
+                if data[:1] and (data[0] & ~STREAM_PKT_DELTA) in STREAM_RECORDS:
+                    packet = self._packet_decoder(data)
+                if packet:
+                    self._packet(source, packet)
+                else:
+                    text = data.decode('utf-8', errors='replace').strip()
+                    if text:
+                        self.messages.put((source, text, 'received'))
+                    continue
+            elif op == 'sync':
+                self._sync(source, *data)
+                continue
+            elif op == 'reset':
+                self._reset(source)
+                continue
+            elif op == 'record':
+                self._set_recording(data)
+                continue
+
+            # Stream samples are summarised rather than printed one by one
+            stats = self._stats[source]
+            summary = stats.summary()
+            if summary and stats.samples:
+                crc_errors = self._decoders[source].crc_errors
+                if crc_errors:
+                    summary += f", {crc_errors} CRC errors"
+                clock = self._clocks[source].summary()
+                if clock:
+                    summary += f", {clock}"
+                self.messages.put((source, summary, 'system'))
+        self._set_recording(None)
+
+    def _reset(self, source):
+        self._decoders[source] = StreamFrameDecoder(self._packet_decoder)
+        self._stats[source] = StreamStats()
+        self._clocks[source] = ClockSync()
+        self._node_now.pop(source, None)
+        for kind in ('agmt', 'quat'):
+            self._epoch.pop((source, kind), None)
+            self._last_t0.pop((source, kind), None)
+            self._rings.pop((source, kind), None)
+
+    def _packet(self, source, packet):
+        if packet['type'] == STREAM_PKT_SPECTRUM:
+            # Features, not samples: no rings, stats or recording
+            self.messages.put((source, format_spectrum(packet), 'system'))
+            return
+        self._stats[source].update(packet)
+        if not NUMPY_AVAILABLE or not len(packet['samples']):
+            return
+        kind = 'agmt' if packet['type'] == STREAM_PKT_AGMT else 'quat'
+        key = (source, kind)
+
+        # The device clock wraps every 71.6 minutes; a backwards jump of more
+        # than half the range is a wrap, anything smaller is reordering
+        t0 = packet['t0_us']
+        last = self._last_t0.get(key)
+        epoch = self._epoch.get(key, 0)
+        if last is not None and last - t0 > 0x80000000:
+            epoch += 1 << 32
+        # After a sync, pick the wrap count that puts t0 nearest the node's
+        # 64-bit clock; never step back, the ring needs ascending times
+        node_now = self._node_now.get(source)
+        if node_now is not None:
+            epoch = max(epoch, (node_now - t0 + 0x80000000) & ~0xFFFFFFFF)
+        self._epoch[key] = epoch
+        self._last_t0[key] = t0
+        samples = packet['samples']
+        if epoch:
+            samples[:, 0] += epoch
+
+        ring = self._rings.get(key)
+        if ring is None:
+            ring = self._rings[key] = SampleRing(samples.shape[1], samples.dtype)
+        ring.extend(samples)
+        self._latest[kind] = source
+        self._record(source, kind, samples)
+
+    def _sync(self, source, t1_us, reply, t4_us):
+        clock = self._clocks[source]
+        clock.node_id = reply['node_id']
+        clock.add(t1_us, reply['t2_us'], reply['t3_us'], t4_us, reply['seq'])
+        self._node_now[source] = reply['t3_us']
+        if NUMPY_AVAILABLE:
+            self._record(source, 'sync', np.array([[t1_us, reply['t2_us'], reply['t3_us'], t4_us,
+                                                    reply['seq'], reply['node_id']]], dtype=np.int64))
+
+    def _record(self, source, kind, rows):
+        if not self._record_base:
+            return
+        key = (source, kind)
+        recorder = self._recorders.get(key)
+        if recorder is None:
+            path = f"{self._record_base}_{source}_{kind}.npy"
+            try:
+                recorder = self._recorders[key] = NpyRecorder(path, rows.shape[1], rows.dtype)
+            except OSError as e:
+                self.messages.put((source, f"[GUI] Recording failed: {e}", 'system'))
+                self._set_recording(None)
+                return
+            self.messages.put((source, f"[GUI] Recording to {path}", 'system'))
+        recorder.append(rows)
+        if kind != 'sync':
+            self.recorded_rows += len(rows)
+
+    def _set_recording(self, base_path):
+        for (source, kind), recorder in self._recorders.items():
+            error = recorder.close()
+            if error:
+                self.messages.put((source, f"[GUI] Recording {recorder.path} failed: {error}", 'system'))
+            else:
+                self.messages.put((source, f"[GUI] Saved {recorder.rows} samples to {recorder.path}", 'system'))
+        self._recorders = {}
+        if base_path and not NUMPY_AVAILABLE:
+            self.messages.put(('serial', "[GUI] Recording needs numpy", 'system'))
+            base_path = None
+        if base_path and base_path.endswith('.npy'):
+            base_path = base_path[:-4]
+        self._record_base = base_path
+        self.recorded_rows = 0
+        self.recording = bool(base_path)
@@ -0,0 +1,373 @@
+"""
+Binary stream protocol shared by the GUI and the receiver pipeline
+
+Framing (stream_frame.h), packet decoding (stream_packet.h, both in
+lib/imu_pipeline/src), per-stream loss/rate statistics and the clock sync
+exchange (include/clock_sync.h).
+"""
+
+import struct
+import time
+from collections import deque
+
+# Binary stream protocol (see stream_packet.h and stream_frame.h in lib/imu_pipeline/src)
+STREAM_SYNC = b'\xa5\x5a'
+STREAM_FRAME_MAX_PACKET = 1024
+STREAM_PKT_AGMT = 0x01
+STREAM_PKT_QUAT6 = 0x02
+STREAM_PKT_QUAT9 = 0x03
+STREAM_PKT_SPECTRUM = 0x40  # spectral features (include/spectral.h), not samples
+STREAM_PKT_DELTA = 0x80    # flag: delta/zig-zag varint coded records
+STREAM_HEADER = struct.Struct('<BBHI')     # type, count, seq, t0_us
+STREAM_RECORD = struct.Struct('<H10h')     # dt_us, acc xyz, gyr xyz, mag xyz, tmp
+STREAM_QUAT_RECORD = struct.Struct('<H3ih')  # dt_us, q1 q2 q3 (Q30), accuracy
+SPECTRUM_HEADER = struct.Struct('<BBHIHBB')  # type, bands, seq, end_us, rate_hz, fft_log2, windows
+SPECTRUM_AXIS = struct.Struct('<hhH8h')     # rms, peak, peak 0.01 Hz, band levels (0.01 dB re 1 mg)
+SPECTRUM_LEVEL_FLOOR = -32768
+STREAM_RECORDS = {
+    STREAM_PKT_AGMT: STREAM_RECORD,
+    STREAM_PKT_QUAT6: STREAM_QUAT_RECORD,
+    STREAM_PKT_QUAT9: STREAM_QUAT_RECORD,
+}
+
+def _build_crc16_table():
+    table = []
+    for i in range(256):
+        crc = i << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+        table.append(crc & 0xFFFF)
+    return table
+
+_CRC16_TABLE = _build_crc16_table()
+
+def crc16_ccitt(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, matching crc16Ccitt() in the firmware"""
+    for byte in data:
+        crc = ((crc << 8) & 0xFFFF) ^ _CRC16_TABLE[((crc >> 8) ^ byte) & 0xFF]
+    return crc
+
+def _read_varint(payload, offset):
+    """Unsigned LEB128 varint at offset, returns (value, next offset)"""
+    value = 0
+    shift = 0
+    while True:
+        if offset >= len(payload) or shift > 63:
+            raise ValueError("truncated varint")
+        byte = payload[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, offset
+        shift += 7
+
+def _decode_delta_records(payload, pkt_type, count):
+    """Undo the delta/zig-zag varint coding into plain record tuples (dt_us, values...)"""
+    n_values = 10 if pkt_type == STREAM_PKT_AGMT else 4
+    prev = [0] * n_values
+    records = []
+    offset = STREAM_HEADER.size
+    for _ in range(count):
+        dt, offset = _read_varint(payload, offset)
+        values = []
+        for i in range(n_values):
+            zz, offset = _read_varint(payload, offset)
+            prev[i] += (zz >> 1) ^ -(zz & 1)
+            values.append(prev[i])
+        records.append((dt,) + tuple(values))
+    if offset != len(payload):
+        raise ValueError("trailing bytes")
+    return records
+
+def spectrum_level_mg(level):
+    """Level code (0.01 dB re 1 mg) -> mg"""
+    return 0.0 if level == SPECTRUM_LEVEL_FLOOR else 10.0 ** (level / 2000.0)
+
+def decode_spectrum_packet(payload):
+    """Decode one spectral feature packet into a dict, or None if it is malformed.
+
+    'axes' holds accel x, y and z, each a dict of rms_mg, peak_mg, peak_hz
+    and bands_mg; 'bands_hz' gives the (low, high) edges of the octave bands.
+    """
+    if len(payload) != SPECTRUM_HEADER.size + 3 * SPECTRUM_AXIS.size:
+        return None
+    pkt_type, bands, seq, end_us, rate_hz, fft_log2, windows = SPECTRUM_HEADER.unpack_from(payload, 0)
+    if pkt_type != STREAM_PKT_SPECTRUM or bands != 8 or not rate_hz:
+        return None
+    axes = []
+    for i in range(3):
+        record = SPECTRUM_AXIS.unpack_from(payload, SPECTRUM_HEADER.size + i * SPECTRUM_AXIS.size)
+        axes.append({'rms_mg': spectrum_level_mg(record[0]), 'peak_mg': spectrum_level_mg(record[1]),
+                     'peak_hz': record[2] / 100.0,
+                     'bands_mg': [spectrum_level_mg(level) for level in record[3:]]})
+    half = 1 << (fft_log2 - 1)
+    bin_hz = rate_hz / float(half * 2)
+    bands_hz = [((half >> (bands - b)) * bin_hz, (half >> (bands - 1 - b)) * bin_hz) for b in range(bands)]
+    return {'type': pkt_type, 'seq': seq, 'end_us': end_us, 'rate_hz': rate_hz, 'fft_size': half * 2,
+            'windows': windows, 'axes': axes, 'bands_hz': bands_hz, 'bytes': len(payload)}
+
+def format_spectrum(packet):
+    """One line per packet: the axis with the most energy, its peak and band levels"""
+    axis = max(range(3), key=lambda i: packet['axes'][i]['rms_mg'])
+    a = packet['axes'][axis]
+    bands = ' '.join(f"{mg:.1f}" for mg in a['bands_mg'])
+    return (f"[Spectrum] #{packet['seq']} {'XYZ'[axis]}: rms {a['rms_mg']:.1f} mg, "
+            f"peak {a['peak_mg']:.1f} mg at {a['peak_hz']:.2f} Hz, bands {bands} mg")
+
+def decode_stream_packet(payload):
+    """Decode one stream packet into a dict, or None if it is malformed.
+
+    AGMT samples are tuples of (timestamp_us, ax, ay, az, gx, gy, gz, mx, my, mz, tmp).
+    Quaternion samples are (timestamp_us, w, x, y, z, accuracy) with float components.
+    Delta-coded packets decode to the same samples. Spectral feature packets
+    have no samples and decode as decode_spectrum_packet().
+    """
+    if payload[:1] == bytes((STREAM_PKT_SPECTRUM,)):
+        return decode_spectrum_packet(payload)
+    if len(payload) < STREAM_HEADER.size:
+        return None
+    pkt_type, count, seq, t0_us = STREAM_HEADER.unpack_from(payload, 0)
+    delta = bool(pkt_type & STREAM_PKT_DELTA)
+    pkt_type &= ~STREAM_PKT_DELTA
+    record_fmt = STREAM_RECORDS.get(pkt_type)
+    if record_fmt is None:
+        return None
+    if delta:
+        try:
+            records = _decode_delta_records(payload, pkt_type, count)
+        except ValueError:
+            return None
+    else:
+        if len(payload) != STREAM_HEADER.size + count * record_fmt.size:
+            return None
+        records = [record_fmt.unpack_from(payload, offset)
+                   for offset in range(STREAM_HEADER.size, len(payload), record_fmt.size)]
+
+    samples = []
+    t_us = t0_us
+    for record in records:
+        t_us = (t_us + record[0]) & 0xFFFFFFFF
+        if pkt_type == STREAM_PKT_AGMT:
+            samples.append((t_us,) + record[1:])
+        else:
+            x, y, z = (q / 1073741824.0 for q in record[1:4])
+            w = max(0.0, 1.0 - (x * x + y * y + z * z)) ** 0.5
+            samples.append((t_us, w, x, y, z, record[4]))
+    return {'type': pkt_type, 'delta': delta, 'seq': seq, 't0_us': t0_us, 'samples': samples,
+            'bytes': len(payload)}
+
+class StreamFrameDecoder:
+    """Splits a serial byte stream into text lines and CRC-checked stream packets"""
+
+    def __init__(self, packet_decoder=None):
+        # packet_decoder turns a CRC-checked payload into a packet dict (or None)
+        self.packet_decoder = packet_decoder or decode_stream_packet
+        self.buffer = bytearray()
+        self.text = bytearray()
+        self.frames = 0
+        self.crc_errors = 0
+
+    def feed(self, data):
+        """Consume raw bytes, return a list of ('text', str) and ('packet', dict) items"""
+        self.buffer += data
+        out = []
+        while True:
+            idx = self.buffer.find(STREAM_SYNC)
+            if idx < 0:
+                # Hold back a trailing first sync byte, it may start the next frame
+                keep = 1 if self.buffer.endswith(STREAM_SYNC[:1]) else 0
+                self._text(self.buffer[:len(self.buffer) - keep], out)
+                del self.buffer[:len(self.buffer) - keep]
+                break
+            if idx > 0:
+                self._text(self.buffer[:idx], out)
+                del self.buffer[:idx]
+            if len(self.buffer) < 4:
+                break
+
+            length = self.buffer[2] | (self.buffer[3] << 8)
+            if length < STREAM_HEADER.size or length > STREAM_FRAME_MAX_PACKET:
+                self._text(self.buffer[:1], out)
+                del self.buffer[:1]
+                continue
+            total = 4 + length + 2
+            if len(self.buffer) < total:
+                break
+
+            crc = self.buffer[4 + length] | (self.buffer[5 + length] << 8)
+            if crc16_ccitt(self.buffer[2:4 + length]) != crc:
+                # Not a frame after all (or corrupted): resync one byte later
+                self.crc_errors += 1
+                self._text(self.buffer[:1], out)
+                del self.buffer[:1]
+                continue
+
+            packet = self.packet_decoder(bytes(self.buffer[4:4 + length]))
+            if packet:
+                self.frames += 1
+                out.append(('packet', packet))
+            del self.buffer[:total]
+        return out
+
+    def _text(self, data, out):
+        self.text += data
+        while True:
+            nl = self.text.find(b'\n')
+            if nl < 0:
+                break
+            line = self.text[:nl].decode('utf-8', errors='ignore').strip()
+            del self.text[:nl + 1]
+            if line:
+                out.append(('text', line))
+
+class StreamStats:
+    """Tracks packet loss and rate for one binary stream"""
+
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.packets = 0
+        self.samples = 0
+        self.lost_packets = 0
+        self.last_seq = None
+        self.last_sample = None
+        self.last_type = STREAM_PKT_AGMT
+        self.window_start = time.time()
+        self.window_samples = 0
+
+    def update(self, packet):
+        if self.last_seq is not None:
+            self.lost_packets += (packet['seq'] - self.last_seq - 1) & 0xFFFF
+        self.last_seq = packet['seq']
+        self.packets += 1
+        self.samples += len(packet['samples'])
+        self.window_samples += len(packet['samples'])
+        if len(packet['samples']):
+            self.last_sample = packet['samples'][-1]
+            self.last_type = packet['type']
+
+    def summary(self):
+        """Return a one-line summary once per second, otherwise None"""
+        now = time.time()
+        elapsed = now - self.window_start
+        if elapsed < 1.0:
+            return None
+        rate = self.window_samples / elapsed
+        self.window_start = now
+        self.window_samples = 0
+        text = f"[Stream] {rate:.0f} samples/s, {self.samples} total, {self.lost_packets} packets lost"
+        if self.last_sample is not None and self.last_type != STREAM_PKT_AGMT:
+            w, x, y, z = self.last_sample[1:5]
+            text += f", q=({w:.3f}, {x:.3f}, {y:.3f}, {z:.3f})"
+        elif self.last_sample is not None:
+            text += f", acc=({self.last_sample[1]}, {self.last_sample[2]}, {self.last_sample[3]})"
+        return text
+
+# Clock sync exchange (see include/clock_sync.h)
+CLOCK_SYNC_OP_PING = 0x01
+CLOCK_SYNC_OP_REPORT = 0x02
+CLOCK_SYNC_OP_REPLY = 0x81
+CLOCK_SYNC_PING = struct.Struct('<BBH')        # op, 0, seq
+CLOCK_SYNC_REPLY = struct.Struct('<BBHQII')    # op, 0, seq, t2_us, t3 - t2 us, node id
+CLOCK_SYNC_REPORT = struct.Struct('<BBHqi')    # op, 0, seq, offset_us, drift_ppb
+CLOCK_SYNC_WINDOW = 128         # exchanges the fit looks back over
+CLOCK_SYNC_MIN_SPAN_US = 5000000  # node time the fit must span before it estimates drift
+
+def host_clock_us():
+    """The host clock exchanges are stamped with: high resolution, never steps"""
+    return time.perf_counter_ns() // 1000
+
+def decode_sync_reply(data):
+    """Decode one sync characteristic notification, or None if it is not a reply"""
+    if len(data) != CLOCK_SYNC_REPLY.size:
+        return None
+    op, _, seq, t2_us, turnaround_us, node_id = CLOCK_SYNC_REPLY.unpack(data)
+    if op != CLOCK_SYNC_OP_REPLY:
+        return None
+    return {'seq': seq, 't2_us': t2_us, 't3_us': t2_us + turnaround_us, 'node_id': node_id}
+
+class ClockSync:
+    """Fits one node's clock against the host clock from ping exchanges.
+
+    host_us = node_us + offset_us + drift * (node_us - reference_us)
+
+    Each exchange gives an offset estimate ((t1 + t4) - (t2 + t3)) / 2 that
+    is off by at most half its round trip, less the node's turnaround. The
+    fit keeps the quarter of the recent exchanges with the shortest round
+    trips, fits a line through their offsets against node time for the
+    drift, and is referenced to the newest of them. Any asymmetry that every
+    short exchange shares (the BLE connection interval splits unevenly
+    between the two directions) stays in the offset; it is the same for
+    nodes on the same connection parameters, so it cancels when their
+    streams are merged.
+    """
+
+    def __init__(self):
+        self.exchanges = deque(maxlen=CLOCK_SYNC_WINDOW)
+        self.node_id = None
+        # (offset_us, drift, reference_us, reference_seq, min round trip us), replaced as a whole
+        self.estimate = None
+
+    def add(self, t1_us, t2_us, t3_us, t4_us, seq=0):
+        """Add one exchange: host send, node receive, node send, host receive"""
+        if self._append(t1_us, t2_us, t3_us, t4_us, seq):
+            self._fit()
+
+    def _append(self, t1_us, t2_us, t3_us, t4_us, seq):
+        rtt = (t4_us - t1_us) - (t3_us - t2_us)
+        if rtt < 0:
+            return False
+        self.exchanges.append((t2_us, ((t1_us + t4_us) - (t2_us + t3_us)) / 2.0, rtt, seq))
+        return True
+
+    def _fit(self):
+        best = sorted(self.exchanges, key=lambda e: e[2])[:max(2, len(self.exchanges) // 4)]
+        reference = max(best, key=lambda e: e[0])
+        xs = [e[0] - reference[0] for e in best]
+        ys = [e[1] for e in best]
+        n = len(best)
+        mean_x = sum(xs) / n
+        mean_y = sum(ys) / n
+        drift = 0.0
+        if max(xs) - min(xs) >= CLOCK_SYNC_MIN_SPAN_US:
+            sxx = sum((x - mean_x) ** 2 for x in xs)
+            sxy = sum((x - mean_x) * (y - mean_y) for x, y in zip(xs, ys))
+            drift = sxy / sxx
+        offset = mean_y - drift * mean_x
+        self.estimate = (offset, drift, reference[0], reference[3], min(e[2] for e in best))
+
+    def to_host(self, node_us):
+        """Map node time (a number or numpy array, microseconds) onto the host clock"""
+        offset, drift, reference, _, _ = self.estimate
+        return node_us + offset + drift * (node_us - reference)
+
+    def summary(self):
+        """Short text for the stream summary line, or None before the first exchange"""
+        if self.estimate is None:
+            return None
+        offset, drift, _, _, rtt = self.estimate
+        return f"clock {offset / 1000.0:+.3f} ms, {drift * 1e6:+.2f} ppm, ±{rtt / 2000.0:.2f} ms"
+
+    def report(self):
+        """The estimate as a report for the node, or None before the first exchange.
+
+        Referenced to the newest exchange, which the node still remembers.
+        """
+        if self.estimate is None:
+            return None
+        t2_us, _, _, seq = self.exchanges[-1]
+        drift = self.estimate[1]
+        return CLOCK_SYNC_REPORT.pack(CLOCK_SYNC_OP_REPORT, 0, seq, int(round(self.to_host(t2_us) - t2_us)),
+                                      int(round(drift * 1e9)))
+
+    @classmethod
+    def from_exchanges(cls, rows):
+        """Refit from recorded exchanges: rows of (t1, t2, t3, t4[, seq, node id])"""
+        clock = cls()
+        clock.exchanges = deque(maxlen=max(len(rows), 1))
+        for row in rows:
+            clock._append(int(row[0]), int(row[1]), int(row[2]), int(row[3]), int(row[4]) if len(row) > 4 else 0)
+        if clock.exchanges:
+            clock._fit()
+        return clock
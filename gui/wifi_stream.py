@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""
+Wi-Fi UDP Stream Receiver for XIAO ESP32S3
+
+Sends commands to a node that joined the network ('wifi join <ssid> <pw>'
+on USB or BLE) as UDP datagrams to its port 5005, subscribes to the binary
+stream with 'wstream on' and feeds every datagram that comes back into the
+GUI's receiver pipeline: replies are printed, stream packets summarised
+once per second (rate, lost datagrams by sequence number) and optionally
+recorded to .npy files.
+
+Examples:
+    python wifi_stream.py 192.168.1.42                   # stream until Ctrl+C
+    python wifi_stream.py 192.168.1.42 --seconds 30 --delta
+    python wifi_stream.py 192.168.1.42 --record run1     # run1_wifi_agmt.npy (needs numpy)
+    python wifi_stream.py 192.168.1.42 --command "dsp wifi 4 mean"
+
+Requirements: none beyond the standard library; numpy for --record.
+"""
+
+import argparse
+import socket
+import sys
+import time
+
+from stream_pipeline import StreamPipeline
+
+WIFI_UDP_PORT = 5005
+RECEIVE_BUFFER = 1 << 20        # rides out the host's scheduling gaps at full rate
+DATAGRAM_MAX = 2048
+
+
+def main():
+    parser = argparse.ArgumentParser(description="XIAO ESP32S3 Wi-Fi UDP stream receiver")
+    parser.add_argument('host', help="node address, as shown by 'wifi' on its console")
+    parser.add_argument('--port', type=int, default=WIFI_UDP_PORT, help="node UDP port")
+    parser.add_argument('--seconds', type=float, default=0, help="stream this long, 0 = until Ctrl+C")
+    parser.add_argument('--delta', action='store_true', help="ask for delta/varint coded records")
+    parser.add_argument('--record', metavar='BASE', help="record to BASE_wifi_<kind>.npy")
+    parser.add_argument('--command', action='append', default=[],
+                        help="extra command to send before 'wstream on' (repeatable)")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, RECEIVE_BUFFER)
+    sock.bind(('', 0))
+    sock.settimeout(0.2)
+    node = (socket.gethostbyname(args.host), args.port)
+
+    pipeline = StreamPipeline()
+    if args.record:
+        pipeline.start_recording(args.record)
+
+    def send(command):
+        print(f"> {command}")
+        sock.sendto(command.encode(), node)
+
+    commands = args.command + [f"wstream delta {'on' if args.delta else 'off'}", "wstream on"]
+    for command in commands:
+        send(command)
+
+    start = time.time()
+    received = 0
+    try:
+        while not args.seconds or time.time() - start < args.seconds:
+            try:
+                data, addr = sock.recvfrom(DATAGRAM_MAX)
+            except socket.timeout:
+                data = None
+            if data and addr[0] == node[0]:
+                received += 1
+                pipeline.feed_wifi(data)
+            for _source, text, _kind in pipeline.drain_messages(100):
+                print(text)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        send("wstream off")
+        time.sleep(0.3)
+        pipeline.stop()
+        for _source, text, _kind in pipeline.drain_messages(100):
+            print(text)
+        sock.close()
+
+    if not received:
+        print("No datagrams from the node: is it on this network ('wifi' on its console)?")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
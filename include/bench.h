@@ -0,0 +1,58 @@
+/*
+ * BLE and USB throughput benchmark
+ *
+ * While a run is active the comms pipeline pushes fixed-size STREAM_PKT_BENCH
+ * packets as fast as the transport takes them: notifications on the stream
+ * characteristic to one BLE client until the stack reports congestion, or framed packets
+ * (stream_frame.h) into the USB CDC while its TX ring has room. A packet is
+ * a StreamPacketHeader (count 0, seq, t0 = send time) followed by filler
+ * bytes (seq + i) & 0xFF, so the host can check length, order and loss.
+ *
+ * The run stops after its duration, on disconnect, or on benchStop(); the
+ * result stays readable until the next start. Round-trip time is measured
+ * by the host with the 'ping' command, which replies without logging.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define BENCH_DEFAULT_SECONDS   10
+#define BENCH_MAX_SECONDS       300
+#define BENCH_MAX_PACKET        1024    // USB limit; BLE is capped by the MTU
+#define BENCH_BURST             32      // packets per pipeline pass at most
+#define BENCH_POLL_MS           1       // pipeline pass period while a run is active
+
+enum BenchTarget {
+    BENCH_BLE = 0,
+    BENCH_USB
+};
+
+struct BenchResult {
+    BenchTarget target;
+    int8_t client;              // BLE: client slot the run goes to
+    bool running;
+    uint16_t packetBytes;       // packet size in use, after the MTU cap
+    uint32_t elapsedMs;
+    uint32_t packets;           // packets handed to the transport
+    uint32_t bytes;
+    uint32_t stalls;            // passes that found the transport full
+    uint32_t drops;             // BLE: notifications the stack rejected or failed
+    uint32_t congestion;        // BLE: congestion events during the run
+    uint16_t connInterval;      // BLE: 1.25 ms units, 0 = unknown
+    float bytesPerSec;
+    float packetsPerEvent;      // BLE: packets per connection event, 0 = unknown
+};
+
+// Starts a run; BLE runs go to bleClient (ble_stream.h). size 0 picks the
+// largest packet the transport allows. Fails if a run or a capture
+// download is active, the transport or client is unavailable or its IMU
+// stream is on.
+bool benchStart(BenchTarget target, uint16_t size, uint32_t seconds, int bleClient);
+void benchStop();
+bool benchActive();
+
+// Sends the next burst. Called from the comms pipeline (comms.h).
+void benchService();
+
+void benchGetResult(BenchResult& out);
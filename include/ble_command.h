@@ -0,0 +1,54 @@
+/*
+ * BLE command queue
+ *
+ * Writes to the command characteristic arrive on the BLE host task. The
+ * write callback only copies the bytes into a fixed-size queue slot, sets
+ * the main scheduler's event bit and returns; the scheduler runs the
+ * command from bleCommandService() and notifies the reply when it is done,
+ * to the client that wrote it only (ble_stream.h tracks who is subscribed).
+ * Slow commands (the I2C scan, IMU reads) therefore never hold up the BLE
+ * stack, so connection events keep being serviced.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/event_groups.h>
+#include "cmd_dispatch.h"
+
+#define BLE_CMD_QUEUE_DEPTH     8
+
+struct BleCommand {
+    uint32_t receivedUs;    // esp_timer time the write arrived
+    int8_t client;          // ble_stream.h client slot of the writer
+    uint16_t len;
+    char data[CMD_LINE_MAX];
+};
+
+// Runs one command on the scheduler's task and fills in the reply.
+typedef void (*BleCommandHandler)(CmdSpan input, CmdReply& reply);
+
+struct BleCommandStats {
+    uint32_t received;      // writes queued
+    uint32_t dropped;       // writes lost because the queue was full
+    uint32_t truncated;     // writes longer than CMD_LINE_MAX
+    uint32_t completed;     // commands run
+    uint32_t maxQueued;     // deepest the queue has been
+    uint32_t maxLatencyUs;  // longest write-to-reply time
+};
+
+// Creates the queue. Each queued write sets readyBit in events; replies
+// are notified on the command characteristic (ble_gatt.h).
+bool bleCommandBegin(BleCommandHandler handler, EventGroupHandle_t events, EventBits_t readyBit);
+
+// Called from the command characteristic's write hook. Never blocks.
+bool bleCommandEnqueue(const uint8_t* data, size_t len, int client);
+
+// Client slot of the command being run, for handlers whose effect is per
+// client (their stream, their downloads). -1 outside bleCommandService().
+int bleCommandClient();
+
+// Runs every queued command. Call from the scheduler when readyBit is set.
+void bleCommandService();
+
+void bleCommandGetStats(BleCommandStats& out);
@@ -0,0 +1,131 @@
+/*
+ * BLE GATT layout and host glue
+ *
+ * The service is described by bleGattTable, a compile-time table of its
+ * characteristics. The attribute handle count handed to the stack and the
+ * raw advertising and scan response payloads are computed from the table
+ * and the UUID strings when compiling. Characteristics, descriptors and
+ * callback objects live in static storage, and advertising is started
+ * once, after its payloads and parameters are in place.
+ *
+ * This is the only file that talks to the BLE host; ble_stream.h keeps
+ * the per-client state and is fed link events from here. The default
+ * build uses Bluedroid through the Arduino BLE library. BLE_USE_NIMBLE=1
+ * (the *_nimble environment in platformio.ini) builds on NimBLE-Arduino
+ * instead, whose host takes considerably less heap and flash; the heap it
+ * leaves is what 'm' reports as free for stream buffers. NimBLE does not
+ * report data length, PHY or connection interval updates after connect,
+ * and a notification refused for lack of buffers counts as congestion.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#if BLE_USE_NIMBLE
+#include <NimBLEDevice.h>
+typedef NimBLEDevice BLEDevice;
+typedef NimBLEServer BLEServer;
+typedef NimBLEService BLEService;
+typedef NimBLECharacteristic BLECharacteristic;
+typedef NimBLEAdvertising BLEAdvertising;
+typedef NimBLEAdvertisementData BLEAdvertisementData;
+#else
+#include <BLE2902.h>
+#include <BLEDevice.h>
+#include <BLEServer.h>
+#endif
+
+#define BLE_DEVICE_NAME             "XIAO-ESP32S3-Test"
+#define SERVICE_UUID                "12345678-1234-1234-1234-123456789abc"
+#define CHARACTERISTIC_UUID         "87654321-4321-4321-4321-cba987654321"
+#define STREAM_CHARACTERISTIC_UUID  "87654321-4321-4321-4321-cba987654322"
+#define PERF_CHARACTERISTIC_UUID    "87654321-4321-4321-4321-cba987654323"
+#define SYNC_CHARACTERISTIC_UUID    "87654321-4321-4321-4321-cba987654324"
+#define SPECTRUM_CHARACTERISTIC_UUID "87654321-4321-4321-4321-cba987654325"
+
+#define BLE_MAX_CLIENTS         3       // CONFIG_BTDM_CTRL_BLE_MAX_CONN / CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define BLE_LOCAL_MTU           517     // largest ATT MTU we accept from a central
+#define BLE_DLE_TX_OCTETS       251
+#define BLE_PREFERRED_CONN_MIN  0x06    // 7.5 ms, advertised for iPhone connections
+#define BLE_PREFERRED_CONN_MAX  0x12    // 22.5 ms
+
+#define BLE_PROP_READ           (1 << 0)
+#define BLE_PROP_WRITE          (1 << 1)
+#define BLE_PROP_NOTIFY         (1 << 2)
+
+enum BleGattChar {
+    BLE_CHAR_COMMAND = 0,   // text commands in, replies notified
+    BLE_CHAR_STREAM,        // binary IMU stream, bench and capture packets
+    BLE_CHAR_PERF,          // binary perf snapshot (perf.h)
+    BLE_CHAR_SYNC,          // clock sync pings in, replies notified (clock_sync.h)
+    BLE_CHAR_SPECTRUM,      // spectral feature packets (spectral.h)
+    BLE_CHAR_COUNT
+};
+
+struct BleCharDef {
+    const char* uuid;
+    uint8_t properties;     // BLE_PROP_*
+};
+
+constexpr BleCharDef bleGattTable[BLE_CHAR_COUNT] = {
+    { CHARACTERISTIC_UUID,          BLE_PROP_READ | BLE_PROP_WRITE | BLE_PROP_NOTIFY },
+    { STREAM_CHARACTERISTIC_UUID,   BLE_PROP_NOTIFY },
+    { PERF_CHARACTERISTIC_UUID,     BLE_PROP_READ },
+    { SYNC_CHARACTERISTIC_UUID,     BLE_PROP_WRITE | BLE_PROP_NOTIFY },
+    { SPECTRUM_CHARACTERISTIC_UUID, BLE_PROP_NOTIFY },
+};
+
+// Service declaration, then per characteristic its declaration and value,
+// plus a CCCD when it notifies
+constexpr uint16_t bleGattHandles(size_t i = 0) {
+    return i == BLE_CHAR_COUNT ? 1
+         : 2 + ((bleGattTable[i].properties & BLE_PROP_NOTIFY) ? 1 : 0) + bleGattHandles(i + 1);
+}
+
+// Byte n of a 128-bit UUID string, in the little-endian order used on air
+constexpr uint8_t bleHexNibble(char c) {
+    return c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0';
+}
+constexpr uint8_t bleUuidByteAt(const char* uuid, int pos) {
+    return (uint8_t)(bleHexNibble(uuid[pos]) << 4 | bleHexNibble(uuid[pos + 1]));
+}
+constexpr uint8_t bleUuidByte(const char* uuid, int n) {
+    return bleUuidByteAt(uuid, 2 * (15 - n) + (15 - n >= 4) + (15 - n >= 6) + (15 - n >= 8) + (15 - n >= 10));
+}
+
+// What the firmware does on BLE events; called on the host task
+struct BleGattHooks {
+    void (*onConnect)(int client);
+    void (*onDisconnect)();
+    void (*onCommand)(const uint8_t* data, size_t len, int client);
+    size_t (*onPerfRead)(uint8_t* out, size_t max);     // snapshot for the perf characteristic
+    // A sync write stamped at rxUs; the reply is notified to the writer
+    // straight from the write callback
+    size_t (*onSync)(const uint8_t* data, size_t len, uint64_t rxUs, uint8_t* out, size_t max);
+};
+
+enum BleSendResult {
+    BLE_SEND_OK = 0,
+    BLE_SEND_BUSY,          // out of host buffers, try again later
+    BLE_SEND_FAILED
+};
+
+// Starts the host, builds the service from bleGattTable and starts
+// advertising. Call once from setup().
+bool bleGattBegin(const BleGattHooks& hooks);
+
+// Restarts advertising, e.g. after a central dropped off without the
+// stack noticing.
+void bleGattAdvertise();
+
+// Advertising interval in 0.625 ms units. Takes effect right away while a
+// client slot is free.
+void bleGattSetAdvInterval(uint16_t minInterval, uint16_t maxInterval);
+
+// Used by ble_stream.cpp: one notification to one connection, and link
+// requests. addr is the peer address from bleStreamLinkUp().
+BleSendResult bleGattNotify(uint16_t connId, BleGattChar chr, const uint8_t* data, uint16_t len);
+void bleGattTuneLink(uint16_t connId, const uint8_t* addr);     // asks for DLE and the 2M PHY
+void bleGattUpdateConnParams(uint16_t connId, const uint8_t* addr, uint16_t minInterval,
+                             uint16_t maxInterval, uint16_t latency, uint16_t timeout);
@@ -0,0 +1,117 @@
+/*
+ * BLE binary IMU streaming
+ *
+ * Streams over the notify-only stream characteristic (ble_gatt.h). Up to
+ * BLE_MAX_CLIENTS centrals can be connected at once (say a phone and a
+ * logging gateway), and each one is a client slot with its own link state:
+ * ATT MTU, data length, PHY, congestion and its own CCCD subscriptions,
+ * which are tracked per connection from the descriptor writes rather than
+ * read from a shared descriptor value. On connect the link is asked for
+ * data length extension and the 2M PHY.
+ *
+ * Every client also picks its own stream: on/off, record coding and DSP
+ * stage (rate). Clients asking for the same stream - same DSP setup, coding
+ * and payload size - share one encoder: samples are filtered and packed
+ * once into the encoder's packet ring, and each client keeps its own read
+ * position in it, so one encoded packet is fanned out to all of them. A
+ * client that falls BLE_STREAM_QUEUE_DEPTH packets behind (congested link)
+ * loses its oldest packets without holding up the others.
+ *
+ * Client numbers are slot indexes 0..BLE_MAX_CLIENTS-1; a slot is reused by
+ * the next central after a disconnect.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "ble_gatt.h"
+#include "imu_dsp.h"
+#include "imu_sample.h"
+
+#define BLE_ALL_CLIENTS         -1
+#define BLE_STREAM_MAX_PAYLOAD  244     // fills one 251-byte LL PDU once DLE is active
+#define BLE_STREAM_QUEUE_DEPTH  16      // packets buffered per encoder while a link is congested
+#define BLE_STREAM_FLUSH_MS     20      // send a partially filled packet after this long
+
+struct BleStreamStats {
+    bool connected;
+    bool subscribed;            // stream notifications enabled in this client's CCCD
+    bool enabled;               // 'bstream on' for this client
+    int8_t encoder;             // shared encoder in use, -1 = none
+    uint8_t sharing;            // clients on that encoder, this one included
+    uint32_t packets;           // notifications handed to the stack
+    uint32_t bytes;             // payload bytes in those notifications
+    uint32_t samples;           // samples carried
+    uint32_t droppedSamples;    // samples lost because this client fell a full queue behind,
+                                // or because no record fits the payload
+    bool recordTooLarge;        // the payload cannot hold one record: samples are dropped
+    uint32_t failedNotifies;    // notifications the stack rejected
+    uint32_t congestion;        // congestion events reported by the stack
+    uint16_t mtu;               // negotiated ATT MTU
+    uint16_t payload;           // bytes per notification in use
+    uint16_t txOctets;          // LL payload after data length negotiation
+    uint8_t  txPhy;             // 1 = 1M, 2 = 2M, 0 = unknown
+    uint16_t connInterval;      // in 1.25 ms units, 0 = unknown
+    bool delta;                 // delta/varint record coding selected
+    DspConfig dsp;              // this client's DSP stage
+};
+
+// Resets the client table. Called by bleGattBegin() before the host starts.
+void bleStreamBegin();
+
+// Link events from the host glue (ble_gatt.cpp), on the host task.
+void bleStreamLinkUp(uint16_t connId, const uint8_t* addr);
+void bleStreamLinkDown(uint16_t connId);
+void bleStreamLinkMtu(uint16_t connId, uint16_t mtu);
+void bleStreamLinkCongested(uint16_t connId, bool congested);
+void bleStreamLinkSubscribed(uint16_t connId, BleGattChar chr, bool notify);
+void bleStreamLinkNotifyFailed(uint16_t connId);
+void bleStreamLinkDataLen(uint16_t connId, uint16_t txOctets);
+void bleStreamLinkInterval(uint16_t connId, uint16_t interval);
+void bleStreamLinkPhy(uint16_t connId, uint8_t txPhy);
+bool bleStreamConnForAddr(const uint8_t* addr, uint16_t& connId);
+
+int bleStreamClientCount();
+bool bleStreamConnected();                  // any client
+bool bleStreamClientConnected(int client);
+int bleStreamClientForConn(uint16_t connId); // -1 if not connected
+
+// Per-client stream settings. BLE_ALL_CLIENTS applies to every connected
+// client; for the DSP stage and the coding it also sets the default new
+// clients start with. SetEnabled fails if no addressed client is
+// connected, SetDsp if the configuration is invalid.
+bool bleStreamSetEnabled(int client, bool enabled);
+bool bleStreamEnabled();                    // any client streaming
+bool bleStreamClientEnabled(int client);
+void bleStreamSetDelta(int client, bool on);
+bool bleStreamSetDsp(int client, const DspConfig& cfg);
+DspConfig bleStreamDsp(int client);         // BLE_ALL_CLIENTS: the default
+bool bleStreamDelta(int client);            // BLE_ALL_CLIENTS: the default
+
+// Redesigns every client's DSP stage for a new sampler rate. Fails and
+// changes nothing if a stage's setup is invalid at that rate.
+bool bleStreamSetInputRate(uint32_t hz);
+
+// Asks every connected central for new connection parameters (see power.h
+// for the per-profile values).
+void bleStreamRequestConnParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout);
+
+// Consumer side: feed every raw sample, then call bleStreamService() to
+// push finished packets to the stack. Both run under CommsLock.
+void bleStreamFeed(const ImuSample& s);
+void bleStreamService();
+
+// Sends one notification on the stream characteristic to one client,
+// bypassing the packet ring. Returns false without sending while that
+// client is disconnected, unsubscribed or congested, and when the stack
+// rejects the notification (counted in failedNotifies). len is capped to
+// the client's payload size.
+bool bleStreamSendRaw(int client, const uint8_t* data, uint16_t len);
+
+// Same for another notifying characteristic (the command replies), capped
+// to the client's ATT MTU.
+bool bleStreamNotify(int client, BleGattChar chr, const uint8_t* data, uint16_t len);
+
+// BLE_ALL_CLIENTS sums the counters over all clients and reports the link
+// of the lowest-numbered connected one.
+void bleStreamGetStats(int client, BleStreamStats& out);
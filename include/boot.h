@@ -0,0 +1,57 @@
+/*
+ * Boot sequencing and startup timing
+ *
+ * With FAST_BOOT set (platformio.ini), setup() no longer waits for a
+ * serial monitor or for the I2C bus to "settle": the sensor and the BLE
+ * stack come up in parallel one-shot tasks (bootRun()) while setup() only
+ * waits for both to finish, and the banner, menu and status dump are
+ * printed from loop() once a USB host is listening rather than on the
+ * boot path. Without a host nothing is printed at all; that matters
+ * because the USB Serial/JTAG driver blocks writes for its TX timeout
+ * while the host is not reading.
+ *
+ * bootMark() records when each milestone was first reached, in esp_timer
+ * microseconds. esp_timer starts during the IDF startup code, so the ROM
+ * and second-stage bootloader (roughly 60-100 ms with the default flash
+ * settings) are not included.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef FAST_BOOT
+#define FAST_BOOT   0
+#endif
+
+#define BOOT_MAX_JOBS       2
+#define BOOT_JOB_STACK      6144        // BLEDevice::init and the GATT table setup need the room
+#define BOOT_JOB_PRIORITY   2           // above loop(), below comms and the sampler
+#define BOOT_JOB_TIMEOUT_MS 5000
+#define BOOT_TARGET_ADV_MS  300         // time-to-advertise goal reported next to the figure
+
+enum BootMark {
+    BOOT_MARK_SETUP = 0,        // setup() entered
+    BOOT_MARK_IMU_READY,        // sensor initialised and the sampler task created
+    BOOT_MARK_ADVERTISING,      // first advertising start
+    BOOT_MARK_LOG_MOUNTED,
+    BOOT_MARK_SETUP_DONE,       // setup() returned
+    BOOT_MARK_FIRST_SAMPLE,     // first sample drained by the pipeline
+    BOOT_MARK_USB_HOST,         // USB host seen listening, banner printed
+    BOOT_MARK_COUNT
+};
+
+// Records the first time a milestone is reached. Callable from any task.
+void bootMark(BootMark mark);
+void bootMarkAt(BootMark mark, uint32_t timestampUs);
+
+// esp_timer time of a milestone in microseconds, 0 if not reached yet.
+uint32_t bootMarkUs(BootMark mark);
+
+// Runs fn in its own task pinned to core. Up to BOOT_MAX_JOBS jobs run at
+// once; bootWait() blocks until all of them have returned, or the timeout.
+bool bootRun(const char* name, void (*fn)(), BaseType_t core);
+bool bootWait(uint32_t timeoutMs);
+
+const char* bootResetReason();
+void bootPrintReport();
@@ -0,0 +1,105 @@
+/*
+ * PSRAM burst capture and bulk download
+ *
+ * While recording, the comms pipeline copies every raw AGMT sample from the
+ * sampler ring into a ring of CaptureRecords in PSRAM, ahead of any DSP
+ * stage, so the capture holds the full ODR. Once the ring is full the
+ * oldest records are overwritten. Recording runs independently of the
+ * links: it carries on while no BLE client is connected.
+ *
+ * Records are numbered from 0 at captureStart(). After captureStop() the
+ * host pulls a range with captureGetStart(); the pipeline then sends
+ * STREAM_PKT_CAPTURE packets as fast as the transport takes them (BLE
+ * notifications on the stream characteristic to the requesting client,
+ * or framed packets over USB CDC). A packet is a CapturePacketHeader
+ * followed by count records; the header carries the index of its first
+ * record, so a host that loses the link or a packet simply asks again
+ * from the first index it is missing. A packet with count 0 ends the
+ * transfer; its index is one past the last record sent.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "imu_sample.h"
+
+#define CAPTURE_BUFFER_BYTES    (4 * 1024 * 1024)   // PSRAM, allocated on the first start
+#define CAPTURE_MAX_SECONDS     3600                // timed recordings, keeps the limit in 32-bit microseconds
+#define CAPTURE_USB_RECORDS     40                  // records per USB packet: 8 + 40 * 24 = 968 bytes
+#define CAPTURE_BURST           16                  // packets per pipeline pass at most
+#define CAPTURE_POLL_MS         1                   // pipeline pass period while a transfer runs
+
+struct __attribute__((packed)) CaptureRecord {
+    uint32_t timestampUs;
+    int16_t  acc[3];
+    int16_t  gyr[3];
+    int16_t  mag[3];
+    int16_t  tmp;
+};
+
+struct __attribute__((packed)) CapturePacketHeader {
+    uint8_t  type;      // STREAM_PKT_CAPTURE
+    uint8_t  count;     // records that follow, 0 = end of transfer
+    uint16_t seq;       // packet counter within the transfer
+    uint32_t index;     // capture index of the first record
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord layout");
+static_assert(sizeof(CapturePacketHeader) == 8, "CapturePacketHeader layout");
+
+enum CaptureTransport {
+    CAPTURE_BLE = 0,
+    CAPTURE_USB
+};
+
+struct CaptureStatus {
+    bool allocated;
+    bool recording;
+    bool transferring;
+    bool importing;         // a flash log query is filling the buffer
+    uint32_t capacity;      // records the buffer holds
+    uint32_t total;         // records written since start, including overwritten ones
+    uint32_t first;         // oldest index still held
+    uint32_t skipped;       // non-AGMT samples ignored (DMP modes)
+    uint32_t durationMs;    // auto-stop after this long, 0 = until captureStop()
+    uint32_t spanUs;        // time covered by the held records
+    CaptureTransport transport;
+    int8_t client;          // BLE client slot of the download
+    uint32_t sendNext;      // next index the transfer will send
+    uint32_t sendEnd;       // one past its last index
+};
+
+// Allocates the buffer if needed and starts a new recording, discarding the
+// previous one. seconds 0 records until captureStop(). Fails without PSRAM
+// or while a transfer or an import is running.
+bool captureStart(uint32_t seconds);
+void captureStop();
+bool captureRecording();
+
+// Releases the PSRAM buffer. Fails while recording, transferring or importing.
+bool captureFree();
+
+// Called by the pipeline for every sample drained from the ring.
+void captureFeed(const ImuSample& s);
+
+// Replaces the capture with records from elsewhere (flash_log.h): Begin
+// discards the held records, then Import appends until the buffer is full
+// and returns how many it took, and End closes the import. Call all three
+// under CommsLock. Begin fails while recording or downloading; until End,
+// recording, downloading and freeing the buffer fail.
+bool captureImportBegin();
+size_t captureImport(const CaptureRecord* records, size_t n);
+void captureImportEnd();
+
+// Starts sending records [first, first + count) of the stopped capture,
+// clamped to what is held; count 0 means to the end, over BLE to bleClient
+// (ble_stream.h). Returns false if nothing was captured, a recording or an
+// import is running, or the transport or client is busy.
+bool captureGetStart(CaptureTransport transport, uint32_t& first, uint32_t& count, int bleClient);
+void captureGetStop();
+bool captureTransferActive();
+
+// Sends the next burst of a transfer. Called from the comms pipeline.
+void captureService();
+
+void captureGetStatus(CaptureStatus& out);
@@ -0,0 +1,86 @@
+/*
+ * Clock sync exchange over the sync characteristic
+ *
+ * Lets a host put the streams of several nodes on its own clock without
+ * cross-correlating them afterwards. The host writes a ping and notes its
+ * send time t1. The node stamps the write as the host task hands it over
+ * (t2) and notifies the reply from that same callback, stamped just before
+ * it goes to the stack (t3). The host notes the arrival (t4). From a run
+ * of exchanges the host fits this node's clock offset and drift against
+ * its own (ClockSync in gui/stream_protocol.py), trusting the exchanges
+ * with the shortest round trip most.
+ *
+ * Node times are esp_timer microseconds, 64-bit here; their low 32 bits
+ * are the timestamps of every stream, taken at the data-ready interrupt in
+ * the register and FIFO modes (imu_sampler.h). DMP quaternions are timed
+ * at the drain instead and can be up to IMU_FIFO_DRAIN_MS late, so they
+ * align to about 10 ms, not below 1 ms. The host may write its estimate
+ * back, which 'sync' shows, so a node's alignment can be checked from its
+ * own console.
+ *
+ * The messages below are little-endian and packed; the reply fits the
+ * default 23-byte ATT MTU. A report's offset is host minus node time at t2
+ * of ping seq, one of the last CLOCK_SYNC_HISTORY pings; its drift is
+ * d(host - node) / d(node).
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define CLOCK_SYNC_OP_PING      0x01
+#define CLOCK_SYNC_OP_REPORT    0x02
+#define CLOCK_SYNC_OP_REPLY     0x81
+#define CLOCK_SYNC_HISTORY      8       // pings a report may refer to
+
+// host -> node
+struct __attribute__((packed)) ClockSyncPing {
+    uint8_t op;             // CLOCK_SYNC_OP_PING
+    uint8_t reserved;
+    uint16_t seq;
+};
+
+// node -> host, notified in answer to a ping
+struct __attribute__((packed)) ClockSyncReply {
+    uint8_t op;             // CLOCK_SYNC_OP_REPLY
+    uint8_t reserved;
+    uint16_t seq;           // the ping's
+    uint64_t rxUs;          // t2
+    uint32_t turnaroundUs;  // t3 - t2
+    uint32_t nodeId;
+};
+
+// host -> node, the host's current estimate
+struct __attribute__((packed)) ClockSyncReport {
+    uint8_t op;             // CLOCK_SYNC_OP_REPORT
+    uint8_t reserved;
+    uint16_t seq;           // ping whose t2 the offset refers to
+    int64_t offsetUs;
+    int32_t driftPpb;
+};
+
+static_assert(sizeof(ClockSyncReply) <= 20, "sync reply must fit the default ATT MTU");
+
+struct ClockSyncStats {
+    uint32_t nodeId;        // factory MAC bytes 2-5, past the vendor prefix
+    uint32_t pings;
+    uint32_t rejected;      // malformed writes, reports for an unknown ping
+    uint32_t lastPingMs;    // millis() of the last ping, 0 = none yet
+    bool reported;          // a host estimate has arrived
+    int64_t offsetUs;       // host minus node time at referenceUs
+    int32_t driftPpb;
+    uint64_t referenceUs;
+    uint32_t reportMs;      // millis() of the last report
+};
+
+void clockSyncBegin();
+
+// Node time in microseconds; the same clock as the sample timestamps.
+uint64_t clockSyncNowUs();
+
+// Handles one write to the sync characteristic received at rxUs. Returns
+// the length of the reply to notify back to the writer, 0 for none. Runs
+// on the host task.
+size_t clockSyncHandle(const uint8_t* data, size_t len, uint64_t rxUs, uint8_t* out, size_t max);
+
+void clockSyncGetStats(ClockSyncStats& out);
@@ -0,0 +1,95 @@
+/*
+ * Transmit pipeline task
+ *
+ * Acquisition runs on IMU_SAMPLER_CORE (core 1, where the data-ready
+ * interrupt is attached). This task is pinned to COMMS_CORE next to the
+ * Bluedroid host and is the sampler ring's only consumer: it drains the
+ * ring, feeds the PSRAM capture, the spectral features, the BLE, USB and
+ * Wi-Fi streams and the flash logger, pushes packets out and runs the
+ * benchmark and capture downloads. The stages share nothing but the
+ * lock-free ring, so a slow I2C transaction never holds up a notification
+ * and a burst of notifications never delays a sample read.
+ *
+ * Each sink (BLE, USB, flash log, Wi-Fi) has its own ImuDsp stage
+ * (imu_dsp.h) between the ring and its consumer, so the sensor can run at
+ * full ODR while every client gets the filtered, decimated rate it asked
+ * for. BLE clients each pick their own; those stages live in ble_stream.h,
+ * one per group of clients sharing a stream.
+ *
+ * An optional trigger (imu_trigger.h) gates the BLE, USB and Wi-Fi streams
+ * ahead of their DSP stages, so they only carry the windows around events.
+ * The capture and the flash logger keep every sample.
+ *
+ * Stream, benchmark and capture state belongs to this task. The command side
+ * (loop) changes it only inside a CommsLock scope; the pipeline holds the
+ * same lock for each pass and re-reads its wake-up period when the scope
+ * ends.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/event_groups.h>
+#include "imu_sample.h"
+#include "imu_dsp.h"
+#include "imu_trigger.h"
+
+#define COMMS_CORE              0
+#define COMMS_PRIORITY          5       // above loop(), below the Bluedroid tasks
+#define COMMS_STACK             4096
+#define COMMS_SERVICE_MS        10      // wake at least this often while streaming, for flush deadlines
+
+// Creates the pipeline task and registers it as the sampler's consumer.
+// benchDoneBit is set in notifyEvents when a benchmark run ends.
+bool commsBegin(EventGroupHandle_t notifyEvents, EventBits_t benchDoneBit);
+
+enum CommsSink {
+    COMMS_SINK_BLE = 0,
+    COMMS_SINK_USB,
+    COMMS_SINK_LOG,         // flash logger (flash_log.h)
+    COMMS_SINK_WIFI,        // UDP stream (wifi_stream.h)
+    COMMS_SINK_COUNT
+};
+
+// Replaces a sink's DSP stage, designed for commsInputRate() input.
+// Returns false and keeps the old one if the configuration is invalid.
+// For COMMS_SINK_BLE this sets every connected client and the default
+// (bleStreamSetDsp(BLE_ALL_CLIENTS, ...)).
+bool commsSetDsp(CommsSink sink, const DspConfig& cfg);
+DspConfig commsDsp(CommsSink sink);
+
+// Redesigns every DSP stage and the trigger for samples at hz, after the
+// sampler rate changed (imuSamplerSetSensorConfig). Fails and changes
+// nothing if one of their setups is invalid at that rate, e.g. a cutoff
+// above the new Nyquist frequency. IMU_SAMPLE_RATE_HZ until called.
+bool commsSetInputRate(uint32_t hz);
+uint32_t commsInputRate();
+
+// Replaces the stream trigger, designed for commsInputRate() input.
+// Returns false and keeps the old one if the configuration is invalid.
+// TRIGGER_SRC_MOTION uses the sensor's wake-on-motion only if the
+// sampler was started with the same threshold (imuSamplerSetWakeOnMotion).
+bool commsSetTrigger(const TriggerConfig& cfg);
+TriggerConfig commsTrigger();
+void commsTriggerStats(TriggerStats& out);
+
+// True while a stream, a benchmark or a capture keeps the pipeline busy.
+bool commsActive();
+
+// Most recent sample drained from the ring, and how many were drained
+// since the last reset.
+void commsLatestSample(ImuSample& out);
+uint32_t commsSamplesConsumed();
+void commsResetSamplesConsumed();
+
+// Time the pipeline spent working since the previous call, for the energy model.
+uint32_t commsTakeBusyUs();
+
+// Holds off the pipeline while stream or benchmark state is changed.
+class CommsLock {
+public:
+    CommsLock();
+    ~CommsLock();
+    CommsLock(const CommsLock&) = delete;
+    CommsLock& operator=(const CommsLock&) = delete;
+};
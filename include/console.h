@@ -0,0 +1,97 @@
+/*
+ * Buffered USB console output
+ *
+ * Text for the USB console never goes to Serial from the caller. The
+ * console functions format into a CONSOLE_LINE_MAX buffer on the caller's
+ * stack and copy the result into one CONSOLE_RING_BYTES byte ring under a
+ * spinlock held only for the copy. A task at CONSOLE_TASK_PRIORITY drains
+ * the ring into the CDC TX buffer, never writing more than
+ * availableForWrite() takes, so it is the only writer that ever waits for
+ * the host. A message that does not fit the ring is dropped whole and
+ * counted; the task reports drops once the ring has emptied again. With no
+ * host reading, output costs a copy until the ring is full and nothing
+ * after that.
+ *
+ * Any task may write, including the BLE stack's callbacks; ISRs may not.
+ * Every message is one ring entry, so messages from different tasks do not
+ * mix mid-line. Binary frames (stream_frame.h) keep writing to Serial
+ * themselves; a frame goes out between two console writes, never inside one.
+ *
+ * consolePrint*() is output asked for (menus, show blocks, command
+ * results) and always goes out. logError() to logDebug() are diagnostics
+ * from setup, callbacks and background tasks: levels above CONSOLE_LEVEL
+ * (build flag) compile out, and consoleSetLevel() filters further at run
+ * time. Both take printf formats.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define CONSOLE_LEVEL_ERROR     1
+#define CONSOLE_LEVEL_WARN      2
+#define CONSOLE_LEVEL_INFO      3
+#define CONSOLE_LEVEL_DEBUG     4
+
+#ifndef CONSOLE_LEVEL
+#define CONSOLE_LEVEL           CONSOLE_LEVEL_INFO  // highest level compiled in
+#endif
+
+#define CONSOLE_RING_BYTES      16384   // power of two: ~140 ms of output at USB full speed
+#define CONSOLE_LINE_MAX        256     // longest formatted message, longer ones are cut
+#define CONSOLE_TASK_PRIORITY   1       // below the flash log writer, with loop()
+#define CONSOLE_TASK_STACK      2560
+#define CONSOLE_RETRY_MS        2       // wait while the CDC TX buffer is full
+
+struct ConsoleStats {
+    uint8_t level;              // run-time level, CONSOLE_LEVEL_*
+    uint32_t messages;          // messages queued
+    uint32_t bytes;             // bytes handed to Serial
+    uint32_t dropped;           // messages lost to a full ring
+    uint32_t droppedBytes;
+    uint32_t filtered;          // diagnostics below the run-time level
+    uint32_t highWater;         // most bytes held in the ring
+    uint32_t stalls;            // waits for the CDC TX buffer
+};
+
+// Starts the drain task. Output queued before it starts goes out once it
+// runs. Call after Serial.begin().
+bool consoleBegin();
+
+void consolePrint(const char* text);
+void consolePrintln(const char* text = "");
+void consolePrintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void consoleWrite(const uint8_t* data, size_t len);
+
+// Diagnostics at `level`; call through the log macros below.
+void consoleLog(uint8_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#if CONSOLE_LEVEL >= CONSOLE_LEVEL_ERROR
+#define logError(...)   consoleLog(CONSOLE_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define logError(...)   do {} while (0)
+#endif
+#if CONSOLE_LEVEL >= CONSOLE_LEVEL_WARN
+#define logWarn(...)    consoleLog(CONSOLE_LEVEL_WARN, __VA_ARGS__)
+#else
+#define logWarn(...)    do {} while (0)
+#endif
+#if CONSOLE_LEVEL >= CONSOLE_LEVEL_INFO
+#define logInfo(...)    consoleLog(CONSOLE_LEVEL_INFO, __VA_ARGS__)
+#else
+#define logInfo(...)    do {} while (0)
+#endif
+#if CONSOLE_LEVEL >= CONSOLE_LEVEL_DEBUG
+#define logDebug(...)   consoleLog(CONSOLE_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(...)   do {} while (0)
+#endif
+
+// False for a level above CONSOLE_LEVEL, which would have no effect.
+bool consoleSetLevel(uint8_t level);
+const char* consoleLevelName(uint8_t level);
+
+// Waits up to timeoutMs for the ring to drain, e.g. before a restart.
+bool consoleFlush(uint32_t timeoutMs);
+
+void consoleGetStats(ConsoleStats& out);
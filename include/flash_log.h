@@ -0,0 +1,112 @@
+/*
+ * Persistent IMU logger on LittleFS
+ *
+ * While enabled, the comms pipeline hands every sample that leaves the
+ * log DSP stage (comms.h, COMMS_SINK_LOG) to flashLogFeed(), which packs
+ * CaptureRecords into FLOG_BLOCK_BYTES blocks in RAM. Only whole blocks
+ * reach the filesystem, written at block-aligned offsets by a low-priority
+ * writer task, so LittleFS never has to rewrite a partly programmed block;
+ * the file is synced (a metadata commit) only every FLOG_SYNC_BLOCKS
+ * blocks. A partly filled block is written when it gets FLOG_BLOCK_MAX_AGE_MS
+ * old or logging stops, which bounds the data lost at power-off.
+ *
+ * Blocks go into segment files /log/<id>.bin of FLOG_SEGMENT_BLOCKS blocks.
+ * When the partition cannot take another segment the oldest one is
+ * deleted. A RAM index holds each segment's boot number and time range,
+ * and every block header carries its own, so a time-range query reads only
+ * the headers of the segments it overlaps plus the blocks it returns.
+ *
+ * Block layout: FlashLogBlockHeader, then count CaptureRecords (capture.h),
+ * then padding. Times are esp_timer microseconds of the boot the block was
+ * written in, widened to 64 bits.
+ *
+ * Flash writes stall the caches of both cores for their duration. The
+ * sampler ring absorbs that (see imu_sampler.h), but register-mode
+ * timestamps show extra jitter while the log writes.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "capture.h"
+#include "imu_sample.h"
+
+#define FLOG_PARTITION          "spiffs"    // default partition table's data partition
+#define FLOG_DIR                "/log"
+#define FLOG_BLOCK_BYTES        4096        // LittleFS block size on the ESP32 flash
+#define FLOG_BLOCK_MAGIC        0x474F4C46  // "FLOG"
+#define FLOG_BUFFERS            4           // RAM blocks between the pipeline and the writer
+#define FLOG_SEGMENT_BLOCKS     64          // 256 KB segment files
+#define FLOG_MAX_SEGMENTS       64
+#define FLOG_SYNC_BLOCKS        8           // metadata commit every 32 KB
+#define FLOG_BLOCK_MAX_AGE_MS   10000
+#define FLOG_TASK_PRIORITY      2           // below comms, above idle
+#define FLOG_TASK_STACK         4096
+
+struct __attribute__((packed)) FlashLogBlockHeader {
+    uint32_t magic;         // FLOG_BLOCK_MAGIC
+    uint16_t boot;          // boot number the block was written in
+    uint16_t count;         // records in this block
+    uint32_t seq;           // block number since the log was created
+    uint64_t firstUs;       // time of the first and last record
+    uint64_t lastUs;
+    uint16_t crc;           // CRC-16/CCITT of the records
+    uint16_t reserved;
+};
+
+#define FLOG_BLOCK_RECORDS  ((FLOG_BLOCK_BYTES - sizeof(FlashLogBlockHeader)) / sizeof(CaptureRecord))
+
+static_assert(sizeof(FlashLogBlockHeader) == 32, "FlashLogBlockHeader layout");
+
+struct FlashLogSegment {
+    uint32_t id;
+    uint16_t boot;
+    uint16_t blocks;
+    uint64_t firstUs;
+    uint64_t lastUs;
+};
+
+struct FlashLogStats {
+    bool mounted;
+    bool enabled;
+    bool loading;
+    uint16_t boot;
+    uint32_t segments;
+    uint32_t totalBytes;        // partition size as LittleFS sees it
+    uint32_t usedBytes;
+    uint32_t records;           // records written to flash this boot
+    uint32_t blocks;            // blocks written this boot
+    uint32_t syncs;             // explicit metadata commits
+    uint32_t segmentsCreated;
+    uint32_t segmentsDeleted;
+    uint32_t droppedRecords;    // lost because every RAM block or the work queue was waiting for the writer
+    uint32_t writeErrors;
+    uint32_t writeUs;           // time spent in LittleFS write/sync calls
+    uint32_t lifetimeBlocks;    // blocks written since the log was created, all boots
+    uint32_t loaded;            // records copied by the last query
+};
+
+// Mounts the partition (formatting it if it has never been used), bumps the
+// boot number and rebuilds the segment index. Starts the writer task.
+bool flashLogBegin();
+bool flashLogMounted();
+
+bool flashLogSetEnabled(bool on);
+bool flashLogEnabled();
+
+// Called by the pipeline for every sample leaving the log DSP stage.
+void flashLogFeed(const ImuSample& s);
+
+// Segment index, oldest first. Returns the number of entries copied.
+size_t flashLogSegments(FlashLogSegment* out, size_t max);
+
+// Asynchronously copies the records of boot with fromMs <= t <= toMs (ms
+// since that boot) into the capture buffer, replacing its contents, for
+// download with 'cap get'. Fails while logging is busy with another query,
+// or while a capture is recording or downloading.
+bool flashLogLoad(uint16_t boot, uint32_t fromMs, uint32_t toMs);
+
+// Deletes every segment. Fails while logging is enabled.
+bool flashLogErase();
+
+void flashLogGetStats(FlashLogStats& out);
@@ -0,0 +1,89 @@
+/*
+ * Queued I2C transactions
+ *
+ * A bus task, pinned next to the sampler, owns the I2C port that Wire set
+ * up and runs register transactions from a queue. Callers submit an
+ * I2cTxn and either block until it completes (i2cBusTransfer) or carry on
+ * and get a completion callback, which runs on the bus task. The transfer
+ * itself is interrupt driven by the ESP-IDF legacy I2C master driver: the
+ * bus task sleeps in i2c_master_cmd_begin() while the controller refills
+ * its FIFO from the ISR, so a multi-hundred-byte FIFO burst no longer
+ * holds the submitting task for its full length.
+ *
+ * i2cBusAttach() makes the bus the SparkFun library's serial interface
+ * (serif): every ICM_20948 register access after icm.begin() goes through
+ * the queue, so library calls and the sampler's own asynchronous burst
+ * reads never interleave. Wire keeps working for the scanner; the IDF
+ * driver serialises its transfers with ours.
+ *
+ * The ESP32-S3 I2C controller has no DMA; the IDF 5 asynchronous master
+ * driver is not available on the Arduino 2.0.x core, hence the task.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ICM_20948.h>
+#include <driver/i2c.h>
+
+#define I2C_BUS_QUEUE_DEPTH     8
+#define I2C_BUS_CORE            1       // same core as the sampler
+#define I2C_BUS_PRIORITY        (configMAX_PRIORITIES - 1)  // completes reads ahead of the sampler
+#define I2C_BUS_STACK           3072
+#define I2C_BUS_TIMEOUT_MS      20      // per transaction, then the driver resets the bus
+
+#define I2C_BUS_STANDARD_HZ     100000
+#define I2C_BUS_FAST_HZ         400000
+#define I2C_BUS_FAST_PLUS_HZ    1000000 // beyond the ICM-20948 spec; short wires and stiff pull-ups only
+
+struct I2cTxn;
+
+// Runs on the bus task once txn has completed (result filled in). Keep it
+// short: give a semaphore, set an event bit.
+typedef void (*I2cCallback)(I2cTxn& txn);
+
+struct I2cTxn {
+    uint8_t addr;           // 7-bit device address
+    uint8_t reg;            // register written before the data or the read
+    bool write;
+    uint8_t* data;
+    uint16_t len;
+    I2cCallback callback;   // nullptr: none
+    void* user;
+    volatile bool busy;     // set by submit, cleared before the callback runs
+    esp_err_t result;
+};
+
+struct I2cBusStats {
+    uint32_t clockHz;
+    uint32_t transactions;
+    uint32_t bytes;
+    uint32_t errors;        // NACKs, timeouts, arbitration losses
+    uint32_t rejected;      // submits refused because the queue was full
+    uint32_t busyUs;        // time spent in the driver
+    uint32_t maxQueued;
+};
+
+// Starts the bus task on port, which Wire.begin() must already have
+// configured at clockHz.
+bool i2cBusBegin(i2c_port_t port, uint32_t clockHz);
+
+// Queues txn without blocking. txn must stay valid until busy clears.
+bool i2cBusSubmit(I2cTxn& txn);
+
+// Submits and waits for completion; returns the driver result.
+esp_err_t i2cBusTransfer(I2cTxn& txn);
+
+// Routes the sensor's register accesses through the bus. Call after
+// icm.begin() succeeded and i2cBusBegin().
+void i2cBusAttach(ICM_20948_I2C& dev);
+
+// Address of the attached sensor, for asynchronous I2cTxns; 0 before
+// i2cBusAttach().
+uint8_t i2cBusDeviceAddr();
+
+// Records the clock after Wire.setClock(), for the stats. The caller makes
+// sure nothing is queued while the clock changes.
+void i2cBusClockChanged(uint32_t clockHz);
+
+void i2cBusGetStats(I2cBusStats& out);
@@ -0,0 +1,35 @@
+/*
+ * Incremental I2C bus scanner
+ *
+ * Probes the 7-bit address range a few addresses at a time from the main
+ * scheduler instead of walking the whole bus in one blocking call. Devices
+ * are reported on USB Serial as they answer. Wire serialises bus access,
+ * so the sampling task keeps running between (and around) the probes.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#define I2C_SCAN_FIRST_ADDR     0x01
+#define I2C_SCAN_LAST_ADDR      0x7E
+#define I2C_SCAN_GAP_MS         5       // normal scan: pause between probes
+#define I2C_SCAN_FAST_BATCH     8       // fast scan: probes per service call, no pause
+#define I2C_SCAN_TIMEOUT_MS     5       // per-probe bus timeout; a stuck SCL fails fast
+
+// Starts a scan. Fails if one is already running.
+bool i2cScanStart(TwoWire& wire, bool fast);
+bool i2cScanActive();
+
+// Probes the next address(es) when due. Call from the scheduler on every
+// wakeup while a scan is active.
+void i2cScanService();
+
+// Longest the scheduler may sleep before the next i2cScanService().
+// Only meaningful while i2cScanActive().
+uint32_t i2cScanWaitMs();
+
+// Results of the last completed (or running) scan.
+uint8_t i2cScanDeviceCount();
+bool i2cScanFound(uint8_t addr);
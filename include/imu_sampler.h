@@ -0,0 +1,185 @@
+/*
+ * ICM-20948 sampling task
+ *
+ * A dedicated FreeRTOS task, pinned to IMU_SAMPLER_CORE, pushes timestamped
+ * ImuSamples into a lock-free SPSC ring. Exactly one other task may consume
+ * from the ring. Two acquisition modes are available:
+ *
+ *  - IMU_ACQ_REGISTER: the task sleeps until the sensor's data-ready
+ *    interrupt fires and reads one accel/gyro/temp/mag block per sample.
+ *  - IMU_ACQ_FIFO: the sensor's hardware FIFO collects samples and the task
+ *    wakes every IMU_FIFO_DRAIN_MS to drain it in large burst reads, which
+ *    cuts bus transactions and wakeups by roughly an order of magnitude.
+ *    Bursts are queued on the I2C bus task (i2c_bus.h) two buffers deep,
+ *    so one burst is decoded while the next is on the wire.
+ *    The data-ready interrupt stays enabled and only timestamps its edge:
+ *    the newest record of a drain is timed from the last edge and the rest
+ *    spaced back at the sample period (from the drain time if INT is not
+ *    wired or an edge raced the FIFO count read).
+ *  - IMU_ACQ_DMP6 / IMU_ACQ_DMP9: the sensor's Digital Motion Processor runs
+ *    the fusion on-chip and the task drains quaternion packets from the
+ *    FIFO every IMU_FIFO_DRAIN_MS. Samples carry a quaternion instead of
+ *    AGMT values. Requires the library's DMP support (ICM_20948_USE_DMP).
+ *    No interrupt is used: the newest packet of a drain is timed at the
+ *    drain and the rest spaced back at the DMP period, so a stamp can be
+ *    up to IMU_FIFO_DRAIN_MS late.
+ *
+ * The FIFO and DMP modes can also arm the sensor's wake-on-motion logic,
+ * which compares every accel sample with the previous one and raises
+ * WOM_INT on the same INT pin (so it doubles as the light-sleep wakeup of
+ * power.h). Drain passes read the status and count the events for the
+ * trigger engine (imu_trigger.h). Register mode would need a status read
+ * per sample; there the trigger runs the same comparison in software.
+ *
+ * While the sampler is running it owns the sensor: nothing else should call
+ * into the ICM_20948 object until imuSamplerStop() returns.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ICM_20948.h>
+#include <freertos/event_groups.h>
+#include "imu_sample.h"
+#include "spsc_ring.h"
+
+// ICM-20948 INT output -> XIAO D3. Configured push-pull, active high, 50us pulse.
+// Sample timestamps are esp_timer microseconds, the time base clock_sync.h reports.
+#define IMU_INT_PIN             4
+
+#define IMU_RING_SIZE           1024    // samples, must be a power of two
+#define IMU_SAMPLER_CORE        1
+#define IMU_SAMPLER_PRIORITY    (configMAX_PRIORITIES - 2)
+#define IMU_SAMPLER_STACK       4096
+#define IMU_DRDY_TIMEOUT_MS     20      // no interrupt for this long counts as a stall
+#define IMU_NOTIFY_WATERMARK    8       // register mode: wake the consumer once this many samples wait
+
+// Accel and gyro both run at 1125 Hz / (1 + divider) with the DLPF enabled.
+// The divider is part of ImuSensorConfig; IMU_SAMPLE_RATE_HZ is the
+// default rate and the highest one, imuSamplerRateHz() the one in effect.
+#define IMU_BASE_RATE_HZ        1125
+#define IMU_RATE_DIVIDER        0       // default
+#define IMU_MAX_RATE_DIVIDER    255     // the gyro divider is 8 bits: 4.4 Hz
+#define IMU_SAMPLE_RATE_HZ      (IMU_BASE_RATE_HZ / (1 + IMU_RATE_DIVIDER))
+
+// FIFO mode. A FIFO record is the same 23-byte block the register mode
+// reads. The SparkFun I2C read path counts received bytes in a uint8_t, so
+// one burst stays below 256 bytes; Wire's buffer must be raised to match.
+#define IMU_FIFO_DRAIN_MS       10
+#define IMU_FIFO_BURST_SAMPLES  11      // 253 bytes per burst read
+#define IMU_I2C_BUFFER_BYTES    260     // pass to Wire.setBufferSize() before Wire.begin()
+
+// DMP modes. The DMP runs at 55 Hz / (1 + interval); the requested rate is
+// rounded to the nearest interval it can produce.
+#define IMU_DMP_BASE_RATE_HZ    55
+#define IMU_DMP_DEFAULT_RATE_HZ 55
+#define IMU_DMP_MAX_PACKETS     32      // FIFO packets read per drain pass
+
+// Wake-on-motion threshold register: 4 mg per LSB, 8 bits.
+#define IMU_WOM_MG_PER_LSB      4
+#define IMU_WOM_MAX_MG          (255 * IMU_WOM_MG_PER_LSB)
+
+enum ImuAcqMode {
+    IMU_ACQ_REGISTER = 0,
+    IMU_ACQ_FIFO,
+    IMU_ACQ_DMP6,           // Game Rotation Vector: accel + gyro, no heading reference
+    IMU_ACQ_DMP9            // Rotation Vector: accel + gyro + mag, with heading accuracy
+};
+
+typedef SpscRing<ImuSample, IMU_RING_SIZE> ImuRing;
+
+// Sensor setup applied by imuSamplerStart() in the register and FIFO
+// modes; the DMP modes program their own rate and ranges.
+struct ImuSensorConfig {
+    uint8_t rateDivider;    // 0..IMU_MAX_RATE_DIVIDER, accel and gyro alike
+    uint8_t accelFs;        // ICM_20948_ACCEL_CONFIG_FS_SEL_e, gpm2..gpm16
+    uint8_t gyroFs;         // ICM_20948_GYRO_CONFIG_1_FS_SEL_e, dps250..dps2000
+    uint8_t accelDlpf;      // ICM_20948_ACCEL_CONFIG_DLPCFG_e
+    uint8_t gyroDlpf;       // ICM_20948_GYRO_CONFIG_1_DLPCFG_e
+};
+
+// Power-on defaults of this firmware: 1125 Hz, +-2 g, +-250 dps, widest
+// DLPF bandwidths that still apply the divider.
+const ImuSensorConfig IMU_SENSOR_DEFAULTS = { IMU_RATE_DIVIDER, gpm2, dps250, acc_d246bw_n265bw, gyr_d196bw6_n229bw8 };
+
+struct ImuSamplerStats {
+    uint32_t samples;       // samples pushed into the ring
+    uint32_t overruns;      // samples dropped because the ring was full
+    uint32_t missedIrqs;    // data-ready interrupts that arrived before the previous one was serviced
+    uint32_t readErrors;    // failed I2C burst reads
+    uint32_t stalls;        // IMU_DRDY_TIMEOUT_MS elapsed without an interrupt
+    uint32_t ringDepth;     // samples currently waiting for the consumer
+    uint32_t ringHighWater; // deepest the ring has been since start
+    uint32_t runTimeMs;     // time since imuSamplerStart()
+    uint32_t fifoDrains;    // FIFO mode: drain passes
+    uint32_t fifoBursts;    // FIFO mode: burst reads issued
+    uint32_t fifoOverflows; // FIFO mode: FIFO filled up before it was drained
+    uint32_t fifoAnchored;  // FIFO mode: drains timed from the data-ready interrupt
+    uint32_t dmpPackets;    // DMP modes: FIFO packets read
+    uint32_t dmpErrors;     // DMP modes: unrecognised or incomplete FIFO packets
+    uint32_t womEvents;     // FIFO and DMP modes: drains that saw WOM_INT
+};
+
+// Creates the sampling task. Call once after icm.begin() succeeded.
+bool imuSamplerBegin(ICM_20948& dev);
+
+// Configures the sensor for the selected mode and starts acquisition.
+bool imuSamplerStart();
+void imuSamplerStop();
+bool imuSamplerRunning();
+
+// Selects the acquisition mode used by the next imuSamplerStart().
+// Fails while the sampler is running, or for the DMP modes when the
+// firmware was built without ICM_20948_USE_DMP.
+bool imuSamplerSetMode(ImuAcqMode mode);
+ImuAcqMode imuSamplerMode();
+const char* imuSamplerModeName(ImuAcqMode mode);
+
+// DMP output rate for the next imuSamplerStart(). Returns the rate that
+// will actually be used. Fails while the sampler is running.
+bool imuSamplerSetDmpRate(uint32_t hz);
+uint32_t imuSamplerDmpRate();
+
+// Sensor setup for the next imuSamplerStart(). Fails while the sampler is
+// running or for a value out of range.
+bool imuSamplerSetSensorConfig(const ImuSensorConfig& cfg);
+ImuSensorConfig imuSamplerSensorConfig();
+
+// AGMT sample rate of the sensor setup, rounded down to whole Hz.
+uint32_t imuSamplerRateHz();
+
+// Rate divider closest to hz, for ImuSensorConfig::rateDivider.
+uint8_t imuSamplerDividerForRate(uint32_t hz);
+
+// 3 dB bandwidths of the DLPF settings, Hz (the NBW is a little wider).
+float imuSamplerAccelDlpfHz(uint8_t dlpf);
+float imuSamplerGyroDlpfHz(uint8_t dlpf);
+
+// Wake-on-motion threshold in mg for the next imuSamplerStart(), 0 = off,
+// rounded down to the register's 4 mg steps. Fails while the sampler is
+// running or above IMU_WOM_MAX_MG.
+bool imuSamplerSetWakeOnMotion(uint16_t mg);
+uint16_t imuSamplerWakeOnMotion();
+
+// True while the sensor's wake-on-motion is armed: running in FIFO or DMP
+// mode with a threshold set. imuSamplerWomEvents() counts its events.
+bool imuSamplerWomActive();
+uint32_t imuSamplerWomEvents();
+
+// Full-scale selections in effect, for converting raw samples to units.
+ICM_20948_fss_t imuSamplerFullScale();
+
+ImuRing& imuSamplerRing();
+
+// Sets bit in events when samples are waiting: in register mode once the
+// ring reaches IMU_NOTIFY_WATERMARK, in the FIFO and DMP modes after every
+// drain pass that produced samples.
+void imuSamplerSetConsumerEvent(EventGroupHandle_t events, EventBits_t bit);
+
+// Called by imuSamplerStart() once running, before the register and FIFO
+// modes attach their edge interrupt, and at the end of imuSamplerStop(),
+// so another user of the INT pin (the light-sleep wakeup of power.h) can
+// let go of it or take it back.
+void imuSamplerSetPinHook(void (*hook)());
+
+void imuSamplerGetStats(ImuSamplerStats& out);
@@ -0,0 +1,52 @@
+/*
+ * ICM-20948 SPI transport
+ *
+ * Build with IMU_USE_SPI=1 (the *_spi environment in platformio.ini) for
+ * boards with the sensor wired to the XIAO's SPI pins. icm.begin() brings
+ * the sensor up through Arduino SPI as usual; imuSpiAttach() then hands
+ * the SPI2 bus to the ESP-IDF master driver at IMU_SPI_CLOCK_HZ and
+ * replaces the library's serif, so every later register access, the
+ * sampler's FIFO bursts included, is one DMA transaction instead of a
+ * byte-at-a-time SPI.transfer() loop.
+ *
+ * Short accesses use the driver's polling path, which costs less than an
+ * interrupt round trip at this clock. Longer ones (FIFO bursts) go through
+ * DMA with the calling task blocked until the transfer completes.
+ * Everything passes through one internal DMA buffer, so the callers'
+ * buffers need no particular alignment or memory type.
+ *
+ * The acquisition API (imu_sampler.h) is unchanged; only the sensor object
+ * in main.cpp and its setup differ between the transports.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ICM_20948.h>
+
+#ifndef IMU_USE_SPI
+#define IMU_USE_SPI    0
+#endif
+
+// XIAO ESP32S3 SPI pins: D8 SCK, D9 MISO, D10 MOSI; chip select on D2
+#define IMU_SPI_SCK             7
+#define IMU_SPI_MISO            8
+#define IMU_SPI_MOSI            9
+#define IMU_SPI_CS              3
+#define IMU_SPI_CLOCK_HZ        7000000 // ICM-20948 maximum for all registers
+#define IMU_SPI_MAX_TRANSFER    512     // bytes per register access
+#define IMU_SPI_POLL_BYTES      32      // up to this long: polling transaction, no DMA interrupt
+
+struct ImuSpiStats {
+    uint32_t transfers;
+    uint32_t dmaTransfers;  // the ones long enough for the DMA path
+    uint32_t bytes;
+    uint32_t errors;
+};
+
+// Moves the sensor from Arduino SPI to the IDF driver. Call after
+// icm.begin() succeeded; nothing may be using SPI at that point.
+bool imuSpiAttach(ICM_20948_SPI& dev);
+bool imuSpiAttached();
+
+void imuSpiGetStats(ImuSpiStats& out);
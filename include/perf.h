@@ -0,0 +1,69 @@
+/*
+ * Latency and throughput instrumentation
+ *
+ * Stage timings are recorded into log2 histograms (perf_histogram.h):
+ * CPU-local ones in cycles from the core's cycle counter, end-to-end ones
+ * in microseconds from esp_timer. The 'perf' command prints them together
+ * with the flash log's throughput and wear counters, per-task stack
+ * high-water marks and CPU usage; the histograms are also readable in
+ * binary form from the perf characteristic.
+ *
+ * Cycle counts are per core and assume the clock stays put between start
+ * and end; the report converts with the clock in effect when it runs.
+ *
+ * Binary snapshot, little-endian:
+ *   version u8 | metrics u8 | cpu MHz u16 | uptime ms u32 |
+ *   free heap u32 | min free heap u32
+ * then per metric:
+ *   id u8 | unit u8 (0 = cycles, 1 = us) | count u32 | min u32 |
+ *   mean u32 | p50 u32 | p99 u32 | max u32
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "perf_histogram.h"
+
+#define PERF_SNAPSHOT_VERSION       1
+#define PERF_MAX_TASKS              24
+
+enum PerfMetric {
+    PERF_CMD_DISPATCH = 0,  // cycles: processCommand(), parse to reply
+    PERF_BLE_NOTIFY,        // cycles: one stream notification handed to the stack
+    PERF_I2C_BLOCK,         // cycles: one 23-byte register-mode sample read
+    PERF_I2C_BURST,         // cycles: one FIFO burst read
+    PERF_BLE_SAMPLE_TO_TX,  // us: sample timestamp to its BLE notification
+    PERF_USB_SAMPLE_TO_TX,  // us: sample timestamp to its USB write
+    PERF_SAMPLE_JITTER,     // us: register mode, |sample interval - period|
+    PERF_FLOG_WRITE,        // us: one flash log block written (and synced, every FLOG_SYNC_BLOCKS)
+    PERF_SPECTRAL_WINDOW,   // cycles: one spectral window transformed (and its packet sent)
+    PERF_WIFI_SAMPLE_TO_TX, // us: first sample of a datagram to its handoff to lwIP
+    PERF_METRIC_COUNT
+};
+
+extern PerfHistogram perfHistograms[PERF_METRIC_COUNT];
+
+inline uint32_t perfCycles() {
+    return ESP.getCycleCount();
+}
+
+inline void perfRecord(PerfMetric metric, uint32_t value) {
+    perfHistograms[metric].record(value);
+}
+
+inline void perfRecordSince(PerfMetric metric, uint32_t startCycles) {
+    perfHistograms[metric].record(perfCycles() - startCycles);
+}
+
+const char* perfMetricName(PerfMetric metric);
+bool perfMetricInCycles(PerfMetric metric);
+
+// Clears all histograms. Call once at startup before anything records.
+void perfReset();
+
+// Prints histograms and the task table to USB Serial.
+void perfPrintReport();
+
+// Writes the binary snapshot, which is also the value of the perf
+// characteristic (ble_gatt.h). Returns its length, 0 if out is too small.
+size_t perfEncode(uint8_t* out, size_t size);
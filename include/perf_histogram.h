@@ -0,0 +1,68 @@
+/*
+ * Log2 latency histogram
+ *
+ * Bucket b counts values in [2^b, 2^(b+1)), bucket 0 also takes 0. One
+ * record() is a count-leading-zeros and a handful of adds, cheap enough
+ * for the sampling and streaming hot paths. Each histogram must have a
+ * single writer; readers may see a record half applied, which only skews
+ * a snapshot by one value.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PERF_HIST_BUCKETS   32
+
+struct PerfHistogram {
+    uint32_t buckets[PERF_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+
+    void reset() {
+        for (size_t i = 0; i < PERF_HIST_BUCKETS; i++) {
+            buckets[i] = 0;
+        }
+        count = 0;
+        min = UINT32_MAX;
+        max = 0;
+        sum = 0;
+    }
+
+    void record(uint32_t v) {
+        buckets[v ? 31 - __builtin_clz(v) : 0]++;
+        count++;
+        sum += v;
+        if (v < min) {
+            min = v;
+        }
+        if (v > max) {
+            max = v;
+        }
+    }
+
+    uint32_t mean() const {
+        return count ? (uint32_t)(sum / count) : 0;
+    }
+
+    // Upper edge of the bucket holding the p-th percentile (0..100),
+    // clamped to the largest value seen.
+    uint32_t percentile(uint32_t p) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t target = ((uint64_t)count * p + 99) / 100;
+        uint64_t seen = 0;
+        for (size_t b = 0; b < PERF_HIST_BUCKETS; b++) {
+            seen += buckets[b];
+            if (seen >= target && seen > 0) {
+                uint32_t edge = b >= 31 ? UINT32_MAX : (2u << b) - 1;
+                return edge < max ? edge : max;
+            }
+        }
+        return max;
+    }
+};
@@ -0,0 +1,87 @@
+/*
+ * Power profiles and energy estimate
+ *
+ * A profile bundles the CPU clock policy, automatic light sleep, the BLE
+ * connection parameters requested from the central and the advertising
+ * interval:
+ *
+ *  - POWER_PROFILE_THROUGHPUT: 240 MHz, no sleep, 7.5-15 ms interval, no
+ *    slave latency. The firmware's historical behaviour and the default.
+ *  - POWER_PROFILE_BALANCED: 80-160 MHz, 30-50 ms interval, latency 2.
+ *  - POWER_PROFILE_LOW: 80 MHz, automatic light sleep between events,
+ *    100-200 ms interval, latency 4, slow advertising. The IMU INT pin is
+ *    armed as a light-sleep wakeup source, except while register or FIFO
+ *    sampling holds it for their edge interrupt; the choice is made again
+ *    on every sampler start and stop. Pair this profile with DMP
+ *    acquisition only.
+ *
+ * Frequency scaling and automatic light sleep need an SDK built with
+ * CONFIG_PM_ENABLE (and CONFIG_FREERTOS_USE_TICKLESS_IDLE for sleep). The
+ * prebuilt Arduino core has neither, so there the profile falls back to a
+ * fixed setCpuFrequencyMhz() at the profile's maximum clock. Light sleep
+ * suspends the USB Serial/JTAG link, so POWER_PROFILE_LOW is meant for
+ * battery deployments without a USB host.
+ *
+ * The energy counter is a model, not a measurement: time spent busy in the
+ * scheduler, idle or asleep, BLE connection events and notifications, and
+ * IMU on-time are weighted with the typical currents below.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+enum PowerProfile {
+    POWER_PROFILE_THROUGHPUT = 0,
+    POWER_PROFILE_BALANCED,
+    POWER_PROFILE_LOW
+};
+
+#define POWER_WINDOW_MS             5000    // averaging window for windowMa
+
+// Energy model, typical values from the ESP32-S3 and ICM-20948 datasheets
+#define POWER_MODEL_SUPPLY_V        3.3f
+#define POWER_MODEL_BASE_MA         12.0f   // active CPU, clock-independent part
+#define POWER_MODEL_MA_PER_MHZ      0.13f   // active CPU, per MHz
+#define POWER_MODEL_IDLE_FACTOR     0.55f   // idle (WFI) current relative to active
+#define POWER_MODEL_SLEEP_MA        0.24f   // light sleep
+#define POWER_MODEL_CONN_EVENT_UC   15.0f   // one empty BLE connection event
+#define POWER_MODEL_NOTIFY_UC       8.0f    // extra charge per notification sent
+#define POWER_MODEL_ADV_EVENT_UC    25.0f   // one advertising event on three channels
+#define POWER_MODEL_IMU_ACTIVE_MA   3.1f    // accel + gyro low-noise mode
+#define POWER_MODEL_IMU_IDLE_MA     0.01f   // sensor in sleep
+
+struct PowerStats {
+    PowerProfile profile;
+    uint32_t cpuMhz;            // current CPU clock
+    bool dfsActive;             // esp_pm frequency scaling configured
+    bool lightSleepActive;      // automatic light sleep configured
+    float avgMa;                // modelled average current since the last reset
+    float windowMa;             // modelled average current over the last window
+    float cpuMah;               // modelled charge by component since the last reset
+    float radioMah;
+    float imuMah;
+    float totalMah;
+    float totalMwh;
+    uint32_t elapsedMs;         // accounting time since the last reset
+    float busyPercent;          // scheduler busy time
+};
+
+// Applies the profile. Link parameters are requested again on the next
+// connection, or now if connected.
+void powerSetProfile(PowerProfile profile);
+PowerProfile powerProfile();
+const char* powerProfileName(PowerProfile profile);
+
+// Called from the server's onConnect() to request this profile's link.
+void powerOnConnect();
+
+// Sampler pin hook (imuSamplerSetPinHook): arms or disarms the IMU wakeup
+// again for the acquisition that just started or stopped.
+void powerOnSamplerChange();
+
+// Called by the scheduler after every pass with the time it spent working.
+void powerAccount(uint32_t busyUs);
+
+void powerGetStats(PowerStats& out);
+void powerResetStats();
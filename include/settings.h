@@ -0,0 +1,56 @@
+/*
+ * Saved node settings in NVS
+ *
+ * One packed, versioned blob in the default NVS partition holds what a
+ * deployed node should come up with: acquisition mode, sensor setup, DMP
+ * rate, I2C clock, power profile (which is also the BLE connection
+ * profile), stream record coding and the Wi-Fi radio preferences. Reading
+ * it is a single NVS lookup; setup() hands the values to their modules
+ * through the same setters the commands use once the hardware is up, so
+ * none of the initialisation runs twice, and does nothing at all when no
+ * settings are saved.
+ *
+ * Nothing is written unless asked for (`cfg save`), and a blob of another
+ * version or size is ignored, so a firmware update that changes the layout
+ * simply boots with the defaults. This module only stores; main.cpp takes
+ * the live values from, and hands them back to, the modules they belong to.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "imu_sampler.h"
+
+#define SETTINGS_NAMESPACE      "node"
+#define SETTINGS_KEY            "cfg"
+#define SETTINGS_VERSION        1
+
+// Settings::streamDelta bits
+#define SETTINGS_DELTA_BLE      (1 << 0)    // default for new BLE clients
+#define SETTINGS_DELTA_USB      (1 << 1)
+#define SETTINGS_DELTA_WIFI     (1 << 2)
+
+struct __attribute__((packed)) Settings {
+    uint8_t version;            // SETTINGS_VERSION
+    uint8_t acqMode;            // ImuAcqMode
+    ImuSensorConfig sensor;
+    uint8_t dmpRateHz;
+    uint16_t i2cClockKhz;
+    uint8_t powerProfile;       // PowerProfile
+    uint8_t streamDelta;        // SETTINGS_DELTA_* bits
+    uint8_t wifiCoex;           // WifiCoex
+    uint8_t wifiMaxPowerSave;
+    uint8_t wifiOn;             // rejoin the last network at boot
+};
+
+// Firmware defaults, what a node without saved settings runs with.
+void settingsDefaults(Settings& out);
+
+// Fills out with the saved settings. Returns false, with out set to the
+// defaults, if nothing is saved or the blob does not hold valid settings.
+bool settingsLoad(Settings& out);
+
+bool settingsSave(const Settings& s);
+
+// Deletes the saved settings; the next boot uses the defaults.
+bool settingsErase();
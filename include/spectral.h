@@ -0,0 +1,106 @@
+/*
+ * On-device spectral features
+ *
+ * For vibration monitoring the node can send what a host would compute
+ * from the raw accelerometer stream instead of the stream itself. While
+ * enabled, the comms pipeline copies the accel of every raw AGMT sample
+ * into a SPECTRAL_FFT_SIZE history, ahead of any DSP stage like the
+ * capture. Every SPECTRAL_HOP samples (windows overlap by half) the three
+ * axes are put through a Hann window and esp-dsp's radix-2 float FFT, x
+ * and y sharing one complex transform; on the ESP32-S3 esp-dsp selects
+ * its aes3 kernels. The power spectra of `average` consecutive windows are
+ * averaged (Welch) and reduced, per axis, to:
+ *
+ *  - the RMS of the window with its mean removed, from the samples;
+ *  - the strongest bin from SPECTRAL_MIN_BIN up, its frequency refined
+ *    by Gaussian interpolation over its neighbours, and its amplitude;
+ *  - the RMS in SPECTRAL_BANDS octave bands, the highest ending at Nyquist:
+ *    band b spans bins [N/2 >> (SPECTRAL_BANDS - b), N/2 >> (SPECTRAL_BANDS - 1 - b)).
+ *
+ * Each result is one SpectralPacket, notified on the spectrum
+ * characteristic to every subscribed BLE client whose MTU takes it whole,
+ * and framed on USB CDC (stream_frame.h) if asked for. Levels are in
+ * 0.01 dB re 1 mg (mg = 10^(level / 2000)); SPECTRAL_LEVEL_FLOOR marks
+ * zero. At the defaults that is 78 bytes every 455 ms instead of ~25 KB/s
+ * of raw samples; averaging cuts it further.
+ *
+ * All floating point runs once per hop on the comms task; the per-sample
+ * work is a copy. The buffers (~32 KB internal RAM) are allocated on the
+ * first enable. DMP quaternion samples are skipped.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "imu_sample.h"
+#include "stream_packet.h"
+
+#define SPECTRAL_FFT_LOG2       10
+#define SPECTRAL_FFT_SIZE       (1 << SPECTRAL_FFT_LOG2)   // 0.91 s, 1.1 Hz bins at 1125 Hz
+#define SPECTRAL_HOP            (SPECTRAL_FFT_SIZE / 2)
+#define SPECTRAL_BANDS          8
+#define SPECTRAL_MIN_BIN        2       // Hann leakage of the mean reaches bin 1
+#define SPECTRAL_MAX_AVERAGE    64
+#define SPECTRAL_LEVEL_FLOOR    INT16_MIN
+
+static_assert((SPECTRAL_FFT_SIZE / 2) >> SPECTRAL_BANDS >= SPECTRAL_MIN_BIN,
+              "lowest band would start below SPECTRAL_MIN_BIN");
+
+struct __attribute__((packed)) SpectralHeader {
+    uint8_t  type;          // STREAM_PKT_SPECTRUM
+    uint8_t  bands;         // SPECTRAL_BANDS
+    uint16_t seq;           // packet counter since enable, wraps at 65536
+    uint32_t endUs;         // timestamp of the last sample that went in
+    uint16_t rateHz;        // sample rate the bins refer to
+    uint8_t  fftLog2;       // window length, log2
+    uint8_t  windows;       // windows averaged
+};
+
+struct __attribute__((packed)) SpectralAxis {
+    int16_t  rms;           // 0.01 dB re 1 mg
+    int16_t  peak;          // amplitude of the strongest component, same
+    uint16_t peakCentiHz;   // its frequency, 0.01 Hz
+    int16_t  band[SPECTRAL_BANDS];
+};
+
+struct __attribute__((packed)) SpectralPacket {
+    SpectralHeader hdr;
+    SpectralAxis axis[3];   // accel x, y, z
+};
+
+static_assert(sizeof(SpectralHeader) == 12, "SpectralHeader layout");
+static_assert(sizeof(SpectralAxis) == 6 + 2 * SPECTRAL_BANDS, "SpectralAxis layout");
+
+struct SpectralStatus {
+    bool allocated;
+    bool enabled;
+    bool usb;               // packets are framed on USB CDC too
+    uint8_t average;        // windows per packet
+    uint32_t windows;       // windows transformed since enable
+    uint32_t packets;       // packets produced
+    uint32_t bleSent;       // notifications handed to the stack
+    uint32_t bleSmallMtu;   // connected clients skipped, MTU below the packet
+    uint32_t usbSent;
+    uint32_t usbDropped;    // CDC buffer full
+    uint32_t skipped;       // non-AGMT samples ignored (DMP modes)
+    uint32_t computeUs;     // last window's transform and reduction
+    bool haveLast;
+    SpectralPacket last;
+};
+
+// Allocates on first use and starts collecting from an empty window.
+// Fails if the buffers or the FFT tables cannot be allocated. Call these
+// under CommsLock.
+bool spectralSetEnabled(bool on, bool usb);
+bool spectralEnabled();
+bool spectralSetAverage(uint8_t windows);   // 1..SPECTRAL_MAX_AVERAGE, restarts the average
+
+// Called by the pipeline for every sample drained from the ring.
+void spectralFeed(const ImuSample& s);
+
+void spectralGetStatus(SpectralStatus& out);
+
+// Level code -> mg, 0 for SPECTRAL_LEVEL_FLOOR.
+inline float spectralLevelMg(int16_t level) {
+    return level == SPECTRAL_LEVEL_FLOOR ? 0.0f : powf(10.0f, level / 2000.0f);
+}
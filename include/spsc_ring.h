@@ -0,0 +1,90 @@
+/*
+ * Single-producer / single-consumer lock-free ring buffer.
+ *
+ * The producer (sampling task) only writes head, the consumer only writes
+ * tail, so no locks or critical sections are needed as long as each side
+ * stays on its own task. When the ring is full the new item is dropped and
+ * counted as an overrun; the producer never blocks.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+    SpscRing() : head_(0), tail_(0), overruns_(0), highWater_(0) {}
+
+    // Producer side
+    bool push(const T& item) {
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        const uint32_t tail = tail_.load(std::memory_order_acquire);
+        const uint32_t used = head - tail;
+        if (used >= N) {
+            overruns_.store(overruns_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        items_[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        if (used + 1 > highWater_.load(std::memory_order_relaxed)) {
+            highWater_.store(used + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T& out) {
+        const uint32_t tail = tail_.load(std::memory_order_relaxed);
+        const uint32_t head = head_.load(std::memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        out = items_[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: pops up to maxItems in one go, returns how many.
+    size_t popBatch(T* out, size_t maxItems) {
+        const uint32_t tail = tail_.load(std::memory_order_relaxed);
+        const uint32_t head = head_.load(std::memory_order_acquire);
+        size_t count = head - tail;
+        if (count > maxItems) {
+            count = maxItems;
+        }
+        for (size_t i = 0; i < count; i++) {
+            out[i] = items_[(tail + i) & (N - 1)];
+        }
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Either side; the value may be stale by the time it is used.
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity() { return N; }
+    uint32_t overruns() const { return overruns_.load(std::memory_order_relaxed); }
+    uint32_t highWater() const { return highWater_.load(std::memory_order_relaxed); }
+
+    // Only call while neither side is running.
+    void reset() {
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        overruns_.store(0, std::memory_order_relaxed);
+        highWater_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    T items_[N];
+    std::atomic<uint32_t> head_;
+    std::atomic<uint32_t> tail_;
+    std::atomic<uint32_t> overruns_;
+    std::atomic<uint32_t> highWater_;
+};
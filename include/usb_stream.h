@@ -0,0 +1,42 @@
+/*
+ * Binary IMU streaming over native USB CDC
+ *
+ * Samples drained from the sampler ring are packed into stream packets,
+ * wrapped in CRC-checked frames (stream_frame.h) and collected in a local
+ * buffer that goes to the USB Serial/JTAG CDC in large writes. Nothing on
+ * this path formats text, and it never blocks: if the host stops reading,
+ * frames are dropped and counted.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "imu_sample.h"
+
+#define USB_CDC_TX_BUFFER           8192    // driver TX ring, set before Serial.begin()
+#define USB_STREAM_PACKET_SAMPLES   32      // 8 + 32 * 22 = 712 byte packets
+#define USB_STREAM_TX_BYTES         4096    // local batch buffer
+#define USB_STREAM_WRITE_THRESHOLD  2048    // write once this much is pending
+#define USB_STREAM_FLUSH_MS         10      // or once the oldest data is this old
+
+struct UsbStreamStats {
+    uint32_t frames;            // frames written to the CDC
+    uint32_t bytes;             // bytes written, including framing
+    uint32_t writes;            // Serial.write() calls
+    uint32_t samples;           // samples carried
+    uint32_t droppedFrames;     // frames lost because the host was not reading
+    uint32_t droppedSamples;
+    bool delta;                 // delta/varint record coding selected
+};
+
+bool usbStreamSetEnabled(bool enabled);
+bool usbStreamEnabled();
+
+// Selects delta/varint record coding (stream_packet.h) from the next packet on.
+void usbStreamSetDelta(bool on);
+
+// Consumer side: feed every sample, then call usbStreamService().
+void usbStreamFeed(const ImuSample& s);
+void usbStreamService();
+
+void usbStreamGetStats(UsbStreamStats& out);
@@ -0,0 +1,53 @@
+/*
+ * Binary IMU streaming over Wi-Fi UDP
+ *
+ * The same stream packets as BLE and USB (stream_packet.h), one per
+ * datagram and without the USB framing: UDP keeps datagram boundaries and
+ * checksums them, and the packet sequence number shows what got lost.
+ * Packets are built straight into the lwIP pbuf they are sent from, so a
+ * sample is written once and never copied again on the way to the driver.
+ *
+ * A packet closes at WIFI_STREAM_PACKET_SAMPLES or when it would outgrow
+ * WIFI_STREAM_MAX_DATAGRAM (delta coding fits more samples), and a partial
+ * one once it is WIFI_STREAM_FLUSH_MS old. It goes to one target, normally
+ * the host that sent `wstream on`. Nothing waits: while the station is not
+ * connected, or lwIP has no buffer or queue space, samples are dropped and
+ * counted.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "imu_sample.h"
+
+#define WIFI_STREAM_PACKET_SAMPLES  64      // 8 + 64 * 22 = 1416 byte datagrams
+#define WIFI_STREAM_MAX_DATAGRAM    1472    // UDP payload of a 1500 byte MTU
+#define WIFI_STREAM_FLUSH_MS        20      // close a partial packet this old
+
+struct WifiStreamStats {
+    uint32_t packets;           // datagrams handed to lwIP
+    uint32_t bytes;
+    uint32_t samples;
+    uint32_t droppedPackets;    // send queue full
+    uint32_t droppedSamples;    // including samples while disconnected
+    uint32_t allocFailures;     // no pbuf for the next packet
+    bool delta;                 // delta/varint record coding selected
+    uint32_t targetIp;          // IPv4, network byte order
+    uint16_t targetPort;
+};
+
+// Fails when enabling without a target.
+bool wifiStreamSetEnabled(bool on);
+bool wifiStreamEnabled();
+
+// Destination of the stream datagrams (IPv4, network byte order).
+void wifiStreamSetTarget(uint32_t ip, uint16_t port);
+
+// Selects delta/varint record coding (stream_packet.h) from the next packet on.
+void wifiStreamSetDelta(bool on);
+
+// Consumer side: feed every sample, then call wifiStreamService().
+void wifiStreamFeed(const ImuSample& s);
+void wifiStreamService();
+
+void wifiStreamGetStats(WifiStreamStats& out);
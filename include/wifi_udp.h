@@ -0,0 +1,95 @@
+/*
+ * Wi-Fi station and UDP link
+ *
+ * Optional second radio path next to BLE, for nodes that need the full
+ * sample rate untethered. The node joins an access point as a station and
+ * opens one raw lwIP UDP socket on WIFI_UDP_PORT. A host talks to it the way
+ * a BLE central does over the command characteristic: every datagram that
+ * arrives is one command line, queued for the scheduler like a BLE write
+ * (ble_command.h), and the reply goes back to the sender as one text
+ * datagram ending in '\n'. Commands act as if typed on USB; `wstream on`
+ * from a sender subscribes it to the stream (wifi_stream.h).
+ *
+ * Datagrams go out without copies: senders fill an lwIP pbuf in place and
+ * hand it over with wifiUdpSend(). lwIP's raw API belongs to its tcpip
+ * thread, so the pbuf is queued (one lock-free queue per sending task) and
+ * the tcpip thread is woken with a non-blocking callback that sends
+ * whatever is queued. Nothing here waits for the tcpip thread or the air.
+ *
+ * BLE and Wi-Fi share the 2.4 GHz radio. The coexistence preference picks
+ * which one the arbiter favours, and BLE requires Wi-Fi modem sleep; the
+ * maximum power save setting trades Wi-Fi throughput and latency for
+ * current. The driver keeps the last credentials in its own NVS entry, so
+ * `wifi on` joins the same network again.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/event_groups.h>
+#include "cmd_dispatch.h"
+
+struct pbuf;
+
+#define WIFI_UDP_PORT           5005    // commands in; replies and stream out
+#define WIFI_UDP_QUEUE_DEPTH    16      // datagrams per sender waiting for the tcpip thread
+#define WIFI_CMD_QUEUE_DEPTH    4
+
+enum WifiUdpSender {
+    WIFI_UDP_STREAM = 0,    // comms task (wifi_stream.h)
+    WIFI_UDP_REPLY,         // scheduler, command replies
+    WIFI_UDP_SENDER_COUNT
+};
+
+enum WifiCoex {
+    WIFI_COEX_BALANCE = 0,
+    WIFI_COEX_WIFI,         // favour Wi-Fi throughput
+    WIFI_COEX_BLE,          // favour BLE connection events
+};
+
+struct WifiStatus {
+    bool started;           // station enabled
+    bool connected;         // associated and holding an address
+    char ssid[33];
+    uint32_t ip;            // IPv4, network byte order
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t coex;           // WifiCoex
+    bool maxPowerSave;
+    uint32_t commands;      // datagrams queued as commands
+    uint32_t commandsDropped;   // lost to a full queue or not from IPv4
+    uint32_t sent;          // datagrams lwIP accepted
+    uint32_t sendErrors;    // datagrams lwIP refused (no route, no memory)
+    uint32_t queueFull;     // datagrams dropped before reaching the tcpip thread
+};
+
+// Runs one command on the scheduler's task and fills in the reply.
+typedef void (*WifiCommandHandler)(CmdSpan input, CmdReply& reply);
+
+// Registers the command handler; each queued datagram sets readyBit in
+// events. The radio stays off until wifiConnect().
+bool wifiUdpBegin(WifiCommandHandler handler, EventGroupHandle_t events, EventBits_t readyBit);
+
+// Starts the station and joins ssid, or the network last joined when ssid
+// is null. Returns false if the station or the socket cannot be set up;
+// the connection itself completes in the background.
+bool wifiConnect(const char* ssid, const char* password);
+void wifiDisconnect();
+bool wifiConnected();
+
+bool wifiSetCoex(WifiCoex pref);
+bool wifiSetMaxPowerSave(bool on);
+const char* wifiCoexName(uint8_t pref);
+
+// Takes ownership of p, a PBUF_RAM pbuf holding one datagram for ip:port
+// (IPv4, network byte order). Returns false and frees it if the sender's
+// queue is full or the socket is closed. Each sender must stay on one task.
+bool wifiUdpSend(WifiUdpSender sender, struct pbuf* p, uint32_t ip, uint16_t port);
+
+// Runs every queued command. Call from the scheduler when readyBit is set.
+void wifiCommandService();
+
+// Sender of the command being run. False outside wifiCommandService().
+bool wifiCommandSource(uint32_t& ip, uint16_t& port);
+
+void wifiGetStatus(WifiStatus& out);
@@ -0,0 +1,135 @@
+/*
+ * Allocation-free command parsing and dispatch - see cmd_dispatch.h
+ */
+
+#include "cmd_dispatch.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+CmdSpan cmdSpan(const char* s) {
+    CmdSpan out = { s, s ? strlen(s) : 0 };
+    return out;
+}
+
+CmdSpan cmdTrim(CmdSpan s) {
+    while (s.len > 0 && isSpace(s.ptr[0])) {
+        s.ptr++;
+        s.len--;
+    }
+    while (s.len > 0 && isSpace(s.ptr[s.len - 1])) {
+        s.len--;
+    }
+    return s;
+}
+
+CmdSpan cmdNextWord(CmdSpan& rest) {
+    rest = cmdTrim(rest);
+    size_t n = 0;
+    while (n < rest.len && !isSpace(rest.ptr[n])) {
+        n++;
+    }
+    CmdSpan word = { rest.ptr, n };
+    CmdSpan tail = { rest.ptr + n, rest.len - n };
+    rest = cmdTrim(tail);
+    return word;
+}
+
+bool cmdEquals(CmdSpan s, const char* word) {
+    size_t n = strlen(word);
+    return s.len == n && memcmp(s.ptr, word, n) == 0;
+}
+
+bool cmdParseInt(CmdSpan s, long& out) {
+    char tmp[16];
+    if (s.len == 0 || s.len >= sizeof(tmp)) {
+        return false;
+    }
+    memcpy(tmp, s.ptr, s.len);
+    tmp[s.len] = '\0';
+    char* end = nullptr;
+    long v = strtol(tmp, &end, 10);
+    if (*end != '\0') {
+        return false;
+    }
+    out = v;
+    return true;
+}
+
+CmdReply::CmdReply(char* buf, size_t size) : buf_(buf), size_(size), len_(0) {
+    if (size_) {
+        buf_[0] = '\0';
+    }
+}
+
+void CmdReply::clear() {
+    len_ = 0;
+    if (size_) {
+        buf_[0] = '\0';
+    }
+}
+
+void CmdReply::set(const char* text) {
+    clear();
+    append(cmdSpan(text));
+}
+
+void CmdReply::printf(const char* fmt, ...) {
+    if (len_ + 1 >= size_) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf_ + len_, size_ - len_, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        len_ += (size_t)n < size_ - len_ ? (size_t)n : size_ - len_ - 1;
+    }
+}
+
+void CmdReply::append(CmdSpan text) {
+    if (len_ + 1 >= size_) {
+        return;
+    }
+    size_t n = text.len < size_ - len_ - 1 ? text.len : size_ - len_ - 1;
+    memcpy(buf_ + len_, text.ptr, n);
+    len_ += n;
+    buf_[len_] = '\0';
+}
+
+const CmdEntry* cmdFind(const CmdEntry* table, size_t n, CmdSpan line, CmdSpan& args) {
+    args = line;
+    CmdSpan verb = cmdNextWord(args);
+    uint32_t h = cmdHash(verb);
+    for (size_t i = 0; i < n; i++) {
+        if (table[i].hash == h && cmdEquals(verb, table[i].name)) {
+            return &table[i];
+        }
+    }
+    return nullptr;
+}
+
+bool CmdLineBuffer::feed(char c, CmdSpan& line) {
+    if (c == '\n' || c == '\r') {
+        bool complete = len_ > 0 && !overflow_;
+        if (overflow_) {
+            dropped_++;
+        }
+        line.ptr = buf_;
+        line.len = len_;
+        len_ = 0;
+        overflow_ = false;
+        return complete;
+    }
+    if (len_ >= sizeof(buf_)) {
+        overflow_ = true;
+        return false;
+    }
+    buf_[len_++] = c;
+    return false;
+}
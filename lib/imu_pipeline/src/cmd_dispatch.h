@@ -0,0 +1,113 @@
+/*
+ * Allocation-free command parsing and dispatch
+ *
+ * Commands arrive as (pointer, length) spans straight from the transport's
+ * receive buffer and replies are formatted into a caller-owned buffer, so
+ * handling a command never touches the heap.
+ *
+ * The dispatch table is a constexpr array of { hash, name, handler }. The
+ * FNV-1a hash of every command name is computed at compile time and a
+ * static_assert rejects tables with colliding hashes; a lookup hashes the
+ * first word of the input once and only compares names on a hash match.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CMD_LINE_MAX    128     // longest accepted command line
+#define CMD_REPLY_MAX   160     // longest reply, including the terminator
+
+#define CMD_FNV_OFFSET  2166136261u
+#define CMD_FNV_PRIME   16777619u
+
+struct CmdSpan {
+    const char* ptr;
+    size_t len;
+};
+
+constexpr uint32_t cmdHash(const char* s, size_t n, uint32_t h = CMD_FNV_OFFSET) {
+    return n == 0 ? h : cmdHash(s + 1, n - 1, (h ^ (uint8_t)*s) * CMD_FNV_PRIME);
+}
+
+template <size_t N>
+constexpr uint32_t cmdHash(const char (&s)[N]) {
+    return cmdHash(s, N - 1);
+}
+
+// Runtime form of cmdHash(), kept iterative for the hot path.
+inline uint32_t cmdHash(CmdSpan s) {
+    uint32_t h = CMD_FNV_OFFSET;
+    for (size_t i = 0; i < s.len; i++) {
+        h = (h ^ (uint8_t)s.ptr[i]) * CMD_FNV_PRIME;
+    }
+    return h;
+}
+
+CmdSpan cmdSpan(const char* s);
+CmdSpan cmdTrim(CmdSpan s);
+
+// Splits off the first space-delimited word; rest keeps the trimmed remainder.
+CmdSpan cmdNextWord(CmdSpan& rest);
+
+bool cmdEquals(CmdSpan s, const char* word);
+bool cmdParseInt(CmdSpan s, long& out);
+
+// Formats into a fixed buffer; output beyond the buffer is truncated.
+class CmdReply {
+public:
+    CmdReply(char* buf, size_t size);
+
+    void clear();
+    void set(const char* text);
+    void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    void append(CmdSpan text);
+
+    bool empty() const { return len_ == 0; }
+    size_t length() const { return len_; }
+    const char* c_str() const { return buf_; }
+
+private:
+    char* buf_;
+    size_t size_;
+    size_t len_;
+};
+
+typedef void (*CmdHandler)(CmdSpan args, bool isBLE, CmdReply& reply);
+
+struct CmdEntry {
+    uint32_t hash;
+    const char* name;
+    CmdHandler handler;
+};
+
+#define CMD_ENTRY(name, handler) { cmdHash(name), name, handler }
+
+constexpr bool cmdHashesUnique(const CmdEntry* t, size_t n, size_t i = 0, size_t j = 1) {
+    return i >= n ? true
+         : j >= n ? cmdHashesUnique(t, n, i + 1, i + 2)
+         : t[i].hash != t[j].hash && cmdHashesUnique(t, n, i, j + 1);
+}
+
+// Finds the entry for the first word of line and leaves its arguments in
+// args. Returns nullptr for unknown commands.
+const CmdEntry* cmdFind(const CmdEntry* table, size_t n, CmdSpan line, CmdSpan& args);
+
+// Collects bytes into complete lines without allocating. Overlong lines
+// are dropped whole rather than dispatched truncated.
+class CmdLineBuffer {
+public:
+    CmdLineBuffer() : len_(0), overflow_(false), dropped_(0) {}
+
+    // Returns true when c completes a line; line then points into the
+    // buffer and stays valid until the next feed().
+    bool feed(char c, CmdSpan& line);
+    uint32_t droppedLines() const { return dropped_; }
+
+private:
+    char buf_[CMD_LINE_MAX];
+    size_t len_;
+    bool overflow_;
+    uint32_t dropped_;
+};
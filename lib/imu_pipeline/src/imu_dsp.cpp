@@ -0,0 +1,217 @@
+/*
+ * Per-sink filtering and decimation stage - see imu_dsp.h
+ */
+
+#include "imu_dsp.h"
+#include <math.h>
+#include <string.h>
+
+#define DSP_BIQUAD_SHIFT    28
+#define DSP_STATE_SHIFT     8
+#define DSP_FIR_SHIFT       15
+
+static_assert(offsetof(ImuSample, tmp) - offsetof(ImuSample, acc) == (DSP_CHANNELS - 1) * sizeof(int16_t),
+              "AGMT channels must be contiguous");
+
+static const char* const filterNames[] = { "none", "iir", "fir" };
+static const char* const windowNames[] = { "last", "mean", "min", "max" };
+
+// The AGMT channels as one int16 array
+static const void* channels(const ImuSample& s) {
+    return (const uint8_t*)&s + offsetof(ImuSample, acc);
+}
+
+const char* dspFilterName(DspFilter filter) {
+    return filterNames[filter];
+}
+
+const char* dspWindowName(DspWindow window) {
+    return windowNames[window];
+}
+
+static int16_t saturate16(int32_t v) {
+    return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+}
+
+ImuDsp::ImuDsp() {
+    cfg_.filter = DSP_FILTER_NONE;
+    cfg_.cutoffHz = 0;
+    cfg_.firTaps = DSP_FIR_DEFAULT_TAPS;
+    cfg_.decimation = 1;
+    cfg_.window = DSP_WINDOW_LAST;
+    memset(bq_, 0, sizeof(bq_));
+    memset(taps_, 0, sizeof(taps_));
+    reset();
+}
+
+bool ImuDsp::configure(const DspConfig& cfg, uint32_t sampleRateHz) {
+    if (cfg.decimation < 1 || cfg.decimation > DSP_MAX_DECIMATION || sampleRateHz == 0) {
+        return false;
+    }
+    if (cfg.filter != DSP_FILTER_NONE && (cfg.cutoffHz == 0 || 2u * cfg.cutoffHz >= sampleRateHz)) {
+        return false;
+    }
+
+    int32_t bq[5] = { 0, 0, 0, 0, 0 };
+    int16_t taps[DSP_FIR_MAX_TAPS] = { 0 };
+    float fc = (float)cfg.cutoffHz / sampleRateHz;
+
+    if (cfg.filter == DSP_FILTER_IIR) {
+        // RBJ cookbook low-pass, Q = 1/sqrt(2)
+        float w0 = 2.0f * (float)M_PI * fc;
+        float cw = cosf(w0);
+        float alpha = sinf(w0) / (2.0f * 0.70710678f);
+        float a0 = 1.0f + alpha;
+        float coef[5] = { (1.0f - cw) / 2.0f, 1.0f - cw, (1.0f - cw) / 2.0f, -2.0f * cw, 1.0f - alpha };
+        for (int i = 0; i < 5; i++) {
+            bq[i] = (int32_t)lroundf(coef[i] / a0 * (float)(1L << DSP_BIQUAD_SHIFT));
+        }
+    } else if (cfg.filter == DSP_FILTER_FIR) {
+        if (cfg.firTaps < 3 || cfg.firTaps > DSP_FIR_MAX_TAPS) {
+            return false;
+        }
+        float h[DSP_FIR_MAX_TAPS];
+        float sum = 0;
+        float mid = (cfg.firTaps - 1) / 2.0f;
+        for (int i = 0; i < cfg.firTaps; i++) {
+            float t = i - mid;
+            float sinc = t == 0 ? 2.0f * fc : sinf(2.0f * (float)M_PI * fc * t) / ((float)M_PI * t);
+            float window = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * i / (cfg.firTaps - 1));
+            h[i] = sinc * window;
+            sum += h[i];
+        }
+        // Unity DC gain after quantisation: the rounding error goes to the centre tap
+        int32_t total = 0;
+        int32_t absTotal = 0;
+        for (int i = 0; i < cfg.firTaps; i++) {
+            taps[i] = (int16_t)lroundf(h[i] / sum * (1 << DSP_FIR_SHIFT));
+            total += taps[i];
+        }
+        taps[cfg.firTaps / 2] += (1 << DSP_FIR_SHIFT) - total;
+        for (int i = 0; i < cfg.firTaps; i++) {
+            absTotal += taps[i] < 0 ? -taps[i] : taps[i];
+        }
+        if (absTotal >= 2 << DSP_FIR_SHIFT) {
+            return false;   // the int32 accumulator could overflow
+        }
+    }
+
+    cfg_ = cfg;
+    memcpy(bq_, bq, sizeof(bq_));
+    memcpy(taps_, taps, sizeof(taps_));
+    reset();
+    return true;
+}
+
+void ImuDsp::reset() {
+    kind_ = IMU_SAMPLE_AGMT;
+    histPos_ = 0;
+    primed_ = 0;
+    n_ = 0;
+    memset(x1_, 0, sizeof(x1_));
+    memset(x2_, 0, sizeof(x2_));
+    memset(y1_, 0, sizeof(y1_));
+    memset(y2_, 0, sizeof(y2_));
+    memset(hist_, 0, sizeof(hist_));
+}
+
+int32_t ImuDsp::filter(size_t ch, int16_t x) {
+    if (cfg_.filter == DSP_FILTER_IIR) {
+        int32_t x0 = (int32_t)x << DSP_STATE_SHIFT;
+        int64_t acc = (int64_t)bq_[0] * x0 + (int64_t)bq_[1] * x1_[ch] + (int64_t)bq_[2] * x2_[ch]
+                    - (int64_t)bq_[3] * y1_[ch] - (int64_t)bq_[4] * y2_[ch];
+        int32_t y0 = (int32_t)((acc + (1LL << (DSP_BIQUAD_SHIFT - 1))) >> DSP_BIQUAD_SHIFT);
+        x2_[ch] = x1_[ch];
+        x1_[ch] = x0;
+        y2_[ch] = y1_[ch];
+        y1_[ch] = y0;
+        return (y0 + (1 << (DSP_STATE_SHIFT - 1))) >> DSP_STATE_SHIFT;
+    }
+    if (cfg_.filter == DSP_FILTER_FIR) {
+        // histPos_ already points at the slot for this sample
+        hist_[ch][histPos_] = x;
+        int32_t acc = 0;
+        size_t pos = histPos_;
+        for (size_t i = 0; i < cfg_.firTaps; i++) {
+            acc += (int32_t)taps_[i] * hist_[ch][pos];
+            pos = pos ? pos - 1 : cfg_.firTaps - 1;
+        }
+        return (acc + (1 << (DSP_FIR_SHIFT - 1))) >> DSP_FIR_SHIFT;
+    }
+    return x;
+}
+
+bool ImuDsp::process(const ImuSample& in, ImuSample& out) {
+    if (in.kind != kind_) {
+        reset();
+        kind_ = in.kind;
+    }
+    if (in.kind != IMU_SAMPLE_AGMT) {
+        if (++n_ < cfg_.decimation) {
+            return false;
+        }
+        n_ = 0;
+        out = in;
+        return true;
+    }
+
+    int16_t v[DSP_CHANNELS];
+    memcpy(v, channels(in), sizeof(v));
+
+    if (!primed_) {
+        // Start from steady state on the first sample instead of ringing up from zero
+        for (size_t ch = 0; ch < DSP_CHANNELS; ch++) {
+            int32_t q = (int32_t)v[ch] << DSP_STATE_SHIFT;
+            x1_[ch] = x2_[ch] = y1_[ch] = y2_[ch] = q;
+            for (size_t i = 0; i < DSP_FIR_MAX_TAPS; i++) {
+                hist_[ch][i] = v[ch];
+            }
+        }
+        primed_ = 1;
+    }
+    if (cfg_.filter == DSP_FILTER_FIR) {
+        histPos_ = histPos_ + 1 < cfg_.firTaps ? histPos_ + 1 : 0;
+    }
+
+    for (size_t ch = 0; ch < DSP_CHANNELS; ch++) {
+        int16_t y = saturate16(filter(ch, v[ch]));
+        if (n_ == 0) {
+            sum_[ch] = 0;
+            min_[ch] = y;
+            max_[ch] = y;
+        }
+        sum_[ch] += y;
+        if (y < min_[ch]) {
+            min_[ch] = y;
+        }
+        if (y > max_[ch]) {
+            max_[ch] = y;
+        }
+        last_[ch] = y;
+    }
+
+    if (++n_ < cfg_.decimation) {
+        return false;
+    }
+
+    const int16_t* src = last_;
+    int16_t mean[DSP_CHANNELS];
+    switch (cfg_.window) {
+    case DSP_WINDOW_MEAN:
+        for (size_t ch = 0; ch < DSP_CHANNELS; ch++) {
+            int32_t s = sum_[ch];
+            mean[ch] = (int16_t)(s >= 0 ? (s + n_ / 2) / n_ : (s - n_ / 2) / n_);
+        }
+        src = mean;
+        break;
+    case DSP_WINDOW_MIN: src = min_; break;
+    case DSP_WINDOW_MAX: src = max_; break;
+    default: break;
+    }
+    n_ = 0;
+
+    out.timestampUs = in.timestampUs;
+    out.kind = IMU_SAMPLE_AGMT;
+    memcpy((uint8_t*)&out + offsetof(ImuSample, acc), src, sizeof(v));
+    return true;
+}
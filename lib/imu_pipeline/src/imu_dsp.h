@@ -0,0 +1,103 @@
+/*
+ * Per-sink filtering and decimation stage
+ *
+ * Sits between the sampler ring and a stream: each sink (BLE, USB) can run
+ * its own ImuDsp so the sensor keeps sampling at full ODR for anti-aliasing
+ * while a client only receives the bandwidth it asked for. Per AGMT channel
+ * the stage applies, in order:
+ *
+ *  1. an optional low-pass filter, either a 2nd-order Butterworth biquad
+ *     (DSP_FILTER_IIR) or a Hamming-windowed sinc FIR of up to
+ *     DSP_FIR_MAX_TAPS taps (DSP_FILTER_FIR);
+ *  2. decimation by 1..DSP_MAX_DECIMATION, emitting either the last
+ *     filtered sample of each window or its mean, minimum or maximum.
+ *
+ * Filter design uses float once in configure(); process() is integer only.
+ * Biquad coefficients are Q28 with Q8 state in 64-bit accumulators, which
+ * keeps cutoffs down to ~0.5% of the sample rate stable. FIR taps are Q15
+ * over int32 accumulators. Output samples carry the timestamp of the last
+ * input in their window.
+ *
+ * Quaternion samples are already fused and band-limited by the DMP; they
+ * are only decimated (last of each window). A change of sample kind
+ * restarts the filters. No Arduino dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "imu_sample.h"
+
+#define DSP_CHANNELS            10      // acc xyz, gyr xyz, mag xyz, tmp
+#define DSP_MAX_DECIMATION      64
+#define DSP_FIR_MAX_TAPS        32
+#define DSP_FIR_DEFAULT_TAPS    31
+
+enum DspFilter {
+    DSP_FILTER_NONE = 0,
+    DSP_FILTER_IIR,
+    DSP_FILTER_FIR
+};
+
+enum DspWindow {
+    DSP_WINDOW_LAST = 0,    // plain decimation: last filtered sample
+    DSP_WINDOW_MEAN,
+    DSP_WINDOW_MIN,
+    DSP_WINDOW_MAX
+};
+
+struct DspConfig {
+    DspFilter filter;
+    uint16_t cutoffHz;      // low-pass -3 dB (IIR) / -6 dB (FIR) point
+    uint8_t firTaps;        // DSP_FILTER_FIR only, 3..DSP_FIR_MAX_TAPS
+    uint8_t decimation;     // 1 = every sample
+    DspWindow window;
+};
+
+const char* dspFilterName(DspFilter filter);
+const char* dspWindowName(DspWindow window);
+
+class ImuDsp {
+public:
+    ImuDsp();
+
+    // Designs the filter for inputs at sampleRateHz. Returns false and
+    // keeps the previous setup if the configuration is out of range
+    // (cutoff at or above Nyquist, bad tap count or decimation).
+    bool configure(const DspConfig& cfg, uint32_t sampleRateHz);
+    const DspConfig& config() const { return cfg_; }
+
+    // True when configured as a no-op (no filter, decimation 1).
+    bool passthrough() const { return cfg_.filter == DSP_FILTER_NONE && cfg_.decimation <= 1; }
+
+    // Clears filter history and the current window.
+    void reset();
+
+    // Feeds one sample. Returns true with out filled when a window closes.
+    bool process(const ImuSample& in, ImuSample& out);
+
+private:
+    int32_t filter(size_t ch, int16_t x);
+
+    DspConfig cfg_;
+    uint8_t kind_;
+
+    // Biquad, DF1: b0 b1 b2 a1 a2 in Q28, history in Q8
+    int32_t bq_[5];
+    int32_t x1_[DSP_CHANNELS], x2_[DSP_CHANNELS];
+    int32_t y1_[DSP_CHANNELS], y2_[DSP_CHANNELS];
+
+    // FIR, Q15 taps over a circular history per channel
+    int16_t taps_[DSP_FIR_MAX_TAPS];
+    int16_t hist_[DSP_CHANNELS][DSP_FIR_MAX_TAPS];
+    uint8_t histPos_;
+    uint8_t primed_;            // samples seen, saturates at the tap count
+
+    // Decimation window
+    uint8_t n_;
+    int32_t sum_[DSP_CHANNELS];
+    int16_t min_[DSP_CHANNELS];
+    int16_t max_[DSP_CHANNELS];
+    int16_t last_[DSP_CHANNELS];
+};
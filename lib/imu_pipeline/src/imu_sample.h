@@ -0,0 +1,63 @@
+/*
+ * IMU sample record shared by the sampling task and its consumers.
+ *
+ * Samples carry the ICM-20948's native register values. Scaling to
+ * physical units only happens where a human reads them (the 'i' command),
+ * so the hot path never touches floating point.
+ *
+ * In DMP mode the sensor fuses on-chip and a sample carries one quaternion
+ * instead of AGMT values; kind tells the two apart.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+enum ImuSampleKind {
+    IMU_SAMPLE_AGMT = 0,    // raw accel/gyro/mag/temp
+    IMU_SAMPLE_QUAT6,       // DMP Game Rotation Vector (accel + gyro)
+    IMU_SAMPLE_QUAT9        // DMP 9-axis rotation vector (accel + gyro + mag)
+};
+
+struct ImuQuat {
+    int32_t q[3];           // Q1..Q3 in Q30 fixed point; Q0 = sqrt(1 - Q1^2 - Q2^2 - Q3^2)
+    int16_t accuracy;       // heading accuracy estimate (9-axis only)
+};
+
+struct ImuSample {
+    uint32_t timestampUs;   // esp_timer time of the data-ready interrupt
+    uint8_t kind;           // ImuSampleKind
+    union {
+        struct {
+            int16_t acc[3]; // accelerometer X/Y/Z, raw LSB
+            int16_t gyr[3]; // gyroscope X/Y/Z, raw LSB
+            int16_t mag[3]; // AK09916 magnetometer X/Y/Z, raw LSB
+            int16_t tmp;    // die temperature, raw LSB
+        };
+        ImuQuat quat;       // kind == IMU_SAMPLE_QUAT6 / IMU_SAMPLE_QUAT9
+    };
+};
+
+// Raw -> physical unit conversion. fsSel is the ACCEL_FS_SEL / GYRO_FS_SEL
+// index (0..3) the sensor was configured with.
+inline float imuAccelMg(int16_t raw, uint8_t fsSel) {
+    static const float lsbPerMg[4] = { 16.384f, 8.192f, 4.096f, 2.048f };
+    return raw / lsbPerMg[fsSel & 0x03];
+}
+
+inline float imuGyroDps(int16_t raw, uint8_t fsSel) {
+    static const float lsbPerDps[4] = { 131.0f, 65.5f, 32.8f, 16.4f };
+    return raw / lsbPerDps[fsSel & 0x03];
+}
+
+inline float imuMagUt(int16_t raw) {
+    return raw * 0.15f;
+}
+
+inline float imuTempC(int16_t raw) {
+    return ((raw - 21.0f) / 333.87f) + 21.0f;
+}
+
+inline float imuQuatComponent(int32_t q30) {
+    return q30 / 1073741824.0f;
+}
@@ -0,0 +1,243 @@
+/*
+ * Event trigger for the live streams - see imu_trigger.h
+ */
+
+#include "imu_trigger.h"
+#include <string.h>
+
+#define TRIGGER_MASK    (TRIGGER_HISTORY_SAMPLES - 1)
+
+static_assert((TRIGGER_HISTORY_SAMPLES & TRIGGER_MASK) == 0, "TRIGGER_HISTORY_SAMPLES must be a power of two");
+
+// 1 g and 1 dps in raw LSB per full-scale index, as in imu_sample.h
+static uint32_t lsbPerG(uint8_t fs) {
+    return 16384u >> (fs & 0x03);
+}
+
+static uint32_t gyroRaw(uint32_t dps, uint8_t fs) {
+    return dps * 131u >> (fs & 0x03);
+}
+
+ImuTrigger::ImuTrigger() {
+    memset(&cfg_, 0, sizeof(cfg_));
+    cfg_.levelMg = TRIGGER_DEFAULT_LEVEL_MG;
+    cfg_.rmsWindowMs = TRIGGER_DEFAULT_RMS_WINDOW;
+    cfg_.preMs = TRIGGER_DEFAULT_PRE_MS;
+    cfg_.postMs = TRIGGER_DEFAULT_POST_MS;
+    preUs_ = cfg_.preMs * 1000u;
+    postUs_ = cfg_.postMs * 1000u;
+    rmsSamples_ = 0;
+    accelFs_ = 0;
+    gyroFs_ = 0;
+    hwMotion_ = false;
+    events_ = 0;
+    lastSources_ = 0;
+    lastEventUs_ = 0;
+    passed_ = 0;
+    suppressed_ = 0;
+    overflows_ = 0;
+    updateThresholds();
+    reset();
+}
+
+bool ImuTrigger::valid(const TriggerConfig& cfg, uint32_t sampleRateHz) {
+    if (sampleRateHz == 0 || (uint64_t)cfg.preMs * sampleRateHz / 1000 >= TRIGGER_HISTORY_SAMPLES) {
+        return false;
+    }
+    uint32_t rms = (uint32_t)((uint64_t)cfg.rmsWindowMs * sampleRateHz / 1000);
+    return cfg.rmsMg == 0 || (rms > 0 && rms <= TRIGGER_RMS_MAX_SAMPLES);
+}
+
+bool ImuTrigger::configure(const TriggerConfig& cfg, uint32_t sampleRateHz) {
+    if (!valid(cfg, sampleRateHz)) {
+        return false;
+    }
+    cfg_ = cfg;
+    preUs_ = cfg.preMs * 1000u;
+    postUs_ = cfg.postMs * 1000u;
+    rmsSamples_ = (uint32_t)((uint64_t)cfg.rmsWindowMs * sampleRateHz / 1000);
+    updateThresholds();
+    reset();
+    return true;
+}
+
+void ImuTrigger::setFullScale(uint8_t accelFs, uint8_t gyroFs) {
+    if (accelFs != accelFs_ || gyroFs != gyroFs_) {
+        accelFs_ = accelFs;
+        gyroFs_ = gyroFs;
+        updateThresholds();
+    }
+}
+
+void ImuTrigger::updateThresholds() {
+    uint64_t g = lsbPerG(accelFs_);
+    levelLo2_ = 0;
+    levelHi2_ = 0;
+    if (cfg_.levelMg > 0) {
+        uint64_t th = g * cfg_.levelMg / 1000;
+        levelHi2_ = (g + th) * (g + th);
+        levelLo2_ = th < g ? (g - th) * (g - th) : 0;
+    }
+    uint64_t w = gyroRaw(cfg_.gyroDps, gyroFs_);
+    gyro2_ = w * w;
+    uint64_t rms = g * cfg_.rmsMg / 1000;
+    rmsSum_ = rms * rms * rmsSamples_;
+    motionRaw_ = (int32_t)(g * cfg_.motionMg / 1000);
+}
+
+void ImuTrigger::reset() {
+    head_ = 0;
+    count_ = 0;
+    budget_ = 0;
+    open_ = false;
+    endUs_ = 0;
+    motionPending_ = false;
+    havePrev_ = false;
+    memset(prev_, 0, sizeof(prev_));
+    memset(mean_, 0, sizeof(mean_));
+    memset(energy_, 0, sizeof(energy_));
+    energyPos_ = 0;
+    energyFill_ = 0;
+    energySum_ = 0;
+}
+
+uint8_t ImuTrigger::detect(const ImuSample& s) {
+    uint8_t hit = 0;
+    if (motionPending_) {
+        motionPending_ = false;
+        if (motionRaw_ > 0) {
+            hit |= TRIGGER_SRC_MOTION;
+        }
+    }
+    if (s.kind != IMU_SAMPLE_AGMT) {
+        havePrev_ = false;
+        return hit;
+    }
+
+    if (levelHi2_ > 0) {
+        uint64_t a2 = 0;
+        for (int i = 0; i < 3; i++) {
+            a2 += (int32_t)s.acc[i] * s.acc[i];
+        }
+        if (a2 > levelHi2_ || a2 < levelLo2_) {
+            hit |= TRIGGER_SRC_LEVEL;
+        }
+    }
+    if (gyro2_ > 0) {
+        uint64_t w2 = 0;
+        for (int i = 0; i < 3; i++) {
+            w2 += (int32_t)s.gyr[i] * s.gyr[i];
+        }
+        if (w2 > gyro2_) {
+            hit |= TRIGGER_SRC_LEVEL;
+        }
+    }
+
+    if (rmsSum_ > 0) {
+        // Track the mean from the first sample on, so a window does not
+        // start with the full 1 g step
+        uint32_t e = 0;
+        for (int i = 0; i < 3; i++) {
+            int32_t x = (int32_t)s.acc[i] << 8;
+            if (!havePrev_) {
+                mean_[i] = x;
+            }
+            mean_[i] += (x - mean_[i]) >> TRIGGER_RMS_DC_SHIFT;
+            int32_t d = (x - mean_[i]) >> 8;
+            d = d > INT16_MAX ? INT16_MAX : d < -INT16_MAX ? -INT16_MAX : d;
+            e += (uint32_t)(d * d);
+        }
+        energySum_ += e;
+        energySum_ -= energy_[energyPos_];
+        energy_[energyPos_] = e;
+        energyPos_ = energyPos_ + 1 < rmsSamples_ ? energyPos_ + 1 : 0;
+        if (energyFill_ < rmsSamples_) {
+            energyFill_++;
+        } else if (energySum_ > rmsSum_) {
+            hit |= TRIGGER_SRC_RMS;
+        }
+    }
+
+    if (motionRaw_ > 0 && !hwMotion_ && havePrev_) {
+        for (int i = 0; i < 3; i++) {
+            int32_t d = (int32_t)s.acc[i] - prev_[i];
+            if (d > motionRaw_ || d < -motionRaw_) {
+                hit |= TRIGGER_SRC_MOTION;
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        prev_[i] = s.acc[i];
+    }
+    havePrev_ = true;
+    return hit;
+}
+
+void ImuTrigger::trimHistory() {
+    if (count_ == 0) {
+        return;
+    }
+    uint32_t newestUs = hist_[(head_ - 1) & TRIGGER_MASK].timestampUs;
+    while (count_ > 0 && newestUs - hist_[(head_ - count_) & TRIGGER_MASK].timestampUs > preUs_) {
+        count_--;
+        suppressed_++;
+    }
+}
+
+void ImuTrigger::feed(const ImuSample& s) {
+    if (count_ == TRIGGER_HISTORY_SAMPLES) {
+        count_--;
+        if (open_) {
+            overflows_++;
+        } else {
+            suppressed_++;
+        }
+    }
+    hist_[head_ & TRIGGER_MASK] = s;
+    head_++;
+    count_++;
+    budget_ = TRIGGER_CATCHUP;
+
+    uint8_t hit = detect(s);
+    if (hit) {
+        if (!open_) {
+            open_ = true;
+            events_++;
+            lastSources_ = hit;
+            lastEventUs_ = s.timestampUs;
+        }
+        endUs_ = s.timestampUs + postUs_;
+    }
+    if (!open_) {
+        trimHistory();
+    }
+}
+
+bool ImuTrigger::pop(ImuSample& out) {
+    if (!open_ || count_ == 0 || budget_ == 0) {
+        return false;
+    }
+    const ImuSample& oldest = hist_[(head_ - count_) & TRIGGER_MASK];
+    if ((int32_t)(oldest.timestampUs - endUs_) > 0) {
+        // Past the window: what is left becomes the next one's history
+        open_ = false;
+        trimHistory();
+        return false;
+    }
+    out = oldest;
+    count_--;
+    budget_--;
+    passed_++;
+    return true;
+}
+
+void ImuTrigger::getStats(TriggerStats& out) const {
+    out.open = open_;
+    out.events = events_;
+    out.lastSources = lastSources_;
+    out.lastEventUs = lastEventUs_;
+    out.passed = passed_;
+    out.suppressed = suppressed_;
+    out.overflows = overflows_;
+    out.backlog = count_;
+}
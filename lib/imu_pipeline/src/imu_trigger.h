@@ -0,0 +1,150 @@
+/*
+ * Event trigger for the live streams
+ *
+ * Sits between the sampler ring and the BLE and USB streams and holds the
+ * samples back until something happens, so a quiet sensor costs no
+ * airtime. Every sample goes into a history ring; while no event is open
+ * the history only keeps the last preMs. A sample that meets a condition
+ * opens a window: the history is released oldest first, then live samples
+ * until postMs after the last sample that met a condition. A condition met
+ * again inside the window extends it. Conditions, each off at 0:
+ *
+ *  - TRIGGER_SRC_LEVEL: the accel magnitude differs from 1 g by more
+ *    than levelMg, or the gyro magnitude exceeds gyroDps.
+ *  - TRIGGER_SRC_RMS: the RMS of the accel, with its slowly tracked mean
+ *    (gravity, offsets) removed, over the last rmsWindowMs exceeds rmsMg.
+ *  - TRIGGER_SRC_MOTION: wake-on-motion, any accel axis changed by more
+ *    than motionMg since the previous sample. The ICM-20948 runs this
+ *    comparison itself in the FIFO and DMP modes (imu_sampler.h) and the
+ *    pipeline passes its events in with motionEvent(); otherwise the
+ *    trigger repeats it on the samples.
+ *
+ * Level, RMS and software motion look at AGMT samples only; DMP quaternion
+ * streams can be gated by the sensor's wake-on-motion. History leaves at
+ * most TRIGGER_CATCHUP samples per sample fed, so a window's pre-trigger
+ * part reaches the streams at a bounded multiple of the input rate rather
+ * than as one burst their queues cannot hold. Released samples keep their
+ * timestamps; a host sees the gap between windows in them.
+ *
+ * Thresholds are converted to raw LSB once per full-scale change; the
+ * per-sample work is integer only. No Arduino dependencies.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "imu_sample.h"
+
+#define TRIGGER_HISTORY_SAMPLES 512     // pre-trigger ring, power of two: 455 ms at 1125 Hz
+#define TRIGGER_RMS_MAX_SAMPLES 256     // longest RMS window
+#define TRIGGER_CATCHUP         2       // samples released per sample fed
+#define TRIGGER_RMS_DC_SHIFT    8       // mean tracking, time constant 2^8 samples
+
+// Setup until the first configure(): off, with a level threshold ready
+#define TRIGGER_DEFAULT_LEVEL_MG    250
+#define TRIGGER_DEFAULT_RMS_WINDOW  100     // ms
+#define TRIGGER_DEFAULT_PRE_MS      200
+#define TRIGGER_DEFAULT_POST_MS     500
+
+#define TRIGGER_SRC_LEVEL       (1 << 0)
+#define TRIGGER_SRC_RMS         (1 << 1)
+#define TRIGGER_SRC_MOTION      (1 << 2)
+
+struct TriggerConfig {
+    bool enabled;           // false: every sample passes straight through
+    uint16_t levelMg;       // TRIGGER_SRC_LEVEL, accel
+    uint16_t gyroDps;       // TRIGGER_SRC_LEVEL, gyro
+    uint16_t rmsMg;         // TRIGGER_SRC_RMS
+    uint16_t rmsWindowMs;
+    uint16_t motionMg;      // TRIGGER_SRC_MOTION
+    uint16_t preMs;         // history released when a window opens
+    uint16_t postMs;        // window length after the last hit
+};
+
+struct TriggerStats {
+    bool open;              // a window is being released
+    uint32_t events;        // windows opened
+    uint8_t lastSources;    // TRIGGER_SRC_* that opened the last window
+    uint32_t lastEventUs;   // timestamp of the sample that opened it
+    uint32_t passed;        // samples released to the streams
+    uint32_t suppressed;    // samples that aged out of the history unsent
+    uint32_t overflows;     // history samples lost while a window was open
+    uint32_t backlog;       // samples held in the history now
+};
+
+class ImuTrigger {
+public:
+    ImuTrigger();
+
+    // Sets up the trigger for inputs at sampleRateHz, which only sizes the
+    // RMS window. Returns false and keeps the previous setup if preMs does
+    // not fit TRIGGER_HISTORY_SAMPLES or the RMS window
+    // TRIGGER_RMS_MAX_SAMPLES. Clears the history.
+    bool configure(const TriggerConfig& cfg, uint32_t sampleRateHz);
+    static bool valid(const TriggerConfig& cfg, uint32_t sampleRateHz);
+    const TriggerConfig& config() const { return cfg_; }
+    bool enabled() const { return cfg_.enabled; }
+
+    // ACCEL_FS_SEL / GYRO_FS_SEL of the incoming samples.
+    void setFullScale(uint8_t accelFs, uint8_t gyroFs);
+
+    // With hardware on, TRIGGER_SRC_MOTION comes from motionEvent() only:
+    // the next sample fed counts as a hit.
+    void setHardwareMotion(bool on) { hwMotion_ = on; }
+    void motionEvent() { motionPending_ = true; }
+
+    // Drops the history and closes any window; counters are kept.
+    void reset();
+
+    void feed(const ImuSample& s);
+
+    // Next sample for the streams. False once the window is closed or this
+    // feed's TRIGGER_CATCHUP are out.
+    bool pop(ImuSample& out);
+
+    void getStats(TriggerStats& out) const;
+
+private:
+    uint8_t detect(const ImuSample& s);
+    void trimHistory();
+    void updateThresholds();
+
+    TriggerConfig cfg_;
+    uint32_t preUs_;
+    uint32_t postUs_;
+    uint16_t rmsSamples_;
+    uint8_t accelFs_;
+    uint8_t gyroFs_;
+    bool hwMotion_;
+    bool motionPending_;
+
+    // Raw-LSB thresholds for the current full scale
+    uint64_t levelLo2_, levelHi2_;  // squared accel magnitude bounds, 0 = unused
+    uint64_t gyro2_;
+    uint64_t rmsSum_;               // window energy above which RMS hits
+    int32_t motionRaw_;
+
+    ImuSample hist_[TRIGGER_HISTORY_SAMPLES];
+    uint32_t head_;
+    uint32_t count_;
+    uint8_t budget_;
+    bool open_;
+    uint32_t endUs_;
+
+    // Detector state
+    bool havePrev_;
+    int16_t prev_[3];
+    int32_t mean_[3];               // Q8
+    uint32_t energy_[TRIGGER_RMS_MAX_SAMPLES];
+    uint16_t energyPos_;
+    uint16_t energyFill_;
+    uint64_t energySum_;
+
+    uint32_t events_;
+    uint8_t lastSources_;
+    uint32_t lastEventUs_;
+    uint32_t passed_;
+    uint32_t suppressed_;
+    uint32_t overflows_;
+};
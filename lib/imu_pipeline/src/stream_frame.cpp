@@ -0,0 +1,47 @@
+/*
+ * Byte-stream framing for stream packets - see stream_frame.h
+ */
+
+#include "stream_frame.h"
+#include <string.h>
+
+static uint16_t crcTable[256];
+static bool crcTableReady = false;
+
+static void buildCrcTable() {
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc = (uint16_t)(i << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        crcTable[i] = crc;
+    }
+    crcTableReady = true;
+}
+
+uint16_t crc16Ccitt(const uint8_t* data, size_t len, uint16_t crc) {
+    if (!crcTableReady) {
+        buildCrcTable();
+    }
+    for (size_t i = 0; i < len; i++) {
+        crc = (uint16_t)((crc << 8) ^ crcTable[((crc >> 8) ^ data[i]) & 0xFF]);
+    }
+    return crc;
+}
+
+size_t streamFrameEncode(const uint8_t* packet, size_t len, uint8_t* out, size_t outSize) {
+    if (len > STREAM_FRAME_MAX_PACKET || outSize < len + STREAM_FRAME_OVERHEAD) {
+        return 0;
+    }
+
+    out[0] = STREAM_FRAME_SYNC0;
+    out[1] = STREAM_FRAME_SYNC1;
+    out[2] = (uint8_t)(len & 0xFF);
+    out[3] = (uint8_t)(len >> 8);
+    memcpy(out + 4, packet, len);
+
+    uint16_t crc = crc16Ccitt(out + 2, len + 2);
+    out[4 + len] = (uint8_t)(crc & 0xFF);
+    out[5 + len] = (uint8_t)(crc >> 8);
+    return len + STREAM_FRAME_OVERHEAD;
+}
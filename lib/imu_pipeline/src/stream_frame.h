@@ -0,0 +1,28 @@
+/*
+ * Byte-stream framing for stream packets
+ *
+ * Datagram transports (BLE notifications) carry a stream packet as is. On
+ * byte streams such as USB CDC, where text output may sit between packets,
+ * every packet is wrapped so the host can find and verify it:
+ *
+ *   0xA5 0x5A | length u16 | packet (length bytes) | CRC-16 u16
+ *
+ * The CRC is CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over the length
+ * field and the packet. All multi-byte fields are little-endian.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STREAM_FRAME_SYNC0      0xA5
+#define STREAM_FRAME_SYNC1      0x5A
+#define STREAM_FRAME_OVERHEAD   6       // sync(2) + length(2) + crc(2)
+#define STREAM_FRAME_MAX_PACKET 1024
+
+uint16_t crc16Ccitt(const uint8_t* data, size_t len, uint16_t crc = 0xFFFF);
+
+// Writes the framed packet to out. Returns the frame size, or 0 if out is
+// too small or the packet exceeds STREAM_FRAME_MAX_PACKET.
+size_t streamFrameEncode(const uint8_t* packet, size_t len, uint8_t* out, size_t outSize);
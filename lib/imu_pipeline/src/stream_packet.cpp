@@ -0,0 +1,146 @@
+/*
+ * Binary IMU stream packets - see stream_packet.h
+ */
+
+#include "stream_packet.h"
+#include <string.h>
+
+StreamPacker::StreamPacker()
+    : buf_(nullptr), bufSize_(0), maxBytes_(0), len_(0), count_(0), type_(STREAM_PKT_AGMT),
+      seq_(0), t0Us_(0), lastUs_(0), wantDelta_(false), delta_(false) {}
+
+static uint8_t* putVarint(uint8_t* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+// Values in record order: 10 for AGMT, 4 for a quaternion
+static size_t recordValues(const ImuSample& s, uint8_t type, int32_t* out) {
+    if (type == STREAM_PKT_AGMT) {
+        for (int i = 0; i < 3; i++) {
+            out[i] = s.acc[i];
+            out[3 + i] = s.gyr[i];
+            out[6 + i] = s.mag[i];
+        }
+        out[9] = s.tmp;
+        return 10;
+    }
+    for (int i = 0; i < 3; i++) {
+        out[i] = s.quat.q[i];
+    }
+    out[3] = type == STREAM_PKT_QUAT9 ? s.quat.accuracy : 0;
+    return 4;
+}
+
+void StreamPacker::begin(uint8_t* buf, size_t bufSize) {
+    buf_ = buf;
+    bufSize_ = bufSize;
+    maxBytes_ = bufSize;
+    len_ = 0;
+    count_ = 0;
+    seq_ = 0;
+}
+
+void StreamPacker::setBuffer(uint8_t* buf, size_t bufSize) {
+    buf_ = buf;
+    bufSize_ = bufSize;
+    maxBytes_ = bufSize;
+    len_ = 0;
+    count_ = 0;
+}
+
+void StreamPacker::setMaxBytes(size_t maxBytes) {
+    maxBytes_ = maxBytes < bufSize_ ? maxBytes : bufSize_;
+}
+
+bool StreamPacker::add(const ImuSample& s) {
+    if (!buf_) {
+        return false;
+    }
+
+    uint8_t type = streamPacketType(s.kind);
+    size_t recSize = streamRecordSize(type);
+    uint32_t dt = 0;
+    if (count_ == 0) {
+        type_ = type;
+        delta_ = wantDelta_;
+        len_ = sizeof(StreamPacketHeader);
+        memset(prev_, 0, sizeof(prev_));
+    } else {
+        dt = s.timestampUs - lastUs_;
+        if (type != type_ || dt > 0xFFFF || count_ >= 255) {
+            return false;
+        }
+    }
+    uint8_t coded[STREAM_DELTA_MAX_RECORD];
+    int32_t values[10];
+    size_t nValues = 0;
+    if (delta_) {
+        uint8_t* p = putVarint(coded, dt);
+        nValues = recordValues(s, type, values);
+        for (size_t i = 0; i < nValues; i++) {
+            p = putVarint(p, zigzag((int64_t)values[i] - prev_[i]));
+        }
+        recSize = p - coded;
+    }
+    if (len_ + recSize > maxBytes_) {
+        if (count_ == 0) {
+            len_ = 0;
+        }
+        return false;
+    }
+    if (count_ == 0) {
+        t0Us_ = s.timestampUs;
+    }
+    lastUs_ = s.timestampUs;
+
+    uint8_t* dst = buf_ + len_;
+    if (delta_) {
+        memcpy(dst, coded, recSize);
+        memcpy(prev_, values, nValues * sizeof(int32_t));
+    } else if (type == STREAM_PKT_AGMT) {
+        StreamSampleRecord rec;
+        rec.dtUs = (uint16_t)dt;
+        memcpy(rec.acc, s.acc, sizeof(rec.acc));
+        memcpy(rec.gyr, s.gyr, sizeof(rec.gyr));
+        memcpy(rec.mag, s.mag, sizeof(rec.mag));
+        rec.tmp = s.tmp;
+        memcpy(dst, &rec, sizeof(rec));
+    } else {
+        StreamQuatRecord rec;
+        rec.dtUs = (uint16_t)dt;
+        memcpy(rec.q, s.quat.q, sizeof(rec.q));
+        rec.accuracy = type == STREAM_PKT_QUAT9 ? s.quat.accuracy : 0;
+        memcpy(dst, &rec, sizeof(rec));
+    }
+    len_ += recSize;
+    count_++;
+
+    StreamPacketHeader hdr;
+    hdr.type = delta_ ? type_ | STREAM_PKT_DELTA : type_;
+    hdr.count = (uint8_t)count_;
+    hdr.seq = seq_;
+    hdr.t0Us = t0Us_;
+    memcpy(buf_, &hdr, sizeof(hdr));
+    return true;
+}
+
+void StreamPacker::next() {
+    len_ = 0;
+    count_ = 0;
+    seq_++;
+}
+
+void StreamPacker::resetSequence() {
+    len_ = 0;
+    count_ = 0;
+    seq_ = 0;
+}
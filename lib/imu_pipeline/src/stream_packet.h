@@ -0,0 +1,134 @@
+/*
+ * Binary IMU stream packets
+ *
+ * Transport-neutral packet layout shared by every streaming path. All
+ * fields are little-endian.
+ *
+ *   StreamPacketHeader   8 bytes
+ *   records              count x record size for the packet type
+ *
+ * STREAM_PKT_AGMT records carry the raw int16 AGMT values, the DMP packet
+ * types one Q30 quaternion. Every record starts with the microseconds since
+ * the previous record in the same packet (0 for the first one, whose time
+ * is t0Us). A gap that does not fit in 16 bits, or a sample of a different
+ * kind, closes the packet early.
+ *
+ * Delta mode (type | STREAM_PKT_DELTA) is lossless and carries the same
+ * records as varints instead: dt as an unsigned LEB128 varint, then every
+ * value (acc xyz, gyr xyz, mag xyz, tmp; or Q1-Q3, accuracy) as the zig-zag
+ * LEB128 varint of its difference to the same value in the previous record.
+ * The first record of a packet is diffed against 0, so each packet decodes
+ * on its own. Quiet AGMT samples shrink from 22 to about 12 bytes.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "imu_sample.h"
+
+#define STREAM_PKT_AGMT     0x01    // StreamSampleRecord
+#define STREAM_PKT_QUAT6    0x02    // StreamQuatRecord, Game Rotation Vector
+#define STREAM_PKT_QUAT9    0x03    // StreamQuatRecord, 9-axis rotation vector
+#define STREAM_PKT_BENCH    0x10    // benchmark filler, count is 0 (bench.h)
+#define STREAM_PKT_CAPTURE  0x20    // capture download, CapturePacketHeader (capture.h)
+#define STREAM_PKT_SPECTRUM 0x40    // spectral features, SpectralPacket (spectral.h)
+#define STREAM_PKT_DELTA    0x80    // flag: records are delta/varint coded
+
+#define STREAM_DELTA_MAX_RECORD 33  // worst-case coded AGMT record: 3 + 10 x 3 bytes
+
+struct __attribute__((packed)) StreamPacketHeader {
+    uint8_t  type;      // STREAM_PKT_*
+    uint8_t  count;     // records in this packet
+    uint16_t seq;       // per-stream packet counter, wraps at 65536
+    uint32_t t0Us;      // timestamp of the first record
+};
+
+struct __attribute__((packed)) StreamSampleRecord {
+    uint16_t dtUs;
+    int16_t  acc[3];
+    int16_t  gyr[3];
+    int16_t  mag[3];
+    int16_t  tmp;
+};
+
+struct __attribute__((packed)) StreamQuatRecord {
+    uint16_t dtUs;
+    int32_t  q[3];      // Q1..Q3, Q30
+    int16_t  accuracy;  // 0 for STREAM_PKT_QUAT6
+};
+
+static_assert(sizeof(StreamPacketHeader) == 8, "stream header layout");
+static_assert(sizeof(StreamSampleRecord) == 22, "stream record layout");
+static_assert(sizeof(StreamQuatRecord) == 16, "stream quaternion record layout");
+
+inline uint8_t streamPacketType(uint8_t sampleKind) {
+    switch (sampleKind) {
+    case IMU_SAMPLE_QUAT6: return STREAM_PKT_QUAT6;
+    case IMU_SAMPLE_QUAT9: return STREAM_PKT_QUAT9;
+    default:               return STREAM_PKT_AGMT;
+    }
+}
+
+inline size_t streamRecordSize(uint8_t packetType) {
+    return packetType == STREAM_PKT_AGMT ? sizeof(StreamSampleRecord) : sizeof(StreamQuatRecord);
+}
+
+// Number of records that fit in a packet of maxBytes.
+inline size_t streamRecordsPerPacket(size_t maxBytes, uint8_t packetType = STREAM_PKT_AGMT) {
+    if (maxBytes <= sizeof(StreamPacketHeader)) {
+        return 0;
+    }
+    size_t records = (maxBytes - sizeof(StreamPacketHeader)) / streamRecordSize(packetType);
+    return records > 255 ? 255 : records;
+}
+
+// Builds packets in a caller-owned buffer. No allocation.
+class StreamPacker {
+public:
+    StreamPacker();
+
+    // buf must hold at least maxBytes. maxBytes may later be lowered or
+    // raised (up to the buffer size) with setMaxBytes().
+    void begin(uint8_t* buf, size_t bufSize);
+
+    // Moves packing to another buffer, e.g. the network buffer a datagram
+    // is sent from, keeping the sequence and coding. Drops a packet in
+    // progress, so call it between packets.
+    void setBuffer(uint8_t* buf, size_t bufSize);
+    void setMaxBytes(size_t maxBytes);
+
+    // Selects delta/varint coding, from the next packet on.
+    void setDelta(bool on) { wantDelta_ = on; }
+    bool delta() const { return wantDelta_; }
+
+    // Appends a sample. Returns false when it does not fit; the caller
+    // then takes the finished packet, calls next() and adds it again.
+    bool add(const ImuSample& s);
+
+    bool empty() const { return count_ == 0; }
+    size_t count() const { return count_; }
+    size_t length() const { return len_; }
+    const uint8_t* data() const { return buf_; }
+    uint32_t firstTimestampUs() const { return t0Us_; }
+
+    // Starts the next packet and advances the sequence number.
+    void next();
+
+    // Restarts the sequence at 0 (new stream session).
+    void resetSequence();
+
+private:
+    uint8_t* buf_;
+    size_t bufSize_;
+    size_t maxBytes_;
+    size_t len_;
+    size_t count_;
+    uint8_t type_;
+    uint16_t seq_;
+    uint32_t t0Us_;
+    uint32_t lastUs_;
+    bool wantDelta_;
+    bool delta_;            // coding of the packet being built
+    int32_t prev_[10];      // delta mode: values of the previous record
+};
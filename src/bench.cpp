@@ -0,0 +1,167 @@
+/*
+ * BLE and USB throughput benchmark - see bench.h
+ */
+
+#include "bench.h"
+#include "ble_stream.h"
+#include "capture.h"
+#include "stream_packet.h"
+#include "stream_frame.h"
+#include "usb_stream.h"
+#include <esp_timer.h>
+
+static bool active = false;
+static BenchTarget target = BENCH_BLE;
+static int client = 0;
+static uint16_t packetBytes = 0;
+static uint32_t durationMs = 0;
+static uint32_t startMs = 0;
+static uint32_t endMs = 0;
+static uint16_t seq = 0;
+
+static uint32_t packets = 0;
+static uint32_t bytes = 0;
+static uint32_t stalls = 0;
+static uint32_t startFailed = 0;    // BleStreamStats baselines
+static uint32_t startCongestion = 0;
+static uint32_t drops = 0;
+static uint32_t congestion = 0;
+
+static uint8_t packet[BENCH_MAX_PACKET];
+static uint8_t frame[BENCH_MAX_PACKET + STREAM_FRAME_OVERHEAD];
+
+static void buildPacket() {
+    StreamPacketHeader hdr;
+    hdr.type = STREAM_PKT_BENCH;
+    hdr.count = 0;
+    hdr.seq = seq;
+    hdr.t0Us = (uint32_t)esp_timer_get_time();
+    memcpy(packet, &hdr, sizeof(hdr));
+    for (uint16_t i = sizeof(hdr); i < packetBytes; i++) {
+        packet[i] = (uint8_t)(seq + i);
+    }
+}
+
+bool benchStart(BenchTarget t, uint16_t size, uint32_t seconds, int bleClient) {
+    if (active || captureTransferActive()) {
+        return false;
+    }
+    uint16_t limit = BENCH_MAX_PACKET;
+    if (t == BENCH_BLE) {
+        if (!bleStreamClientConnected(bleClient) || bleStreamClientEnabled(bleClient)) {
+            return false;
+        }
+        BleStreamStats st;
+        bleStreamGetStats(bleClient, st);
+        limit = st.payload;
+        startFailed = st.failedNotifies;
+        startCongestion = st.congestion;
+    } else if (usbStreamEnabled()) {
+        return false;
+    }
+    if (size == 0 || size > limit) {
+        size = limit;
+    }
+    if (size < sizeof(StreamPacketHeader)) {
+        size = sizeof(StreamPacketHeader);
+    }
+    if (seconds == 0) {
+        seconds = BENCH_DEFAULT_SECONDS;
+    }
+    if (seconds > BENCH_MAX_SECONDS) {
+        seconds = BENCH_MAX_SECONDS;
+    }
+
+    target = t;
+    client = bleClient;
+    packetBytes = size;
+    durationMs = seconds * 1000;
+    seq = 0;
+    packets = bytes = stalls = drops = congestion = 0;
+    startMs = endMs = millis();
+    active = true;
+    return true;
+}
+
+static void finish() {
+    if (target == BENCH_BLE) {
+        BleStreamStats st;
+        bleStreamGetStats(client, st);
+        drops = st.failedNotifies - startFailed;
+        congestion = st.congestion - startCongestion;
+    }
+    endMs = millis();
+    active = false;
+}
+
+void benchStop() {
+    if (active) {
+        finish();
+    }
+}
+
+bool benchActive() {
+    return active;
+}
+
+static bool sendOne() {
+    buildPacket();
+    if (target == BENCH_BLE) {
+        return bleStreamSendRaw(client, packet, packetBytes);
+    }
+    size_t len = streamFrameEncode(packet, packetBytes, frame, sizeof(frame));
+    if ((size_t)Serial.availableForWrite() < len) {
+        return false;
+    }
+    Serial.write(frame, len);
+    return true;
+}
+
+void benchService() {
+    if (!active) {
+        return;
+    }
+    if (millis() - startMs >= durationMs || (target == BENCH_BLE && !bleStreamClientConnected(client))) {
+        finish();
+        return;
+    }
+    for (int i = 0; i < BENCH_BURST; i++) {
+        if (!sendOne()) {
+            stalls++;
+            return;
+        }
+        seq++;
+        packets++;
+        bytes += packetBytes;
+    }
+}
+
+void benchGetResult(BenchResult& out) {
+    uint32_t elapsed = (active ? millis() : endMs) - startMs;
+    out.target = target;
+    out.client = (int8_t)client;
+    out.running = active;
+    out.packetBytes = packetBytes;
+    out.elapsedMs = elapsed;
+    out.packets = packets;
+    out.bytes = bytes;
+    out.stalls = stalls;
+    out.drops = drops;
+    out.congestion = congestion;
+    out.connInterval = 0;
+    out.packetsPerEvent = 0;
+    if (target == BENCH_BLE) {
+        BleStreamStats st;
+        bleStreamGetStats(client, st);
+        if (active) {
+            out.drops = st.failedNotifies - startFailed;
+            out.congestion = st.congestion - startCongestion;
+        }
+        out.connInterval = st.connInterval;
+        if (st.connInterval && elapsed) {
+            float events = elapsed / (st.connInterval * 1.25f);
+            out.packetsPerEvent = packets / events;
+        }
+    }
+    out.bytesPerSec = elapsed ? bytes * 1000.0f / elapsed : 0;
+}
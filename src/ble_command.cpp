@@ -0,0 +1,112 @@
+/*
+ * BLE command queue - see ble_command.h
+ */
+
+#include "ble_command.h"
+#include "ble_stream.h"
+#include "console.h"
+#include <esp_timer.h>
+#include <string.h>
+
+static BleCommandHandler handler = nullptr;
+static EventGroupHandle_t readyEvents = nullptr;
+static EventBits_t readyBit = 0;
+
+static QueueHandle_t queue = nullptr;
+static StaticQueue_t queueState;
+static uint8_t queueStorage[BLE_CMD_QUEUE_DEPTH * sizeof(BleCommand)];
+
+static int currentClient = -1;
+
+static volatile uint32_t received = 0;
+static volatile uint32_t dropped = 0;
+static volatile uint32_t truncated = 0;
+static volatile uint32_t completed = 0;
+static volatile uint32_t maxQueued = 0;
+static volatile uint32_t maxLatencyUs = 0;
+
+void bleCommandService() {
+    // Static so the caller's stack only has to hold the handlers themselves
+    static BleCommand cmd;
+    static char replyBuf[CMD_REPLY_MAX];
+
+    if (!queue) {
+        return;
+    }
+    while (xQueueReceive(queue, &cmd, 0) == pdTRUE) {
+        CmdSpan input = cmdTrim(CmdSpan{ cmd.data, cmd.len });
+        if (input.len == 0) {
+            continue;
+        }
+        logInfo("[BLE] Received: %.*s\n", (int)input.len, input.ptr);
+
+        CmdReply reply(replyBuf, sizeof(replyBuf));
+        currentClient = cmd.client;
+        handler(input, reply);
+        currentClient = -1;
+        completed++;
+
+        if (!reply.empty()) {
+            bleStreamNotify(cmd.client, BLE_CHAR_COMMAND, (const uint8_t*)reply.c_str(), reply.length());
+        }
+
+        uint32_t latency = (uint32_t)esp_timer_get_time() - cmd.receivedUs;
+        if (latency > maxLatencyUs) {
+            maxLatencyUs = latency;
+        }
+    }
+}
+
+bool bleCommandBegin(BleCommandHandler fn, EventGroupHandle_t events, EventBits_t bit) {
+    if (queue) {
+        return true;
+    }
+    handler = fn;
+    readyEvents = events;
+    readyBit = bit;
+    queue = xQueueCreateStatic(BLE_CMD_QUEUE_DEPTH, sizeof(BleCommand), queueStorage, &queueState);
+    return queue != nullptr;
+}
+
+bool bleCommandEnqueue(const uint8_t* data, size_t len, int client) {
+    if (!queue) {
+        return false;
+    }
+
+    BleCommand cmd;
+    cmd.receivedUs = (uint32_t)esp_timer_get_time();
+    cmd.client = (int8_t)client;
+    if (len > sizeof(cmd.data)) {
+        len = sizeof(cmd.data);
+        truncated++;
+    }
+    cmd.len = (uint16_t)len;
+    memcpy(cmd.data, data, len);
+
+    if (xQueueSend(queue, &cmd, 0) != pdTRUE) {
+        dropped++;
+        return false;
+    }
+    received++;
+    if (readyEvents) {
+        xEventGroupSetBits(readyEvents, readyBit);
+    }
+    uint32_t depth = uxQueueMessagesWaiting(queue);
+    if (depth > maxQueued) {
+        maxQueued = depth;
+    }
+    return true;
+}
+
+int bleCommandClient() {
+    return currentClient;
+}
+
+void bleCommandGetStats(BleCommandStats& out) {
+    out.received = received;
+    out.dropped = dropped;
+    out.truncated = truncated;
+    out.completed = completed;
+    out.maxQueued = maxQueued;
+    out.maxLatencyUs = maxLatencyUs;
+}
@@ -0,0 +1,438 @@
+/*
+ * BLE GATT layout and host glue - see ble_gatt.h
+ */
+
+#include "ble_gatt.h"
+#include "ble_stream.h"
+#include <esp_timer.h>
+#if BLE_USE_NIMBLE
+#include "nimble/nimble/host/include/host/ble_hs.h"
+#else
+#include <esp_gap_ble_api.h>
+#include <esp_gatts_api.h>
+#endif
+
+#define BLE_ATT_MAX_VALUE   512     // largest attribute value a read can return
+#define BLE_SYNC_REPLY_MAX  20      // default ATT MTU payload
+
+#if BLE_USE_NIMBLE
+#define BLE_CHAR_PROPS(i)   (((bleGattTable[i].properties & BLE_PROP_READ) ? NIMBLE_PROPERTY::READ : 0) | \
+                             ((bleGattTable[i].properties & BLE_PROP_WRITE) ? NIMBLE_PROPERTY::WRITE : 0) | \
+                             ((bleGattTable[i].properties & BLE_PROP_NOTIFY) ? NIMBLE_PROPERTY::NOTIFY : 0))
+#else
+#define BLE_CHAR_PROPS(i)   (((bleGattTable[i].properties & BLE_PROP_READ) ? BLECharacteristic::PROPERTY_READ : 0) | \
+                             ((bleGattTable[i].properties & BLE_PROP_WRITE) ? BLECharacteristic::PROPERTY_WRITE : 0) | \
+                             ((bleGattTable[i].properties & BLE_PROP_NOTIFY) ? BLECharacteristic::PROPERTY_NOTIFY : 0))
+#endif
+
+static_assert(BLE_CHAR_COUNT == 5, "characteristic storage below follows bleGattTable");
+
+static BLECharacteristic chars[BLE_CHAR_COUNT] = {
+    { bleGattTable[BLE_CHAR_COMMAND].uuid, BLE_CHAR_PROPS(BLE_CHAR_COMMAND) },
+    { bleGattTable[BLE_CHAR_STREAM].uuid, BLE_CHAR_PROPS(BLE_CHAR_STREAM) },
+    { bleGattTable[BLE_CHAR_PERF].uuid, BLE_CHAR_PROPS(BLE_CHAR_PERF) },
+    { bleGattTable[BLE_CHAR_SYNC].uuid, BLE_CHAR_PROPS(BLE_CHAR_SYNC) },
+    { bleGattTable[BLE_CHAR_SPECTRUM].uuid, BLE_CHAR_PROPS(BLE_CHAR_SPECTRUM) },
+};
+
+// Advertising: flags and the 128-bit service UUID. Scan response: the
+// preferred connection interval, then the name.
+static const uint8_t advData[] = {
+    2, 0x01, 0x06,
+    17, 0x07,
+    bleUuidByte(SERVICE_UUID, 0),  bleUuidByte(SERVICE_UUID, 1),  bleUuidByte(SERVICE_UUID, 2),
+    bleUuidByte(SERVICE_UUID, 3),  bleUuidByte(SERVICE_UUID, 4),  bleUuidByte(SERVICE_UUID, 5),
+    bleUuidByte(SERVICE_UUID, 6),  bleUuidByte(SERVICE_UUID, 7),  bleUuidByte(SERVICE_UUID, 8),
+    bleUuidByte(SERVICE_UUID, 9),  bleUuidByte(SERVICE_UUID, 10), bleUuidByte(SERVICE_UUID, 11),
+    bleUuidByte(SERVICE_UUID, 12), bleUuidByte(SERVICE_UUID, 13), bleUuidByte(SERVICE_UUID, 14),
+    bleUuidByte(SERVICE_UUID, 15),
+};
+
+struct __attribute__((packed)) ScanResponse {
+    uint8_t intervalLen;
+    uint8_t intervalType;
+    uint16_t intervalMin;
+    uint16_t intervalMax;
+    uint8_t nameLen;
+    uint8_t nameType;
+    char name[sizeof(BLE_DEVICE_NAME)];     // sent without the terminator
+};
+
+static const ScanResponse scanResponse = {
+    5, 0x12, BLE_PREFERRED_CONN_MIN, BLE_PREFERRED_CONN_MAX,
+    sizeof(BLE_DEVICE_NAME), 0x09, BLE_DEVICE_NAME,
+};
+
+static_assert(sizeof(advData) <= 31, "advertising payload too long");
+static_assert(sizeof(ScanResponse) - 1 <= 31, "scan response too long, shorten BLE_DEVICE_NAME");
+
+static BleGattHooks hooks = {};
+static BLEServer* server = nullptr;
+
+static void startAdvertising(BLEAdvertising* adv) {
+    BLEAdvertisementData data;
+    BLEAdvertisementData response;
+    data.addData(std::string((const char*)advData, sizeof(advData)));
+    response.addData(std::string((const char*)&scanResponse, sizeof(scanResponse) - 1));
+    adv->setAdvertisementData(data);
+    adv->setScanResponseData(response);
+    adv->start();
+}
+
+static void onLinkUp(uint16_t connId, const uint8_t* addr) {
+    bleStreamLinkUp(connId, addr);
+    if (hooks.onConnect) {
+        hooks.onConnect(bleStreamClientForConn(connId));
+    }
+    // The stack stops advertising on connect; keep it up while a slot is free
+    if (bleStreamClientCount() < BLE_MAX_CLIENTS) {
+        BLEDevice::startAdvertising();
+    }
+}
+
+static void onLinkDown(uint16_t connId) {
+    bleStreamLinkDown(connId);
+    if (hooks.onDisconnect) {
+        hooks.onDisconnect();
+    }
+    BLEDevice::startAdvertising();
+}
+
+static void onPerfRead(BLECharacteristic* chr) {
+    static uint8_t buf[BLE_ATT_MAX_VALUE];
+    size_t len = hooks.onPerfRead ? hooks.onPerfRead(buf, sizeof(buf)) : 0;
+    chr->setValue(buf, len);
+}
+
+// Answered on the host task rather than queued like commands: the reply's
+// timestamps are only useful while the gap between write and notification
+// stays short
+static void onSyncWrite(uint16_t connId, const uint8_t* data, size_t len, uint64_t rxUs) {
+    uint8_t reply[BLE_SYNC_REPLY_MAX];
+    size_t n = hooks.onSync ? hooks.onSync(data, len, rxUs, reply, sizeof(reply)) : 0;
+    if (n > 0) {
+        bleGattNotify(connId, BLE_CHAR_SYNC, reply, n);
+    }
+}
+
+#if BLE_USE_NIMBLE
+
+// ---------------------------------------------------------------- NimBLE
+
+class ServerCallbacks : public NimBLEServerCallbacks {
+    void onConnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+        onLinkUp(desc->conn_handle, desc->peer_ota_addr.val);
+        bleStreamLinkInterval(desc->conn_handle, desc->conn_itvl);
+    }
+
+    void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+        onLinkDown(desc->conn_handle);
+    }
+
+    void onMTUChange(uint16_t mtu, ble_gap_conn_desc* desc) {
+        bleStreamLinkMtu(desc->conn_handle, mtu);
+    }
+};
+
+class CharCallbacks : public NimBLECharacteristicCallbacks {
+    void onWrite(NimBLECharacteristic* pChar, ble_gap_conn_desc* desc) {
+        uint64_t rxUs = (uint64_t)esp_timer_get_time();
+        NimBLEAttValue value = pChar->getValue();
+        if (pChar == &chars[BLE_CHAR_SYNC]) {
+            onSyncWrite(desc->conn_handle, value.data(), value.length(), rxUs);
+            return;
+        }
+        // Runs on the host task; the hook only queues the bytes
+        if (value.length() > 0 && hooks.onCommand) {
+            hooks.onCommand(value.data(), value.length(), bleStreamClientForConn(desc->conn_handle));
+        }
+    }
+
+    void onRead(NimBLECharacteristic* pChar, ble_gap_conn_desc* desc) {
+        onPerfRead(pChar);
+    }
+
+    void onSubscribe(NimBLECharacteristic* pChar, ble_gap_conn_desc* desc, uint16_t subValue) {
+        for (int i = 0; i < BLE_CHAR_COUNT; i++) {
+            if (pChar == &chars[i]) {
+                bleStreamLinkSubscribed(desc->conn_handle, (BleGattChar)i, (subValue & 0x01) != 0);
+            }
+        }
+    }
+};
+
+static ServerCallbacks serverCallbacks;
+static CharCallbacks charCallbacks;
+
+bool bleGattBegin(const BleGattHooks& h) {
+    hooks = h;
+    bleStreamBegin();
+
+    NimBLEDevice::init(BLE_DEVICE_NAME);
+    NimBLEDevice::setMTU(BLE_LOCAL_MTU);
+    server = NimBLEDevice::createServer();
+    server->setCallbacks(&serverCallbacks, false);
+
+    // NimBLE adds the CCCDs of notifying characteristics itself
+    BLEService* service = server->createService(SERVICE_UUID);
+    for (int i = 0; i < BLE_CHAR_COUNT; i++) {
+        chars[i].setCallbacks(&charCallbacks);
+        service->addCharacteristic(&chars[i]);
+    }
+    chars[BLE_CHAR_COMMAND].setValue("Hello from XIAO ESP32S3!");
+    if (!service->start()) {
+        return false;
+    }
+
+    startAdvertising(NimBLEDevice::getAdvertising());
+    return true;
+}
+
+BleSendResult bleGattNotify(uint16_t connId, BleGattChar chr, const uint8_t* data, uint16_t len) {
+    os_mbuf* om = ble_hs_mbuf_from_flat(data, len);
+    if (!om) {
+        return BLE_SEND_BUSY;
+    }
+    int rc = ble_gatts_notify_custom(connId, chars[chr].getHandle(), om);
+    if (rc == BLE_HS_ENOMEM) {
+        return BLE_SEND_BUSY;
+    }
+    return rc == 0 ? BLE_SEND_OK : BLE_SEND_FAILED;
+}
+
+void bleGattTuneLink(uint16_t connId, const uint8_t* addr) {
+    server->setDataLen(connId, BLE_DLE_TX_OCTETS);
+    ble_gap_set_prefered_le_phy(connId, BLE_GAP_LE_PHY_1M_MASK | BLE_GAP_LE_PHY_2M_MASK,
+                                BLE_GAP_LE_PHY_1M_MASK | BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+}
+
+void bleGattUpdateConnParams(uint16_t connId, const uint8_t* addr, uint16_t minInterval,
+                             uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+    server->updateConnParams(connId, minInterval, maxInterval, latency, timeout);
+}
+
+#else
+
+// ---------------------------------------------------------------- Bluedroid
+
+static BLE2902 cccds[BLE_CHAR_COUNT];
+
+// The DLE completion event does not name the peer, so requests go out one at
+// a time and the event is credited to the link whose request is in flight
+struct DleRequest {
+    uint16_t connId;
+    esp_bd_addr_t bda;
+};
+static DleRequest dleQueue[BLE_MAX_CLIENTS];
+static int dleQueued = 0;
+static int dleConn = -1;            // link with a request in flight, -1 if none
+
+class CommandCallbacks : public BLECharacteristicCallbacks {
+    void onWrite(BLECharacteristic* pChar, esp_ble_gatts_cb_param_t* param) {
+        // Runs on the host task; the hook only queues the bytes
+        if (pChar->getLength() > 0 && hooks.onCommand) {
+            hooks.onCommand(pChar->getData(), pChar->getLength(), bleStreamClientForConn(param->write.conn_id));
+        }
+    }
+};
+
+class PerfCallbacks : public BLECharacteristicCallbacks {
+    void onRead(BLECharacteristic* pChar) {
+        onPerfRead(pChar);
+    }
+};
+
+class SyncCallbacks : public BLECharacteristicCallbacks {
+    void onWrite(BLECharacteristic* pChar, esp_ble_gatts_cb_param_t* param) {
+        uint64_t rxUs = (uint64_t)esp_timer_get_time();
+        onSyncWrite(param->write.conn_id, pChar->getData(), pChar->getLength(), rxUs);
+    }
+};
+
+static CommandCallbacks commandCallbacks;
+static PerfCallbacks perfCallbacks;
+static SyncCallbacks syncCallbacks;
+
+static void onCccdWrite(esp_ble_gatts_cb_param_t* param) {
+    if (param->write.len < 2) {
+        return;
+    }
+    for (int i = 0; i < BLE_CHAR_COUNT; i++) {
+        if ((bleGattTable[i].properties & BLE_PROP_NOTIFY) && param->write.handle == cccds[i].getHandle()) {
+            bleStreamLinkSubscribed(param->write.conn_id, (BleGattChar)i, (param->write.value[0] & 0x01) != 0);
+        }
+    }
+}
+
+static void dleRequest(uint16_t connId, const uint8_t* addr) {
+    esp_bd_addr_t bda;
+    memcpy(bda, addr, sizeof(bda));
+    dleConn = connId;
+    if (esp_ble_gap_set_pkt_data_len(bda, BLE_DLE_TX_OCTETS) != ESP_OK) {
+        dleConn = -1;
+    }
+}
+
+static void dleNext() {
+    dleConn = -1;
+    while (dleConn < 0 && dleQueued > 0) {
+        DleRequest next = dleQueue[0];
+        dleQueued--;
+        memmove(&dleQueue[0], &dleQueue[1], dleQueued * sizeof(dleQueue[0]));
+        dleRequest(next.connId, next.bda);
+    }
+}
+
+static void dleQueueLink(uint16_t connId, const uint8_t* addr) {
+    if (dleConn < 0) {
+        dleRequest(connId, addr);
+    } else if (dleQueued < BLE_MAX_CLIENTS) {
+        dleQueue[dleQueued].connId = connId;
+        memcpy(dleQueue[dleQueued].bda, addr, sizeof(esp_bd_addr_t));
+        dleQueued++;
+    }
+}
+
+static void dleLinkDown(uint16_t connId) {
+    int kept = 0;
+    for (int i = 0; i < dleQueued; i++) {
+        if (dleQueue[i].connId != connId) {
+            dleQueue[kept++] = dleQueue[i];
+        }
+    }
+    dleQueued = kept;
+    if (dleConn == connId) {
+        dleNext();      // its completion may never come
+    }
+}
+
+static void gattsEventHandler(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param) {
+    switch (event) {
+    case ESP_GATTS_CONNECT_EVT:
+        onLinkUp(param->connect.conn_id, param->connect.remote_bda);
+        break;
+    case ESP_GATTS_DISCONNECT_EVT:
+        dleLinkDown(param->disconnect.conn_id);
+        onLinkDown(param->disconnect.conn_id);
+        break;
+    case ESP_GATTS_WRITE_EVT:
+        if (!param->write.is_prep) {
+            onCccdWrite(param);
+        }
+        break;
+    case ESP_GATTS_MTU_EVT:
+        bleStreamLinkMtu(param->mtu.conn_id, param->mtu.mtu);
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        bleStreamLinkCongested(param->congest.conn_id, param->congest.congested);
+        break;
+    case ESP_GATTS_CONF_EVT:
+        if (param->conf.handle == chars[BLE_CHAR_STREAM].getHandle() && param->conf.status != ESP_GATT_OK) {
+            bleStreamLinkNotifyFailed(param->conf.conn_id);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void gapEventHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+    uint16_t connId;
+    switch (event) {
+    case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+        if (dleConn >= 0) {
+            if (param->pkt_data_lenth_cmpl.status == ESP_BT_STATUS_SUCCESS) {
+                bleStreamLinkDataLen(dleConn, param->pkt_data_lenth_cmpl.params.tx_len);
+            }
+            dleNext();
+        }
+        break;
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+        if (bleStreamConnForAddr(param->update_conn_params.bda, connId)) {
+            bleStreamLinkInterval(connId, param->update_conn_params.conn_int);
+        }
+        break;
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+        if (bleStreamConnForAddr(param->phy_update.bda, connId)) {
+            bleStreamLinkPhy(connId, param->phy_update.tx_phy);
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+bool bleGattBegin(const BleGattHooks& h) {
+    hooks = h;
+    bleStreamBegin();
+
+    BLEDevice::init(BLE_DEVICE_NAME);
+    BLEDevice::setMTU(BLE_LOCAL_MTU);
+    BLEDevice::setCustomGattsHandler(gattsEventHandler);
+    BLEDevice::setCustomGapHandler(gapEventHandler);
+    server = BLEDevice::createServer();
+
+    // Sized from the table, so the stack allocates the attribute table once
+    BLEService* service = server->createService(BLEUUID(SERVICE_UUID), bleGattHandles());
+    if (!service) {
+        return false;
+    }
+    for (int i = 0; i < BLE_CHAR_COUNT; i++) {
+        if (bleGattTable[i].properties & BLE_PROP_NOTIFY) {
+            chars[i].addDescriptor(&cccds[i]);
+        }
+        service->addCharacteristic(&chars[i]);
+    }
+    chars[BLE_CHAR_COMMAND].setCallbacks(&commandCallbacks);
+    chars[BLE_CHAR_COMMAND].setValue("Hello from XIAO ESP32S3!");
+    chars[BLE_CHAR_PERF].setCallbacks(&perfCallbacks);
+    chars[BLE_CHAR_SYNC].setCallbacks(&syncCallbacks);
+    service->start();
+
+    startAdvertising(BLEDevice::getAdvertising());
+    return true;
+}
+
+BleSendResult bleGattNotify(uint16_t connId, BleGattChar chr, const uint8_t* data, uint16_t len) {
+    esp_err_t err = esp_ble_gatts_send_indicate(server->getGattsIf(), connId, chars[chr].getHandle(),
+                                                len, (uint8_t*)data, false);
+    return err == ESP_OK ? BLE_SEND_OK : BLE_SEND_FAILED;
+}
+
+void bleGattTuneLink(uint16_t connId, const uint8_t* addr) {
+    dleQueueLink(connId, addr);
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    esp_bd_addr_t bda;
+    memcpy(bda, addr, sizeof(bda));
+    esp_ble_gap_set_prefer_phy(bda, 0,
+                               ESP_BLE_GAP_PHY_2M_PREF_MASK | ESP_BLE_GAP_PHY_1M_PREF_MASK,
+                               ESP_BLE_GAP_PHY_2M_PREF_MASK | ESP_BLE_GAP_PHY_1M_PREF_MASK,
+                               ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+}
+
+void bleGattUpdateConnParams(uint16_t connId, const uint8_t* addr, uint16_t minInterval,
+                             uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+    esp_bd_addr_t bda;
+    memcpy(bda, addr, sizeof(bda));
+    server->updateConnParams(bda, minInterval, maxInterval, latency, timeout);
+}
+
+#endif
+
+void bleGattAdvertise() {
+    BLEDevice::startAdvertising();
+}
+
+void bleGattSetAdvInterval(uint16_t minInterval, uint16_t maxInterval) {
+    BLEAdvertising* adv = BLEDevice::getAdvertising();
+    adv->setMinInterval(minInterval);
+    adv->setMaxInterval(maxInterval);
+    if (bleStreamClientCount() < BLE_MAX_CLIENTS) {
+        // New interval only takes effect on a fresh advertising start
+        BLEDevice::stopAdvertising();
+        BLEDevice::startAdvertising();
+    }
+}
@@ -0,0 +1,576 @@
+/*
+ * BLE binary IMU streaming - see ble_stream.h
+ */
+
+#include "ble_stream.h"
+#include "imu_sampler.h"
+#include "stream_packet.h"
+#include "perf.h"
+#include <esp_timer.h>
+
+struct Client {
+    // Link state, written from the host task
+    volatile bool connected;
+    volatile uint32_t generation;   // bumped on every connect into this slot
+    volatile bool congested;
+    volatile bool subscribed[BLE_CHAR_COUNT];
+    volatile uint16_t connId;
+    volatile uint16_t mtu;
+    volatile uint16_t txOctets;
+    volatile uint8_t txPhy;
+    volatile uint16_t connInterval;
+    volatile uint32_t congestionEvents;
+    volatile uint32_t failedNotifies;
+    uint8_t addr[6];
+
+    // Stream state, under CommsLock
+    uint32_t seenGeneration;
+    bool enabled;
+    bool delta;
+    DspConfig dsp;
+    int encoder;                    // -1 = not bound
+    uint32_t cursor;                // next packet of the encoder to send
+    uint32_t packetsSent;
+    uint32_t bytesSent;
+    uint32_t samplesSent;
+    uint32_t droppedSamples;
+};
+
+// One DSP stage and packer shared by every client asking for the same
+// stream, with a ring of finished packets the clients read independently
+struct Encoder {
+    uint8_t refs;
+    bool delta;
+    uint16_t payload;
+    ImuDsp dsp;
+    StreamPacker packer;
+    uint8_t staging[BLE_STREAM_MAX_PAYLOAD];
+    unsigned long startMs;
+    uint8_t packets[BLE_STREAM_QUEUE_DEPTH][BLE_STREAM_MAX_PAYLOAD];
+    uint16_t len[BLE_STREAM_QUEUE_DEPTH];
+    uint8_t count[BLE_STREAM_QUEUE_DEPTH];
+    uint32_t produced;              // packets committed since the encoder was set up
+    bool unfit;                     // the last sample did not fit an empty packet
+};
+
+static Client clients[BLE_MAX_CLIENTS];
+static Encoder encoders[BLE_MAX_CLIENTS];
+static ImuDsp probe;                // validates DSP setups, and its default is the new-client one
+static DspConfig defaultDsp = probe.config();
+static bool defaultDelta = false;
+static uint32_t inputRateHz = IMU_SAMPLE_RATE_HZ;
+
+static uint16_t payloadSize(const Client& c) {
+    uint16_t payload = c.mtu - 3;
+    return payload < BLE_STREAM_MAX_PAYLOAD ? payload : BLE_STREAM_MAX_PAYLOAD;
+}
+
+static bool sameDsp(const DspConfig& a, const DspConfig& b) {
+    return a.filter == b.filter && a.cutoffHz == b.cutoffHz && a.firTaps == b.firTaps &&
+           a.decimation == b.decimation && a.window == b.window;
+}
+
+static Client* findClient(uint16_t connId) {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (clients[i].connected && clients[i].connId == connId) {
+            return &clients[i];
+        }
+    }
+    return nullptr;
+}
+
+void bleStreamBegin() {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        clients[i].connected = false;
+        clients[i].encoder = -1;
+        clients[i].dsp = defaultDsp;
+    }
+}
+
+// ---------------------------------------------------------------- link events
+
+void bleStreamLinkUp(uint16_t connId, const uint8_t* addr) {
+    Client* slot = nullptr;
+    for (int i = 0; i < BLE_MAX_CLIENTS && !slot; i++) {
+        if (!clients[i].connected) {
+            slot = &clients[i];
+        }
+    }
+    if (!slot) {
+        return;
+    }
+    Client& c = *slot;
+    memcpy(c.addr, addr, sizeof(c.addr));
+    c.connId = connId;
+    c.mtu = 23;
+    c.txOctets = 27;
+    c.txPhy = 1;
+    c.connInterval = 0;
+    c.congested = false;
+    c.congestionEvents = 0;
+    c.failedNotifies = 0;
+    for (int i = 0; i < BLE_CHAR_COUNT; i++) {
+        c.subscribed[i] = false;
+    }
+    c.generation++;
+    c.connected = true;
+
+    // Requests; the central decides what it supports and the results come
+    // back as link events
+    bleGattTuneLink(connId, c.addr);
+}
+
+void bleStreamLinkDown(uint16_t connId) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->connected = false;
+    }
+}
+
+void bleStreamLinkMtu(uint16_t connId, uint16_t mtu) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->mtu = mtu;
+    }
+}
+
+void bleStreamLinkCongested(uint16_t connId, bool congested) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->congested = congested;
+        if (congested) {
+            c->congestionEvents++;
+        }
+    }
+}
+
+void bleStreamLinkSubscribed(uint16_t connId, BleGattChar chr, bool notify) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->subscribed[chr] = notify;
+    }
+}
+
+void bleStreamLinkNotifyFailed(uint16_t connId) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->failedNotifies++;
+    }
+}
+
+void bleStreamLinkDataLen(uint16_t connId, uint16_t txOctets) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->txOctets = txOctets;
+    }
+}
+
+void bleStreamLinkInterval(uint16_t connId, uint16_t interval) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->connInterval = interval;
+    }
+}
+
+void bleStreamLinkPhy(uint16_t connId, uint8_t txPhy) {
+    Client* c = findClient(connId);
+    if (c) {
+        c->txPhy = txPhy;
+    }
+}
+
+bool bleStreamConnForAddr(const uint8_t* addr, uint16_t& connId) {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (clients[i].connected && memcmp(clients[i].addr, addr, sizeof(clients[i].addr)) == 0) {
+            connId = clients[i].connId;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---------------------------------------------------------------- encoders
+
+static bool encoderMatches(const Encoder& e, const Client& c) {
+    return e.refs > 0 && e.delta == c.delta && e.payload == payloadSize(c) && sameDsp(e.dsp.config(), c.dsp);
+}
+
+static void unbind(Client& c) {
+    if (c.encoder >= 0) {
+        encoders[c.encoder].refs--;
+        c.encoder = -1;
+    }
+}
+
+static void bind(Client& c) {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (encoderMatches(encoders[i], c)) {
+            // Joins on the next finished packet
+            encoders[i].refs++;
+            c.encoder = i;
+            c.cursor = encoders[i].produced;
+            return;
+        }
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Encoder& e = encoders[i];
+        if (e.refs == 0) {
+            e.dsp.configure(c.dsp, inputRateHz);
+            e.dsp.reset();
+            e.delta = c.delta;
+            e.payload = payloadSize(c);
+            e.packer.begin(e.staging, sizeof(e.staging));
+            e.packer.setMaxBytes(e.payload);
+            e.packer.setDelta(e.delta);
+            e.packer.resetSequence();
+            e.produced = 0;
+            e.unfit = false;
+            e.refs = 1;
+            c.encoder = i;
+            c.cursor = 0;
+            return;
+        }
+    }
+}
+
+// Applies connects, disconnects, MTU changes and setting changes to the
+// encoder bindings. Runs under CommsLock, before any client state is used.
+static void syncClients() {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Client& c = clients[i];
+        if (c.seenGeneration != c.generation) {
+            // A new central in this slot starts from the defaults
+            c.seenGeneration = c.generation;
+            unbind(c);
+            c.enabled = false;
+            c.delta = defaultDelta;
+            c.dsp = defaultDsp;
+        }
+        if (!c.connected) {
+            c.enabled = false;
+        }
+        bool wanted = c.connected && c.enabled;
+        if (c.encoder >= 0 && (!wanted || !encoderMatches(encoders[c.encoder], c))) {
+            unbind(c);
+        }
+        if (wanted && c.encoder < 0) {
+            bind(c);
+        }
+    }
+}
+
+static void commitPacket(int index) {
+    Encoder& e = encoders[index];
+    if (e.packer.empty()) {
+        return;
+    }
+    size_t slot = e.produced % BLE_STREAM_QUEUE_DEPTH;
+    if (e.produced >= BLE_STREAM_QUEUE_DEPTH) {
+        // Overwrites the oldest packet: clients still waiting for it lose it
+        for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+            Client& c = clients[i];
+            if (c.encoder == index && e.produced - c.cursor >= BLE_STREAM_QUEUE_DEPTH) {
+                c.droppedSamples += e.count[slot];
+                c.cursor++;
+            }
+        }
+    }
+    memcpy(e.packets[slot], e.packer.data(), e.packer.length());
+    e.len[slot] = e.packer.length();
+    e.count[slot] = e.packer.count();
+    e.produced++;
+    e.packer.next();
+}
+
+// ---------------------------------------------------------------- clients
+
+int bleStreamClientCount() {
+    int n = 0;
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        n += clients[i].connected ? 1 : 0;
+    }
+    return n;
+}
+
+bool bleStreamConnected() {
+    return bleStreamClientCount() > 0;
+}
+
+bool bleStreamClientConnected(int client) {
+    return client >= 0 && client < BLE_MAX_CLIENTS && clients[client].connected;
+}
+
+int bleStreamClientForConn(uint16_t connId) {
+    Client* c = findClient(connId);
+    return c ? (int)(c - clients) : -1;
+}
+
+static bool addressed(int target, int client) {
+    return (target == BLE_ALL_CLIENTS || target == client) && clients[client].connected;
+}
+
+bool bleStreamSetEnabled(int client, bool on) {
+    syncClients();
+    bool any = false;
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Client& c = clients[i];
+        if (!addressed(client, i)) {
+            continue;
+        }
+        if (on && !c.enabled) {
+            c.packetsSent = 0;
+            c.bytesSent = 0;
+            c.samplesSent = 0;
+            c.droppedSamples = 0;
+            c.failedNotifies = 0;
+            c.congestionEvents = 0;
+        }
+        c.enabled = on;
+        any = true;
+    }
+    syncClients();
+    return any || !on;
+}
+
+bool bleStreamEnabled() {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (clients[i].enabled) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bleStreamClientEnabled(int client) {
+    return bleStreamClientConnected(client) && clients[client].enabled;
+}
+
+void bleStreamSetDelta(int client, bool on) {
+    syncClients();
+    if (client == BLE_ALL_CLIENTS) {
+        defaultDelta = on;
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (addressed(client, i)) {
+            clients[i].delta = on;
+        }
+    }
+    syncClients();
+}
+
+bool bleStreamSetDsp(int client, const DspConfig& cfg) {
+    if (!probe.configure(cfg, inputRateHz)) {
+        return false;
+    }
+    syncClients();
+    if (client == BLE_ALL_CLIENTS) {
+        defaultDsp = cfg;
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (addressed(client, i)) {
+            clients[i].dsp = cfg;
+        }
+    }
+    syncClients();
+    return true;
+}
+
+DspConfig bleStreamDsp(int client) {
+    if (client < 0 || client >= BLE_MAX_CLIENTS) {
+        return defaultDsp;
+    }
+    return clients[client].dsp;
+}
+
+bool bleStreamDelta(int client) {
+    if (client < 0 || client >= BLE_MAX_CLIENTS) {
+        return defaultDelta;
+    }
+    return clients[client].delta;
+}
+
+bool bleStreamSetInputRate(uint32_t hz) {
+    syncClients();
+    if (!probe.configure(defaultDsp, hz)) {
+        return false;
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (clients[i].connected && !probe.configure(clients[i].dsp, hz)) {
+            return false;
+        }
+    }
+    inputRateHz = hz;
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Encoder& e = encoders[i];
+        if (e.refs > 0) {
+            e.dsp.configure(e.dsp.config(), hz);
+            e.dsp.reset();
+        }
+    }
+    return true;
+}
+
+void bleStreamRequestConnParams(uint16_t minInterval, uint16_t maxInterval, uint16_t latency, uint16_t timeout) {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (clients[i].connected) {
+            bleGattUpdateConnParams(clients[i].connId, clients[i].addr, minInterval, maxInterval, latency, timeout);
+        }
+    }
+}
+
+// ---------------------------------------------------------------- pipeline
+
+void bleStreamFeed(const ImuSample& s) {
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Encoder& e = encoders[i];
+        if (e.refs == 0) {
+            continue;
+        }
+        ImuSample out;
+        const ImuSample* in = &s;
+        if (!e.dsp.passthrough()) {
+            if (!e.dsp.process(s, out)) {
+                continue;
+            }
+            in = &out;
+        }
+        if (e.packer.empty()) {
+            e.startMs = millis();
+        }
+        if (e.packer.add(*in)) {
+            e.unfit = false;
+            continue;
+        }
+        commitPacket(i);
+        e.startMs = millis();
+        e.unfit = !e.packer.add(*in);
+        if (e.unfit) {
+            // The payload cannot hold a single record (23-byte MTU); lost
+            // until the central raises the MTU and the clients rebind
+            for (int j = 0; j < BLE_MAX_CLIENTS; j++) {
+                if (clients[j].encoder == i) {
+                    clients[j].droppedSamples++;
+                }
+            }
+        }
+    }
+}
+
+static bool sendTo(Client& c, BleGattChar chr, const uint8_t* data, uint16_t len) {
+    if (!c.connected || c.congested || !c.subscribed[chr]) {
+        return false;
+    }
+    BleSendResult result = bleGattNotify(c.connId, chr, data, len);
+    if (result == BLE_SEND_BUSY) {
+        c.congestionEvents++;
+    } else if (result == BLE_SEND_FAILED) {
+        c.failedNotifies++;
+    }
+    return result == BLE_SEND_OK;
+}
+
+void bleStreamService() {
+    syncClients();
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Encoder& e = encoders[i];
+        if (e.refs > 0 && !e.packer.empty() && millis() - e.startMs >= BLE_STREAM_FLUSH_MS) {
+            commitPacket(i);
+        }
+    }
+
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        Client& c = clients[i];
+        if (c.encoder < 0) {
+            continue;
+        }
+        const Encoder& e = encoders[c.encoder];
+        while (c.cursor != e.produced) {
+            size_t slot = c.cursor % BLE_STREAM_QUEUE_DEPTH;
+            uint32_t start = perfCycles();
+            if (!sendTo(c, BLE_CHAR_STREAM, e.packets[slot], e.len[slot])) {
+                break;
+            }
+            perfRecordSince(PERF_BLE_NOTIFY, start);
+            StreamPacketHeader hdr;
+            memcpy(&hdr, e.packets[slot], sizeof(hdr));
+            perfRecord(PERF_BLE_SAMPLE_TO_TX, (uint32_t)esp_timer_get_time() - hdr.t0Us);
+            c.packetsSent++;
+            c.bytesSent += e.len[slot];
+            c.samplesSent += e.count[slot];
+            c.cursor++;
+        }
+    }
+}
+
+bool bleStreamSendRaw(int client, const uint8_t* data, uint16_t len) {
+    if (!bleStreamClientConnected(client)) {
+        return false;
+    }
+    Client& c = clients[client];
+    if (len > payloadSize(c)) {
+        len = payloadSize(c);
+    }
+    return sendTo(c, BLE_CHAR_STREAM, data, len);
+}
+
+bool bleStreamNotify(int client, BleGattChar chr, const uint8_t* data, uint16_t len) {
+    if (!bleStreamClientConnected(client)) {
+        return false;
+    }
+    Client& c = clients[client];
+    if (len > c.mtu - 3) {
+        len = c.mtu - 3;
+    }
+    return sendTo(c, chr, data, len);
+}
+
+static void linkStats(int client, BleStreamStats& out) {
+    const Client& c = clients[client];
+    out.connected = c.connected;
+    out.subscribed = c.subscribed[BLE_CHAR_STREAM];
+    out.mtu = c.mtu;
+    out.payload = payloadSize(c);
+    out.txOctets = c.txOctets;
+    out.txPhy = c.txPhy;
+    out.connInterval = c.connInterval;
+}
+
+void bleStreamGetStats(int client, BleStreamStats& out) {
+    memset(&out, 0, sizeof(out));
+    out.encoder = -1;
+    out.mtu = 23;
+    out.payload = 20;
+    out.txOctets = 27;
+    out.dsp = defaultDsp;
+    if (client >= 0 && client < BLE_MAX_CLIENTS) {
+        const Client& c = clients[client];
+        linkStats(client, out);
+        out.enabled = c.connected && c.enabled;
+        out.encoder = (int8_t)c.encoder;
+        out.sharing = c.encoder >= 0 ? encoders[c.encoder].refs : 0;
+        out.recordTooLarge = c.encoder >= 0 && encoders[c.encoder].unfit;
+        out.packets = c.packetsSent;
+        out.bytes = c.bytesSent;
+        out.samples = c.samplesSent;
+        out.droppedSamples = c.droppedSamples;
+        out.failedNotifies = c.failedNotifies;
+        out.congestion = c.congestionEvents;
+        out.delta = c.delta;
+        out.dsp = c.dsp;
+        return;
+    }
+    for (int i = BLE_MAX_CLIENTS - 1; i >= 0; i--) {
+        const Client& c = clients[i];
+        if (c.connected) {
+            linkStats(i, out);
+            out.enabled = out.enabled || c.enabled;
+            out.recordTooLarge = out.recordTooLarge || (c.encoder >= 0 && encoders[c.encoder].unfit);
+        }
+        out.packets += c.packetsSent;
+        out.bytes += c.bytesSent;
+        out.samples += c.samplesSent;
+        out.droppedSamples += c.droppedSamples;
+        out.failedNotifies += c.failedNotifies;
+        out.congestion += c.congestionEvents;
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * Boot sequencing and startup timing - see boot.h
+ */
+
+#include "boot.h"
+#include "console.h"
+#include <atomic>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/event_groups.h>
+
+struct BootJob {
+    void (*fn)();
+    EventBits_t bit;
+};
+
+static std::atomic<uint32_t> marks[BOOT_MARK_COUNT];
+
+static StaticEventGroup_t jobEventsState;
+static EventGroupHandle_t jobEvents = nullptr;
+static BootJob jobs[BOOT_MAX_JOBS];
+static EventBits_t jobsStarted = 0;
+
+static const char* markNames[BOOT_MARK_COUNT] = {
+    "setup()", "IMU ready", "Advertising", "Log mounted", "Setup done", "First sample", "USB host"
+};
+
+void bootMarkAt(BootMark mark, uint32_t timestampUs) {
+    uint32_t unset = 0;
+    if (timestampUs == 0) {
+        timestampUs = 1;    // 0 means "not reached"
+    }
+    marks[mark].compare_exchange_strong(unset, timestampUs, std::memory_order_relaxed);
+}
+
+void bootMark(BootMark mark) {
+    bootMarkAt(mark, (uint32_t)esp_timer_get_time());
+}
+
+uint32_t bootMarkUs(BootMark mark) {
+    return marks[mark].load(std::memory_order_relaxed);
+}
+
+static void jobTask(void* arg) {
+    BootJob* job = (BootJob*)arg;
+    job->fn();
+    xEventGroupSetBits(jobEvents, job->bit);
+    vTaskDelete(nullptr);
+}
+
+bool bootRun(const char* name, void (*fn)(), BaseType_t core) {
+    if (!jobEvents) {
+        jobEvents = xEventGroupCreateStatic(&jobEventsState);
+    }
+    for (int i = 0; i < BOOT_MAX_JOBS; i++) {
+        EventBits_t bit = 1 << i;
+        if (jobsStarted & bit) {
+            continue;
+        }
+        jobs[i].fn = fn;
+        jobs[i].bit = bit;
+        if (xTaskCreatePinnedToCore(jobTask, name, BOOT_JOB_STACK, &jobs[i], BOOT_JOB_PRIORITY,
+                                    nullptr, core) != pdPASS) {
+            return false;
+        }
+        jobsStarted |= bit;
+        return true;
+    }
+    return false;
+}
+
+bool bootWait(uint32_t timeoutMs) {
+    if (!jobsStarted) {
+        return true;
+    }
+    EventBits_t done = xEventGroupWaitBits(jobEvents, jobsStarted, pdTRUE, pdTRUE, pdMS_TO_TICKS(timeoutMs));
+    bool ok = (done & jobsStarted) == jobsStarted;
+    jobsStarted = 0;
+    return ok;
+}
+
+const char* bootResetReason() {
+    switch (esp_reset_reason()) {
+    case ESP_RST_POWERON:   return "power-on";
+    case ESP_RST_SW:        return "software";
+    case ESP_RST_PANIC:     return "panic";
+    case ESP_RST_INT_WDT:   return "interrupt watchdog";
+    case ESP_RST_TASK_WDT:  return "task watchdog";
+    case ESP_RST_WDT:       return "other watchdog";
+    case ESP_RST_DEEPSLEEP: return "deep sleep";
+    case ESP_RST_BROWNOUT:  return "brownout";
+    default:                return "other";
+    }
+}
+
+void bootPrintReport() {
+    consolePrintln("\n=== Boot ===");
+    consolePrintf("Mode: %s, reset: %s\n", FAST_BOOT ? "fast" : "standard", bootResetReason());
+    for (int i = 0; i < BOOT_MARK_COUNT; i++) {
+        uint32_t us = bootMarkUs((BootMark)i);
+        if (us) {
+            consolePrintf("%s: %.1f ms\n", markNames[i], us / 1000.0f);
+        } else {
+            consolePrintf("%s: not yet\n", markNames[i]);
+        }
+    }
+    uint32_t adv = bootMarkUs(BOOT_MARK_ADVERTISING);
+    if (adv) {
+        consolePrintf("Time to advertise: %lu ms (target %d ms)\n", (unsigned long)(adv / 1000), BOOT_TARGET_ADV_MS);
+    }
+    consolePrintln("============\n");
+}
@@ -0,0 +1,243 @@
+/*
+ * PSRAM burst capture and bulk download - see capture.h
+ */
+
+#include "capture.h"
+#include "bench.h"
+#include "ble_stream.h"
+#include "stream_frame.h"
+#include "stream_packet.h"
+#include "usb_stream.h"
+
+#define CAPTURE_MAX_PACKET  (sizeof(CapturePacketHeader) + CAPTURE_USB_RECORDS * sizeof(CaptureRecord))
+
+static CaptureRecord* buffer = nullptr;
+static uint32_t capacity = 0;
+
+static bool recording = false;
+static uint32_t total = 0;
+static uint32_t skipped = 0;
+static uint32_t durationUs = 0;
+static uint32_t startUs = 0;
+
+static bool transferring = false;
+static bool importing = false;          // between captureImportBegin() and captureImportEnd()
+static CaptureTransport transport = CAPTURE_BLE;
+static int client = 0;
+static uint32_t sendNext = 0;
+static uint32_t sendEnd = 0;
+static uint16_t seq = 0;
+
+static uint8_t packet[CAPTURE_MAX_PACKET];
+static uint8_t frame[CAPTURE_MAX_PACKET + STREAM_FRAME_OVERHEAD];
+
+static uint32_t firstHeld() {
+    return total > capacity ? total - capacity : 0;
+}
+
+static const CaptureRecord& record(uint32_t index) {
+    return buffer[index % capacity];
+}
+
+static bool allocate() {
+    if (!buffer) {
+        if (!psramFound()) {
+            return false;
+        }
+        buffer = (CaptureRecord*)ps_malloc(CAPTURE_BUFFER_BYTES);
+        if (!buffer) {
+            return false;
+        }
+        capacity = CAPTURE_BUFFER_BYTES / sizeof(CaptureRecord);
+    }
+    return true;
+}
+
+bool captureStart(uint32_t seconds) {
+    if (transferring || importing || !allocate()) {
+        return false;
+    }
+    total = 0;
+    skipped = 0;
+    if (seconds > CAPTURE_MAX_SECONDS) {
+        seconds = CAPTURE_MAX_SECONDS;
+    }
+    durationUs = seconds * 1000000UL;
+    recording = true;
+    return true;
+}
+
+void captureStop() {
+    recording = false;
+}
+
+bool captureRecording() {
+    return recording;
+}
+
+bool captureFree() {
+    if (recording || transferring || importing) {
+        return false;
+    }
+    free(buffer);
+    buffer = nullptr;
+    capacity = 0;
+    total = 0;
+    return true;
+}
+
+void captureFeed(const ImuSample& s) {
+    if (!recording) {
+        return;
+    }
+    if (s.kind != IMU_SAMPLE_AGMT) {
+        skipped++;
+        return;
+    }
+    if (total == 0) {
+        startUs = s.timestampUs;
+    } else if (durationUs && s.timestampUs - startUs >= durationUs) {
+        recording = false;
+        return;
+    }
+    CaptureRecord& r = buffer[total % capacity];
+    r.timestampUs = s.timestampUs;
+    memcpy(r.acc, s.acc, sizeof(r.acc));
+    memcpy(r.gyr, s.gyr, sizeof(r.gyr));
+    memcpy(r.mag, s.mag, sizeof(r.mag));
+    r.tmp = s.tmp;
+    total++;
+}
+
+bool captureImportBegin() {
+    if (recording || transferring || !allocate()) {
+        return false;
+    }
+    total = 0;
+    skipped = 0;
+    durationUs = 0;
+    importing = true;
+    return true;
+}
+
+size_t captureImport(const CaptureRecord* records, size_t n) {
+    if (!importing || recording || transferring || !buffer || total >= capacity) {
+        return 0;
+    }
+    if (n > capacity - total) {
+        n = capacity - total;
+    }
+    memcpy(buffer + total, records, n * sizeof(CaptureRecord));
+    total += n;
+    return n;
+}
+
+void captureImportEnd() {
+    importing = false;
+}
+
+bool captureGetStart(CaptureTransport t, uint32_t& first, uint32_t& count, int bleClient) {
+    if (recording || importing || total == 0 || benchActive()) {
+        return false;
+    }
+    if (t == CAPTURE_BLE ? !bleStreamClientConnected(bleClient) || bleStreamClientEnabled(bleClient)
+                         : usbStreamEnabled()) {
+        return false;
+    }
+    if (first < firstHeld()) {
+        first = firstHeld();
+    }
+    if (first > total) {
+        first = total;
+    }
+    if (count == 0 || count > total - first) {
+        count = total - first;
+    }
+    transport = t;
+    client = bleClient;
+    sendNext = first;
+    sendEnd = first + count;
+    seq = 0;
+    transferring = true;
+    return true;
+}
+
+void captureGetStop() {
+    transferring = false;
+}
+
+bool captureTransferActive() {
+    return transferring;
+}
+
+static bool sendPacket(uint16_t records) {
+    CapturePacketHeader hdr;
+    hdr.type = STREAM_PKT_CAPTURE;
+    hdr.count = (uint8_t)records;
+    hdr.seq = seq;
+    hdr.index = sendNext;
+    memcpy(packet, &hdr, sizeof(hdr));
+    for (uint16_t i = 0; i < records; i++) {
+        memcpy(packet + sizeof(hdr) + i * sizeof(CaptureRecord), &record(sendNext + i), sizeof(CaptureRecord));
+    }
+    size_t len = sizeof(hdr) + records * sizeof(CaptureRecord);
+    if (transport == CAPTURE_BLE) {
+        return bleStreamSendRaw(client, packet, (uint16_t)len);
+    }
+    size_t frameLen = streamFrameEncode(packet, len, frame, sizeof(frame));
+    if ((size_t)Serial.availableForWrite() < frameLen) {
+        return false;
+    }
+    Serial.write(frame, frameLen);
+    return true;
+}
+
+void captureService() {
+    if (!transferring) {
+        return;
+    }
+    uint16_t perPacket = CAPTURE_USB_RECORDS;
+    if (transport == CAPTURE_BLE) {
+        if (!bleStreamClientConnected(client)) {
+            transferring = false;   // the host resumes from its last index after reconnecting
+            return;
+        }
+        BleStreamStats st;
+        bleStreamGetStats(client, st);
+        perPacket = (st.payload - sizeof(CapturePacketHeader)) / sizeof(CaptureRecord);
+        if (perPacket == 0) {
+            transferring = false;   // 23-byte MTU cannot carry a record
+            return;
+        }
+    }
+    for (int i = 0; i < CAPTURE_BURST; i++) {
+        uint32_t left = sendEnd - sendNext;
+        uint16_t records = left < perPacket ? (uint16_t)left : perPacket;
+        if (!sendPacket(records)) {
+            return;
+        }
+        seq++;
+        if (records == 0) {
+            transferring = false;
+            return;
+        }
+        sendNext += records;
+    }
+}
+
+void captureGetStatus(CaptureStatus& out) {
+    out.allocated = buffer != nullptr;
+    out.recording = recording;
+    out.transferring = transferring;
+    out.importing = importing;
+    out.capacity = capacity;
+    out.total = total;
+    out.first = firstHeld();
+    out.skipped = skipped;
+    out.durationMs = durationUs / 1000;
+    out.spanUs = total > 0 ? record(total - 1).timestampUs - record(firstHeld()).timestampUs : 0;
+    out.transport = transport;
+    out.client = (int8_t)client;
+    out.sendNext = sendNext;
+    out.sendEnd = sendEnd;
+}
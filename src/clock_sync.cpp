@@ -0,0 +1,108 @@
+/*
+ * Clock sync exchange - see clock_sync.h
+ */
+
+#include "clock_sync.h"
+#include <esp_timer.h>
+
+struct PingRecord {
+    uint16_t seq;
+    uint64_t rxUs;          // 0 = unused slot
+};
+
+static uint32_t nodeId = 0;
+static volatile uint32_t pings = 0;
+static volatile uint32_t rejected = 0;
+static volatile uint32_t lastPingMs = 0;
+
+// Written on the host task, read by 'sync' on the comms task
+static portMUX_TYPE syncMux = portMUX_INITIALIZER_UNLOCKED;
+static PingRecord history[CLOCK_SYNC_HISTORY];
+static uint32_t historyNext = 0;
+static bool reported = false;
+static int64_t offsetUs = 0;
+static int32_t driftPpb = 0;
+static uint64_t referenceUs = 0;
+static uint32_t reportMs = 0;
+
+void clockSyncBegin() {
+    // MAC bytes 0-2 are Espressif's OUI (the low bytes of the eFuse word), so
+    // take the top four, where boards of one batch actually differ
+    nodeId = (uint32_t)(ESP.getEfuseMac() >> 16);
+}
+
+uint64_t clockSyncNowUs() {
+    return (uint64_t)esp_timer_get_time();
+}
+
+static size_t handlePing(const ClockSyncPing& ping, uint64_t rxUs, uint8_t* out, size_t max) {
+    if (max < sizeof(ClockSyncReply)) {
+        return 0;
+    }
+    pings++;
+    lastPingMs = millis();
+    portENTER_CRITICAL(&syncMux);
+    history[historyNext] = { ping.seq, rxUs };
+    historyNext = (historyNext + 1) % CLOCK_SYNC_HISTORY;
+    portEXIT_CRITICAL(&syncMux);
+
+    ClockSyncReply reply = {};
+    reply.op = CLOCK_SYNC_OP_REPLY;
+    reply.seq = ping.seq;
+    reply.rxUs = rxUs;
+    reply.nodeId = nodeId;
+    // Last, so t3 is as close to the notification as this side can get
+    reply.turnaroundUs = (uint32_t)(clockSyncNowUs() - rxUs);
+    memcpy(out, &reply, sizeof(reply));
+    return sizeof(reply);
+}
+
+static void handleReport(const ClockSyncReport& report) {
+    uint32_t now = millis();
+    bool found = false;
+    portENTER_CRITICAL(&syncMux);
+    for (int i = 0; i < CLOCK_SYNC_HISTORY && !found; i++) {
+        if (history[i].rxUs != 0 && history[i].seq == report.seq) {
+            referenceUs = history[i].rxUs;
+            offsetUs = report.offsetUs;
+            driftPpb = report.driftPpb;
+            reportMs = now;
+            reported = true;
+            found = true;
+        }
+    }
+    portEXIT_CRITICAL(&syncMux);
+    if (!found) {
+        rejected++;
+    }
+}
+
+size_t clockSyncHandle(const uint8_t* data, size_t len, uint64_t rxUs, uint8_t* out, size_t max) {
+    if (len == sizeof(ClockSyncPing) && data[0] == CLOCK_SYNC_OP_PING) {
+        ClockSyncPing ping;
+        memcpy(&ping, data, sizeof(ping));
+        return handlePing(ping, rxUs, out, max);
+    }
+    if (len == sizeof(ClockSyncReport) && data[0] == CLOCK_SYNC_OP_REPORT) {
+        ClockSyncReport report;
+        memcpy(&report, data, sizeof(report));
+        handleReport(report);
+    } else {
+        rejected++;
+    }
+    return 0;
+}
+
+void clockSyncGetStats(ClockSyncStats& out) {
+    out.nodeId = nodeId;
+    out.pings = pings;
+    out.rejected = rejected;
+    out.lastPingMs = lastPingMs;
+    portENTER_CRITICAL(&syncMux);
+    out.reported = reported;
+    out.offsetUs = offsetUs;
+    out.driftPpb = driftPpb;
+    out.referenceUs = referenceUs;
+    out.reportMs = reportMs;
+    portEXIT_CRITICAL(&syncMux);
+}
@@ -0,0 +1,259 @@
+/*
+ * Transmit pipeline task - see comms.h
+ */
+
+#include "comms.h"
+#include "bench.h"
+#include "ble_stream.h"
+#include "boot.h"
+#include "capture.h"
+#include "flash_log.h"
+#include "imu_sampler.h"
+#include "spectral.h"
+#include "usb_stream.h"
+#include "wifi_stream.h"
+#include <atomic>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+
+#define COMMS_EVT_SAMPLES   (1 << 0)    // set by the sampler
+#define COMMS_EVT_WAKE      (1 << 1)    // state changed under CommsLock
+#define COMMS_EVT_ALL       (COMMS_EVT_SAMPLES | COMMS_EVT_WAKE)
+
+static TaskHandle_t taskHandle = nullptr;
+static StaticEventGroup_t eventsState;
+static EventGroupHandle_t events = nullptr;
+static StaticSemaphore_t lockState;
+static SemaphoreHandle_t lock = nullptr;
+
+static EventGroupHandle_t notifyEvents = nullptr;
+static EventBits_t benchDoneBit = 0;
+
+static portMUX_TYPE latestMux = portMUX_INITIALIZER_UNLOCKED;
+static ImuSample latest = {};
+static std::atomic<uint32_t> consumed(0);
+static std::atomic<uint32_t> busyUs(0);
+
+static ImuDsp dsp[COMMS_SINK_COUNT];
+static ImuDsp probe;                // validates setups for a new input rate
+static uint32_t inputRateHz = IMU_SAMPLE_RATE_HZ;
+static ImuTrigger trigger;
+static bool wasGated = false;
+static uint32_t womSeen = 0;
+
+static void feedStreams(const ImuSample& s) {
+    ImuSample out;
+    if (bleStreamEnabled()) {
+        bleStreamFeed(s);   // DSP per client group, see ble_stream.h
+    }
+    if (usbStreamEnabled()) {
+        if (dsp[COMMS_SINK_USB].passthrough()) {
+            usbStreamFeed(s);
+        } else if (dsp[COMMS_SINK_USB].process(s, out)) {
+            usbStreamFeed(out);
+        }
+    }
+    if (wifiStreamEnabled()) {
+        if (dsp[COMMS_SINK_WIFI].passthrough()) {
+            wifiStreamFeed(s);
+        } else if (dsp[COMMS_SINK_WIFI].process(s, out)) {
+            wifiStreamFeed(out);
+        }
+    }
+}
+
+static bool streaming() {
+    return bleStreamEnabled() || usbStreamEnabled() || wifiStreamEnabled();
+}
+
+static void drainRing() {
+    // The trigger only runs while a stream is on; a stale history or an
+    // open window must not leak into the next stream
+    bool gated = trigger.enabled() && streaming();
+    if (gated) {
+        ICM_20948_fss_t fss = imuSamplerFullScale();
+        trigger.setFullScale(fss.a, fss.g);
+        trigger.setHardwareMotion(imuSamplerWomActive());
+        // The count restarts with the sampler
+        uint32_t wom = imuSamplerWomEvents();
+        if (wom > womSeen) {
+            trigger.motionEvent();
+        }
+        womSeen = wom;
+    } else {
+        if (wasGated) {
+            trigger.reset();
+        }
+        womSeen = imuSamplerWomEvents();
+    }
+    wasGated = gated;
+
+    ImuSample s;
+    bool any = false;
+    while (imuSamplerRing().pop(s)) {
+        ImuSample out;
+        captureFeed(s);
+        spectralFeed(s);
+        if (gated) {
+            trigger.feed(s);
+            ImuSample t;
+            while (trigger.pop(t)) {
+                feedStreams(t);
+            }
+        } else {
+            feedStreams(s);
+        }
+        if (flashLogEnabled()) {
+            if (dsp[COMMS_SINK_LOG].passthrough()) {
+                flashLogFeed(s);
+            } else if (dsp[COMMS_SINK_LOG].process(s, out)) {
+                flashLogFeed(out);
+            }
+        }
+        consumed.fetch_add(1, std::memory_order_relaxed);
+        any = true;
+    }
+    if (any) {
+        bootMarkAt(BOOT_MARK_FIRST_SAMPLE, s.timestampUs);
+        portENTER_CRITICAL(&latestMux);
+        latest = s;
+        portEXIT_CRITICAL(&latestMux);
+    }
+}
+
+static void commsTask(void* arg) {
+    for (;;) {
+        TickType_t wait = portMAX_DELAY;
+        if (streaming()) {
+            wait = pdMS_TO_TICKS(COMMS_SERVICE_MS);
+        }
+        if (benchActive() || captureTransferActive()) {
+            // At least one tick: never spin, this core's idle task feeds the watchdog
+            TickType_t poll = pdMS_TO_TICKS(benchActive() ? BENCH_POLL_MS : CAPTURE_POLL_MS);
+            wait = poll > 0 ? poll : 1;
+        }
+        xEventGroupWaitBits(events, COMMS_EVT_ALL, pdTRUE, pdFALSE, wait);
+        uint32_t start = (uint32_t)esp_timer_get_time();
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        drainRing();
+        bleStreamService();
+        usbStreamService();
+        wifiStreamService();
+        bool benchWasActive = benchActive();
+        benchService();
+        captureService();
+        xSemaphoreGive(lock);
+
+        if (benchWasActive && !benchActive() && notifyEvents) {
+            xEventGroupSetBits(notifyEvents, benchDoneBit);
+        }
+        busyUs.fetch_add((uint32_t)esp_timer_get_time() - start, std::memory_order_relaxed);
+    }
+}
+
+bool commsBegin(EventGroupHandle_t notify, EventBits_t doneBit) {
+    if (taskHandle) {
+        return true;
+    }
+    notifyEvents = notify;
+    benchDoneBit = doneBit;
+    events = xEventGroupCreateStatic(&eventsState);
+    lock = xSemaphoreCreateMutexStatic(&lockState);
+    imuSamplerSetConsumerEvent(events, COMMS_EVT_SAMPLES);
+
+    BaseType_t ok = xTaskCreatePinnedToCore(commsTask, "comms", COMMS_STACK, nullptr,
+                                            COMMS_PRIORITY, &taskHandle, COMMS_CORE);
+    return ok == pdPASS;
+}
+
+bool commsSetDsp(CommsSink sink, const DspConfig& cfg) {
+    CommsLock hold;
+    if (sink == COMMS_SINK_BLE) {
+        return bleStreamSetDsp(BLE_ALL_CLIENTS, cfg);
+    }
+    return dsp[sink].configure(cfg, inputRateHz);
+}
+
+DspConfig commsDsp(CommsSink sink) {
+    CommsLock hold;
+    if (sink == COMMS_SINK_BLE) {
+        return bleStreamDsp(BLE_ALL_CLIENTS);
+    }
+    return dsp[sink].config();
+}
+
+bool commsSetInputRate(uint32_t hz) {
+    CommsLock hold;
+    for (int i = 0; i < COMMS_SINK_COUNT; i++) {
+        if (i != COMMS_SINK_BLE && !probe.configure(dsp[i].config(), hz)) {
+            return false;
+        }
+    }
+    if (!ImuTrigger::valid(trigger.config(), hz) || !bleStreamSetInputRate(hz)) {
+        return false;
+    }
+    inputRateHz = hz;
+    for (int i = 0; i < COMMS_SINK_COUNT; i++) {
+        if (i != COMMS_SINK_BLE) {
+            dsp[i].configure(dsp[i].config(), hz);
+        }
+    }
+    trigger.configure(trigger.config(), hz);
+    return true;
+}
+
+uint32_t commsInputRate() {
+    return inputRateHz;
+}
+
+bool commsSetTrigger(const TriggerConfig& cfg) {
+    CommsLock hold;
+    return trigger.configure(cfg, inputRateHz);
+}
+
+TriggerConfig commsTrigger() {
+    CommsLock hold;
+    return trigger.config();
+}
+
+void commsTriggerStats(TriggerStats& out) {
+    CommsLock hold;
+    trigger.getStats(out);
+}
+
+bool commsActive() {
+    return streaming() || benchActive() || captureRecording() ||
+           captureTransferActive() || flashLogEnabled() || spectralEnabled();
+}
+
+void commsLatestSample(ImuSample& out) {
+    portENTER_CRITICAL(&latestMux);
+    out = latest;
+    portEXIT_CRITICAL(&latestMux);
+}
+
+uint32_t commsSamplesConsumed() {
+    return consumed.load(std::memory_order_relaxed);
+}
+
+void commsResetSamplesConsumed() {
+    consumed.store(0, std::memory_order_relaxed);
+}
+
+uint32_t commsTakeBusyUs() {
+    return busyUs.exchange(0, std::memory_order_relaxed);
+}
+
+CommsLock::CommsLock() {
+    if (lock) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+    }
+}
+
+CommsLock::~CommsLock() {
+    if (lock) {
+        xSemaphoreGive(lock);
+        xEventGroupSetBits(events, COMMS_EVT_WAKE);
+    }
+}
@@ -0,0 +1,199 @@
+/*
+ * Buffered USB console output - see console.h
+ */
+
+#include "console.h"
+#include "comms.h"
+#include <stdarg.h>
+
+#define CONSOLE_MASK    (CONSOLE_RING_BYTES - 1)
+
+static_assert((CONSOLE_RING_BYTES & CONSOLE_MASK) == 0, "CONSOLE_RING_BYTES must be a power of two");
+
+static uint8_t ring[CONSOLE_RING_BYTES];
+static portMUX_TYPE ringMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t head = 0;       // both under ringMux; the drain task alone moves tail
+static uint32_t tail = 0;
+static TaskHandle_t taskHandle = nullptr;
+
+static volatile uint8_t level = CONSOLE_LEVEL;
+static volatile uint32_t messages = 0;
+static volatile uint32_t bytes = 0;
+static volatile uint32_t dropped = 0;
+static volatile uint32_t droppedBytes = 0;
+static volatile uint32_t filtered = 0;
+static volatile uint32_t highWater = 0;
+static volatile uint32_t stalls = 0;
+
+static const char* const levelNames[] = { "off", "error", "warn", "info", "debug" };
+
+// One message, optionally with a newline, as one ring entry or not at all
+static void push(const uint8_t* data, size_t len, bool newline) {
+    size_t total = len + (newline ? 1 : 0);
+    if (total == 0) {
+        return;
+    }
+    bool ok;
+    portENTER_CRITICAL(&ringMux);
+    uint32_t used = head - tail;
+    ok = total <= CONSOLE_RING_BYTES - used;
+    if (ok) {
+        uint32_t off = head & CONSOLE_MASK;
+        size_t first = len < CONSOLE_RING_BYTES - off ? len : CONSOLE_RING_BYTES - off;
+        memcpy(ring + off, data, first);
+        memcpy(ring, data + first, len - first);
+        if (newline) {
+            ring[(head + len) & CONSOLE_MASK] = '\n';
+        }
+        head += total;
+        if (used + total > highWater) {
+            highWater = used + total;
+        }
+        messages++;
+    } else {
+        dropped++;
+        droppedBytes += total;
+    }
+    portEXIT_CRITICAL(&ringMux);
+    if (ok && taskHandle) {
+        xTaskNotifyGive(taskHandle);
+    }
+}
+
+static void pushFormatted(const char* fmt, va_list ap) {
+    char line[CONSOLE_LINE_MAX];
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    if (n < 0) {
+        return;
+    }
+    push((const uint8_t*)line, (size_t)n < sizeof(line) ? n : sizeof(line) - 1, false);
+}
+
+void consolePrint(const char* text) {
+    push((const uint8_t*)text, strlen(text), false);
+}
+
+void consolePrintln(const char* text) {
+    push((const uint8_t*)text, strlen(text), true);
+}
+
+void consolePrintf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    pushFormatted(fmt, ap);
+    va_end(ap);
+}
+
+void consoleWrite(const uint8_t* data, size_t len) {
+    push(data, len, false);
+}
+
+void consoleLog(uint8_t msgLevel, const char* fmt, ...) {
+    if (msgLevel > level) {
+        filtered++;
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    pushFormatted(fmt, ap);
+    va_end(ap);
+}
+
+static void drainTask(void*) {
+    uint32_t reported = 0;
+    for (;;) {
+        portENTER_CRITICAL(&ringMux);
+        uint32_t h = head;
+        portEXIT_CRITICAL(&ringMux);
+        uint32_t t = tail;
+
+        if (h == t) {
+            // Report losses once there is room for the report
+            uint32_t lost = dropped - reported;
+            if (lost) {
+                reported += lost;
+                consolePrintf("[Console] %lu messages dropped, ring full\n", (unsigned long)lost);
+                continue;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        uint32_t off = t & CONSOLE_MASK;
+        size_t n = h - t;
+        if (n > CONSOLE_RING_BYTES - off) {
+            n = CONSOLE_RING_BYTES - off;
+        }
+        int room = Serial.availableForWrite();
+        if (room <= 0) {
+            n = 0;
+        } else if ((size_t)room < n) {
+            n = room;
+        }
+        if (n > 0) {
+            n = Serial.write(ring + off, n);
+        }
+        if (n == 0) {
+            stalls++;
+            vTaskDelay(pdMS_TO_TICKS(CONSOLE_RETRY_MS));
+            continue;
+        }
+        portENTER_CRITICAL(&ringMux);
+        tail = t + n;
+        portEXIT_CRITICAL(&ringMux);
+        bytes += n;
+    }
+}
+
+bool consoleBegin() {
+    if (taskHandle) {
+        return true;
+    }
+    TaskHandle_t handle = nullptr;
+    if (xTaskCreatePinnedToCore(drainTask, "console", CONSOLE_TASK_STACK, nullptr, CONSOLE_TASK_PRIORITY,
+                                &handle, COMMS_CORE) != pdPASS) {
+        return false;
+    }
+    taskHandle = handle;
+    xTaskNotifyGive(taskHandle);    // for anything queued before the task existed
+    return true;
+}
+
+bool consoleSetLevel(uint8_t newLevel) {
+    if (newLevel < CONSOLE_LEVEL_ERROR || newLevel > CONSOLE_LEVEL) {
+        return false;
+    }
+    level = newLevel;
+    return true;
+}
+
+const char* consoleLevelName(uint8_t lvl) {
+    return lvl <= CONSOLE_LEVEL_DEBUG ? levelNames[lvl] : "?";
+}
+
+bool consoleFlush(uint32_t timeoutMs) {
+    uint32_t start = millis();
+    for (;;) {
+        portENTER_CRITICAL(&ringMux);
+        bool empty = head == tail;
+        portEXIT_CRITICAL(&ringMux);
+        if (empty) {
+            return true;
+        }
+        if (!taskHandle || millis() - start >= timeoutMs) {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+void consoleGetStats(ConsoleStats& out) {
+    out.level = level;
+    out.messages = messages;
+    out.bytes = bytes;
+    out.dropped = dropped;
+    out.droppedBytes = droppedBytes;
+    out.filtered = filtered;
+    out.highWater = highWater;
+    out.stalls = stalls;
+}
@@ -0,0 +1,516 @@
+/*
+ * Persistent IMU logger on LittleFS - see flash_log.h
+ */
+
+#include "flash_log.h"
+#include "comms.h"
+#include "console.h"
+#include "perf.h"
+#include "stream_frame.h"
+#include <FS.h>
+#include <LittleFS.h>
+#include <esp_timer.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define FLOG_STATE_PATH     FLOG_DIR "/state"
+#define FLOG_STATE_MAGIC    0x54534C46  // "FLST"
+#define FLOG_SEGMENT_BYTES  ((uint32_t)FLOG_SEGMENT_BLOCKS * FLOG_BLOCK_BYTES)
+
+enum FlogOp {
+    FLOG_OP_WRITE = 0,
+    FLOG_OP_SYNC,
+    FLOG_OP_LOAD,
+    FLOG_OP_ERASE
+};
+
+struct FlogMsg {
+    uint8_t op;
+    uint8_t block;
+};
+
+struct __attribute__((packed)) FlogState {
+    uint32_t magic;
+    uint16_t boot;
+    uint16_t reserved;
+    uint32_t lifetimeBlocks;
+    uint32_t nextSegment;
+};
+
+static bool mounted = false;
+static bool enabled = false;
+static volatile bool loading = false;
+static FlogState state;
+
+static TaskHandle_t taskHandle = nullptr;
+static StaticQueue_t workQueueState;
+static uint8_t workQueueStorage[(FLOG_BUFFERS + 2) * sizeof(FlogMsg)];
+static QueueHandle_t workQueue = nullptr;
+static StaticQueue_t freeQueueState;
+static uint8_t freeQueueStorage[FLOG_BUFFERS];
+static QueueHandle_t freeQueue = nullptr;
+static StaticSemaphore_t indexLockState;
+static SemaphoreHandle_t indexLock = nullptr;
+
+// Pipeline side: the block being filled
+static uint8_t blocks[FLOG_BUFFERS][FLOG_BLOCK_BYTES];
+static int fill = -1;
+static unsigned long fillStartMs = 0;
+static uint64_t clockUs = 0;            // last sample time, widened to 64 bits
+
+// Writer side
+static fs::File file;
+static uint16_t segBlocks = FLOG_SEGMENT_BLOCKS;
+static uint16_t sinceSync = 0;
+static uint8_t readBuf[FLOG_BLOCK_BYTES];
+
+// Segment index, oldest first, guarded by indexLock
+static FlashLogSegment segments[FLOG_MAX_SEGMENTS];
+static size_t segmentCount = 0;
+
+static uint16_t loadBoot = 0;
+static uint64_t loadFromUs = 0;
+static uint64_t loadToUs = 0;
+
+static FlashLogStats stats;
+
+static void segmentPath(uint32_t id, char* out, size_t size) {
+    snprintf(out, size, FLOG_DIR "/%08lu.bin", (unsigned long)id);
+}
+
+static void saveState() {
+    fs::File f = LittleFS.open(FLOG_STATE_PATH, "w");
+    if (f) {
+        f.write((const uint8_t*)&state, sizeof(state));
+        f.close();
+    }
+}
+
+static bool readHeader(fs::File& f, uint32_t block, FlashLogBlockHeader& hdr) {
+    return f.seek((size_t)block * FLOG_BLOCK_BYTES) && f.read((uint8_t*)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+           hdr.magic == FLOG_BLOCK_MAGIC;
+}
+
+// Adds a segment file found at mount to the index, or deletes it if it holds nothing readable
+static void indexSegment(uint32_t id) {
+    char path[32];
+    segmentPath(id, path, sizeof(path));
+    fs::File f = LittleFS.open(path, "r");
+    FlashLogBlockHeader first, last;
+    uint32_t n = f ? f.size() / FLOG_BLOCK_BYTES : 0;
+    bool ok = n > 0 && readHeader(f, 0, first) && readHeader(f, n - 1, last);
+    if (f) {
+        f.close();
+    }
+    if (!ok || segmentCount >= FLOG_MAX_SEGMENTS) {
+        LittleFS.remove(path);
+        return;
+    }
+    // Insertion sort by id; there are few segments and this runs once
+    size_t i = segmentCount++;
+    while (i > 0 && segments[i - 1].id > id) {
+        segments[i] = segments[i - 1];
+        i--;
+    }
+    segments[i].id = id;
+    segments[i].boot = first.boot;
+    segments[i].blocks = n;
+    segments[i].firstUs = first.firstUs;
+    segments[i].lastUs = last.lastUs;
+    if (id >= state.nextSegment) {
+        state.nextSegment = id + 1;
+    }
+}
+
+static void deleteOldest() {
+    char path[32];
+    xSemaphoreTake(indexLock, portMAX_DELAY);
+    segmentPath(segments[0].id, path, sizeof(path));
+    memmove(segments, segments + 1, (segmentCount - 1) * sizeof(segments[0]));
+    segmentCount--;
+    xSemaphoreGive(indexLock);
+    LittleFS.remove(path);
+    stats.segmentsDeleted++;
+}
+
+static void closeSegment() {
+    if (file) {
+        file.close();
+        sinceSync = 0;
+    }
+    segBlocks = FLOG_SEGMENT_BLOCKS;
+}
+
+static bool openSegment() {
+    closeSegment();
+    while (segmentCount > 0 && (segmentCount >= FLOG_MAX_SEGMENTS ||
+                                LittleFS.totalBytes() - LittleFS.usedBytes() < FLOG_SEGMENT_BYTES + 2 * FLOG_BLOCK_BYTES)) {
+        deleteOldest();
+    }
+    char path[32];
+    uint32_t id = state.nextSegment++;
+    segmentPath(id, path, sizeof(path));
+    file = LittleFS.open(path, "w");
+    saveState();
+    if (!file) {
+        return false;
+    }
+    xSemaphoreTake(indexLock, portMAX_DELAY);
+    FlashLogSegment& seg = segments[segmentCount++];
+    seg.id = id;
+    seg.boot = state.boot;
+    seg.blocks = 0;
+    seg.firstUs = 0;
+    seg.lastUs = 0;
+    xSemaphoreGive(indexLock);
+    segBlocks = 0;
+    stats.segmentsCreated++;
+    return true;
+}
+
+static void writeBlock(uint8_t* block) {
+    FlashLogBlockHeader* hdr = (FlashLogBlockHeader*)block;
+    uint8_t* records = block + sizeof(FlashLogBlockHeader);
+    size_t recordBytes = hdr->count * sizeof(CaptureRecord);
+    hdr->magic = FLOG_BLOCK_MAGIC;
+    hdr->boot = state.boot;
+    hdr->seq = state.lifetimeBlocks;
+    hdr->crc = crc16Ccitt(records, recordBytes);
+    hdr->reserved = 0;
+    memset(records + recordBytes, 0xFF, FLOG_BLOCK_BYTES - sizeof(FlashLogBlockHeader) - recordBytes);
+
+    if (segBlocks >= FLOG_SEGMENT_BLOCKS && !openSegment()) {
+        stats.writeErrors++;
+        return;
+    }
+    uint32_t start = (uint32_t)esp_timer_get_time();
+    size_t n = file.write(block, FLOG_BLOCK_BYTES);
+    if (++sinceSync >= FLOG_SYNC_BLOCKS) {
+        file.flush();
+        sinceSync = 0;
+        stats.syncs++;
+    }
+    uint32_t us = (uint32_t)esp_timer_get_time() - start;
+    perfRecord(PERF_FLOG_WRITE, us);
+    stats.writeUs += us;
+
+    if (n != FLOG_BLOCK_BYTES) {
+        // Most likely out of space: the next block starts a new segment after making room
+        stats.writeErrors++;
+        closeSegment();
+        return;
+    }
+    xSemaphoreTake(indexLock, portMAX_DELAY);
+    FlashLogSegment& seg = segments[segmentCount - 1];
+    if (seg.blocks == 0) {
+        seg.firstUs = hdr->firstUs;
+    }
+    seg.blocks++;
+    seg.lastUs = hdr->lastUs;
+    xSemaphoreGive(indexLock);
+    segBlocks++;
+    state.lifetimeBlocks++;
+    stats.blocks++;
+    stats.records += hdr->count;
+}
+
+// First block of an open segment file whose last record is at or after fromUs
+static uint32_t findBlock(fs::File& f, uint32_t blockCount, uint64_t fromUs) {
+    uint32_t lo = 0;
+    uint32_t hi = blockCount;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        FlashLogBlockHeader hdr;
+        if (readHeader(f, mid, hdr) && hdr.lastUs < fromUs) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void loadRange() {
+    bool ok;
+    {
+        CommsLock hold;
+        ok = captureImportBegin();
+    }
+    stats.loaded = 0;
+    if (!ok) {
+        consolePrintln("[FLog] Query failed: capture buffer busy or no PSRAM");
+        return;
+    }
+    if (file) {
+        file.flush();   // make the open segment's blocks readable
+    }
+    bool full = false;
+    for (size_t i = 0; !full; i++) {
+        FlashLogSegment seg;
+        xSemaphoreTake(indexLock, portMAX_DELAY);
+        bool more = i < segmentCount;
+        if (more) {
+            seg = segments[i];
+        }
+        xSemaphoreGive(indexLock);
+        if (!more) {
+            break;
+        }
+        if (seg.boot != loadBoot || seg.blocks == 0 || seg.lastUs < loadFromUs || seg.firstUs > loadToUs) {
+            continue;
+        }
+        char path[32];
+        segmentPath(seg.id, path, sizeof(path));
+        fs::File f = LittleFS.open(path, "r");
+        if (!f) {
+            continue;
+        }
+        for (uint32_t b = findBlock(f, seg.blocks, loadFromUs); b < seg.blocks && !full; b++) {
+            const FlashLogBlockHeader* hdr = (const FlashLogBlockHeader*)readBuf;
+            const CaptureRecord* recs = (const CaptureRecord*)(readBuf + sizeof(FlashLogBlockHeader));
+            if (!f.seek((size_t)b * FLOG_BLOCK_BYTES) || f.read(readBuf, FLOG_BLOCK_BYTES) != FLOG_BLOCK_BYTES ||
+                hdr->magic != FLOG_BLOCK_MAGIC || hdr->count > FLOG_BLOCK_RECORDS ||
+                hdr->crc != crc16Ccitt((const uint8_t*)recs, hdr->count * sizeof(CaptureRecord))) {
+                continue;
+            }
+            if (hdr->firstUs > loadToUs) {
+                break;
+            }
+            // Keep the records inside the window; they are in time order
+            size_t from = 0;
+            size_t to = hdr->count;
+            for (size_t r = 0; r < hdr->count; r++) {
+                uint64_t t = hdr->firstUs + (int32_t)(recs[r].timestampUs - (uint32_t)hdr->firstUs);
+                if (t < loadFromUs) {
+                    from = r + 1;
+                } else if (t > loadToUs) {
+                    to = r;
+                    break;
+                }
+            }
+            if (from < to) {
+                CommsLock hold;
+                size_t taken = captureImport(recs + from, to - from);
+                stats.loaded += taken;
+                full = taken < to - from;
+            }
+        }
+        f.close();
+    }
+    {
+        CommsLock hold;
+        captureImportEnd();
+    }
+    consolePrintf("[FLog] Query loaded %lu records into the capture buffer%s\n", (unsigned long)stats.loaded,
+                  full ? " (buffer full, window truncated)" : "");
+}
+
+static void eraseAll() {
+    closeSegment();
+    while (segmentCount > 0) {
+        deleteOldest();
+    }
+}
+
+static void writerTask(void* arg) {
+    for (;;) {
+        FlogMsg msg;
+        xQueueReceive(workQueue, &msg, portMAX_DELAY);
+        switch (msg.op) {
+        case FLOG_OP_WRITE:
+            writeBlock(blocks[msg.block]);
+            xQueueSend(freeQueue, &msg.block, 0);
+            break;
+        case FLOG_OP_SYNC:
+            if (file) {
+                file.flush();
+                sinceSync = 0;
+                stats.syncs++;
+            }
+            saveState();
+            break;
+        case FLOG_OP_LOAD:
+            loadRange();
+            loading = false;
+            break;
+        case FLOG_OP_ERASE:
+            eraseAll();
+            break;
+        }
+    }
+}
+
+bool flashLogBegin() {
+    if (mounted) {
+        return true;
+    }
+    if (!LittleFS.begin(true, "/littlefs", 4, FLOG_PARTITION)) {
+        return false;
+    }
+    LittleFS.mkdir(FLOG_DIR);
+
+    memset(&state, 0, sizeof(state));
+    fs::File f = LittleFS.open(FLOG_STATE_PATH, "r");
+    if (f) {
+        if (f.read((uint8_t*)&state, sizeof(state)) != sizeof(state) || state.magic != FLOG_STATE_MAGIC) {
+            memset(&state, 0, sizeof(state));
+        }
+        f.close();
+    }
+    state.magic = FLOG_STATE_MAGIC;
+    state.boot++;
+
+    indexLock = xSemaphoreCreateMutexStatic(&indexLockState);
+    fs::File dir = LittleFS.open(FLOG_DIR);
+    for (fs::File entry = dir.openNextFile(); entry; entry = dir.openNextFile()) {
+        const char* name = strrchr(entry.name(), '/');
+        name = name ? name + 1 : entry.name();
+        char* end = nullptr;
+        uint32_t id = strtoul(name, &end, 10);
+        bool segment = end != name && strcmp(end, ".bin") == 0;
+        entry.close();
+        if (segment) {
+            indexSegment(id);
+        }
+    }
+    dir.close();
+    saveState();
+
+    // Every block starts out free; the writer hands them back after writing
+    workQueue = xQueueCreateStatic(FLOG_BUFFERS + 2, sizeof(FlogMsg), workQueueStorage, &workQueueState);
+    freeQueue = xQueueCreateStatic(FLOG_BUFFERS, sizeof(uint8_t), freeQueueStorage, &freeQueueState);
+    for (uint8_t i = 0; i < FLOG_BUFFERS; i++) {
+        xQueueSend(freeQueue, &i, 0);
+    }
+    if (xTaskCreatePinnedToCore(writerTask, "flog", FLOG_TASK_STACK, nullptr, FLOG_TASK_PRIORITY, &taskHandle,
+                                COMMS_CORE) != pdPASS) {
+        return false;
+    }
+    mounted = true;
+    return true;
+}
+
+bool flashLogMounted() {
+    return mounted;
+}
+
+static void submit() {
+    FlogMsg msg = { FLOG_OP_WRITE, (uint8_t)fill };
+    if (xQueueSend(workQueue, &msg, 0) != pdTRUE) {
+        // Work queue full (syncs behind a long load): drop the block's
+        // records but keep the block in the pool
+        stats.droppedRecords += ((FlashLogBlockHeader*)blocks[fill])->count;
+        xQueueSend(freeQueue, &msg.block, 0);
+    }
+    fill = -1;
+}
+
+bool flashLogSetEnabled(bool on) {
+    if (!mounted) {
+        return false;
+    }
+    if (on && !enabled) {
+        clockUs = esp_timer_get_time();
+    }
+    if (!on && enabled) {
+        if (fill >= 0) {
+            submit();
+        }
+        FlogMsg msg = { FLOG_OP_SYNC, 0 };
+        xQueueSend(workQueue, &msg, 0);
+    }
+    enabled = on;
+    return true;
+}
+
+bool flashLogEnabled() {
+    return enabled;
+}
+
+void flashLogFeed(const ImuSample& s) {
+    if (!enabled || s.kind != IMU_SAMPLE_AGMT) {
+        return;
+    }
+    if (fill < 0) {
+        uint8_t idx;
+        if (xQueueReceive(freeQueue, &idx, 0) != pdTRUE) {
+            stats.droppedRecords++;
+            return;
+        }
+        fill = idx;
+        ((FlashLogBlockHeader*)blocks[fill])->count = 0;
+    }
+    FlashLogBlockHeader* hdr = (FlashLogBlockHeader*)blocks[fill];
+    CaptureRecord* recs = (CaptureRecord*)(blocks[fill] + sizeof(FlashLogBlockHeader));
+
+    // Sample times are 32-bit and wrap after ~71 minutes; widen them against the running clock
+    clockUs += (int32_t)(s.timestampUs - (uint32_t)clockUs);
+    if (hdr->count == 0) {
+        hdr->firstUs = clockUs;
+        fillStartMs = millis();
+    }
+    CaptureRecord& r = recs[hdr->count++];
+    r.timestampUs = s.timestampUs;
+    memcpy(r.acc, s.acc, sizeof(r.acc));
+    memcpy(r.gyr, s.gyr, sizeof(r.gyr));
+    memcpy(r.mag, s.mag, sizeof(r.mag));
+    r.tmp = s.tmp;
+    hdr->lastUs = clockUs;
+
+    if (hdr->count >= FLOG_BLOCK_RECORDS || millis() - fillStartMs >= FLOG_BLOCK_MAX_AGE_MS) {
+        submit();
+    }
+}
+
+size_t flashLogSegments(FlashLogSegment* out, size_t max) {
+    if (!mounted) {
+        return 0;
+    }
+    xSemaphoreTake(indexLock, portMAX_DELAY);
+    size_t n = segmentCount < max ? segmentCount : max;
+    memcpy(out, segments, n * sizeof(segments[0]));
+    xSemaphoreGive(indexLock);
+    return n;
+}
+
+bool flashLogLoad(uint16_t boot, uint32_t fromMs, uint32_t toMs) {
+    if (!mounted || loading || fromMs > toMs || captureRecording() || captureTransferActive()) {
+        return false;
+    }
+    loadBoot = boot;
+    loadFromUs = (uint64_t)fromMs * 1000;
+    loadToUs = (uint64_t)toMs * 1000 + 999;
+    loading = true;
+    FlogMsg msg = { FLOG_OP_LOAD, 0 };
+    if (xQueueSend(workQueue, &msg, 0) != pdTRUE) {
+        loading = false;
+        return false;
+    }
+    return true;
+}
+
+bool flashLogErase() {
+    if (!mounted || enabled || loading) {
+        return false;
+    }
+    FlogMsg msg = { FLOG_OP_ERASE, 0 };
+    return xQueueSend(workQueue, &msg, 0) == pdTRUE;
+}
+
+void flashLogGetStats(FlashLogStats& out) {
+    out = stats;
+    out.mounted = mounted;
+    out.enabled = enabled;
+    out.loading = loading;
+    out.boot = state.boot;
+    out.lifetimeBlocks = state.lifetimeBlocks;
+    out.totalBytes = mounted ? LittleFS.totalBytes() : 0;
+    out.usedBytes = mounted ? LittleFS.usedBytes() : 0;
+    if (mounted) {
+        xSemaphoreTake(indexLock, portMAX_DELAY);
+        out.segments = segmentCount;
+        xSemaphoreGive(indexLock);
+    } else {
+        out.segments = 0;
+    }
+}
@@ -0,0 +1,174 @@
+/*
+ * Queued I2C transactions - see i2c_bus.h
+ */
+
+#include "i2c_bus.h"
+#include <esp_timer.h>
+
+static i2c_port_t port = I2C_NUM_0;
+static TaskHandle_t busTaskHandle = nullptr;
+static QueueHandle_t queue = nullptr;
+static StaticQueue_t queueState;
+static uint8_t queueStorage[I2C_BUS_QUEUE_DEPTH * sizeof(I2cTxn*)];
+
+// One command link, reused for every transaction
+static uint8_t linkBuffer[I2C_LINK_RECOMMENDED_SIZE(2)];
+
+static volatile uint32_t clockHz = 0;
+static volatile uint32_t transactions = 0;
+static volatile uint32_t bytes = 0;
+static volatile uint32_t errors = 0;
+static volatile uint32_t rejected = 0;
+static volatile uint32_t busyUs = 0;
+static volatile uint32_t maxQueued = 0;
+
+static uint8_t devAddr = 0;
+
+static esp_err_t run(const I2cTxn& txn) {
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(linkBuffer, sizeof(linkBuffer));
+    i2c_master_start(cmd);
+    i2c_master_write_byte(cmd, (txn.addr << 1) | I2C_MASTER_WRITE, true);
+    i2c_master_write_byte(cmd, txn.reg, true);
+    if (txn.write) {
+        if (txn.len > 0) {
+            i2c_master_write(cmd, txn.data, txn.len, true);
+        }
+    } else if (txn.len > 0) {
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, (txn.addr << 1) | I2C_MASTER_READ, true);
+        i2c_master_read(cmd, txn.data, txn.len, I2C_MASTER_LAST_NACK);
+    }
+    i2c_master_stop(cmd);
+    esp_err_t err = i2c_master_cmd_begin(port, cmd, pdMS_TO_TICKS(I2C_BUS_TIMEOUT_MS));
+    i2c_cmd_link_delete_static(cmd);
+    return err;
+}
+
+static void busTask(void* arg) {
+    I2cTxn* txn;
+    for (;;) {
+        if (xQueueReceive(queue, &txn, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        uint32_t start = (uint32_t)esp_timer_get_time();
+        txn->result = run(*txn);
+        busyUs += (uint32_t)esp_timer_get_time() - start;
+        transactions++;
+        if (txn->result == ESP_OK) {
+            bytes += txn->len;
+        } else {
+            errors++;
+        }
+        // Read the callback first: a waiter may reuse txn as soon as busy clears
+        I2cCallback callback = txn->callback;
+        txn->busy = false;
+        if (callback) {
+            callback(*txn);
+        }
+    }
+}
+
+bool i2cBusBegin(i2c_port_t p, uint32_t hz) {
+    if (busTaskHandle) {
+        return true;
+    }
+    port = p;
+    clockHz = hz;
+    queue = xQueueCreateStatic(I2C_BUS_QUEUE_DEPTH, sizeof(I2cTxn*), queueStorage, &queueState);
+    if (!queue) {
+        return false;
+    }
+    BaseType_t ok = xTaskCreatePinnedToCore(busTask, "i2c_bus", I2C_BUS_STACK, nullptr,
+                                            I2C_BUS_PRIORITY, &busTaskHandle, I2C_BUS_CORE);
+    return ok == pdPASS;
+}
+
+static bool enqueue(I2cTxn& txn, TickType_t wait) {
+    if (!queue) {
+        return false;
+    }
+    txn.busy = true;
+    I2cTxn* ptr = &txn;
+    if (xQueueSend(queue, &ptr, wait) != pdTRUE) {
+        txn.busy = false;
+        rejected++;
+        return false;
+    }
+    uint32_t depth = uxQueueMessagesWaiting(queue);
+    if (depth > maxQueued) {
+        maxQueued = depth;
+    }
+    return true;
+}
+
+bool i2cBusSubmit(I2cTxn& txn) {
+    return enqueue(txn, 0);
+}
+
+static void giveDone(I2cTxn& txn) {
+    xSemaphoreGive((SemaphoreHandle_t)txn.user);
+}
+
+esp_err_t i2cBusTransfer(I2cTxn& txn) {
+    StaticSemaphore_t doneState;
+    SemaphoreHandle_t done = xSemaphoreCreateBinaryStatic(&doneState);
+    txn.callback = giveDone;
+    txn.user = done;
+    // Waits for queue space; the driver times out every transaction, so
+    // the completion always comes
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (enqueue(txn, portMAX_DELAY)) {
+        xSemaphoreTake(done, portMAX_DELAY);
+        err = txn.result;
+    }
+    vSemaphoreDelete(done);
+    return err;
+}
+
+static ICM_20948_Status_e serifTransfer(uint8_t reg, uint8_t* data, uint32_t len, bool write) {
+    if (len > UINT16_MAX) {
+        return ICM_20948_Stat_ParamErr;
+    }
+    I2cTxn txn = {};
+    txn.addr = devAddr;
+    txn.reg = reg;
+    txn.write = write;
+    txn.data = data;
+    txn.len = (uint16_t)len;
+    return i2cBusTransfer(txn) == ESP_OK ? ICM_20948_Stat_Ok : ICM_20948_Stat_Err;
+}
+
+static ICM_20948_Status_e serifWrite(uint8_t reg, uint8_t* data, uint32_t len, void* user) {
+    return serifTransfer(reg, data, len, true);
+}
+
+static ICM_20948_Status_e serifRead(uint8_t reg, uint8_t* data, uint32_t len, void* user) {
+    return serifTransfer(reg, data, len, false);
+}
+
+void i2cBusAttach(ICM_20948_I2C& dev) {
+    // The library keeps a pointer to dev._serif, so replacing its
+    // functions redirects every later access
+    devAddr = dev._addr;
+    dev._serif.write = serifWrite;
+    dev._serif.read = serifRead;
+    dev._serif.user = nullptr;
+}
+
+uint8_t i2cBusDeviceAddr() {
+    return devAddr;
+}
+
+void i2cBusClockChanged(uint32_t hz) {
+    clockHz = hz;
+}
+
+void i2cBusGetStats(I2cBusStats& out) {
+    out.clockHz = clockHz;
+    out.transactions = transactions;
+    out.bytes = bytes;
+    out.errors = errors;
+    out.rejected = rejected;
+    out.busyUs = busyUs;
+    out.maxQueued = maxQueued;
+}
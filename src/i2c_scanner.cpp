@@ -0,0 +1,95 @@
+/*
+ * Incremental I2C bus scanner - see i2c_scanner.h
+ */
+
+#include "i2c_scanner.h"
+#include "console.h"
+
+static TwoWire* bus = nullptr;
+static bool active = false;
+static bool fastScan = false;
+static uint8_t nextAddr = I2C_SCAN_FIRST_ADDR;
+static uint8_t deviceCount = 0;
+static uint8_t found[16];       // one bit per 7-bit address
+static uint16_t savedTimeout = 0;
+static unsigned long lastProbeMs = 0;
+static unsigned long startMs = 0;
+
+static void finish() {
+    bus->setTimeOut(savedTimeout);
+    active = false;
+
+    consolePrintf("[I2C] Scan done in %lu ms\n", millis() - startMs);
+    if (deviceCount == 0) {
+        consolePrintln("No I2C devices found!");
+        consolePrintln("Check:");
+        consolePrintln("  - Wiring connections");
+        consolePrintln("  - Pull-up resistors (may be needed)");
+        consolePrintln("  - Power supply (3.3V)");
+    } else {
+        consolePrintf("Found %u device(s)\n", deviceCount);
+    }
+    consolePrintln("==========================\n");
+}
+
+bool i2cScanStart(TwoWire& wire, bool fast) {
+    if (active) {
+        return false;
+    }
+    bus = &wire;
+    fastScan = fast;
+    nextAddr = I2C_SCAN_FIRST_ADDR;
+    deviceCount = 0;
+    memset(found, 0, sizeof(found));
+    savedTimeout = bus->getTimeOut();
+    bus->setTimeOut(I2C_SCAN_TIMEOUT_MS);
+    startMs = millis();
+    lastProbeMs = startMs - I2C_SCAN_GAP_MS;
+    active = true;
+    return true;
+}
+
+bool i2cScanActive() {
+    return active;
+}
+
+void i2cScanService() {
+    if (!active) {
+        return;
+    }
+    if (!fastScan && millis() - lastProbeMs < I2C_SCAN_GAP_MS) {
+        return;
+    }
+
+    int probes = fastScan ? I2C_SCAN_FAST_BATCH : 1;
+    while (probes-- > 0 && nextAddr <= I2C_SCAN_LAST_ADDR) {
+        uint8_t addr = nextAddr++;
+        bus->beginTransmission(addr);
+        if (bus->endTransmission(true) == 0) {
+            found[addr >> 3] |= 1 << (addr & 7);
+            deviceCount++;
+            consolePrintf("[I2C] Device found at 0x%02X (%u)\n", addr, addr);
+        }
+    }
+    lastProbeMs = millis();
+
+    if (nextAddr > I2C_SCAN_LAST_ADDR) {
+        finish();
+    }
+}
+
+uint32_t i2cScanWaitMs() {
+    if (!active || fastScan) {
+        return 0;
+    }
+    unsigned long elapsed = millis() - lastProbeMs;
+    return elapsed >= I2C_SCAN_GAP_MS ? 0 : I2C_SCAN_GAP_MS - elapsed;
+}
+
+uint8_t i2cScanDeviceCount() {
+    return deviceCount;
+}
+
+bool i2cScanFound(uint8_t addr) {
+    return addr < 128 && (found[addr >> 3] & (1 << (addr & 7)));
+}
@@ -0,0 +1,698 @@
+/*
+ * ICM-20948 sampling task - see imu_sampler.h
+ */
+
+#include "imu_sampler.h"
+#include "console.h"
+#include "i2c_bus.h"
+#include "perf.h"
+#include <esp_timer.h>
+
+// ACCEL_XOUT_H .. EXT_SLV_SENS_DATA_08: accel(6) gyro(6) temp(2) and the
+// 9 AK09916 bytes (ST1, HXL..HZH, TMPS, ST2) mirrored by I2C slave 0.
+#define IMU_BLOCK_BYTES 23
+
+// FIFO_EN_1: SLV_0_FIFO_EN. FIFO_EN_2: ACCEL, GYRO Z/Y/X and TEMP.
+#define IMU_FIFO_EN_1_BITS  0x01
+#define IMU_FIFO_EN_2_BITS  0x1F
+#define IMU_FIFO_OVERFLOW   0x1F    // INT_STATUS_2 FIFO_OVERFLOW_INT[4:0]
+#define IMU_INT_STATUS_WOM  0x08    // INT_STATUS WOM_INT
+#define IMU_WOM_PREVIOUS    1       // ACCEL_INTEL_MODE_INT: compare with the previous sample
+
+static ICM_20948* imu = nullptr;
+static ImuRing ring;
+static TaskHandle_t samplerTaskHandle = nullptr;
+static SemaphoreHandle_t stopAck = nullptr;
+
+// FIFO mode: two burst buffers, so one is decoded while the bus task
+// reads the next into the other
+static uint8_t burstBuf[2][IMU_FIFO_BURST_SAMPLES * IMU_BLOCK_BYTES];
+static I2cTxn bursts[2];
+static uint32_t burstStart[2];
+static SemaphoreHandle_t burstDone = nullptr;
+static StaticSemaphore_t burstDoneState;
+
+static EventGroupHandle_t consumerEvents = nullptr;
+static EventBits_t consumerBit = 0;
+static void (*pinHook)() = nullptr;
+
+static volatile bool running = false;
+static volatile bool stopPending = false;
+static ImuAcqMode mode = IMU_ACQ_REGISTER;
+static volatile uint32_t lastIrqUs = 0;
+static volatile uint32_t irqCount = 0;  // FIFO mode: data-ready edges since start
+static uint32_t prevSampleUs = 0;       // register mode: previous timestamp, 0 after start or a miss
+static ICM_20948_fss_t fullScale = { 0, 0 };
+
+static volatile uint32_t sampleCount = 0;
+static volatile uint32_t missedIrqs = 0;
+static volatile uint32_t readErrors = 0;
+static volatile uint32_t stalls = 0;
+static volatile uint32_t fifoDrains = 0;
+static volatile uint32_t fifoBursts = 0;
+static volatile uint32_t fifoOverflows = 0;
+static volatile uint32_t fifoAnchored = 0;
+static uint32_t startMs = 0;
+static ImuSensorConfig sensorConfig = IMU_SENSOR_DEFAULTS;
+static uint32_t samplePeriodUs = 1000000UL * (1 + IMU_RATE_DIVIDER) / IMU_BASE_RATE_HZ;
+static uint32_t drdyTimeoutMs = IMU_DRDY_TIMEOUT_MS;
+static uint32_t fifoLastUs = 0;
+static volatile uint32_t dmpPackets = 0;
+static volatile uint32_t dmpErrors = 0;
+static volatile uint32_t womEvents = 0;
+static uint16_t womMg = 0;
+static bool womArmed = false;
+static uint32_t dmpInterval = IMU_DMP_BASE_RATE_HZ / IMU_DMP_DEFAULT_RATE_HZ - 1;
+#ifdef ICM_20948_USE_DMP
+static bool dmpInitialized = false;
+#endif
+
+static bool isDmpMode(ImuAcqMode m) {
+    return m == IMU_ACQ_DMP6 || m == IMU_ACQ_DMP9;
+}
+
+static void IRAM_ATTR imuDataReadyIsr() {
+    lastIrqUs = (uint32_t)esp_timer_get_time();
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(samplerTaskHandle, &woken);
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+// FIFO mode: the edge only timestamps the newest FIFO record, the task
+// keeps its own drain period
+static void IRAM_ATTR imuDataReadyStampIsr() {
+    lastIrqUs = (uint32_t)esp_timer_get_time();
+    irqCount++;
+}
+
+static void signalConsumer() {
+    if (consumerEvents) {
+        xEventGroupSetBits(consumerEvents, consumerBit);
+    }
+}
+
+static void decodeBlock(const uint8_t* buf, ImuSample& s) {
+    s.kind = IMU_SAMPLE_AGMT;
+    // Accel, gyro and temperature are big-endian, the magnetometer is little-endian.
+    for (int i = 0; i < 3; i++) {
+        s.acc[i] = (int16_t)((buf[0 + 2 * i] << 8) | buf[1 + 2 * i]);
+        s.gyr[i] = (int16_t)((buf[6 + 2 * i] << 8) | buf[7 + 2 * i]);
+        s.mag[i] = (int16_t)((buf[16 + 2 * i] << 8) | buf[15 + 2 * i]);
+    }
+    s.tmp = (int16_t)((buf[12] << 8) | buf[13]);
+}
+
+static bool readBlock(ImuSample& s) {
+    uint8_t buf[IMU_BLOCK_BYTES];
+    uint32_t start = perfCycles();
+    if (imu->read(AGB0_REG_ACCEL_XOUT_H, buf, sizeof(buf)) != ICM_20948_Stat_Ok) {
+        return false;
+    }
+    perfRecordSince(PERF_I2C_BLOCK, start);
+    decodeBlock(buf, s);
+    return true;
+}
+
+static ICM_20948_Status_e fifoConfigure(bool on) {
+    uint8_t en1 = on ? IMU_FIFO_EN_1_BITS : 0;
+    uint8_t en2 = on ? IMU_FIFO_EN_2_BITS : 0;
+
+    int err = ICM_20948_Stat_Ok;
+    err |= imu->enableFIFO(false);
+    err |= imu->setBank(0);
+    err |= imu->write(AGB0_REG_FIFO_EN_1, &en1, 1);
+    err |= imu->write(AGB0_REG_FIFO_EN_2, &en2, 1);
+    // Snapshot mode: a full FIFO stops accepting records instead of
+    // overwriting the oldest, so record boundaries stay aligned.
+    err |= imu->setFIFOmode(true);
+    err |= imu->resetFIFO();
+    if (on) {
+        err |= imu->enableFIFO(true);
+    }
+    err |= imu->setBank(0);
+    return (ICM_20948_Status_e)err;
+}
+
+static ICM_20948_Status_e womConfigure(bool on) {
+    int err = ICM_20948_Stat_Ok;
+    if (on) {
+        err |= imu->WOMThreshold(womMg / IMU_WOM_MG_PER_LSB);
+    }
+    err |= imu->WOMLogic(on, IMU_WOM_PREVIOUS);
+    err |= imu->intEnableWOM(on);
+    err |= imu->setBank(0);
+    return (ICM_20948_Status_e)err;
+}
+
+static void burstComplete(I2cTxn& txn) {
+    xSemaphoreGive(burstDone);
+}
+
+// Queues a FIFO burst read into bursts[slot]. Without the bus task (or
+// with its queue full) the read runs in line instead.
+static void startBurst(int slot, uint16_t records) {
+    I2cTxn& txn = bursts[slot];
+    txn.addr = i2cBusDeviceAddr();
+    txn.reg = AGB0_REG_FIFO_R_W;
+    txn.write = false;
+    txn.data = burstBuf[slot];
+    txn.len = records * IMU_BLOCK_BYTES;
+    txn.callback = burstComplete;
+    txn.user = nullptr;
+    fifoBursts++;
+    burstStart[slot] = perfCycles();
+    if (txn.addr && i2cBusSubmit(txn)) {
+        return;
+    }
+    bool ok = imu->read(AGB0_REG_FIFO_R_W, txn.data, txn.len) == ICM_20948_Stat_Ok;
+    txn.result = ok ? ESP_OK : ESP_FAIL;
+    xSemaphoreGive(burstDone);
+}
+
+static bool finishBurst(int slot) {
+    xSemaphoreTake(burstDone, portMAX_DELAY);
+    if (bursts[slot].result != ESP_OK) {
+        return false;
+    }
+    perfRecordSince(PERF_I2C_BURST, burstStart[slot]);
+    return true;
+}
+
+static void drainFifo() {
+    uint8_t raw[2];
+    uint8_t status[3];      // INT_STATUS, INT_STATUS_1, INT_STATUS_2
+    fifoDrains++;
+    uint32_t irqsBefore = irqCount;
+
+    if (imu->read(AGB0_REG_INT_STATUS, status, sizeof(status)) != ICM_20948_Stat_Ok ||
+        imu->read(AGB0_REG_FIFO_COUNT_H, raw, 2) != ICM_20948_Stat_Ok) {
+        readErrors++;
+        return;
+    }
+    uint32_t drainUs = (uint32_t)esp_timer_get_time();
+    uint32_t irqUs = lastIrqUs;
+
+    if (womArmed && (status[0] & IMU_INT_STATUS_WOM)) {
+        womEvents++;
+    }
+    if (status[2] & IMU_FIFO_OVERFLOW) {
+        // Samples were lost inside the sensor; start over on a clean boundary
+        fifoOverflows++;
+        imu->resetFIFO();
+        imu->setBank(0);
+        fifoLastUs = drainUs;
+        return;
+    }
+
+    uint16_t count = ((raw[0] << 8) | raw[1]) & 0x1FFF;
+    uint16_t records = count / IMU_BLOCK_BYTES;
+    if (records == 0) {
+        return;
+    }
+
+    // With no edge during the count read, the newest record counted is the
+    // one whose data-ready edge was stamped last. Otherwise (or with INT
+    // not wired) it was produced no later than now. Space the batch back
+    // from there at the configured period, but never before the previous
+    // batch.
+    uint32_t newestUs = drainUs;
+    if (irqsBefore != 0 && irqCount == irqsBefore && drainUs - irqUs < 2 * samplePeriodUs) {
+        newestUs = irqUs;
+        fifoAnchored++;
+    }
+    uint32_t t = newestUs - (uint32_t)(records - 1) * samplePeriodUs;
+    if ((int32_t)(t - fifoLastUs) <= 0) {
+        t = fifoLastUs + samplePeriodUs;
+    }
+
+    int slot = 0;
+    uint16_t n = records < IMU_FIFO_BURST_SAMPLES ? records : IMU_FIFO_BURST_SAMPLES;
+    startBurst(slot, n);
+    while (records > 0) {
+        if (!finishBurst(slot)) {
+            // A short read leaves the FIFO misaligned
+            readErrors++;
+            imu->resetFIFO();
+            imu->setBank(0);
+            break;
+        }
+        records -= n;
+        uint16_t done = n;
+        n = records < IMU_FIFO_BURST_SAMPLES ? records : IMU_FIFO_BURST_SAMPLES;
+        if (n > 0) {
+            startBurst(slot ^ 1, n);
+        }
+        const uint8_t* buf = burstBuf[slot];
+        for (uint16_t i = 0; i < done; i++) {
+            ImuSample s;
+            decodeBlock(buf + i * IMU_BLOCK_BYTES, s);
+            s.timestampUs = t;
+            fifoLastUs = t;
+            t += samplePeriodUs;
+            if (ring.push(s)) {
+                sampleCount++;
+            }
+        }
+        slot ^= 1;
+    }
+    signalConsumer();
+}
+
+#ifdef ICM_20948_USE_DMP
+static ICM_20948_Status_e dmpConfigure(bool on) {
+    int err = ICM_20948_Stat_Ok;
+    if (!on) {
+        err |= imu->enableDMP(false);
+        err |= imu->enableFIFO(false);
+        err |= imu->resetFIFO();
+        // initializeDMP() reprograms the sensor for the DMP; put the raw
+        // configuration back so register and FIFO modes work afterwards.
+        err |= imu->startupDefault(false);
+        dmpInitialized = false;
+        err |= imu->setBank(0);
+        return (ICM_20948_Status_e)err;
+    }
+
+    if (!dmpInitialized) {
+        // Uploads the DMP firmware image (~14 KB over I2C), so only once
+        // per DMP session.
+        err |= imu->initializeDMP();
+        dmpInitialized = err == ICM_20948_Stat_Ok;
+    }
+    bool nine = mode == IMU_ACQ_DMP9;
+    err |= imu->enableDMPSensor(INV_ICM20948_SENSOR_GAME_ROTATION_VECTOR, !nine);
+    err |= imu->enableDMPSensor(INV_ICM20948_SENSOR_ORIENTATION, nine);
+    err |= imu->setDMPODRrate(nine ? DMP_ODR_Reg_Quat9 : DMP_ODR_Reg_Quat6, dmpInterval);
+    err |= imu->enableFIFO(true);
+    err |= imu->enableDMP(true);
+    err |= imu->resetDMP();
+    err |= imu->resetFIFO();
+    return (ICM_20948_Status_e)err;
+}
+
+static void drainDmp() {
+    static ImuSample batch[IMU_DMP_MAX_PACKETS];
+    fifoDrains++;
+    icm_20948_DMP_data_t data;
+    bool nine = mode == IMU_ACQ_DMP9;
+    int n = 0;
+
+    uint8_t status = 0;
+    if (womArmed && imu->read(AGB0_REG_INT_STATUS, &status, 1) == ICM_20948_Stat_Ok &&
+        (status & IMU_INT_STATUS_WOM)) {
+        womEvents++;
+    }
+
+    uint32_t drainUs = (uint32_t)esp_timer_get_time();
+    for (int i = 0; i < IMU_DMP_MAX_PACKETS; i++) {
+        ICM_20948_Status_e st = imu->readDMPdataFromFIFO(&data);
+        if (st != ICM_20948_Stat_Ok && st != ICM_20948_Stat_FIFOMoreDataAvail) {
+            if (st != ICM_20948_Stat_FIFONoDataAvail) {
+                dmpErrors++;
+            }
+            break;
+        }
+        dmpPackets++;
+
+        uint16_t want = nine ? DMP_header_bitmap_Quat9 : DMP_header_bitmap_Quat6;
+        if (data.header & want) {
+            ImuSample& s = batch[n++];
+            s.kind = nine ? IMU_SAMPLE_QUAT9 : IMU_SAMPLE_QUAT6;
+            if (nine) {
+                s.quat.q[0] = data.Quat9.Data.Q1;
+                s.quat.q[1] = data.Quat9.Data.Q2;
+                s.quat.q[2] = data.Quat9.Data.Q3;
+                s.quat.accuracy = data.Quat9.Data.Accuracy;
+            } else {
+                s.quat.q[0] = data.Quat6.Data.Q1;
+                s.quat.q[1] = data.Quat6.Data.Q2;
+                s.quat.q[2] = data.Quat6.Data.Q3;
+                s.quat.accuracy = 0;
+            }
+        }
+        if (st == ICM_20948_Stat_Ok) {
+            break;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // The DMP packets carry no sample counter and the INT pin is left to the
+    // light-sleep wakeup, so the newest packet is timed at the drain and the
+    // rest spaced back at the DMP period, never before the previous batch.
+    // A packet can be up to one drain period older than its stamp.
+    uint32_t periodUs = 1000000UL * (1 + dmpInterval) / IMU_DMP_BASE_RATE_HZ;
+    uint32_t t = drainUs - (uint32_t)(n - 1) * periodUs;
+    if ((int32_t)(t - fifoLastUs) <= 0) {
+        t = fifoLastUs + periodUs;
+    }
+    for (int i = 0; i < n; i++) {
+        batch[i].timestampUs = t;
+        fifoLastUs = t;
+        t += periodUs;
+        if (ring.push(batch[i])) {
+            sampleCount++;
+        }
+    }
+    signalConsumer();
+}
+#endif
+
+static void samplerTask(void* arg) {
+    for (;;) {
+        // FIFO and DMP modes have no interrupt; the timeout is the drain
+        // period and a notification only arrives from imuSamplerStop().
+        bool fifo = running && mode != IMU_ACQ_REGISTER;
+        uint32_t pending = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(fifo ? IMU_FIFO_DRAIN_MS : drdyTimeoutMs));
+
+        if (!running) {
+            if (stopPending) {
+                stopPending = false;
+                xSemaphoreGive(stopAck);
+            }
+            continue;
+        }
+
+        if (mode == IMU_ACQ_FIFO) {
+            drainFifo();
+            continue;
+        }
+#ifdef ICM_20948_USE_DMP
+        if (isDmpMode(mode)) {
+            drainDmp();
+            continue;
+        }
+#endif
+
+        if (pending == 0) {
+            stalls++;
+            continue;
+        }
+        if (pending > 1) {
+            missedIrqs += pending - 1;
+            prevSampleUs = 0;
+        }
+
+        ImuSample s;
+        s.timestampUs = lastIrqUs;
+        if (prevSampleUs) {
+            int32_t dev = (int32_t)(s.timestampUs - prevSampleUs - samplePeriodUs);
+            perfRecord(PERF_SAMPLE_JITTER, dev < 0 ? -dev : dev);
+        }
+        prevSampleUs = s.timestampUs;
+        if (!readBlock(s)) {
+            readErrors++;
+            continue;
+        }
+
+        if (ring.push(s)) {
+            sampleCount++;
+        }
+        if (ring.size() == IMU_NOTIFY_WATERMARK) {
+            signalConsumer();
+        }
+    }
+}
+
+bool imuSamplerBegin(ICM_20948& dev) {
+    if (samplerTaskHandle) {
+        return true;
+    }
+    imu = &dev;
+    stopAck = xSemaphoreCreateBinary();
+    burstDone = xSemaphoreCreateBinaryStatic(&burstDoneState);
+
+    BaseType_t ok = xTaskCreatePinnedToCore(samplerTask, "imu_sampler", IMU_SAMPLER_STACK,
+                                            nullptr, IMU_SAMPLER_PRIORITY,
+                                            &samplerTaskHandle, IMU_SAMPLER_CORE);
+    return ok == pdPASS && stopAck != nullptr;
+}
+
+bool imuSamplerStart() {
+    if (!imu || !samplerTaskHandle) {
+        return false;
+    }
+    if (running) {
+        return true;
+    }
+
+    // The output data rate divider only applies with the DLPF enabled;
+    // bypassed, the gyro would free-run at 9 kHz and flood the interrupt.
+    uint8_t sensors = ICM_20948_Internal_Acc | ICM_20948_Internal_Gyr;
+    ICM_20948_smplrt_t rate;
+    rate.a = sensorConfig.rateDivider;
+    rate.g = sensorConfig.rateDivider;
+    ICM_20948_dlpcfg_t dlpf;
+    dlpf.a = sensorConfig.accelDlpf;
+    dlpf.g = sensorConfig.gyroDlpf;
+    ICM_20948_fss_t fss;
+    fss.a = sensorConfig.accelFs;
+    fss.g = sensorConfig.gyroFs;
+
+    int err = ICM_20948_Stat_Ok;
+    err |= imu->setSampleMode(sensors, ICM_20948_Sample_Mode_Continuous);
+    err |= imu->setFullScale(sensors, fss);
+    err |= imu->setDLPFcfg(sensors, dlpf);
+    err |= imu->enableDLPF(ICM_20948_Internal_Acc, true);
+    err |= imu->enableDLPF(ICM_20948_Internal_Gyr, true);
+    err |= imu->setSampleRate(sensors, rate);
+    err |= imu->cfgIntActiveLow(false);
+    err |= imu->cfgIntOpenDrain(false);
+    err |= imu->cfgIntLatch(false);
+    err |= imu->intEnableRawDataReady(mode == IMU_ACQ_REGISTER || mode == IMU_ACQ_FIFO);
+
+    // One library read to learn the current full-scale settings, then leave
+    // the register bank on 0 so the hot path is a single burst per read.
+    err |= imu->getAGMT();
+    fullScale = imu->agmt.fss;
+    err |= imu->setBank(0);
+
+    if (mode == IMU_ACQ_FIFO) {
+        err |= fifoConfigure(true);
+    }
+#ifdef ICM_20948_USE_DMP
+    if (isDmpMode(mode)) {
+        err |= dmpConfigure(true);
+    }
+#endif
+    // After the DMP upload, which reprograms the interrupt setup
+    womArmed = womMg > 0 && mode != IMU_ACQ_REGISTER;
+    err |= womConfigure(womArmed);
+
+    if (err != ICM_20948_Stat_Ok) {
+        logError("[IMU] Sampler configuration failed\n");
+        return false;
+    }
+
+    samplePeriodUs = 1000000UL * (1 + sensorConfig.rateDivider) / IMU_BASE_RATE_HZ;
+    // Two periods without an edge count as a stall, but never less than the default
+    drdyTimeoutMs = 2 * samplePeriodUs / 1000 > IMU_DRDY_TIMEOUT_MS ? 2 * samplePeriodUs / 1000 : IMU_DRDY_TIMEOUT_MS;
+    ring.reset();
+    sampleCount = 0;
+    missedIrqs = 0;
+    readErrors = 0;
+    stalls = 0;
+    fifoDrains = 0;
+    fifoBursts = 0;
+    fifoOverflows = 0;
+    fifoAnchored = 0;
+    irqCount = 0;
+    dmpPackets = 0;
+    dmpErrors = 0;
+    womEvents = 0;
+    fifoLastUs = (uint32_t)esp_timer_get_time();
+    prevSampleUs = 0;
+    startMs = millis();
+
+    running = true;
+    if (pinHook) {
+        pinHook();
+    }
+    if (mode == IMU_ACQ_REGISTER) {
+        pinMode(IMU_INT_PIN, INPUT);
+        attachInterrupt(digitalPinToInterrupt(IMU_INT_PIN), imuDataReadyIsr, RISING);
+    } else {
+        if (mode == IMU_ACQ_FIFO) {
+            pinMode(IMU_INT_PIN, INPUT);
+            attachInterrupt(digitalPinToInterrupt(IMU_INT_PIN), imuDataReadyStampIsr, RISING);
+        }
+        // Kick the task so it switches to the drain period right away
+        xTaskNotifyGive(samplerTaskHandle);
+    }
+    return true;
+}
+
+void imuSamplerStop() {
+    if (!running) {
+        return;
+    }
+    if (mode == IMU_ACQ_REGISTER || mode == IMU_ACQ_FIFO) {
+        detachInterrupt(digitalPinToInterrupt(IMU_INT_PIN));
+    }
+    stopPending = true;
+    running = false;
+
+    // Wait for the task to finish any read in flight before handing the
+    // sensor back to the rest of the firmware.
+    xTaskNotifyGive(samplerTaskHandle);
+    xSemaphoreTake(stopAck, pdMS_TO_TICKS(100));
+
+    if (mode == IMU_ACQ_FIFO) {
+        fifoConfigure(false);
+        imu->intEnableRawDataReady(false);
+#ifdef ICM_20948_USE_DMP
+    } else if (isDmpMode(mode)) {
+        dmpConfigure(false);
+#endif
+    } else {
+        imu->intEnableRawDataReady(false);
+    }
+    if (womArmed) {
+        womConfigure(false);
+        womArmed = false;
+    }
+    if (pinHook) {
+        pinHook();
+    }
+}
+
+bool imuSamplerRunning() {
+    return running;
+}
+
+bool imuSamplerSetMode(ImuAcqMode newMode) {
+    if (running) {
+        return false;
+    }
+#ifndef ICM_20948_USE_DMP
+    if (isDmpMode(newMode)) {
+        return false;
+    }
+#endif
+    mode = newMode;
+    return true;
+}
+
+ImuAcqMode imuSamplerMode() {
+    return mode;
+}
+
+const char* imuSamplerModeName(ImuAcqMode m) {
+    switch (m) {
+    case IMU_ACQ_REGISTER: return "register (data-ready interrupt)";
+    case IMU_ACQ_FIFO:     return "FIFO burst";
+    case IMU_ACQ_DMP6:     return "DMP 6-axis quaternion";
+    case IMU_ACQ_DMP9:     return "DMP 9-axis quaternion";
+    }
+    return "unknown";
+}
+
+bool imuSamplerSetDmpRate(uint32_t hz) {
+    if (running || hz == 0) {
+        return false;
+    }
+    if (hz > IMU_DMP_BASE_RATE_HZ) {
+        hz = IMU_DMP_BASE_RATE_HZ;
+    }
+    dmpInterval = (IMU_DMP_BASE_RATE_HZ + hz / 2) / hz - 1;
+    return true;
+}
+
+uint32_t imuSamplerDmpRate() {
+    return IMU_DMP_BASE_RATE_HZ / (dmpInterval + 1);
+}
+
+bool imuSamplerSetSensorConfig(const ImuSensorConfig& cfg) {
+    if (running || cfg.accelFs > gpm16 || cfg.gyroFs > dps2000 || cfg.accelDlpf > acc_d473bw_n499bw ||
+        cfg.gyroDlpf > gyr_d361bw4_n376bw5) {
+        return false;
+    }
+    sensorConfig = cfg;
+    return true;
+}
+
+ImuSensorConfig imuSamplerSensorConfig() {
+    return sensorConfig;
+}
+
+uint32_t imuSamplerRateHz() {
+    return IMU_BASE_RATE_HZ / (1 + sensorConfig.rateDivider);
+}
+
+uint8_t imuSamplerDividerForRate(uint32_t hz) {
+    if (hz == 0) {
+        return IMU_MAX_RATE_DIVIDER;
+    }
+    uint32_t div = (IMU_BASE_RATE_HZ + hz / 2) / hz;
+    div = div > 0 ? div - 1 : 0;
+    return div > IMU_MAX_RATE_DIVIDER ? IMU_MAX_RATE_DIVIDER : div;
+}
+
+// Datasheet table 16 and 18, 3 dB bandwidth by DLPCFG value
+float imuSamplerAccelDlpfHz(uint8_t dlpf) {
+    static const float hz[] = { 246.0f, 246.0f, 111.4f, 50.4f, 23.9f, 11.5f, 5.7f, 473.0f };
+    return dlpf < sizeof(hz) / sizeof(hz[0]) ? hz[dlpf] : 0.0f;
+}
+
+float imuSamplerGyroDlpfHz(uint8_t dlpf) {
+    static const float hz[] = { 196.6f, 151.8f, 119.5f, 51.2f, 23.9f, 11.6f, 5.7f, 361.4f };
+    return dlpf < sizeof(hz) / sizeof(hz[0]) ? hz[dlpf] : 0.0f;
+}
+
+ICM_20948_fss_t imuSamplerFullScale() {
+    return fullScale;
+}
+
+ImuRing& imuSamplerRing() {
+    return ring;
+}
+
+void imuSamplerSetConsumerEvent(EventGroupHandle_t events, EventBits_t bit) {
+    consumerEvents = events;
+    consumerBit = bit;
+}
+
+void imuSamplerSetPinHook(void (*hook)()) {
+    pinHook = hook;
+}
+
+bool imuSamplerSetWakeOnMotion(uint16_t mg) {
+    if (running || mg > IMU_WOM_MAX_MG) {
+        return false;
+    }
+    womMg = mg - mg % IMU_WOM_MG_PER_LSB;
+    return true;
+}
+
+uint16_t imuSamplerWakeOnMotion() {
+    return womMg;
+}
+
+bool imuSamplerWomActive() {
+    return running && womArmed;
+}
+
+uint32_t imuSamplerWomEvents() {
+    return womEvents;
+}
+
+void imuSamplerGetStats(ImuSamplerStats& out) {
+    out.samples = sampleCount;
+    out.overruns = ring.overruns();
+    out.missedIrqs = missedIrqs;
+    out.readErrors = readErrors;
+    out.stalls = stalls;
+    out.ringDepth = ring.size();
+    out.ringHighWater = ring.highWater();
+    out.runTimeMs = running ? millis() - startMs : 0;
+    out.fifoDrains = fifoDrains;
+    out.fifoBursts = fifoBursts;
+    out.fifoOverflows = fifoOverflows;
+    out.fifoAnchored = fifoAnchored;
+    out.dmpPackets = dmpPackets;
+    out.dmpErrors = dmpErrors;
+    out.womEvents = womEvents;
+}
@@ -0,0 +1,116 @@
+/*
+ * ICM-20948 SPI transport - see imu_spi.h
+ */
+
+#include "imu_spi.h"
+#include <SPI.h>
+#include <driver/spi_master.h>
+#include <esp_attr.h>
+
+#define IMU_SPI_READ    0x80    // R/W bit of the address byte
+
+static spi_device_handle_t device = nullptr;
+static SemaphoreHandle_t lock = nullptr;
+static StaticSemaphore_t lockState;
+WORD_ALIGNED_ATTR DMA_ATTR static uint8_t dmaBuf[IMU_SPI_MAX_TRANSFER];
+
+static volatile uint32_t transfers = 0;
+static volatile uint32_t dmaTransfers = 0;
+static volatile uint32_t bytes = 0;
+static volatile uint32_t errors = 0;
+
+static ICM_20948_Status_e transfer(uint8_t reg, uint8_t* data, uint32_t len, bool write) {
+    if (len > IMU_SPI_MAX_TRANSFER) {
+        return ICM_20948_Stat_ParamErr;
+    }
+    spi_transaction_t t = {};
+    t.cmd = write ? (reg & ~IMU_SPI_READ) : (reg | IMU_SPI_READ);
+    t.length = len * 8;
+    if (write) {
+        t.tx_buffer = dmaBuf;
+    } else {
+        t.rxlength = len * 8;
+        t.rx_buffer = dmaBuf;
+    }
+
+    // The library is called from the sampler and from loop(); one device
+    // handle must not run two transactions at once
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (write) {
+        memcpy(dmaBuf, data, len);
+    }
+    bool dma = len > IMU_SPI_POLL_BYTES;
+    esp_err_t err = dma ? spi_device_transmit(device, &t) : spi_device_polling_transmit(device, &t);
+    if (err == ESP_OK && !write) {
+        memcpy(data, dmaBuf, len);
+    }
+    xSemaphoreGive(lock);
+
+    transfers++;
+    if (dma) {
+        dmaTransfers++;
+    }
+    if (err != ESP_OK) {
+        errors++;
+        return ICM_20948_Stat_Err;
+    }
+    bytes += len;
+    return ICM_20948_Stat_Ok;
+}
+
+static ICM_20948_Status_e serifWrite(uint8_t reg, uint8_t* data, uint32_t len, void* user) {
+    return transfer(reg, data, len, true);
+}
+
+static ICM_20948_Status_e serifRead(uint8_t reg, uint8_t* data, uint32_t len, void* user) {
+    return transfer(reg, data, len, false);
+}
+
+bool imuSpiAttach(ICM_20948_SPI& dev) {
+    if (device) {
+        return true;
+    }
+    // Arduino SPI drives the same controller without the IDF driver
+    SPI.end();
+
+    spi_bus_config_t bus = {};
+    bus.mosi_io_num = IMU_SPI_MOSI;
+    bus.miso_io_num = IMU_SPI_MISO;
+    bus.sclk_io_num = IMU_SPI_SCK;
+    bus.quadwp_io_num = -1;
+    bus.quadhd_io_num = -1;
+    bus.max_transfer_sz = IMU_SPI_MAX_TRANSFER;
+    if (spi_bus_initialize(SPI2_HOST, &bus, SPI_DMA_CH_AUTO) != ESP_OK) {
+        return false;
+    }
+
+    spi_device_interface_config_t cfg = {};
+    cfg.command_bits = 8;           // the register address byte
+    cfg.mode = 0;
+    cfg.clock_speed_hz = IMU_SPI_CLOCK_HZ;
+    cfg.spics_io_num = IMU_SPI_CS;
+    cfg.queue_size = 1;
+    if (spi_bus_add_device(SPI2_HOST, &cfg, &device) != ESP_OK) {
+        spi_bus_free(SPI2_HOST);
+        return false;
+    }
+    lock = xSemaphoreCreateMutexStatic(&lockState);
+
+    // The library keeps a pointer to dev._serif, so replacing its
+    // functions redirects every later access
+    dev._serif.write = serifWrite;
+    dev._serif.read = serifRead;
+    dev._serif.user = nullptr;
+    return true;
+}
+
+bool imuSpiAttached() {
+    return device != nullptr;
+}
+
+void imuSpiGetStats(ImuSpiStats& out) {
+    out.transfers = transfers;
+    out.dmaTransfers = dmaTransfers;
+    out.bytes = bytes;
+    out.errors = errors;
+}
@@ -12,19 +12,43 @@
  */
 
 #include <Arduino.h>
-#include <BLEDevice.h>
-#include <BLEServer.h>
-#include <BLEUtils.h>
-#include <BLE2902.h>
 #include <ICM_20948.h>
 #include <Wire.h>
+#include <SPI.h>
+#include <freertos/event_groups.h>
+#include <freertos/timers.h>
+#include <esp_timer.h>
+#include <IPAddress.h>
+#include "imu_sampler.h"
+#include "ble_gatt.h"
+#include "ble_stream.h"
+#include "stream_packet.h"
+#include "usb_stream.h"
+#include "cmd_dispatch.h"
+#include "ble_command.h"
+#include "i2c_scanner.h"
+#include "i2c_bus.h"
+#include "imu_spi.h"
+#include "power.h"
+#include "perf.h"
+#include "bench.h"
+#include "comms.h"
+#include "capture.h"
+#include "flash_log.h"
+#include "boot.h"
+#include "clock_sync.h"
+#include "spectral.h"
+#include "console.h"
+#include "wifi_udp.h"
+#include "wifi_stream.h"
+#include "settings.h"
 
-// BLE Configuration
-#define SERVICE_UUID        "12345678-1234-1234-1234-123456789abc"
-#define CHARACTERISTIC_UUID "87654321-4321-4321-4321-cba987654321"
-
-// ICM20948 Sensor
+// ICM20948 Sensor, on I2C or (IMU_USE_SPI) on the SPI pins, see imu_spi.h
+#if IMU_USE_SPI
+ICM_20948_SPI icm;
+#else
 ICM_20948_I2C icm;
+#endif
 bool icmAvailable = false;
 
 // I2C Pins for XIAO ESP32S3
@@ -33,368 +57,2198 @@ bool icmAvailable = false;
 #define I2C_SCL 6  // Try GPIO6
 #define AD0_VAL 0  // I2C address bit (0 or 1) - sensor detected at 0x68
 
-BLEServer* pServer = nullptr;
-BLECharacteristic* pCharacteristic = nullptr;
-bool bleConnected = false;
+// Scheduler events. loop() sleeps until one of these is set instead of
+// polling on a fixed delay.
+#define EVT_USB_RX          (1 << 0)    // bytes arrived on USB Serial
+#define EVT_BLE_COMMAND     (1 << 1)    // a BLE write was queued
+#define EVT_STATUS          (1 << 2)    // periodic status timer expired
+#define EVT_BENCH_DONE      (1 << 3)    // the comms pipeline finished a benchmark run
+#define EVT_WIFI_COMMAND    (1 << 4)    // a UDP command datagram was queued
+#define EVT_ALL             (EVT_USB_RX | EVT_BLE_COMMAND | EVT_STATUS | EVT_BENCH_DONE | EVT_WIFI_COMMAND)
+
+#define STATUS_PERIOD_MS    30000
+#define USB_POLL_MS         10      // only used when the CDC driver has no RX event
+#define BANNER_POLL_MS      250     // FAST_BOOT: look for a USB host this often until one listens
+
+EventGroupHandle_t schedulerEvents = nullptr;
+StaticEventGroup_t schedulerEventsState;
+TimerHandle_t statusTimer = nullptr;
+StaticTimer_t statusTimerState;
 
 // Test counters
-unsigned long lastStatusUpdate = 0;
 unsigned long testCounter = 0;
 unsigned long usbMessageCount = 0;
 unsigned long bleMessageCount = 0;
 
+// USB command line assembly; bytes are consumed as they arrive
+CmdLineBuffer usbLine;
+
 // Forward declarations
 void showBLEStatus();
+void printBleInfo();
 
-// BLE Server Callbacks
-class MyServerCallbacks: public BLEServerCallbacks {
-    void onConnect(BLEServer* pServer) {
-        bleConnected = true;
-        Serial.println("[BLE] Client connected");
-    };
+// BLE hooks, called on the host task after ble_stream.h has updated its
+// client table. ble_gatt.cpp restarts advertising itself.
+void onBleConnect(int client) {
+    logInfo("[BLE] Client %d connected (%d of %d)\n", client, bleStreamClientCount(), BLE_MAX_CLIENTS);
+    powerOnConnect();
+}
+
+void onBleDisconnect() {
+    logInfo("[BLE] Client disconnected (%d still connected)\n", bleStreamClientCount());
+}
 
-    void onDisconnect(BLEServer* pServer) {
-        bleConnected = false;
-        Serial.println("[BLE] Client disconnected");
-        // Restart advertising
-        BLEDevice::startAdvertising();
+void onBleCommand(const uint8_t* data, size_t len, int client) {
+    // Queue the bytes for the scheduler and return right away so
+    // connection events keep being serviced.
+    bleMessageCount++;
+    if (!bleCommandEnqueue(data, len, client)) {
+        logWarn("[BLE] Command queue full - write dropped\n");
     }
-};
+}
 
 // Forward declarations
-String processCommand(String input, bool isBLE);
+void processCommand(CmdSpan input, bool isBLE, CmdReply& reply);
 
-// BLE Characteristic Callbacks
-class MyCallbacks: public BLECharacteristicCallbacks {
-    void onWrite(BLECharacteristic *pChar) {
-        std::string rxValue = pChar->getValue();
-        bleMessageCount++;
-        
-        if (rxValue.length() > 0) {
-            String input = String(rxValue.c_str());
-            input.trim();
-            
-            Serial.print("[BLE] Received: ");
-            Serial.println(input);
-            
-            // Process the command
-            String response = processCommand(input, true);
-            
-            // Send response back via BLE
-            if (response.length() > 0) {
-                pChar->setValue(response.c_str());
-                pChar->notify();
-            }
-        }
-    }
-};
+void handleBleCommand(CmdSpan input, CmdReply& reply) {
+    processCommand(input, true, reply);
+}
 
 
 
 void setupBLE() {
-    Serial.println("[Setup] Initializing BLE...");
-    
-    BLEDevice::init("XIAO-ESP32S3-Test");
-    pServer = BLEDevice::createServer();
-    pServer->setCallbacks(new MyServerCallbacks());
+    logInfo("[Setup] Initializing BLE...\n");
 
-    BLEService *pService = pServer->createService(SERVICE_UUID);
-    
-    pCharacteristic = pService->createCharacteristic(
-                        CHARACTERISTIC_UUID,
-                        BLECharacteristic::PROPERTY_READ |
-                        BLECharacteristic::PROPERTY_WRITE |
-                        BLECharacteristic::PROPERTY_NOTIFY
-                    );
-
-    pCharacteristic->setCallbacks(new MyCallbacks());
-    pCharacteristic->addDescriptor(new BLE2902());
-    pCharacteristic->setValue("Hello from XIAO ESP32S3!");
-    
-    pService->start();
-    
-    // Start the BLE server
-    pServer->getAdvertising()->start();
-    
-    // Configure advertising for better visibility
-    BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
-    pAdvertising->addServiceUUID(SERVICE_UUID);
-    pAdvertising->setScanResponse(true);
-    pAdvertising->setMinPreferred(0x06);  // Help with iPhone connections
-    pAdvertising->setMaxPreferred(0x12);
-    
-    // Set device as connectable and discoverable
-    BLEDevice::startAdvertising();
-    
-    Serial.println("[BLE] Server started, advertising as 'XIAO-ESP32S3-Test'");
-    Serial.println("[BLE] Service UUID: " + String(SERVICE_UUID));
-    Serial.println("[BLE] Characteristic UUID: " + String(CHARACTERISTIC_UUID));
-    Serial.println("[BLE] ✓ Advertising is ACTIVE");
-    Serial.println("[BLE] ✓ Device is DISCOVERABLE");
-    Serial.println("[BLE] Look for 'XIAO-ESP32S3-Test' in BLE scanners");
-    Serial.println("[BLE] Type 'b' to check advertising status anytime");
+    if (!bleCommandBegin(handleBleCommand, schedulerEvents, EVT_BLE_COMMAND)) {
+        logError("[BLE] ✗ Command queue could not be created\n");
+    }
+
+    // Service, characteristics and advertising payloads come from the
+    // static table in ble_gatt.h; advertising starts once at the end
+    clockSyncBegin();
+    BleGattHooks hooks = { onBleConnect, onBleDisconnect, onBleCommand, perfEncode, clockSyncHandle };
+    if (!bleGattBegin(hooks)) {
+        logError("[BLE] ✗ GATT service could not be created\n");
+        return;
+    }
+    bootMark(BOOT_MARK_ADVERTISING);
+
+    logInfo("[BLE] Server started, advertising as '" BLE_DEVICE_NAME "'\n");
+    if (!FAST_BOOT) {
+        printBleInfo();
+    }
+}
+
+// BLE identifiers and hints; part of the deferred banner with FAST_BOOT
+void printBleInfo() {
+    consolePrintln("[BLE] Service UUID: " SERVICE_UUID);
+    consolePrintln("[BLE] Characteristic UUID: " CHARACTERISTIC_UUID);
+    consolePrintln("[BLE] Stream UUID: " STREAM_CHARACTERISTIC_UUID);
+    consolePrintln("[BLE] Perf UUID: " PERF_CHARACTERISTIC_UUID);
+    consolePrintln("[BLE] ✓ Advertising is ACTIVE");
+    consolePrintln("[BLE] ✓ Device is DISCOVERABLE");
+    consolePrintln("[BLE] Look for '" BLE_DEVICE_NAME "' in BLE scanners");
+    consolePrintln("[BLE] Type 'b' to check advertising status anytime");
 }
 
 
 
 void printMenu() {
-    Serial.println("\n=== XIAO ESP32S3 Communication Test ===");
-    Serial.println("Commands:");
-    Serial.println("  h - Show this help menu");
-    Serial.println("  s - Show connection status");
-    Serial.println("  t - Send test message to all connected devices");
-    Serial.println("  r - Restart BLE advertising");
-    Serial.println("  c - Show message counters");
-    Serial.println("  m - Show memory info");
-    Serial.println("  b - Show BLE advertising status");
-    Serial.println("  i - Show ICM20948 sensor data (IMU)");
-    Serial.println("  scan - Scan I2C bus for devices");
-    Serial.println("  Any other text will be echoed back");
-    Serial.println("=========================================\n");
+    consolePrintln("\n=== XIAO ESP32S3 Communication Test ===");
+    consolePrintln("Commands:");
+    consolePrintln("  h - Show this help menu");
+    consolePrintln("  s - Show connection status");
+    consolePrintln("  t - Send test message to all connected devices");
+    consolePrintln("  t <bytes> - Send a test message padded to this size");
+    consolePrintln("  r - Restart BLE advertising");
+    consolePrintln("  c - Show message counters");
+    consolePrintln("  m - Show memory info");
+    consolePrintln("  b - Show BLE advertising status");
+    consolePrintln("  i - Show ICM20948 sensor data (IMU)");
+    consolePrintln("  scan - Scan I2C bus for devices (runs in the background)");
+    consolePrintln("  scan fast - Scan without the 5 ms gap between probes");
+    consolePrintln("  i2c - Show I2C bus task stats");
+    consolePrintln("  i2c clock <khz> - Set the I2C clock, up to 1000 kHz (Fast-mode Plus) if the wiring allows");
+    consolePrintln("  sample start - Start interrupt-driven IMU sampling");
+    consolePrintln("  sample stop  - Stop IMU sampling");
+    consolePrintln("  sample stats - Show sampler rate, ring depth and overruns");
+    consolePrintln("  sample mode reg|fifo - Per-sample interrupt reads or FIFO burst reads");
+    consolePrintln("  sample mode dmp6|dmp9 - On-chip DMP quaternions (6-axis or 9-axis)");
+    consolePrintln("  sample rate <hz> - Accel/gyro rate, 5-1125 Hz (reg and fifo modes, applied while running)");
+    consolePrintln("  sample range 2|4|8|16 250|500|1000|2000 - Accel (g) and gyro (dps) full scale");
+    consolePrintln("  sample dlpf <accel hz> <gyro hz> - Low-pass bandwidths (nearest setting)");
+    consolePrintln("  dmp rate <hz> - Set DMP quaternion rate (1-55 Hz)");
+    consolePrintln("  bstream on   - Stream binary IMU samples over BLE notifications");
+    consolePrintln("  (bstream and 'dsp ble' from a BLE client set its own stream; from USB, all clients)");
+    consolePrintln("  bstream off  - Stop BLE streaming");
+    consolePrintln("  bstream delta on|off - Delta/varint compress BLE stream records");
+    consolePrintln("  bstream stats - Show BLE stream throughput and link parameters");
+    consolePrintln("  ustream on   - Stream framed binary IMU samples over USB");
+    consolePrintln("  ustream off  - Stop USB streaming");
+    consolePrintln("  ustream delta on|off - Delta/varint compress USB stream records");
+    consolePrintln("  ustream stats - Show USB stream throughput");
+    consolePrintln("  wifi - Show Wi-Fi state, wifi join <ssid> [password] - Join a network (UDP port 5005)");
+    consolePrintln("  wifi on|off - Rejoin the last network / turn the station off");
+    consolePrintln("  wifi coex wifi|ble|balance - Radio coexistence preference, wifi ps min|max - Modem sleep");
+    consolePrintln("  wstream on [<ip> [port]] - Stream binary IMU samples over UDP (default: to the UDP sender)");
+    consolePrintln("  wstream off|stats|delta on|off - Stop / show throughput / delta compress");
+    consolePrintln("  power - Show power profile and modelled energy use");
+    consolePrintln("  power throughput|balanced|low - Select power profile");
+    consolePrintln("  power reset - Restart the energy counters");
+    consolePrintln("  cfg - Show live and saved settings, cfg save - Keep the live ones for every boot");
+    consolePrintln("  cfg load - Apply the saved settings, cfg reset - Erase them (defaults from next boot)");
+    consolePrintln("  cfg format raw|delta - Record coding of every stream");
+    consolePrintln("  perf - Show latency histograms, stack and CPU use per task");
+    consolePrintln("  perf reset - Clear the latency histograms");
+    consolePrintln("  log - Console output: messages, drops, waits for the host; log level error|warn|info|debug");
+    consolePrintln("  boot - Show reset reason and startup timing (time to advertise, first sample)");
+    consolePrintln("  bench ble|usb [bytes] [seconds] - Run a throughput benchmark");
+    consolePrintln("  bench - Show the benchmark result, bench stop - End a run");
+    consolePrintln("  ping <text> - Reply 'pong <text>' at once, for round-trip timing");
+    consolePrintln("  sync - Show node ID, clock sync exchanges and the host's offset/drift estimate");
+    consolePrintln("  dsp - Show the per-stream filter and decimation setup");
+    consolePrintln("  dsp ble|usb|log|wifi <decim> [last|mean|min|max] [iir|fir <hz> [taps]] - Set one up");
+    consolePrintln("  dsp ble|usb|log|wifi off - Pass every raw sample");
+    consolePrintln("  trig - Show the stream trigger, trig on|off - Send only windows around events");
+    consolePrintln("  trig level <mg> [dps] - Accel deviation from 1 g / gyro rate threshold (0 = off)");
+    consolePrintln("  trig rms <mg> [ms] - Accel RMS over a window threshold (0 = off)");
+    consolePrintln("  trig motion <mg> - Wake-on-motion, sample-to-sample accel change (0 = off)");
+    consolePrintln("  trig window <pre ms> <post ms> - History sent before and time kept after an event");
+    consolePrintln("  spec on [usb] - Send accel RMS, peak and octave band levels instead of samples");
+    consolePrintln("  spec off, spec - Stop / show the last features, spec avg <n> - Average n windows per packet");
+    consolePrintln("  cap start [seconds] - Record raw samples into PSRAM (0 = until cap stop)");
+    consolePrintln("  cap stop - End the recording, cap status - Show what is held");
+    consolePrintln("  cap get [first] [count] - Download records over this link, resumable by index");
+    consolePrintln("  cap get stop - Abort a download, cap free - Release the PSRAM buffer");
+    consolePrintln("  flog on|off - Log samples (after 'dsp log') to the LittleFS partition");
+    consolePrintln("  flog - Show logger state, flog list - Show segments by boot and time");
+    consolePrintln("  flog load <from ms> <to ms> [boot] - Copy a time window into the capture buffer");
+    consolePrintln("  flog erase - Delete all log segments");
+    consolePrintln("  Any other text will be echoed back");
+    consolePrintln("=========================================\n");
 }
 
 void showStatus() {
-    Serial.println("\n=== Connection Status ===");
-    Serial.println("USB Serial: Connected (you're reading this!)");
-    Serial.println("BLE: " + String(bleConnected ? "Connected" : "Advertising"));
-    Serial.println("Uptime: " + String(millis() / 1000) + " seconds");
-    Serial.println("Free heap: " + String(ESP.getFreeHeap()) + " bytes");
-    Serial.println("========================\n");
+    consolePrintln("\n=== Connection Status ===");
+    consolePrintln("USB Serial: Connected (you're reading this!)");
+    consolePrintf("BLE: %d of %d clients connected%s\n", bleStreamClientCount(), BLE_MAX_CLIENTS,
+                  bleStreamClientCount() < BLE_MAX_CLIENTS ? ", advertising" : "");
+    consolePrintf("Uptime: %lu seconds\n", millis() / 1000);
+    consolePrintf("Free heap: %lu bytes\n", (unsigned long)ESP.getFreeHeap());
+    consolePrintln("========================\n");
 }
 
-void sendTestMessage() {
+// Sends the numbered test message to every connected client; size > 0 pads
+// each BLE notification with '.' to that many bytes (up to that client's
+// MTU) for quick payload-size checks.
+void sendTestMessage(size_t size = 0) {
     testCounter++;
-    String message = "Test message #" + String(testCounter) + " from XIAO ESP32S3";
+    char message[64];
+    snprintf(message, sizeof(message), "Test message #%lu from XIAO ESP32S3", testCounter);
     
-    Serial.println("[USB] Sending: " + message);
+    consolePrintf("[USB] Sending: %s\n", message);
     
-    if (bleConnected && pCharacteristic) {
-        String bleMessage = "[BLE] " + message;
-        pCharacteristic->setValue(bleMessage.c_str());
-        pCharacteristic->notify();
-        Serial.println("[BLE] Message sent");
-    } else {
-        Serial.println("[BLE] No connection - message not sent");
+    if (!bleStreamConnected()) {
+        consolePrintln("[BLE] No connection - message not sent");
+        return;
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        BleStreamStats link;
+        bleStreamGetStats(i, link);
+        if (!link.connected) {
+            continue;
+        }
+        char bleMessage[BLE_STREAM_MAX_PAYLOAD];
+        int len = snprintf(bleMessage, sizeof(bleMessage), "[BLE] %s", message);
+        size_t padded = size > link.payload ? link.payload : size;
+        if (padded > (size_t)len) {
+            memset(bleMessage + len, '.', padded - len);
+            len = padded;
+        }
+        if (bleStreamNotify(i, BLE_CHAR_COMMAND, (uint8_t*)bleMessage, len)) {
+            consolePrintf("[BLE] Message sent to client %d (%d bytes)\n", i, len);
+        } else {
+            consolePrintf("[BLE] Client %d not subscribed or busy - message not sent\n", i);
+        }
     }
 }
 
 void showCounters() {
-    Serial.println("\n=== Message Counters ===");
-    Serial.println("USB messages received: " + String(usbMessageCount));
-    Serial.println("BLE messages: " + String(bleMessageCount));
-    Serial.println("Test messages sent: " + String(testCounter));
-    Serial.println("========================\n");
+    consolePrintln("\n=== Message Counters ===");
+    consolePrintf("USB messages received: %lu\n", usbMessageCount);
+    consolePrintf("BLE messages: %lu\n", bleMessageCount);
+    consolePrintf("Test messages sent: %lu\n", testCounter);
+    consolePrintf("Dropped overlong lines: %lu\n", (unsigned long)usbLine.droppedLines());
+
+    BleCommandStats ble;
+    bleCommandGetStats(ble);
+    consolePrintf("BLE commands run: %lu (queued %lu, dropped %lu, truncated %lu)\n",
+                  (unsigned long)ble.completed, (unsigned long)ble.received,
+                  (unsigned long)ble.dropped, (unsigned long)ble.truncated);
+    consolePrintf("BLE command queue peak: %lu / %d, worst latency: %lu ms\n",
+                  (unsigned long)ble.maxQueued, BLE_CMD_QUEUE_DEPTH,
+                  (unsigned long)(ble.maxLatencyUs / 1000));
+    consolePrintln("========================\n");
 }
 
 void showMemoryInfo() {
-    Serial.println("\n=== Memory Information ===");
-    Serial.println("Free heap: " + String(ESP.getFreeHeap()) + " bytes");
-    Serial.println("Largest free block: " + String(ESP.getMaxAllocHeap()) + " bytes");
-    Serial.println("Total heap size: " + String(ESP.getHeapSize()) + " bytes");
-    Serial.println("Free PSRAM: " + String(ESP.getFreePsram()) + " bytes");
-    Serial.println("==========================\n");
-}
-
-void scanI2C() {
-    Serial.println("\n=== I2C Device Scanner ===");
-    byte error, address;
-    int deviceCount = 0;
-    
-    Serial.println("Scanning I2C bus...");
-    Serial.print("SDA=GPIO"); Serial.print(I2C_SDA);
-    Serial.print(", SCL=GPIO"); Serial.println(I2C_SCL);
-    Serial.println("Check: SCL should be at 3.3V when idle!");
-    Serial.print("Scanning addresses 0x01 to 0x7F... ");
-    Serial.flush();
-    
-    for(address = 1; address < 127; address++) {
-        // Print progress every 16 addresses
-        if (address % 16 == 0) {
-            Serial.print(".");
-            Serial.flush();
+    consolePrintln("\n=== Memory Information ===");
+    consolePrintf("Free heap: %lu bytes\n", (unsigned long)ESP.getFreeHeap());
+    consolePrintf("Largest free block: %lu bytes\n", (unsigned long)ESP.getMaxAllocHeap());
+    consolePrintf("Minimum free heap: %lu bytes\n", (unsigned long)ESP.getMinFreeHeap());
+    consolePrintf("Total heap size: %lu bytes\n", (unsigned long)ESP.getHeapSize());
+    consolePrintf("Free PSRAM: %lu bytes\n", (unsigned long)ESP.getFreePsram());
+    consolePrintln("==========================\n");
+}
+
+void showPowerStats() {
+    PowerStats st;
+    powerGetStats(st);
+
+    consolePrintln("\n=== Power ===");
+    consolePrintf("Profile: %s\n", powerProfileName(st.profile));
+    consolePrintf("CPU: %lu MHz, DFS: %s, light sleep: %s\n", (unsigned long)st.cpuMhz,
+                  st.dfsActive ? "on" : "off", st.lightSleepActive ? "on" : "off");
+    consolePrintf("Scheduler busy: %.2f%%\n", st.busyPercent);
+    consolePrintf("Modelled current: %.2f mA (last %us: %.2f mA)\n", st.avgMa,
+                  POWER_WINDOW_MS / 1000, st.windowMa);
+    consolePrintf("Modelled charge: %.4f mAh over %lu s (%.4f mWh)\n", st.totalMah,
+                  (unsigned long)(st.elapsedMs / 1000), st.totalMwh);
+    consolePrintf("  CPU %.4f, radio %.4f, IMU %.4f mAh\n", st.cpuMah, st.radioMah, st.imuMah);
+    consolePrintln("=============\n");
+}
+
+bool startI2CScan(bool fast) {
+    if (!i2cScanStart(Wire, fast)) {
+        return false;
+    }
+    consolePrintln("\n=== I2C Device Scanner ===");
+    consolePrintf("SDA=GPIO%d, SCL=GPIO%d\n", I2C_SDA, I2C_SCL);
+    consolePrintln("Check: SCL should be at 3.3V when idle!");
+    consolePrintf("Scanning addresses 0x%02X to 0x%02X%s...\n", I2C_SCAN_FIRST_ADDR, I2C_SCAN_LAST_ADDR,
+                  fast ? " (fast)" : "");
+    return true;
+}
+
+void showSampledIMUData() {
+    ImuSample s;
+    commsLatestSample(s);
+    ICM_20948_fss_t fss = imuSamplerFullScale();
+
+    consolePrintln("\n=== ICM20948 Sensor Data (sampler) ===");
+    consolePrintf("Timestamp: %lu us\n", (unsigned long)s.timestampUs);
+
+    if (s.kind != IMU_SAMPLE_AGMT) {
+        float q1 = imuQuatComponent(s.quat.q[0]);
+        float q2 = imuQuatComponent(s.quat.q[1]);
+        float q3 = imuQuatComponent(s.quat.q[2]);
+        float sq = 1.0f - (q1 * q1 + q2 * q2 + q3 * q3);
+        float q0 = sq > 0.0f ? sqrtf(sq) : 0.0f;
+
+        consolePrintf("Quaternion (%s):\n", s.kind == IMU_SAMPLE_QUAT9 ? "9-axis" : "6-axis");
+        consolePrintf("  W: %.4f  X: %.4f  Y: %.4f  Z: %.4f\n", q0, q1, q2, q3);
+        if (s.kind == IMU_SAMPLE_QUAT9) {
+            consolePrintf("Heading accuracy: %d\n", s.quat.accuracy);
         }
-        
-        Wire.beginTransmission(address);
-        error = Wire.endTransmission(true);  // Send stop bit
-        
-        if (error == 0) {
-            Serial.println();  // New line after progress dots
-            Serial.print("Device found at 0x");
-            if (address < 16) Serial.print("0");
-            Serial.print(address, HEX);
-            Serial.print(" (");
-            Serial.print(address);
-            Serial.println(")");
-            deviceCount++;
+        consolePrintln("======================================\n");
+        return;
+    }
+
+    consolePrintln("Accelerometer (mg):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", imuAccelMg(s.acc[0], fss.a), imuAccelMg(s.acc[1], fss.a),
+                  imuAccelMg(s.acc[2], fss.a));
+
+    consolePrintln("Gyroscope (DPS):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", imuGyroDps(s.gyr[0], fss.g), imuGyroDps(s.gyr[1], fss.g),
+                  imuGyroDps(s.gyr[2], fss.g));
+
+    consolePrintln("Magnetometer (µT):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", imuMagUt(s.mag[0]), imuMagUt(s.mag[1]), imuMagUt(s.mag[2]));
+
+    consolePrintf("Temperature: %.2f °C\n", imuTempC(s.tmp));
+
+    consolePrintln("======================================\n");
+}
+
+// Full-scale codes of the sensor, in register order
+static const uint16_t accelRangesG[] = { 2, 4, 8, 16 };
+static const uint16_t gyroRangesDps[] = { 250, 500, 1000, 2000 };
+
+void printSensorConfig(const ImuSensorConfig& cfg) {
+    consolePrintf("Sensor: %.1f Hz (divider %u), +-%u g, +-%u dps\n",
+                  (float)IMU_BASE_RATE_HZ / (1 + cfg.rateDivider), cfg.rateDivider, accelRangesG[cfg.accelFs & 3],
+                  gyroRangesDps[cfg.gyroFs & 3]);
+    consolePrintf("DLPF: accel %.1f Hz, gyro %.1f Hz\n", imuSamplerAccelDlpfHz(cfg.accelDlpf),
+                  imuSamplerGyroDlpfHz(cfg.gyroDlpf));
+}
+
+void showSamplerStats() {
+    ImuSamplerStats st;
+    imuSamplerGetStats(st);
+
+    consolePrintln("\n=== IMU Sampler ===");
+    consolePrintf("State: %s, mode: %s\n", imuSamplerRunning() ? "Running" : "Stopped",
+                  imuSamplerModeName(imuSamplerMode()));
+    consolePrintf("Samples: %lu (consumed %lu)\n", (unsigned long)st.samples,
+                  (unsigned long)commsSamplesConsumed());
+    if (st.runTimeMs > 0) {
+        consolePrintf("Rate: %.1f Hz\n", st.samples * 1000.0f / st.runTimeMs);
+    }
+    if (imuSamplerMode() == IMU_ACQ_REGISTER || imuSamplerMode() == IMU_ACQ_FIFO) {
+        printSensorConfig(imuSamplerSensorConfig());
+    }
+    consolePrintf("Ring depth: %lu / %d (high water %lu)\n", (unsigned long)st.ringDepth,
+                  IMU_RING_SIZE, (unsigned long)st.ringHighWater);
+    consolePrintf("Overruns: %lu\n", (unsigned long)st.overruns);
+    consolePrintf("Missed interrupts: %lu\n", (unsigned long)st.missedIrqs);
+    consolePrintf("Read errors: %lu\n", (unsigned long)st.readErrors);
+    consolePrintf("Stalls: %lu\n", (unsigned long)st.stalls);
+#if IMU_USE_SPI
+    ImuSpiStats spi;
+    imuSpiGetStats(spi);
+    consolePrintf("Transport: SPI %d MHz, %lu transfers (%lu DMA), %lu bytes, %lu errors\n",
+                  IMU_SPI_CLOCK_HZ / 1000000, (unsigned long)spi.transfers, (unsigned long)spi.dmaTransfers,
+                  (unsigned long)spi.bytes, (unsigned long)spi.errors);
+#else
+    consolePrintln("Transport: I2C (see 'i2c')");
+#endif
+    if (imuSamplerMode() == IMU_ACQ_FIFO) {
+        consolePrintf("FIFO drains: %lu, bursts: %lu\n", (unsigned long)st.fifoDrains, (unsigned long)st.fifoBursts);
+        if (st.fifoBursts > 0) {
+            consolePrintf("Samples per burst: %.2f\n", (float)st.samples / st.fifoBursts);
         }
-        
-        delay(5);  // Small delay between scans
+        consolePrintf("FIFO overflows: %lu\n", (unsigned long)st.fifoOverflows);
+        consolePrintf("Drains timed from data-ready: %lu of %lu\n", (unsigned long)st.fifoAnchored,
+                      (unsigned long)st.fifoDrains);
+    } else if (imuSamplerMode() != IMU_ACQ_REGISTER) {
+        consolePrintf("DMP rate: %lu Hz\n", (unsigned long)imuSamplerDmpRate());
+        consolePrintf("DMP drains: %lu, packets: %lu, errors: %lu\n", (unsigned long)st.fifoDrains,
+                      (unsigned long)st.dmpPackets, (unsigned long)st.dmpErrors);
     }
-    
-    Serial.println(" Done!");
-    
-    if (deviceCount == 0) {
-        Serial.println("No I2C devices found!");
-        Serial.println("Check:");
-        Serial.println("  - Wiring connections");
-        Serial.println("  - Pull-up resistors (may be needed)");
-        Serial.println("  - Power supply (3.3V)");
-    } else {
-        Serial.print("Found ");
-        Serial.print(deviceCount);
-        Serial.println(" device(s)");
+    if (imuSamplerWomActive()) {
+        consolePrintf("Wake-on-motion: %u mg, %lu events\n", imuSamplerWakeOnMotion(),
+                      (unsigned long)st.womEvents);
+    }
+    consolePrintln("===================\n");
+}
+
+void showI2cStats() {
+    I2cBusStats st;
+    i2cBusGetStats(st);
+
+    consolePrintln("\n=== I2C Bus ===");
+    consolePrintf("Clock: %lu kHz\n", (unsigned long)(st.clockHz / 1000));
+    consolePrintf("Transactions: %lu (%lu bytes)\n", (unsigned long)st.transactions, (unsigned long)st.bytes);
+    consolePrintf("Errors: %lu, rejected submits: %lu\n", (unsigned long)st.errors, (unsigned long)st.rejected);
+    consolePrintf("Time in driver: %lu ms, queue peak: %lu / %d\n", (unsigned long)(st.busyUs / 1000),
+                  (unsigned long)st.maxQueued, I2C_BUS_QUEUE_DEPTH);
+    consolePrintln("===============\n");
+}
+
+void printDspConfig(const char* name, const DspConfig& cfg) {
+    consolePrintf("%s: ", name);
+    if (cfg.filter == DSP_FILTER_NONE && cfg.decimation <= 1) {
+        consolePrintln("off (raw samples)");
+        return;
+    }
+    consolePrintf("filter %s", dspFilterName(cfg.filter));
+    if (cfg.filter != DSP_FILTER_NONE) {
+        consolePrintf(" %u Hz", cfg.cutoffHz);
+    }
+    if (cfg.filter == DSP_FILTER_FIR) {
+        consolePrintf(" (%u taps)", cfg.firTaps);
+    }
+    consolePrintf(", decimate by %u (%s) -> %.1f Hz\n", cfg.decimation, dspWindowName(cfg.window),
+                  (float)commsInputRate() / cfg.decimation);
+}
+
+void showBleStreamStats() {
+    BleStreamStats clients[BLE_MAX_CLIENTS];
+    {
+        CommsLock hold;
+        for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+            bleStreamGetStats(i, clients[i]);
+        }
+    }
+
+    consolePrintln("\n=== BLE Stream ===");
+    consolePrintf("Clients: %d of %d\n", bleStreamClientCount(), BLE_MAX_CLIENTS);
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        const BleStreamStats& st = clients[i];
+        if (!st.connected) {
+            continue;
+        }
+        consolePrintf("-- Client %d: %s%s\n", i, st.enabled ? "Streaming" : "Idle",
+                      st.subscribed ? "" : " (stream not subscribed)");
+        consolePrintf("MTU: %u (payload %u bytes, %u samples/notify)\n", st.mtu, st.payload,
+                      (unsigned)streamRecordsPerPacket(st.payload));
+        if (st.recordTooLarge) {
+            consolePrintln("MTU too small for one sample record - samples dropped until the central raises it");
+        }
+        consolePrintf("LL TX octets: %u, PHY: %s\n", st.txOctets,
+                      st.txPhy == 2 ? "2M" : (st.txPhy == 1 ? "1M" : "?"));
+        if (st.connInterval) {
+            consolePrintf("Connection interval: %.2f ms\n", st.connInterval * 1.25f);
+        }
+        printDspConfig("DSP", st.dsp);
+        if (st.encoder >= 0) {
+            consolePrintf("Encoder %d, shared by %u client%s\n", st.encoder, st.sharing, st.sharing == 1 ? "" : "s");
+        }
+        consolePrintf("Packets: %lu, bytes: %lu, samples: %lu\n", (unsigned long)st.packets,
+                      (unsigned long)st.bytes, (unsigned long)st.samples);
+        consolePrintf("Coding: %s", st.delta ? "delta" : "raw");
+        if (st.samples > 0) {
+            consolePrintf(", %.1f bytes/sample", (float)st.bytes / st.samples);
+        }
+        consolePrintln();
+        consolePrintf("Dropped samples: %lu\n", (unsigned long)st.droppedSamples);
+        consolePrintf("Failed notifies: %lu, congestion events: %lu\n", (unsigned long)st.failedNotifies,
+                      (unsigned long)st.congestion);
+    }
+    consolePrintln("==================\n");
+}
+
+void showUsbStreamStats() {
+    UsbStreamStats st;
+    usbStreamGetStats(st);
+
+    consolePrintln("\n=== USB Stream ===");
+    consolePrintf("State: %s\n", usbStreamEnabled() ? "Streaming" : "Idle");
+    consolePrintf("Frames: %lu, bytes: %lu, writes: %lu\n", (unsigned long)st.frames,
+                  (unsigned long)st.bytes, (unsigned long)st.writes);
+    if (st.writes > 0) {
+        consolePrintf("Average write: %lu bytes\n", (unsigned long)(st.bytes / st.writes));
+    }
+    consolePrintf("Samples: %lu\n", (unsigned long)st.samples);
+    consolePrintf("Coding: %s", st.delta ? "delta" : "raw");
+    if (st.samples > 0) {
+        consolePrintf(", %.1f bytes/sample", (float)st.bytes / st.samples);
+    }
+    consolePrintln();
+    consolePrintf("Dropped frames: %lu (%lu samples)\n", (unsigned long)st.droppedFrames,
+                  (unsigned long)st.droppedSamples);
+    consolePrintln("==================\n");
+}
+
+// BLE client a per-client command acts on: the writer of a BLE command,
+// the first connected client for a USB one. -1 if there is none.
+int commandClient(bool isBLE) {
+    if (isBLE) {
+        return bleCommandClient();
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (bleStreamClientConnected(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// "delta on|off" argument of bstream/ustream: 1, 0, or -1 if malformed
+int parseDeltaArg(CmdSpan args) {
+    CmdSpan rest = args;
+    if (!cmdEquals(cmdNextWord(rest), "delta")) {
+        return -1;
     }
-    Serial.println("==========================\n");
+    if (cmdEquals(rest, "on")) {
+        return 1;
+    }
+    return cmdEquals(rest, "off") ? 0 : -1;
+}
+
+// Start resets the sample ring, so keep the comms pipeline off it meanwhile
+bool startSampler() {
+    CommsLock hold;
+    return imuSamplerStart();
 }
 
 void showIMUData() {
     if (!icmAvailable) {
-        Serial.println("[IMU] ICM20948 sensor not available");
-        Serial.println("[IMU] Run 'scan' command to check I2C devices");
+        consolePrintln("[IMU] ICM20948 sensor not available");
+        consolePrintln("[IMU] Run 'scan' command to check I2C devices");
+        return;
+    }
+
+    // While the sampler owns the sensor, show the most recent sample it
+    // produced instead of issuing a competing bus read.
+    if (imuSamplerRunning()) {
+        showSampledIMUData();
         return;
     }
 
     // Always try to read data, don't wait for dataReady()
     icm.getAGMT();
     
-    Serial.println("\n=== ICM20948 Sensor Data ===");
+    consolePrintln("\n=== ICM20948 Sensor Data ===");
     
-    Serial.println("Accelerometer (mg):");
-    Serial.print("  X: "); Serial.print(icm.accX(), 2);
-    Serial.print("  Y: "); Serial.print(icm.accY(), 2);
-    Serial.print("  Z: "); Serial.println(icm.accZ(), 2);
+    consolePrintln("Accelerometer (mg):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", icm.accX(), icm.accY(), icm.accZ());
     
-    Serial.println("Gyroscope (DPS):");
-    Serial.print("  X: "); Serial.print(icm.gyrX(), 2);
-    Serial.print("  Y: "); Serial.print(icm.gyrY(), 2);
-    Serial.print("  Z: "); Serial.println(icm.gyrZ(), 2);
+    consolePrintln("Gyroscope (DPS):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", icm.gyrX(), icm.gyrY(), icm.gyrZ());
     
-    Serial.println("Magnetometer (µT):");
-    Serial.print("  X: "); Serial.print(icm.magX(), 2);
-    Serial.print("  Y: "); Serial.print(icm.magY(), 2);
-    Serial.print("  Z: "); Serial.println(icm.magZ(), 2);
+    consolePrintln("Magnetometer (µT):");
+    consolePrintf("  X: %.2f  Y: %.2f  Z: %.2f\n", icm.magX(), icm.magY(), icm.magZ());
     
-    Serial.print("Temperature: ");
-    Serial.print(icm.temp(), 2);
-    Serial.println(" °C");
+    consolePrintf("Temperature: %.2f °C\n", icm.temp());
     
-    Serial.println("============================\n");
+    consolePrintln("============================\n");
 }
 
-String processCommand(String input, bool isBLE) {
-    String response = "";
-    
-    if (input == "h") {
-        printMenu();
-        response = "Help menu sent to USB Serial";
-    } else if (input == "s") {
-        showStatus();
-        response = "Status displayed on USB Serial";
-    } else if (input == "t") {
-        sendTestMessage();
-        response = "Test message sent";
-    } else if (input == "r") {
-        BLEDevice::startAdvertising();
-        Serial.println("[BLE] Advertising restarted");
-        response = "BLE advertising restarted";
-    } else if (input == "c") {
-        showCounters();
-        response = "Counters displayed on USB Serial";
-    } else if (input == "m") {
-        showMemoryInfo();
-        response = "Memory info displayed on USB Serial";
-    } else if (input == "i") {
-        showIMUData();
-        response = "IMU data displayed on USB Serial";
-    } else if (input == "scan") {
-        scanI2C();
-        response = "I2C scan completed";
-    } else if (input.length() > 0) {
-        response = "Echo: " + input;
+// Command handlers. Each one writes its reply into the caller's buffer;
+// console output goes through the console ring (console.h) and never
+// waits for the host.
+
+void cmdHelp(CmdSpan args, bool isBLE, CmdReply& response) {
+    printMenu();
+    response.set("Help menu sent to USB Serial");
+}
+
+void cmdStatus(CmdSpan args, bool isBLE, CmdReply& response) {
+    showStatus();
+    response.set("Status displayed on USB Serial");
+}
+
+void cmdTest(CmdSpan args, bool isBLE, CmdReply& response) {
+    long size = 0;
+    if (args.len > 0 && (!cmdParseInt(args, size) || size < 0 || size > BLE_STREAM_MAX_PAYLOAD)) {
+        response.printf("Usage: t [0-%d]", BLE_STREAM_MAX_PAYLOAD);
+        return;
+    }
+    sendTestMessage(size);
+    response.set("Test message sent");
+}
+
+void cmdRestartAdvertising(CmdSpan args, bool isBLE, CmdReply& response) {
+    bleGattAdvertise();
+    consolePrintln("[BLE] Advertising restarted");
+    response.set("BLE advertising restarted");
+}
+
+void cmdCounters(CmdSpan args, bool isBLE, CmdReply& response) {
+    showCounters();
+    response.set("Counters displayed on USB Serial");
+}
+
+void cmdMemory(CmdSpan args, bool isBLE, CmdReply& response) {
+    showMemoryInfo();
+    response.set("Memory info displayed on USB Serial");
+}
+
+void cmdImu(CmdSpan args, bool isBLE, CmdReply& response) {
+    showIMUData();
+    response.set("IMU data displayed on USB Serial");
+}
+
+void cmdScan(CmdSpan args, bool isBLE, CmdReply& response) {
+    bool fast = cmdEquals(args, "fast");
+    if (args.len > 0 && !fast) {
+        response.set("Usage: scan [fast]");
+    } else if (!startI2CScan(fast)) {
+        response.set("I2C scan already running");
+    } else {
+        response.set(fast ? "I2C fast scan started" : "I2C scan started");
+    }
+}
+
+// Bus clock changes need the sampler stopped, so no transaction is queued
+// while the controller is reconfigured. Above 400 kHz the sensor is read
+// back once, and the bus drops to 400 kHz if it does not answer. Returns
+// the clock in effect.
+uint32_t setI2cClock(uint32_t hz) {
+    Wire.setClock(hz);
+    if (!IMU_USE_SPI && hz > I2C_BUS_FAST_HZ && icmAvailable && icm.checkID() != ICM_20948_Stat_Ok) {
+        consolePrintf("[I2C] No answer at %lu kHz - back to %d kHz\n", (unsigned long)(hz / 1000),
+                      I2C_BUS_FAST_HZ / 1000);
+        hz = I2C_BUS_FAST_HZ;
+        Wire.setClock(hz);
+    }
+    i2cBusClockChanged(hz);
+    consolePrintf("[I2C] Clock: %lu kHz\n", (unsigned long)(hz / 1000));
+    return hz;
+}
+
+void cmdI2c(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan sub = cmdNextWord(args);
+    long khz;
+    if (sub.len == 0) {
+        showI2cStats();
+        response.set("I2C stats displayed on USB Serial");
+    } else if (!cmdEquals(sub, "clock") || !cmdParseInt(args, khz) || khz < I2C_BUS_STANDARD_HZ / 1000 ||
+               khz > I2C_BUS_FAST_PLUS_HZ / 1000) {
+        response.printf("Usage: i2c [clock %d-%d]", I2C_BUS_STANDARD_HZ / 1000, I2C_BUS_FAST_PLUS_HZ / 1000);
+    } else if (imuSamplerRunning()) {
+        response.set("Stop sampling before changing the I2C clock");
+    } else {
+        uint32_t hz = setI2cClock((uint32_t)khz * 1000);
+        response.printf("I2C clock %lu kHz", (unsigned long)(hz / 1000));
+    }
+}
+
+int rangeCode(const uint16_t* ranges, long value) {
+    for (int i = 0; i < 4; i++) {
+        if (ranges[i] == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// DLPF setting whose 3 dB bandwidth is closest to hz
+uint8_t nearestDlpf(float (*bandwidth)(uint8_t), long hz) {
+    uint8_t best = 0;
+    for (uint8_t code = 1; code < 8; code++) {
+        if (fabsf(bandwidth(code) - hz) < fabsf(bandwidth(best) - hz)) {
+            best = code;
+        }
+    }
+    return best;
+}
+
+// Switches the sensor setup while sampling: the sampler stops, the new
+// setup and the DSP/trigger designs for its rate go in together, and the
+// sampler restarts, so no sample is taken or filtered under a mix of old
+// and new settings. Nothing changes if a stream's DSP stage or the trigger
+// is invalid at the new rate.
+bool applySensorConfig(const ImuSensorConfig& cfg, CmdReply& response) {
+    ImuSensorConfig old = imuSamplerSensorConfig();
+    bool wasRunning = imuSamplerRunning();
+    bool ok;
+    {
+        CommsLock hold;
+        imuSamplerStop();
+        ok = imuSamplerSetSensorConfig(cfg);
+    }
+    if (!ok) {
+        response.set("Invalid sensor setup");
+    } else if (!commsSetInputRate(imuSamplerRateHz())) {
+        imuSamplerSetSensorConfig(old);
+        ok = false;
+        response.printf("A DSP stage or the trigger is invalid at %lu Hz; change it first",
+                        (unsigned long)(IMU_BASE_RATE_HZ / (1 + cfg.rateDivider)));
+    }
+    if (wasRunning && !startSampler()) {
+        response.set("Sampler restart failed");
+        return false;
+    }
+    return ok;
+}
+
+void cmdSample(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan sub = cmdNextWord(args);
+
+    if (cmdEquals(sub, "start")) {
+        if (!icmAvailable) {
+            response.set("IMU not available");
+        } else if (startSampler()) {
+            commsResetSamplesConsumed();
+            uint32_t hz = imuSamplerMode() == IMU_ACQ_DMP6 || imuSamplerMode() == IMU_ACQ_DMP9
+                              ? imuSamplerDmpRate() : imuSamplerRateHz();
+            consolePrintf("[IMU] Sampler started at %lu Hz\n", (unsigned long)hz);
+            response.set("Sampler started");
+        } else {
+            response.set("Sampler start failed");
+        }
+    } else if (cmdEquals(sub, "stop")) {
+        imuSamplerStop();
+        consolePrintln("[IMU] Sampler stopped");
+        response.set("Sampler stopped");
+    } else if (cmdEquals(sub, "stats")) {
+        showSamplerStats();
+        response.set("Sampler stats displayed on USB Serial");
+    } else if (cmdEquals(sub, "mode")) {
+        ImuAcqMode mode;
+        if (cmdEquals(args, "reg")) {
+            mode = IMU_ACQ_REGISTER;
+        } else if (cmdEquals(args, "fifo")) {
+            mode = IMU_ACQ_FIFO;
+        } else if (cmdEquals(args, "dmp6")) {
+            mode = IMU_ACQ_DMP6;
+        } else if (cmdEquals(args, "dmp9")) {
+            mode = IMU_ACQ_DMP9;
+        } else {
+            response.set("Usage: sample mode reg|fifo|dmp6|dmp9");
+            return;
+        }
+        bool wasRunning = imuSamplerRunning();
+        imuSamplerStop();
+        if (!imuSamplerSetMode(mode)) {
+            response.set("Sampler mode not supported by this build");
+            if (wasRunning) {
+                startSampler();
+            }
+        } else if (wasRunning && !startSampler()) {
+            response.set("Sampler restart failed");
+        } else {
+            consolePrintf("[IMU] Acquisition mode: %s\n", imuSamplerModeName(mode));
+            response.set("Sampler mode set");
+        }
+    } else if (cmdEquals(sub, "rate") || cmdEquals(sub, "range") || cmdEquals(sub, "dlpf")) {
+        ImuSensorConfig cfg = imuSamplerSensorConfig();
+        long a, b;
+        if (!cmdParseInt(cmdNextWord(args), a)) {
+            a = -1;
+        }
+        if (!cmdParseInt(args, b)) {
+            b = -1;
+        }
+        if (cmdEquals(sub, "rate")) {
+            if (a < 5 || a > IMU_BASE_RATE_HZ) {
+                response.printf("Usage: sample rate <5-%d>", IMU_BASE_RATE_HZ);
+                return;
+            }
+            cfg.rateDivider = imuSamplerDividerForRate(a);
+        } else if (cmdEquals(sub, "range")) {
+            if (rangeCode(accelRangesG, a) < 0 || rangeCode(gyroRangesDps, b) < 0) {
+                response.set("Usage: sample range 2|4|8|16 250|500|1000|2000");
+                return;
+            }
+            cfg.accelFs = rangeCode(accelRangesG, a);
+            cfg.gyroFs = rangeCode(gyroRangesDps, b);
+        } else {
+            if (a < 1 || b < 1) {
+                response.set("Usage: sample dlpf <accel hz> <gyro hz>");
+                return;
+            }
+            cfg.accelDlpf = nearestDlpf(imuSamplerAccelDlpfHz, a);
+            cfg.gyroDlpf = nearestDlpf(imuSamplerGyroDlpfHz, b);
+        }
+        if (applySensorConfig(cfg, response)) {
+            consolePrintln("[IMU] Sensor setup:");
+            printSensorConfig(cfg);
+            if (cmdEquals(sub, "rate")) {
+                response.printf("Sample rate %lu Hz", (unsigned long)imuSamplerRateHz());
+            } else if (cmdEquals(sub, "range")) {
+                response.printf("Range +-%u g, +-%u dps", accelRangesG[cfg.accelFs], gyroRangesDps[cfg.gyroFs]);
+            } else {
+                response.printf("DLPF accel %.1f Hz, gyro %.1f Hz", imuSamplerAccelDlpfHz(cfg.accelDlpf),
+                                imuSamplerGyroDlpfHz(cfg.gyroDlpf));
+            }
+        }
+    } else {
+        response.set("Usage: sample start|stop|stats|mode <mode>|rate <hz>|range <g> <dps>|dlpf <hz> <hz>");
+    }
+}
+
+void cmdDmp(CmdSpan args, bool isBLE, CmdReply& response) {
+    long hz = 0;
+    if (!cmdEquals(cmdNextWord(args), "rate") || !cmdParseInt(args, hz) ||
+        hz < 1 || hz > IMU_DMP_BASE_RATE_HZ) {
+        response.printf("Usage: dmp rate <1-%d>", IMU_DMP_BASE_RATE_HZ);
+    } else if (!imuSamplerSetDmpRate(hz)) {
+        response.set("Stop the sampler before changing the DMP rate");
+    } else {
+        consolePrintf("[IMU] DMP rate: %lu Hz\n", (unsigned long)imuSamplerDmpRate());
+        response.printf("DMP rate %lu Hz", (unsigned long)imuSamplerDmpRate());
+    }
+}
+
+// From a BLE client these change that client's stream only; from USB they
+// apply to every connected client.
+void cmdBleStream(CmdSpan args, bool isBLE, CmdReply& response) {
+    int client = isBLE ? bleCommandClient() : BLE_ALL_CLIENTS;
+    int delta = parseDeltaArg(args);
+    if (cmdEquals(args, "on")) {
+        if (isBLE ? !bleStreamClientConnected(client) : !bleStreamConnected()) {
+            response.set("BLE stream needs a connected client");
+        } else if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+        } else {
+            CommsLock hold;
+            bleStreamSetEnabled(client, true);
+            consolePrintf("[BLE] Binary stream enabled (%s)\n", isBLE ? "this client" : "all clients");
+            response.set("BLE stream on");
+        }
+    } else if (cmdEquals(args, "off")) {
+        CommsLock hold;
+        bleStreamSetEnabled(client, false);
+        consolePrintf("[BLE] Binary stream disabled (%s)\n", isBLE ? "this client" : "all clients");
+        response.set("BLE stream off");
+    } else if (cmdEquals(args, "stats")) {
+        showBleStreamStats();
+        response.set("BLE stream stats displayed on USB Serial");
+    } else if (delta >= 0) {
+        bool on = delta == 1;
+        CommsLock hold;
+        bleStreamSetDelta(client, on);
+        consolePrintf("[BLE] Stream coding: %s\n", on ? "delta" : "raw");
+        response.set(on ? "BLE stream delta on" : "BLE stream delta off");
+    } else {
+        response.set("Usage: bstream on|off|stats|delta on|off");
+    }
+}
+
+void cmdUsbStream(CmdSpan args, bool isBLE, CmdReply& response) {
+    int delta = parseDeltaArg(args);
+    if (cmdEquals(args, "on")) {
+        if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+        } else {
+            consolePrintln("[USB] Binary stream enabled");
+            CommsLock hold;
+            usbStreamSetEnabled(true);
+            response.set("USB stream on");
+        }
+    } else if (cmdEquals(args, "off")) {
+        CommsLock hold;
+        usbStreamSetEnabled(false);
+        consolePrintln("[USB] Binary stream disabled");
+        response.set("USB stream off");
+    } else if (cmdEquals(args, "stats")) {
+        showUsbStreamStats();
+        response.set("USB stream stats displayed on USB Serial");
+    } else if (delta >= 0) {
+        bool on = delta == 1;
+        CommsLock hold;
+        usbStreamSetDelta(on);
+        consolePrintf("[USB] Stream coding: %s\n", on ? "delta" : "raw");
+        response.set(on ? "USB stream delta on" : "USB stream delta off");
+    } else {
+        response.set("Usage: ustream on|off|stats|delta on|off");
+    }
+}
+
+// Dotted quad of an IPv4 address in network byte order
+void formatIp(uint32_t ip, char* out, size_t size) {
+    snprintf(out, size, "%u.%u.%u.%u", (unsigned)(ip & 0xFF), (unsigned)((ip >> 8) & 0xFF),
+             (unsigned)((ip >> 16) & 0xFF), (unsigned)(ip >> 24));
+}
+
+void showWifiStatus() {
+    WifiStatus st;
+    wifiGetStatus(st);
+    char ip[16];
+    formatIp(st.ip, ip, sizeof(ip));
+
+    consolePrintln("\n=== Wi-Fi ===");
+    if (st.connected) {
+        consolePrintf("State: Connected to '%s', %s, UDP port %d\n", st.ssid, ip, WIFI_UDP_PORT);
+        consolePrintf("RSSI: %d dBm, channel %u\n", st.rssi, st.channel);
+    } else {
+        consolePrintf("State: %s\n", st.started ? "Connecting" : "Off");
+    }
+    consolePrintf("Coexistence: %s, modem sleep: %s\n", wifiCoexName(st.coex), st.maxPowerSave ? "max" : "min");
+    consolePrintf("Commands: %lu, dropped: %lu\n", (unsigned long)st.commands, (unsigned long)st.commandsDropped);
+    consolePrintf("Datagrams sent: %lu, send errors: %lu, queue full: %lu\n", (unsigned long)st.sent,
+                  (unsigned long)st.sendErrors, (unsigned long)st.queueFull);
+    consolePrintln("=============\n");
+}
+
+void handleWifiCommand(CmdSpan input, CmdReply& reply) {
+    processCommand(input, false, reply);
+}
+
+void cmdWifi(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showWifiStatus();
+        WifiStatus st;
+        wifiGetStatus(st);
+        char ip[16];
+        formatIp(st.ip, ip, sizeof(ip));
+        response.printf("WiFi %s", st.connected ? ip : st.started ? "connecting" : "off");
+    } else if (cmdEquals(word, "join")) {
+        // SSID is one word; the rest of the line is the passphrase
+        CmdSpan ssidArg = cmdNextWord(args);
+        char ssid[33];
+        char password[65];
+        if (ssidArg.len == 0 || ssidArg.len >= sizeof(ssid) || args.len >= sizeof(password)) {
+            response.set("Usage: wifi join <ssid> [password]");
+            return;
+        }
+        snprintf(ssid, sizeof(ssid), "%.*s", (int)ssidArg.len, ssidArg.ptr);
+        snprintf(password, sizeof(password), "%.*s", (int)args.len, args.ptr);
+        if (!wifiConnect(ssid, args.len > 0 ? password : nullptr)) {
+            response.set("WiFi station could not be started");
+        } else {
+            consolePrintf("[WiFi] Joining '%s'\n", ssid);
+            response.printf("WiFi joining %s", ssid);
+        }
+    } else if (cmdEquals(word, "on")) {
+        bool ok = wifiConnect(nullptr, nullptr);
+        response.set(ok ? "WiFi joining the last network" : "WiFi station could not be started");
+    } else if (cmdEquals(word, "off")) {
+        {
+            CommsLock hold;
+            wifiStreamSetEnabled(false);
+        }
+        wifiDisconnect();
+        consolePrintln("[WiFi] Station off");
+        response.set("WiFi off");
+    } else if (cmdEquals(word, "coex")) {
+        int pref = -1;
+        for (int i = WIFI_COEX_BALANCE; i <= WIFI_COEX_BLE; i++) {
+            if (cmdEquals(args, wifiCoexName(i))) {
+                pref = i;
+            }
+        }
+        if (pref < 0 || !wifiSetCoex((WifiCoex)pref)) {
+            response.set("Usage: wifi coex wifi|ble|balance");
+        } else {
+            response.printf("WiFi coexistence %s", wifiCoexName(pref));
+        }
+    } else if (cmdEquals(word, "ps")) {
+        if (cmdEquals(args, "min") || cmdEquals(args, "max")) {
+            bool max = cmdEquals(args, "max");
+            wifiSetMaxPowerSave(max);
+            response.set(max ? "WiFi modem sleep max" : "WiFi modem sleep min");
+        } else {
+            response.set("Usage: wifi ps min|max");
+        }
+    } else {
+        response.set("Usage: wifi [join <ssid> [password]|on|off|coex wifi|ble|balance|ps min|max]");
+    }
+}
+
+void showWifiStreamStats() {
+    WifiStreamStats st;
+    wifiStreamGetStats(st);
+    char ip[16];
+    formatIp(st.targetIp, ip, sizeof(ip));
+
+    consolePrintln("\n=== WiFi Stream ===");
+    consolePrintf("State: %s", wifiStreamEnabled() ? "Streaming" : "Idle");
+    if (st.targetIp != 0) {
+        consolePrintf(", to %s:%u", ip, st.targetPort);
+    }
+    consolePrintln();
+    consolePrintf("Datagrams: %lu, bytes: %lu\n", (unsigned long)st.packets, (unsigned long)st.bytes);
+    if (st.packets > 0) {
+        consolePrintf("Average datagram: %lu bytes\n", (unsigned long)(st.bytes / st.packets));
+    }
+    consolePrintf("Samples: %lu\n", (unsigned long)st.samples);
+    consolePrintf("Coding: %s", st.delta ? "delta" : "raw");
+    if (st.samples > 0) {
+        consolePrintf(", %.1f bytes/sample", (float)st.bytes / st.samples);
+    }
+    consolePrintln();
+    consolePrintf("Dropped datagrams: %lu (%lu samples), no buffer: %lu\n", (unsigned long)st.droppedPackets,
+                  (unsigned long)st.droppedSamples, (unsigned long)st.allocFailures);
+    consolePrintln("===================\n");
+}
+
+// Target of `wstream on`: the sender of a UDP command, or <ip> [port] from USB/BLE
+bool parseWifiTarget(CmdSpan args, uint32_t& ip, uint16_t& port) {
+    if (args.len == 0) {
+        return wifiCommandSource(ip, port);
+    }
+    CmdSpan ipArg = cmdNextWord(args);
+    char text[16];
+    IPAddress addr;
+    long p = WIFI_UDP_PORT;
+    if (ipArg.len >= sizeof(text)) {
+        return false;
+    }
+    snprintf(text, sizeof(text), "%.*s", (int)ipArg.len, ipArg.ptr);
+    if (!addr.fromString(text) || (args.len > 0 && (!cmdParseInt(args, p) || p < 1 || p > 65535))) {
+        return false;
+    }
+    ip = (uint32_t)addr;
+    port = p;
+    return ip != 0;
+}
+
+void cmdWifiStream(CmdSpan args, bool isBLE, CmdReply& response) {
+    int delta = parseDeltaArg(args);
+    CmdSpan rest = args;
+    CmdSpan word = cmdNextWord(rest);
+    if (cmdEquals(word, "on")) {
+        uint32_t ip = 0;
+        uint16_t port = 0;
+        if (!parseWifiTarget(rest, ip, port)) {
+            response.set("Usage: wstream on <ip> [port] (no address needed when sent over UDP)");
+        } else if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+        } else {
+            char text[16];
+            formatIp(ip, text, sizeof(text));
+            consolePrintf("[WiFi] Binary stream enabled, to %s:%u\n", text, port);
+            CommsLock hold;
+            wifiStreamSetTarget(ip, port);
+            wifiStreamSetEnabled(true);
+            response.printf("WiFi stream on, to %s:%u%s", text, port, wifiConnected() ? "" : " (not connected)");
+        }
+    } else if (cmdEquals(args, "off")) {
+        CommsLock hold;
+        wifiStreamSetEnabled(false);
+        consolePrintln("[WiFi] Binary stream disabled");
+        response.set("WiFi stream off");
+    } else if (cmdEquals(args, "stats")) {
+        showWifiStreamStats();
+        WifiStreamStats st;
+        wifiStreamGetStats(st);
+        response.printf("WiFi stream %lu datagrams, %lu samples, %lu dropped", (unsigned long)st.packets,
+                        (unsigned long)st.samples, (unsigned long)st.droppedSamples);
+    } else if (delta >= 0) {
+        bool on = delta == 1;
+        CommsLock hold;
+        wifiStreamSetDelta(on);
+        consolePrintf("[WiFi] Stream coding: %s\n", on ? "delta" : "raw");
+        response.set(on ? "WiFi stream delta on" : "WiFi stream delta off");
+    } else {
+        response.set("Usage: wstream on [<ip> [port]]|off|stats|delta on|off");
+    }
+}
+
+void cmdPower(CmdSpan args, bool isBLE, CmdReply& response) {
+    if (args.len == 0) {
+        showPowerStats();
+        response.set("Power stats displayed on USB Serial");
+    } else if (cmdEquals(args, "reset")) {
+        powerResetStats();
+        response.set("Energy counters reset");
+    } else if (cmdEquals(args, "throughput") || cmdEquals(args, "balanced") || cmdEquals(args, "low")) {
+        PowerProfile profile = cmdEquals(args, "low") ? POWER_PROFILE_LOW
+                             : cmdEquals(args, "balanced") ? POWER_PROFILE_BALANCED : POWER_PROFILE_THROUGHPUT;
+        powerSetProfile(profile);
+        response.printf("Power profile %s", powerProfileName(profile));
+    } else {
+        response.set("Usage: power [throughput|balanced|low|reset]");
+    }
+}
+
+// Live values of everything 'cfg save' stores
+void captureSettings(Settings& out) {
+    settingsDefaults(out);
+    out.acqMode = imuSamplerMode();
+    out.sensor = imuSamplerSensorConfig();
+    out.dmpRateHz = imuSamplerDmpRate();
+    I2cBusStats bus;
+    i2cBusGetStats(bus);
+    if (bus.clockHz > 0) {
+        out.i2cClockKhz = bus.clockHz / 1000;
+    }
+    out.powerProfile = powerProfile();
+    UsbStreamStats usb;
+    usbStreamGetStats(usb);
+    WifiStreamStats wifi;
+    wifiStreamGetStats(wifi);
+    out.streamDelta = (bleStreamDelta(BLE_ALL_CLIENTS) ? SETTINGS_DELTA_BLE : 0) |
+                      (usb.delta ? SETTINGS_DELTA_USB : 0) | (wifi.delta ? SETTINGS_DELTA_WIFI : 0);
+    WifiStatus ws;
+    wifiGetStatus(ws);
+    out.wifiCoex = ws.coex;
+    out.wifiMaxPowerSave = ws.maxPowerSave;
+    out.wifiOn = ws.started;
+}
+
+void setStreamCoding(uint8_t deltaBits) {
+    CommsLock hold;
+    bleStreamSetDelta(BLE_ALL_CLIENTS, deltaBits & SETTINGS_DELTA_BLE);
+    usbStreamSetDelta(deltaBits & SETTINGS_DELTA_USB);
+    wifiStreamSetDelta(deltaBits & SETTINGS_DELTA_WIFI);
+}
+
+// Hands saved settings to their modules through the same setters the
+// commands use. The sampler is stopped for the sensor part and restarted
+// if it was running; anything that no longer applies is left as it is.
+void applySettings(const Settings& s) {
+    char buf[CMD_REPLY_MAX];
+    CmdReply reply(buf, sizeof(buf));
+    bool wasRunning = imuSamplerRunning();
+    {
+        CommsLock hold;
+        imuSamplerStop();
+    }
+    if (!imuSamplerSetMode((ImuAcqMode)s.acqMode)) {
+        logWarn("[Settings] Acquisition mode %s not supported by this build\n",
+                imuSamplerModeName((ImuAcqMode)s.acqMode));
+    }
+    imuSamplerSetDmpRate(s.dmpRateHz);
+    if (!applySensorConfig(s.sensor, reply)) {
+        logWarn("[Settings] Sensor setup not applied: %s\n", reply.c_str());
+    }
+    uint32_t i2cHz = (uint32_t)s.i2cClockKhz * 1000;
+    I2cBusStats bus;
+    i2cBusGetStats(bus);
+    if (i2cHz >= I2C_BUS_STANDARD_HZ && i2cHz <= I2C_BUS_FAST_PLUS_HZ && i2cHz != bus.clockHz) {
+        setI2cClock(i2cHz);
+    }
+    if (s.powerProfile != powerProfile()) {
+        powerSetProfile((PowerProfile)s.powerProfile);
+    }
+    setStreamCoding(s.streamDelta);
+    wifiSetCoex((WifiCoex)s.wifiCoex);
+    wifiSetMaxPowerSave(s.wifiMaxPowerSave);
+    WifiStatus ws;
+    wifiGetStatus(ws);
+    if (s.wifiOn && !ws.started && !wifiConnect(nullptr, nullptr)) {
+        logWarn("[Settings] WiFi station could not be started\n");
+    }
+    if (wasRunning && !startSampler()) {
+        logError("[Settings] ✗ Sampler restart failed\n");
+    }
+}
+
+void printSettings(const char* title, const Settings& s) {
+    consolePrintf("%s: mode %s, DMP %u Hz, I2C %u kHz, power %s\n", title,
+                  imuSamplerModeName((ImuAcqMode)s.acqMode), s.dmpRateHz, s.i2cClockKhz,
+                  powerProfileName((PowerProfile)s.powerProfile));
+    printSensorConfig(s.sensor);
+    consolePrintf("Coding: BLE %s, USB %s, WiFi %s\n", s.streamDelta & SETTINGS_DELTA_BLE ? "delta" : "raw",
+                  s.streamDelta & SETTINGS_DELTA_USB ? "delta" : "raw",
+                  s.streamDelta & SETTINGS_DELTA_WIFI ? "delta" : "raw");
+    consolePrintf("WiFi: %s, coex %s, power save %s\n", s.wifiOn ? "on" : "off", wifiCoexName(s.wifiCoex),
+                  s.wifiMaxPowerSave ? "max" : "min");
+}
+
+void showSettings() {
+    Settings live, saved;
+    captureSettings(live);
+    bool stored = settingsLoad(saved);
+
+    consolePrintln("\n=== Settings ===");
+    printSettings("Live", live);
+    if (!stored) {
+        consolePrintln("Saved: none, booting with the defaults");
+    } else if (memcmp(&live, &saved, sizeof(live)) == 0) {
+        consolePrintln("Saved: same as live");
+    } else {
+        printSettings("Saved", saved);
+    }
+    consolePrintln("================\n");
+}
+
+void cmdConfig(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan sub = cmdNextWord(args);
+    Settings s;
+    if (sub.len == 0) {
+        showSettings();
+        response.set("Settings displayed on USB Serial");
+    } else if (cmdEquals(sub, "save")) {
+        captureSettings(s);
+        if (settingsSave(s)) {
+            consolePrintln("[Settings] Saved, applied at every boot");
+            response.set("Settings saved");
+        } else {
+            response.set("Settings could not be written to NVS");
+        }
+    } else if (cmdEquals(sub, "load")) {
+        if (settingsLoad(s)) {
+            applySettings(s);
+            response.set("Saved settings applied");
+        } else {
+            response.set("No saved settings");
+        }
+    } else if (cmdEquals(sub, "reset")) {
+        if (settingsErase()) {
+            consolePrintln("[Settings] Erased, the next boot uses the defaults");
+            response.set("Saved settings erased");
+        } else {
+            response.set("Settings could not be erased");
+        }
+    } else if (cmdEquals(sub, "format") && (cmdEquals(args, "raw") || cmdEquals(args, "delta"))) {
+        bool delta = cmdEquals(args, "delta");
+        setStreamCoding(delta ? SETTINGS_DELTA_BLE | SETTINGS_DELTA_USB | SETTINGS_DELTA_WIFI : 0);
+        consolePrintf("[Settings] Stream coding: %s on BLE, USB and WiFi\n", delta ? "delta" : "raw");
+        response.set(delta ? "Stream coding delta" : "Stream coding raw");
+    } else {
+        response.set("Usage: cfg [save|load|reset|format raw|delta]");
+    }
+}
+
+void formatBenchResult(const BenchResult& r, CmdReply& response) {
+    response.printf("bench %s %uB %lu.%lus%s: %.0f B/s, %lu pkt, %lu stalls",
+                    r.target == BENCH_BLE ? "ble" : "usb", r.packetBytes,
+                    (unsigned long)(r.elapsedMs / 1000), (unsigned long)(r.elapsedMs / 100 % 10),
+                    r.running ? " (running)" : "", r.bytesPerSec,
+                    (unsigned long)r.packets, (unsigned long)r.stalls);
+    if (r.target == BENCH_BLE) {
+        response.printf(", %lu drops, %lu congested, %.2f pkt/event", (unsigned long)r.drops,
+                        (unsigned long)r.congestion, r.packetsPerEvent);
+    }
+}
+
+void showBenchResult() {
+    BenchResult r;
+    benchGetResult(r);
+    consolePrintln("\n=== Benchmark ===");
+    if (r.target == BENCH_BLE) {
+        consolePrintf("Transport: BLE notifications to client %d%s\n", r.client, r.running ? " (running)" : "");
+    } else {
+        consolePrintf("Transport: USB CDC frames%s\n", r.running ? " (running)" : "");
+    }
+    consolePrintf("Packet size: %u bytes\n", r.packetBytes);
+    consolePrintf("Duration: %lu ms\n", (unsigned long)r.elapsedMs);
+    consolePrintf("Sent: %lu packets, %lu bytes\n", (unsigned long)r.packets, (unsigned long)r.bytes);
+    consolePrintf("Throughput: %.0f bytes/s\n", r.bytesPerSec);
+    consolePrintf("Transport full: %lu times\n", (unsigned long)r.stalls);
+    if (r.target == BENCH_BLE) {
+        consolePrintf("Rejected/failed notifications: %lu\n", (unsigned long)r.drops);
+        consolePrintf("Congestion events: %lu\n", (unsigned long)r.congestion);
+        if (r.connInterval) {
+            consolePrintf("Connection interval: %.2f ms, %.2f packets per event\n",
+                          r.connInterval * 1.25f, r.packetsPerEvent);
+        } else {
+            consolePrintln("Connection interval: unknown (no update event yet)");
+        }
+    }
+    consolePrintln("=================\n");
+}
+
+void cmdBench(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showBenchResult();
+        BenchResult r;
+        benchGetResult(r);
+        formatBenchResult(r, response);
+    } else if (cmdEquals(word, "stop")) {
+        CommsLock hold;
+        benchStop();
+        response.set("Benchmark stopped");
+    } else if (cmdEquals(word, "ble") || cmdEquals(word, "usb")) {
+        long size = 0;
+        long seconds = BENCH_DEFAULT_SECONDS;
+        CmdSpan sizeArg = cmdNextWord(args);
+        if ((sizeArg.len > 0 && (!cmdParseInt(sizeArg, size) || size < 0 || size > BENCH_MAX_PACKET)) ||
+            (args.len > 0 && (!cmdParseInt(args, seconds) || seconds < 1 || seconds > BENCH_MAX_SECONDS))) {
+            response.printf("Usage: bench ble|usb [0-%d bytes] [1-%d s]", BENCH_MAX_PACKET, BENCH_MAX_SECONDS);
+            return;
+        }
+        BenchTarget target = cmdEquals(word, "ble") ? BENCH_BLE : BENCH_USB;
+        bool started;
+        {
+            CommsLock hold;
+            started = benchStart(target, size, seconds, commandClient(isBLE));
+        }
+        if (!started) {
+            response.set(target == BENCH_BLE ? "BLE benchmark needs a client, bstream off and no run active"
+                                             : "USB benchmark needs ustream off and no run active");
+            return;
+        }
+        BenchResult r;
+        benchGetResult(r);
+        consolePrintf("[Bench] %s: %u-byte packets for %ld s\n", target == BENCH_BLE ? "BLE" : "USB",
+                      r.packetBytes, seconds);
+        response.printf("bench %s started, %u bytes", target == BENCH_BLE ? "ble" : "usb", r.packetBytes);
+    } else {
+        response.set("Usage: bench [ble|usb [bytes] [seconds]|stop]");
+    }
+}
+
+void cmdPing(CmdSpan args, bool isBLE, CmdReply& response) {
+    response.set("pong ");
+    response.append(args);
+    if (!isBLE) {
+        consolePrintf("pong %.*s\n", (int)args.len, args.ptr);
+    }
+}
+
+void showDspConfig() {
+    consolePrintln("\n=== Stream DSP ===");
+    consolePrintf("Input rate: %lu Hz\n", (unsigned long)commsInputRate());
+    const char* names[COMMS_SINK_COUNT] = { "BLE default", "USB", "Log", "WiFi" };
+    for (int i = 0; i < COMMS_SINK_COUNT; i++) {
+        printDspConfig(names[i], commsDsp((CommsSink)i));
+    }
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (bleStreamClientConnected(i)) {
+            char name[16];
+            snprintf(name, sizeof(name), "BLE client %d", i);
+            DspConfig cfg;
+            {
+                CommsLock hold;
+                cfg = bleStreamDsp(i);
+            }
+            printDspConfig(name, cfg);
+        }
+    }
+    consolePrintln("==================\n");
+}
+
+void cmdDsp(CmdSpan args, bool isBLE, CmdReply& response) {
+    if (args.len == 0) {
+        showDspConfig();
+        response.set("DSP setup displayed on USB Serial");
+        return;
+    }
+    CmdSpan sinkArg = cmdNextWord(args);
+    CommsSink sink = cmdEquals(sinkArg, "ble") ? COMMS_SINK_BLE
+                   : cmdEquals(sinkArg, "usb") ? COMMS_SINK_USB
+                   : cmdEquals(sinkArg, "log") ? COMMS_SINK_LOG
+                   : cmdEquals(sinkArg, "wifi") ? COMMS_SINK_WIFI : COMMS_SINK_COUNT;
+    if (sink == COMMS_SINK_COUNT) {
+        response.set("Usage: dsp [ble|usb|log|wifi off|<decim> [last|mean|min|max] [iir|fir <hz> [taps]]]");
+        return;
+    }
+
+    DspConfig cfg;
+    cfg.filter = DSP_FILTER_NONE;
+    cfg.cutoffHz = 0;
+    cfg.firTaps = DSP_FIR_DEFAULT_TAPS;
+    cfg.decimation = 1;
+    cfg.window = DSP_WINDOW_LAST;
+
+    bool ok = true;
+    if (!cmdEquals(args, "off")) {
+        long decim = 0;
+        ok = cmdParseInt(cmdNextWord(args), decim) && decim >= 1 && decim <= DSP_MAX_DECIMATION;
+        cfg.decimation = decim;
+        CmdSpan word = cmdNextWord(args);
+        if (cmdEquals(word, "last") || cmdEquals(word, "mean") || cmdEquals(word, "min") || cmdEquals(word, "max")) {
+            cfg.window = cmdEquals(word, "mean") ? DSP_WINDOW_MEAN
+                       : cmdEquals(word, "min") ? DSP_WINDOW_MIN
+                       : cmdEquals(word, "max") ? DSP_WINDOW_MAX : DSP_WINDOW_LAST;
+            word = cmdNextWord(args);
+        }
+        if (cmdEquals(word, "iir") || cmdEquals(word, "fir")) {
+            cfg.filter = cmdEquals(word, "iir") ? DSP_FILTER_IIR : DSP_FILTER_FIR;
+            long hz = 0;
+            long taps = DSP_FIR_DEFAULT_TAPS;
+            ok = ok && cmdParseInt(cmdNextWord(args), hz) && hz > 0 && hz < (long)commsInputRate() / 2;
+            if (args.len > 0) {
+                ok = ok && cfg.filter == DSP_FILTER_FIR && cmdParseInt(args, taps) && taps >= 3 &&
+                     taps <= DSP_FIR_MAX_TAPS;
+            }
+            cfg.cutoffHz = hz;
+            cfg.firTaps = taps;
+        } else if (word.len > 0) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        response.printf("Usage: dsp ble|usb|log|wifi <1-%d> [last|mean|min|max] [iir|fir <1-%d Hz> [3-%d taps]]",
+                        DSP_MAX_DECIMATION, (int)commsInputRate() / 2 - 1, DSP_FIR_MAX_TAPS);
+        return;
+    }
+    bool set;
+    if (sink == COMMS_SINK_BLE && isBLE) {
+        // A BLE client sets its own rate; from USB it is every client's
+        CommsLock hold;
+        set = bleStreamSetDsp(bleCommandClient(), cfg);
+    } else {
+        set = commsSetDsp(sink, cfg);
+    }
+    if (!set) {
+        response.set("DSP configuration rejected");
+        return;
+    }
+    const char* names[COMMS_SINK_COUNT] = { "BLE", "USB", "Log", "WiFi" };
+    consolePrintf("[DSP] %s: %s, decimate by %u (%s)\n", names[sink], dspFilterName(cfg.filter),
+                  cfg.decimation, dspWindowName(cfg.window));
+    response.printf("%s DSP set, %.1f Hz out", names[sink], (float)commsInputRate() / cfg.decimation);
+}
+
+void showClockSync() {
+    ClockSyncStats st;
+    clockSyncGetStats(st);
+    consolePrintln("\n=== Clock Sync ===");
+    consolePrintf("Node ID: %08lX\n", (unsigned long)st.nodeId);
+    consolePrintf("Node time: %llu us\n", (unsigned long long)clockSyncNowUs());
+    consolePrintf("Pings: %lu, rejected writes: %lu\n", (unsigned long)st.pings, (unsigned long)st.rejected);
+    if (st.pings > 0) {
+        consolePrintf("Last ping: %lu ms ago\n", (unsigned long)(millis() - st.lastPingMs));
+    }
+    if (st.reported) {
+        // The host fitted host = node + offset + drift * (node - reference)
+        int64_t since = (int64_t)(clockSyncNowUs() - st.referenceUs);
+        double offsetNow = st.offsetUs + since * (st.driftPpb * 1e-9);
+        consolePrintf("Host estimate: offset %+.1f us now, drift %+.3f ppm (reported %lu ms ago)\n",
+                      offsetNow, st.driftPpb / 1000.0, (unsigned long)(millis() - st.reportMs));
+    } else {
+        consolePrintln("Host estimate: none reported");
+    }
+    consolePrintln("==================\n");
+}
+
+void cmdSync(CmdSpan args, bool isBLE, CmdReply& response) {
+    showClockSync();
+    ClockSyncStats st;
+    clockSyncGetStats(st);
+    response.printf("node %08lX, %lu pings", (unsigned long)st.nodeId, (unsigned long)st.pings);
+    if (st.reported) {
+        response.printf(", drift %+.3f ppm", st.driftPpb / 1000.0);
+    }
+}
+
+void showConsole() {
+    ConsoleStats st;
+    consoleGetStats(st);
+    consolePrintln("\n=== Console ===");
+    consolePrintf("Level: %s (compiled up to %s)\n", consoleLevelName(st.level), consoleLevelName(CONSOLE_LEVEL));
+    consolePrintf("Messages: %lu, %lu bytes written, %lu filtered by level\n", (unsigned long)st.messages,
+                  (unsigned long)st.bytes, (unsigned long)st.filtered);
+    consolePrintf("Dropped: %lu messages (%lu bytes), ring high water %lu of %d bytes\n",
+                  (unsigned long)st.dropped, (unsigned long)st.droppedBytes, (unsigned long)st.highWater,
+                  CONSOLE_RING_BYTES);
+    consolePrintf("Waits for the CDC TX buffer: %lu\n", (unsigned long)st.stalls);
+    consolePrintln("===============\n");
+}
+
+void cmdLog(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showConsole();
+        ConsoleStats st;
+        consoleGetStats(st);
+        response.printf("log %s, %lu messages, %lu dropped", consoleLevelName(st.level),
+                        (unsigned long)st.messages, (unsigned long)st.dropped);
+    } else if (cmdEquals(word, "level")) {
+        uint8_t level = 0;
+        for (uint8_t i = CONSOLE_LEVEL_ERROR; i <= CONSOLE_LEVEL_DEBUG; i++) {
+            if (cmdEquals(args, consoleLevelName(i))) {
+                level = i;
+            }
+        }
+        if (level == 0) {
+            response.set("Usage: log level error|warn|info|debug");
+        } else if (!consoleSetLevel(level)) {
+            response.printf("Level %s is compiled out (CONSOLE_LEVEL %s)", consoleLevelName(level),
+                            consoleLevelName(CONSOLE_LEVEL));
+        } else {
+            response.printf("log level %s", consoleLevelName(level));
+        }
+    } else {
+        response.set("Usage: log [level error|warn|info|debug]");
+    }
+}
+
+void cmdBoot(CmdSpan args, bool isBLE, CmdReply& response) {
+    bootPrintReport();
+    uint32_t adv = bootMarkUs(BOOT_MARK_ADVERTISING);
+    uint32_t sample = bootMarkUs(BOOT_MARK_FIRST_SAMPLE);
+    response.printf("boot %s: adv %lu ms, first sample ", FAST_BOOT ? "fast" : "standard",
+                    (unsigned long)(adv / 1000));
+    if (sample) {
+        response.printf("%lu ms", (unsigned long)(sample / 1000));
+    } else {
+        response.append(cmdSpan("none"));
+    }
+}
+
+void cmdPerf(CmdSpan args, bool isBLE, CmdReply& response) {
+    if (args.len == 0) {
+        perfPrintReport();
+        response.set("Perf report displayed on USB Serial");
+    } else if (cmdEquals(args, "reset")) {
+        perfReset();
+        response.set("Perf histograms cleared");
+    } else {
+        response.set("Usage: perf [reset]");
+    }
+}
+
+void showTrigger() {
+    TriggerConfig cfg = commsTrigger();
+    TriggerStats st;
+    commsTriggerStats(st);
+    consolePrintln("\n=== Stream Trigger ===");
+    consolePrintf("State: %s%s\n", cfg.enabled ? "On" : "Off", st.open ? ", window open" : "");
+    consolePrintf("Level: accel %u mg, gyro %u dps\n", cfg.levelMg, cfg.gyroDps);
+    consolePrintf("RMS: %u mg over %u ms\n", cfg.rmsMg, cfg.rmsWindowMs);
+    consolePrintf("Motion: %u mg (%s)\n", cfg.motionMg,
+                  imuSamplerWomActive() ? "sensor wake-on-motion" : "compared in software");
+    consolePrintf("Window: %u ms before, %u ms after\n", cfg.preMs, cfg.postMs);
+    consolePrintf("Events: %lu", (unsigned long)st.events);
+    if (st.events > 0) {
+        consolePrintf(", last at %lu us by%s%s%s", (unsigned long)st.lastEventUs,
+                      st.lastSources & TRIGGER_SRC_LEVEL ? " level" : "",
+                      st.lastSources & TRIGGER_SRC_RMS ? " rms" : "",
+                      st.lastSources & TRIGGER_SRC_MOTION ? " motion" : "");
+    }
+    consolePrintln();
+    uint32_t seen = st.passed + st.suppressed + st.overflows;
+    consolePrintf("Samples: %lu sent, %lu suppressed (%.1f%% sent), %lu lost to overflow\n",
+                  (unsigned long)st.passed, (unsigned long)st.suppressed,
+                  seen ? 100.0f * st.passed / seen : 0.0f, (unsigned long)st.overflows);
+    consolePrintf("History: %lu samples held\n", (unsigned long)st.backlog);
+    consolePrintln("======================\n");
+}
+
+// The sensor's wake-on-motion threshold is part of the sampler setup, so a
+// change restarts a running sampler, as 'sample mode' does
+bool setWakeOnMotion(uint16_t mg) {
+    if (mg == imuSamplerWakeOnMotion()) {
+        return true;
+    }
+    bool wasRunning = imuSamplerRunning();
+    imuSamplerStop();
+    bool ok = imuSamplerSetWakeOnMotion(mg);
+    if (wasRunning && !startSampler()) {
+        ok = false;
+    }
+    return ok;
+}
+
+void cmdTrigger(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showTrigger();
+        TriggerStats st;
+        commsTriggerStats(st);
+        response.printf("trig %s, %lu events, %lu sent, %lu suppressed", commsTrigger().enabled ? "on" : "off",
+                        (unsigned long)st.events, (unsigned long)st.passed, (unsigned long)st.suppressed);
+        return;
+    }
+
+    TriggerConfig cfg = commsTrigger();
+    long a = 0;
+    long b = 0;
+    bool ok = true;
+    if (cmdEquals(word, "on") || cmdEquals(word, "off")) {
+        cfg.enabled = cmdEquals(word, "on");
+    } else if (cmdEquals(word, "level")) {
+        ok = cmdParseInt(cmdNextWord(args), a) && a >= 0 && a <= 16000;
+        if (ok && args.len > 0) {
+            ok = cmdParseInt(args, b) && b >= 0 && b <= 2000;
+            cfg.gyroDps = b;
+        }
+        cfg.levelMg = a;
+    } else if (cmdEquals(word, "rms")) {
+        ok = cmdParseInt(cmdNextWord(args), a) && a >= 0 && a <= 16000;
+        if (ok && args.len > 0) {
+            ok = cmdParseInt(args, b) && b >= 1 && b <= 1000;
+            cfg.rmsWindowMs = b;
+        }
+        cfg.rmsMg = a;
+    } else if (cmdEquals(word, "motion")) {
+        ok = cmdParseInt(args, a) && a >= 0 && a <= IMU_WOM_MAX_MG;
+        cfg.motionMg = a - a % IMU_WOM_MG_PER_LSB;
+    } else if (cmdEquals(word, "window")) {
+        ok = cmdParseInt(cmdNextWord(args), a) && cmdParseInt(args, b) && a >= 0 && a <= 60000 &&
+             b >= 0 && b <= 60000;
+        cfg.preMs = a;
+        cfg.postMs = b;
+    } else {
+        response.set("Usage: trig [on|off|level <mg> [dps]|rms <mg> [ms]|motion <mg>|window <pre ms> <post ms>]");
+        return;
+    }
+    if (!ok || !commsSetTrigger(cfg)) {
+        response.printf("Trigger setting rejected (history %d samples, RMS window %d samples at %d Hz)",
+                        TRIGGER_HISTORY_SAMPLES, TRIGGER_RMS_MAX_SAMPLES, (int)commsInputRate());
+        return;
+    }
+    if (!setWakeOnMotion(cfg.motionMg)) {
+        response.set("Trigger set, sampler restart failed");
+        return;
+    }
+    if (cfg.enabled && !cfg.levelMg && !cfg.gyroDps && !cfg.rmsMg && !cfg.motionMg) {
+        consolePrintln("[Trig] No condition set - the streams stay silent");
+    }
+    consolePrintf("[Trig] %s: level %u mg / %u dps, rms %u mg / %u ms, motion %u mg, window %u+%u ms\n",
+                  cfg.enabled ? "On" : "Off", cfg.levelMg, cfg.gyroDps, cfg.rmsMg, cfg.rmsWindowMs,
+                  cfg.motionMg, cfg.preMs, cfg.postMs);
+    response.printf("trig %s", cfg.enabled ? "on" : "off");
+}
+
+void showSpectral() {
+    SpectralStatus st;
+    {
+        CommsLock hold;
+        spectralGetStatus(st);
+    }
+    consolePrintln("\n=== Spectral Features ===");
+    consolePrintf("State: %s%s\n", st.enabled ? "On" : st.allocated ? "Off" : "Off, no buffers",
+                  st.usb ? ", framed on USB too" : "");
+    consolePrintf("Window: %d samples (%.2f s, %.2f Hz bins), hop %d, %u per packet\n", SPECTRAL_FFT_SIZE,
+                  (float)SPECTRAL_FFT_SIZE / imuSamplerRateHz(), (float)imuSamplerRateHz() / SPECTRAL_FFT_SIZE,
+                  SPECTRAL_HOP, st.average);
+    consolePrintf("Windows: %lu, packets: %lu, last window %lu us\n", (unsigned long)st.windows,
+                  (unsigned long)st.packets, (unsigned long)st.computeUs);
+    consolePrintf("BLE notifications: %lu, skipped for MTU: %lu\n", (unsigned long)st.bleSent,
+                  (unsigned long)st.bleSmallMtu);
+    if (st.usb) {
+        consolePrintf("USB frames: %lu, dropped: %lu\n", (unsigned long)st.usbSent, (unsigned long)st.usbDropped);
+    }
+    if (st.skipped) {
+        consolePrintf("Skipped non-AGMT samples: %lu\n", (unsigned long)st.skipped);
+    }
+    if (st.haveLast) {
+        const char axes[] = "XYZ";
+        consolePrintf("Last packet, %u windows ending at %lu us (mg):\n", st.last.hdr.windows,
+                      (unsigned long)st.last.hdr.endUs);
+        for (int a = 0; a < 3; a++) {
+            const SpectralAxis& ax = st.last.axis[a];
+            consolePrintf("  %c: rms %.2f, peak %.2f at %.2f Hz, bands", axes[a], spectralLevelMg(ax.rms),
+                          spectralLevelMg(ax.peak), ax.peakCentiHz / 100.0f);
+            for (int b = 0; b < SPECTRAL_BANDS; b++) {
+                consolePrintf(" %.2f", spectralLevelMg(ax.band[b]));
+            }
+            consolePrintln();
+        }
+    }
+    consolePrintln("=========================\n");
+}
+
+void cmdSpectral(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showSpectral();
+        SpectralStatus st;
+        {
+            CommsLock hold;
+            spectralGetStatus(st);
+        }
+        response.printf("spec %s, %lu packets", st.enabled ? "on" : "off", (unsigned long)st.packets);
+        if (st.haveLast) {
+            // The axis with the most energy, as a one-line summary
+            int a = 0;
+            for (int i = 1; i < 3; i++) {
+                if (st.last.axis[i].rms > st.last.axis[a].rms) {
+                    a = i;
+                }
+            }
+            response.printf(", %c rms %.2f mg, peak %.2f Hz", "XYZ"[a], spectralLevelMg(st.last.axis[a].rms),
+                            st.last.axis[a].peakCentiHz / 100.0f);
+        }
+    } else if (cmdEquals(word, "on")) {
+        bool usb = cmdEquals(args, "usb");
+        if (args.len > 0 && !usb) {
+            response.set("Usage: spec on [usb]");
+        } else if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+        } else {
+            bool ok;
+            {
+                CommsLock hold;
+                ok = spectralSetEnabled(true, usb);
+            }
+            if (!ok) {
+                response.set("Spectral buffers could not be allocated");
+            } else {
+                consolePrintf("[Spec] Features on%s\n", usb ? ", framed on USB" : "");
+                response.set("spec on");
+            }
+        }
+    } else if (cmdEquals(word, "off")) {
+        {
+            CommsLock hold;
+            spectralSetEnabled(false, false);
+        }
+        consolePrintln("[Spec] Features off");
+        response.set("spec off");
+    } else if (cmdEquals(word, "avg")) {
+        long n = 0;
+        bool ok = cmdParseInt(args, n) && n >= 1 && n <= SPECTRAL_MAX_AVERAGE;
+        if (ok) {
+            CommsLock hold;
+            ok = spectralSetAverage(n);
+        }
+        if (!ok) {
+            response.printf("Usage: spec avg <1-%d>", SPECTRAL_MAX_AVERAGE);
+        } else {
+            consolePrintf("[Spec] Averaging %ld windows per packet\n", n);
+            response.printf("spec avg %ld, one packet per %.2f s", n,
+                            (float)n * SPECTRAL_HOP / imuSamplerRateHz());
+        }
+    } else {
+        response.set("Usage: spec [on [usb]|off|avg <n>]");
+    }
+}
+
+void showCaptureStatus() {
+    CaptureStatus st;
+    {
+        CommsLock hold;
+        captureGetStatus(st);
+    }
+    consolePrintln("\n=== Capture ===");
+    consolePrintf("State: %s%s\n", st.recording ? "Recording" : st.allocated ? "Stopped" : "No buffer",
+                  st.transferring ? ", downloading" : st.importing ? ", import in progress" : "");
+    if (st.allocated) {
+        consolePrintf("Buffer: %lu records (%.1f s at %d Hz) in PSRAM\n", (unsigned long)st.capacity,
+                      (float)st.capacity / imuSamplerRateHz(), (int)imuSamplerRateHz());
+    }
+    if (st.durationMs) {
+        consolePrintf("Duration limit: %lu ms\n", (unsigned long)st.durationMs);
+    }
+    consolePrintf("Records: %lu written, held %lu..%lu, %.3f s\n", (unsigned long)st.total,
+                  (unsigned long)st.first, (unsigned long)st.total, st.spanUs / 1e6f);
+    if (st.skipped) {
+        consolePrintf("Skipped non-AGMT samples: %lu\n", (unsigned long)st.skipped);
+    }
+    if (st.transferring) {
+        if (st.transport == CAPTURE_BLE) {
+            consolePrintf("Download over BLE to client %d: next %lu, end %lu\n", st.client,
+                          (unsigned long)st.sendNext, (unsigned long)st.sendEnd);
+        } else {
+            consolePrintf("Download over USB: next %lu, end %lu\n", (unsigned long)st.sendNext,
+                          (unsigned long)st.sendEnd);
+        }
+    }
+    consolePrintln("===============\n");
+}
+
+void cmdCapture(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0 || cmdEquals(word, "status")) {
+        showCaptureStatus();
+        CaptureStatus st;
+        {
+            CommsLock hold;
+            captureGetStatus(st);
+        }
+        response.printf("cap %s, %lu..%lu", st.recording ? "recording" : "stopped",
+                        (unsigned long)st.first, (unsigned long)st.total);
+    } else if (cmdEquals(word, "start")) {
+        long seconds = 0;
+        if (args.len > 0 && (!cmdParseInt(args, seconds) || seconds < 0 || seconds > CAPTURE_MAX_SECONDS)) {
+            response.printf("Usage: cap start [0-%d s]", CAPTURE_MAX_SECONDS);
+            return;
+        }
+        if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+            return;
+        }
+        bool started;
+        {
+            CommsLock hold;
+            started = captureStart(seconds);
+        }
+        if (!started) {
+            response.set("Capture needs PSRAM and no download or flash log query running");
+            return;
+        }
+        consolePrintf("[Capture] Recording %s\n", seconds ? "for a fixed time" : "until 'cap stop'");
+        response.printf("cap started, %ld s", seconds);
+    } else if (cmdEquals(word, "stop")) {
+        CaptureStatus st;
+        {
+            CommsLock hold;
+            captureStop();
+            captureGetStatus(st);
+        }
+        consolePrintf("[Capture] Stopped, %lu records\n", (unsigned long)st.total);
+        response.set("cap stopped");
+    } else if (cmdEquals(word, "get") && cmdEquals(args, "stop")) {
+        {
+            CommsLock hold;
+            captureGetStop();
+        }
+        consolePrintln("[Capture] Download stopped");
+        response.set("cap get stopped");
+    } else if (cmdEquals(word, "get")) {
+        long first = 0;
+        long count = 0;
+        CmdSpan firstArg = cmdNextWord(args);
+        if ((firstArg.len > 0 && (!cmdParseInt(firstArg, first) || first < 0)) ||
+            (args.len > 0 && (!cmdParseInt(args, count) || count < 0))) {
+            response.set("Usage: cap get [first] [count]");
+            return;
+        }
+        uint32_t from = first;
+        uint32_t n = count;
+        bool started;
+        {
+            CommsLock hold;
+            started = captureGetStart(isBLE ? CAPTURE_BLE : CAPTURE_USB, from, n, commandClient(isBLE));
+            if (started && !isBLE) {
+                // The host reads the range before the first frame, so print it while the pipeline waits
+                consolePrintf("cap get %lu %lu\n", (unsigned long)from, (unsigned long)n);
+            }
+        }
+        if (!started) {
+            response.set(isBLE ? "Capture download needs a stopped capture, no query, bstream off and no benchmark"
+                               : "Capture download needs a stopped capture, no query, ustream off and no benchmark");
+            return;
+        }
+        response.printf("cap get %lu %lu", (unsigned long)from, (unsigned long)n);
+    } else if (cmdEquals(word, "free")) {
+        CommsLock hold;
+        response.set(captureFree() ? "cap buffer released" : "Capture busy");
+    } else {
+        response.set("Usage: cap [status|start [s]|stop|get [first] [count]|get stop|free]");
+    }
+}
+
+void showFlashLog() {
+    FlashLogStats st;
+    flashLogGetStats(st);
+    consolePrintln("\n=== Flash Log ===");
+    if (!st.mounted) {
+        consolePrintln("State: partition not mounted");
+        consolePrintln("=================\n");
+        return;
+    }
+    consolePrintf("State: %s%s, boot %u\n", st.enabled ? "Logging" : "Idle", st.loading ? ", query running" : "",
+                  st.boot);
+    consolePrintf("Partition: %lu of %lu KB used, %lu segments\n", (unsigned long)(st.usedBytes / 1024),
+                  (unsigned long)(st.totalBytes / 1024), (unsigned long)st.segments);
+    consolePrintf("This boot: %lu records in %lu blocks, %lu syncs\n", (unsigned long)st.records,
+                  (unsigned long)st.blocks, (unsigned long)st.syncs);
+    consolePrintf("Segments created: %lu, deleted: %lu\n", (unsigned long)st.segmentsCreated,
+                  (unsigned long)st.segmentsDeleted);
+    consolePrintf("Dropped records: %lu, write errors: %lu\n", (unsigned long)st.droppedRecords,
+                  (unsigned long)st.writeErrors);
+    consolePrintf("Last query: %lu records\n", (unsigned long)st.loaded);
+    consolePrintln("=================\n");
+}
+
+void showFlashLogSegments() {
+    static FlashLogSegment segs[FLOG_MAX_SEGMENTS];
+    size_t n = flashLogSegments(segs, FLOG_MAX_SEGMENTS);
+    consolePrintln("\n=== Flash Log Segments ===");
+    consolePrintln("Segment   Boot  Blocks  From ms     To ms");
+    for (size_t i = 0; i < n; i++) {
+        consolePrintf("%8lu  %4u  %6u  %9lu  %9lu\n", (unsigned long)segs[i].id, segs[i].boot, segs[i].blocks,
+                      (unsigned long)(segs[i].firstUs / 1000), (unsigned long)(segs[i].lastUs / 1000));
+    }
+    if (n == 0) {
+        consolePrintln("(empty)");
+    }
+    consolePrintln("==========================\n");
+}
+
+void cmdFlashLog(CmdSpan args, bool isBLE, CmdReply& response) {
+    CmdSpan word = cmdNextWord(args);
+    if (word.len == 0) {
+        showFlashLog();
+        FlashLogStats st;
+        flashLogGetStats(st);
+        response.printf("flog %s, boot %u, %lu segments, %lu/%lu KB", st.enabled ? "on" : "off", st.boot,
+                        (unsigned long)st.segments, (unsigned long)(st.usedBytes / 1024),
+                        (unsigned long)(st.totalBytes / 1024));
+    } else if (cmdEquals(word, "on")) {
+        if (!flashLogMounted()) {
+            response.set("Flash log partition not mounted");
+        } else if (!icmAvailable || !startSampler()) {
+            response.set("IMU sampler not available");
+        } else {
+            CommsLock hold;
+            flashLogSetEnabled(true);
+            consolePrintln("[FLog] Logging enabled");
+            response.set("flog on");
+        }
+    } else if (cmdEquals(word, "off")) {
+        CommsLock hold;
+        flashLogSetEnabled(false);
+        consolePrintln("[FLog] Logging disabled");
+        response.set("flog off");
+    } else if (cmdEquals(word, "list")) {
+        showFlashLogSegments();
+        response.set("Flash log segments displayed on USB Serial");
+    } else if (cmdEquals(word, "load")) {
+        FlashLogStats st;
+        flashLogGetStats(st);
+        long from = 0;
+        long to = 0;
+        long boot = st.boot;
+        bool ok = cmdParseInt(cmdNextWord(args), from) && cmdParseInt(cmdNextWord(args), to) &&
+                  from >= 0 && to >= from;
+        if (ok && args.len > 0) {
+            ok = cmdParseInt(args, boot) && boot >= 0 && boot <= 0xFFFF;
+        }
+        if (!ok) {
+            response.set("Usage: flog load <from ms> <to ms> [boot]");
+        } else if (!flashLogLoad(boot, from, to)) {
+            response.set("Flash log query needs no query running and the capture stopped");
+        } else {
+            response.printf("flog load boot %ld %ld..%ld ms started, then 'cap get'", boot, from, to);
+        }
+    } else if (cmdEquals(word, "erase")) {
+        response.set(flashLogErase() ? "flog erased" : "Flash log busy or logging");
+    } else {
+        response.set("Usage: flog [on|off|list|load <from ms> <to ms> [boot]|erase]");
+    }
+}
+
+static constexpr CmdEntry commands[] = {
+    CMD_ENTRY("h", cmdHelp),
+    CMD_ENTRY("s", cmdStatus),
+    CMD_ENTRY("t", cmdTest),
+    CMD_ENTRY("r", cmdRestartAdvertising),
+    CMD_ENTRY("c", cmdCounters),
+    CMD_ENTRY("m", cmdMemory),
+    CMD_ENTRY("i", cmdImu),
+    CMD_ENTRY("scan", cmdScan),
+    CMD_ENTRY("i2c", cmdI2c),
+    CMD_ENTRY("sample", cmdSample),
+    CMD_ENTRY("dmp", cmdDmp),
+    CMD_ENTRY("bstream", cmdBleStream),
+    CMD_ENTRY("ustream", cmdUsbStream),
+    CMD_ENTRY("wifi", cmdWifi),
+    CMD_ENTRY("wstream", cmdWifiStream),
+    CMD_ENTRY("power", cmdPower),
+    CMD_ENTRY("cfg", cmdConfig),
+    CMD_ENTRY("perf", cmdPerf),
+    CMD_ENTRY("bench", cmdBench),
+    CMD_ENTRY("ping", cmdPing),
+    CMD_ENTRY("sync", cmdSync),
+    CMD_ENTRY("dsp", cmdDsp),
+    CMD_ENTRY("trig", cmdTrigger),
+    CMD_ENTRY("spec", cmdSpectral),
+    CMD_ENTRY("cap", cmdCapture),
+    CMD_ENTRY("boot", cmdBoot),
+    CMD_ENTRY("log", cmdLog),
+    CMD_ENTRY("flog", cmdFlashLog),
+};
+
+static constexpr size_t commandCount = sizeof(commands) / sizeof(commands[0]);
+static_assert(cmdHashesUnique(commands, commandCount), "command name hash collision");
+
+void processCommand(CmdSpan input, bool isBLE, CmdReply& response) {
+    response.clear();
+    if (input.len == 0) {
+        return;
+    }
+
+    uint32_t start = perfCycles();
+    CmdSpan args;
+    const CmdEntry* cmd = cmdFind(commands, commandCount, input, args);
+    if (cmd) {
+        cmd->handler(args, isBLE, response);
+    } else {
+        response.set("Echo: ");
+        response.append(input);
         if (!isBLE) {
-            Serial.println("[USB Echo] You sent: " + input);
+            consolePrintf("[USB Echo] You sent: %.*s\n", (int)input.len, input.ptr);
         }
     }
-    
-    return response;
+    perfRecordSince(PERF_CMD_DISPATCH, start);
 }
 
-void setup() {
-    // Initialize USB Serial
-    Serial.begin(115200);
-    delay(2000); // Give time for serial monitor to connect
-    
-    Serial.println("\n*** XIAO ESP32S3 Communication Test Starting ***");
-    Serial.println("Board: Seeed XIAO ESP32S3");
-    Serial.println("USB Port: COM9");
-    Serial.println("Baud Rate: 115200");
-    
+#if ARDUINO_USB_MODE
+void onUsbEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    xEventGroupSetBits(schedulerEvents, EVT_USB_RX);
+}
+#endif
+
+void onStatusTimer(TimerHandle_t timer) {
+    xEventGroupSetBits(schedulerEvents, EVT_STATUS);
+}
+
+// Handle USB Serial input, one complete line at a time
+void serviceUsbInput() {
+    while (Serial.available()) {
+        CmdSpan line;
+        if (usbLine.feed((char)Serial.read(), line)) {
+            usbMessageCount++;
+            
+            char replyBuf[CMD_REPLY_MAX];
+            CmdReply response(replyBuf, sizeof(replyBuf));
+            processCommand(cmdTrim(line), false, response);
+        }
+    }
+}
+
+void showPeriodicStatus() {
+    consolePrintf("\n[Periodic Update] System running - %lus uptime\n", millis() / 1000);
+    consolePrintf("Connections: USB=Active, BLE=%d of %d clients\n", bleStreamClientCount(), BLE_MAX_CLIENTS);
+    if (!bleStreamConnected()) {
+        consolePrintln("[BLE] Still advertising as '" BLE_DEVICE_NAME "' - ready for connections");
+    }
+}
+
+void printBootBanner() {
+    consolePrintln("\n*** XIAO ESP32S3 Communication Test Starting ***");
+    consolePrintln("Board: Seeed XIAO ESP32S3");
+    consolePrintln("USB Port: COM9");
+    consolePrintln("Baud Rate: 115200");
+}
+
+// I2C and the ICM-20948. With FAST_BOOT this runs in a boot task on the
+// sampler's core, so the data-ready interrupt is attached there as before.
+void setupIMU() {
     // Initialize I2C for ICM20948 with explicit pins
-    Serial.println("[Setup] Initializing I2C...");
+    Wire.setBufferSize(IMU_I2C_BUFFER_BYTES);  // Room for FIFO burst reads
     Wire.begin(I2C_SDA, I2C_SCL);  // Explicit pin assignment
-    Wire.setClock(400000); // 400kHz I2C clock
-    Serial.print("[Setup] I2C initialized on SDA=GPIO");
-    Serial.print(I2C_SDA);
-    Serial.print(", SCL=GPIO");
-    Serial.println(I2C_SCL);
-    Serial.println("[Setup] Measure SCL with multimeter - should be 3.3V when idle");
-    delay(100);  // Give I2C time to stabilize
-    
-    // Initialize ICM20948 sensor
-    Serial.println("[Setup] Initializing ICM20948 sensor...");
-    Serial.print("[Setup] Trying I2C address 0x");
-    Serial.println(AD0_VAL ? "69" : "68");
+    Wire.setClock(I2C_BUS_FAST_HZ); // 400kHz for init; a saved clock is applied afterwards
+    if (!FAST_BOOT) {
+        logInfo("[Setup] I2C initialized on SDA=GPIO%d, SCL=GPIO%d\n", I2C_SDA, I2C_SCL);
+        logInfo("[Setup] Measure SCL with multimeter - should be 3.3V when idle\n");
+        delay(100);  // Give I2C time to stabilize
+        logInfo("[Setup] Initializing ICM20948 sensor...\n");
+#if IMU_USE_SPI
+        logInfo("[Setup] Using SPI, CS on GPIO%d\n", IMU_SPI_CS);
+#else
+        logInfo("[Setup] Trying I2C address 0x%s\n", AD0_VAL ? "69" : "68");
+#endif
+    }
     
+#if IMU_USE_SPI
+    // Wire stays up for the scanner and other I2C devices
+    SPI.begin(IMU_SPI_SCK, IMU_SPI_MISO, IMU_SPI_MOSI, -1);
+    icm.begin(IMU_SPI_CS, SPI, IMU_SPI_CLOCK_HZ);
+#else
     icm.begin(Wire, AD0_VAL);
+#endif
     
-    Serial.print("[Setup] Initialization returned: ");
-    Serial.println(icm.statusString());
+    logInfo("[Setup] ICM20948 initialization returned: %s\n", icm.statusString());
     
     if (icm.status == ICM_20948_Stat_Ok) {
         icmAvailable = true;
-        Serial.println("[Setup] ✓ ICM20948 sensor initialized successfully!");
-        Serial.println("[Setup] Sensor ready to read data");
+        logInfo("[Setup] ✓ ICM20948 sensor initialized successfully!\n");
+#if IMU_USE_SPI
+        if (imuSpiAttach(icm)) {
+            logInfo("[Setup] SPI transport: %d MHz, DMA\n", IMU_SPI_CLOCK_HZ / 1000000);
+        } else {
+            logError("[Setup] ✗ SPI DMA driver unavailable - sensor not usable\n");
+            icmAvailable = false;
+            return;
+        }
+#else
+        // From here on the library's register accesses go through the bus task
+        if (i2cBusBegin(I2C_NUM_0, I2C_BUS_FAST_HZ)) {
+            i2cBusAttach(icm);
+        }
+#endif
+        if (imuSamplerBegin(icm)) {
+            imuSamplerSetPinHook(powerOnSamplerChange);
+            bootMark(BOOT_MARK_IMU_READY);
+            logInfo("[Setup] Sampler task ready (INT on GPIO%d, type 'sample start')\n", IMU_INT_PIN);
+        }
     } else {
         icmAvailable = false;
-        Serial.println("[Setup] ✗ ICM20948 sensor initialization failed!");
-        Serial.println("[Setup] Check wiring: SDA=GPIO5, SCL=GPIO6, VCC(3.3V), GND");
-        Serial.println("[Setup] Type 'scan' to scan I2C bus for devices");
+        logError("[Setup] ✗ ICM20948 sensor initialization failed!\n");
+#if IMU_USE_SPI
+        logInfo("[Setup] Check wiring: SCK=GPIO%d, MISO=GPIO%d, MOSI=GPIO%d, CS=GPIO%d, VCC(3.3V), GND\n",
+                IMU_SPI_SCK, IMU_SPI_MISO, IMU_SPI_MOSI, IMU_SPI_CS);
+#else
+        logInfo("[Setup] Check wiring: SDA=GPIO5, SCL=GPIO6, VCC(3.3V), GND\n");
+#endif
+        logInfo("[Setup] Type 'scan' to scan I2C bus for devices\n");
     }
-    
-    // Initialize BLE
-    setupBLE();
-    
-    // Show initial status and menu
+}
+
+void setupFlashLog() {
+    // Mount the log partition; this formats it on first use, which takes a few seconds
+    if (flashLogBegin()) {
+        bootMark(BOOT_MARK_LOG_MOUNTED);
+        FlashLogStats st;
+        flashLogGetStats(st);
+        logInfo("[Setup] Flash log mounted: boot %u, %lu segments, %lu of %lu KB used\n", st.boot,
+                (unsigned long)st.segments, (unsigned long)(st.usedBytes / 1024),
+                (unsigned long)(st.totalBytes / 1024));
+    } else {
+        logError("[Setup] ✗ Flash log partition could not be mounted\n");
+    }
+}
+
+// Saved settings are applied once the sensor and BLE are up; without any
+// the node keeps the defaults its modules started with.
+void applySavedSettings() {
+    Settings s;
+    if (settingsLoad(s)) {
+        applySettings(s);
+        logInfo("[Setup] Saved settings applied\n");
+    }
+}
+
+// With FAST_BOOT the banner waits until a USB host is listening
+bool bannerPending = FAST_BOOT;
+
+void serviceDeferredBanner() {
+    if (!bannerPending || !Serial) {
+        return;
+    }
+    bannerPending = false;
+    bootMark(BOOT_MARK_USB_HOST);
+    printBootBanner();
+    printBleInfo();
     showStatus();
     printMenu();
+    bootPrintReport();
+}
+
+void setup() {
+    bootMark(BOOT_MARK_SETUP);
+
+    // Initialize USB Serial. The larger TX ring lets the binary stream go
+    // out in big writes without blocking; text goes through the console
+    // ring and its task, so no caller waits for the host.
+    Serial.setTxBufferSize(USB_CDC_TX_BUFFER);
+    Serial.begin(115200);
+    consoleBegin();
+    if (!FAST_BOOT) {
+        delay(2000); // Give time for serial monitor to connect
+        printBootBanner();
+    }
+    
+    // Event-driven scheduler: USB RX, BLE commands, benchmark runs and the status
+    // timer all wake loop() through one event group.
+    schedulerEvents = xEventGroupCreateStatic(&schedulerEventsState);
+    perfReset();
+#if ARDUINO_USB_MODE
+    Serial.onEvent(ARDUINO_HW_CDC_RX_EVENT, onUsbEvent);
+    Serial.onEvent(ARDUINO_HW_CDC_CONNECTED_EVENT, onUsbEvent);    // prints a deferred banner
+#endif
+    if (!commsBegin(schedulerEvents, EVT_BENCH_DONE)) {
+        logError("[Setup] ✗ Comms pipeline task could not be created\n");
+    }
+    // The station stays off until 'wifi join' or 'wifi on'
+    if (!wifiUdpBegin(handleWifiCommand, schedulerEvents, EVT_WIFI_COMMAND)) {
+        logError("[Setup] ✗ WiFi command queue could not be created\n");
+    }
+    statusTimer = xTimerCreateStatic("status", pdMS_TO_TICKS(STATUS_PERIOD_MS), pdTRUE, nullptr,
+                                     onStatusTimer, &statusTimerState);
+    
+    if (FAST_BOOT) {
+        // Sensor and BLE stack come up side by side; a job that cannot get
+        // a task runs here instead
+        if (!bootRun("imu_init", setupIMU, IMU_SAMPLER_CORE)) {
+            setupIMU();
+        }
+        if (!bootRun("ble_init", setupBLE, COMMS_CORE)) {
+            setupBLE();
+        }
+        if (!bootWait(BOOT_JOB_TIMEOUT_MS)) {
+            logError("[Setup] ✗ Sensor or BLE initialization timed out\n");
+        }
+        applySavedSettings();
+        // Mounting reads flash with the caches off, so it waits until advertising is up
+        setupFlashLog();
+    } else {
+        logInfo("[Setup] Initializing I2C...\n");
+        setupIMU();
+        setupFlashLog();
+        setupBLE();
+        applySavedSettings();
+        
+        // Show initial status and menu
+        showStatus();
+        printMenu();
+    }
     
-    lastStatusUpdate = millis();
+    xTimerStart(statusTimer, 0);
+    bootMark(BOOT_MARK_SETUP_DONE);
     
-    Serial.println("[Setup] All communication channels initialized!");
-    Serial.println("[Setup] Ready for testing...");
+    logInfo("[Setup] All communication channels initialized!\n");
+    logInfo("[Setup] Ready for testing...\n");
 }
 
 void loop() {
-    // Handle USB Serial input
-    if (Serial.available()) {
-        String input = Serial.readStringUntil('\n');
-        input.trim();
-        usbMessageCount++;
-        
-        processCommand(input, false);
+    // Sleep until something happens. Streaming and benchmarks run on the
+    // comms pipeline; while it is busy, wake once per energy window so the
+    // power figures keep up with its work.
+    TickType_t wait = commsActive() ? pdMS_TO_TICKS(POWER_WINDOW_MS) : portMAX_DELAY;
+#if !ARDUINO_USB_MODE
+    if (wait > pdMS_TO_TICKS(USB_POLL_MS)) {
+        wait = pdMS_TO_TICKS(USB_POLL_MS);
+    }
+#endif
+    if (i2cScanActive() && wait > pdMS_TO_TICKS(i2cScanWaitMs())) {
+        wait = pdMS_TO_TICKS(i2cScanWaitMs());
+    }
+    if (bannerPending && wait > pdMS_TO_TICKS(BANNER_POLL_MS)) {
+        wait = pdMS_TO_TICKS(BANNER_POLL_MS);
     }
+    EventBits_t events = xEventGroupWaitBits(schedulerEvents, EVT_ALL, pdTRUE, pdFALSE, wait);
+    uint32_t busyStartUs = (uint32_t)esp_timer_get_time();
+
+    // USB input is checked on every wakeup; it costs one FIFO read when idle
+    serviceUsbInput();
+    serviceDeferredBanner();
     
+    if (events & EVT_BLE_COMMAND) {
+        bleCommandService();
+    }
 
+    if (events & EVT_WIFI_COMMAND) {
+        wifiCommandService();
+    }
     
-    // Periodic status update every 30 seconds
-    if (millis() - lastStatusUpdate > 30000) {
-        Serial.println("\n[Periodic Update] System running - " + String(millis() / 1000) + "s uptime");
-        Serial.println("Connections: USB=Active, BLE=" + String(bleConnected ? "Connected" : "Advertising"));
-        if (!bleConnected) {
-            Serial.println("[BLE] Still advertising as 'XIAO-ESP32S3-Test' - ready for connections");
-        }
-        lastStatusUpdate = millis();
+    // A few more probes of a background I2C scan
+    i2cScanService();
+    
+    if (events & EVT_BENCH_DONE) {
+        showBenchResult();
+    }
+    
+    if (events & EVT_STATUS) {
+        showPeriodicStatus();
     }
     
-    delay(100); // Small delay to prevent overwhelming the serial output
+    // Feed the energy model with how long this pass and the pipeline kept the CPU busy
+    powerAccount((uint32_t)esp_timer_get_time() - busyStartUs + commsTakeBusyUs());
 }
\ No newline at end of file
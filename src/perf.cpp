@@ -0,0 +1,187 @@
+/*
+ * Latency and throughput instrumentation - see perf.h
+ */
+
+#include "perf.h"
+#include "console.h"
+#include "flash_log.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define PERF_SNAPSHOT_HEADER_BYTES  16
+#define PERF_SNAPSHOT_METRIC_BYTES  26
+
+PerfHistogram perfHistograms[PERF_METRIC_COUNT];
+
+struct MetricInfo {
+    const char* name;
+    bool cycles;
+};
+
+static const MetricInfo metrics[PERF_METRIC_COUNT] = {
+    { "cmd dispatch",      true  },
+    { "BLE notify",        true  },
+    { "I2C sample read",   true  },
+    { "I2C FIFO burst",    true  },
+    { "BLE sample->tx",    false },
+    { "USB sample->tx",    false },
+    { "sample jitter",     false },
+    { "flash log write",   false },
+    { "spectral window",   true  },
+    { "WiFi sample->tx",   false },
+};
+
+#if configUSE_TRACE_FACILITY
+static TaskStatus_t tasks[PERF_MAX_TASKS];
+#if configGENERATE_RUN_TIME_STATS
+// Run-time counters from the previous report, for per-interval CPU usage
+static TaskHandle_t prevHandle[PERF_MAX_TASKS];
+static uint32_t prevRunTime[PERF_MAX_TASKS];
+static size_t prevCount = 0;
+static uint32_t prevTotal = 0;
+#endif
+#endif
+
+const char* perfMetricName(PerfMetric metric) {
+    return metrics[metric].name;
+}
+
+bool perfMetricInCycles(PerfMetric metric) {
+    return metrics[metric].cycles;
+}
+
+void perfReset() {
+    for (size_t i = 0; i < PERF_METRIC_COUNT; i++) {
+        perfHistograms[i].reset();
+    }
+}
+
+static uint32_t toUs(uint32_t cycles, uint32_t mhz) {
+    return mhz ? cycles / mhz : cycles;
+}
+
+static void printFlashLog() {
+    FlashLogStats st;
+    flashLogGetStats(st);
+    if (!st.mounted) {
+        consolePrintln("Flash log: not mounted");
+        return;
+    }
+    uint32_t written = st.blocks * FLOG_BLOCK_BYTES;
+    uint32_t payload = st.records * sizeof(CaptureRecord);
+    consolePrintf("Flash log: %lu blocks, %lu syncs, %lu KB in %lu ms of writes (%.0f KB/s)\n",
+                  (unsigned long)st.blocks, (unsigned long)st.syncs, (unsigned long)(written / 1024),
+                  (unsigned long)(st.writeUs / 1000), st.writeUs ? written / 1.024f / (st.writeUs / 1000.0f) : 0);
+    consolePrintf("  amplification %.2fx (file bytes per record byte), %lu dropped, %lu errors\n",
+                  payload ? (float)written / payload : 0, (unsigned long)st.droppedRecords,
+                  (unsigned long)st.writeErrors);
+    uint32_t partitionBlocks = st.totalBytes / FLOG_BLOCK_BYTES;
+    consolePrintf("  wear: %lu blocks written over all boots, ~%.2f erase cycles per block\n",
+                  (unsigned long)st.lifetimeBlocks,
+                  partitionBlocks ? (float)st.lifetimeBlocks / partitionBlocks : 0);
+}
+
+static void printTasks() {
+#if configUSE_TRACE_FACILITY
+    uint32_t total = 0;
+    UBaseType_t n = uxTaskGetSystemState(tasks, PERF_MAX_TASKS, &total);
+    if (n == 0) {
+        consolePrintf("Tasks: more than %d, table not read\n", PERF_MAX_TASKS);
+        return;
+    }
+    consolePrintln("Task              Prio  Stack free  CPU");
+    for (UBaseType_t i = 0; i < n; i++) {
+        const TaskStatus_t& t = tasks[i];
+        char cpu[8] = "-";
+#if configGENERATE_RUN_TIME_STATS
+        // Percent of all cores since the previous report
+        uint32_t elapsed = (total - prevTotal) * portNUM_PROCESSORS;
+        for (size_t j = 0; j < prevCount && elapsed > 0; j++) {
+            if (prevHandle[j] == t.xHandle) {
+                uint32_t ran = t.ulRunTimeCounter - prevRunTime[j];
+                snprintf(cpu, sizeof(cpu), "%lu%%", (unsigned long)((uint64_t)ran * 100 / elapsed));
+                break;
+            }
+        }
+#endif
+        // ESP-IDF stacks are byte-addressed, so the mark is in bytes
+        consolePrintf("%-16s  %4lu  %10lu  %s\n", t.pcTaskName, (unsigned long)t.uxCurrentPriority,
+                      (unsigned long)t.usStackHighWaterMark, cpu);
+    }
+#if configGENERATE_RUN_TIME_STATS
+    for (UBaseType_t i = 0; i < n; i++) {
+        prevHandle[i] = tasks[i].xHandle;
+        prevRunTime[i] = tasks[i].ulRunTimeCounter;
+    }
+    prevCount = n;
+    prevTotal = total;
+#else
+    consolePrintln("(CPU usage needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)");
+#endif
+#else
+    consolePrintf("Task %s stack free: %lu bytes\n", pcTaskGetName(nullptr),
+                  (unsigned long)uxTaskGetStackHighWaterMark(nullptr));
+    consolePrintln("(task table needs CONFIG_FREERTOS_USE_TRACE_FACILITY)");
+#endif
+}
+
+void perfPrintReport() {
+    uint32_t mhz = getCpuFrequencyMhz();
+    consolePrintln("\n=== Performance ===");
+    consolePrintf("CPU clock: %lu MHz, all figures in us\n", (unsigned long)mhz);
+    consolePrintln("Stage               Count      Mean       p50       p99       Max");
+    for (size_t i = 0; i < PERF_METRIC_COUNT; i++) {
+        const PerfHistogram& h = perfHistograms[i];
+        if (h.count == 0) {
+            consolePrintf("%-16s  %7s\n", metrics[i].name, "-");
+            continue;
+        }
+        uint32_t scale = metrics[i].cycles ? mhz : 1;
+        consolePrintf("%-16s  %7lu  %8lu  %8lu  %8lu  %8lu\n", metrics[i].name, (unsigned long)h.count,
+                      (unsigned long)toUs(h.mean(), scale), (unsigned long)toUs(h.percentile(50), scale),
+                      (unsigned long)toUs(h.percentile(99), scale), (unsigned long)toUs(h.max, scale));
+    }
+    consolePrintln("(percentiles are log2 bucket upper bounds)");
+    printFlashLog();
+    printTasks();
+    consolePrintln("===================\n");
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t* put32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+    return p + 4;
+}
+
+size_t perfEncode(uint8_t* out, size_t size) {
+    const size_t len = PERF_SNAPSHOT_HEADER_BYTES + PERF_METRIC_COUNT * PERF_SNAPSHOT_METRIC_BYTES;
+    if (size < len) {
+        return 0;
+    }
+    uint8_t* p = out;
+    *p++ = PERF_SNAPSHOT_VERSION;
+    *p++ = PERF_METRIC_COUNT;
+    p = put16(p, getCpuFrequencyMhz());
+    p = put32(p, millis());
+    p = put32(p, ESP.getFreeHeap());
+    p = put32(p, ESP.getMinFreeHeap());
+    for (size_t i = 0; i < PERF_METRIC_COUNT; i++) {
+        const PerfHistogram& h = perfHistograms[i];
+        *p++ = i;
+        *p++ = metrics[i].cycles ? 0 : 1;
+        p = put32(p, h.count);
+        p = put32(p, h.count ? h.min : 0);
+        p = put32(p, h.mean());
+        p = put32(p, h.percentile(50));
+        p = put32(p, h.percentile(99));
+        p = put32(p, h.max);
+    }
+    return p - out;
+}
@@ -0,0 +1,219 @@
+/*
+ * Power profiles and energy estimate - see power.h
+ */
+
+#include "power.h"
+#include "ble_gatt.h"
+#include "ble_stream.h"
+#include "console.h"
+#include "imu_sampler.h"
+#include <esp_timer.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
+
+struct ProfileConfig {
+    const char* name;
+    uint16_t maxMhz;        // esp_pm maximum, also the fixed clock without esp_pm
+    uint16_t minMhz;        // esp_pm minimum
+    bool lightSleep;
+    uint16_t connMin;       // 1.25 ms units
+    uint16_t connMax;
+    uint16_t latency;       // connection events the peripheral may skip
+    uint16_t timeout;       // 10 ms units
+    uint16_t advMin;        // 0.625 ms units
+    uint16_t advMax;
+};
+
+// Supervision timeouts leave room for (1 + latency) * connMax * 2 as the
+// spec requires. BLE needs the CPU at 80 MHz or more.
+static const ProfileConfig profiles[] = {
+    { "throughput", 240, 240, false,   6,  12, 0, 400,   32,   64 },
+    { "balanced",   160,  80, false,  24,  40, 2, 500,  160,  320 },
+    { "low",         80,  80, true,   80, 160, 4, 600, 1600, 3200 },
+};
+
+static PowerProfile current = POWER_PROFILE_THROUGHPUT;
+static bool dfsActive = false;
+static bool lightSleepActive = false;
+
+// Energy accounting, in mC
+static double cpuCharge = 0;
+static double radioCharge = 0;
+static double imuCharge = 0;
+static double windowCharge = 0;
+static float windowMa = 0;
+static uint64_t lastUs = 0;
+static uint64_t resetUs = 0;
+static uint64_t windowStartUs = 0;
+static uint64_t busyTotalUs = 0;
+static uint32_t lastPackets = 0;
+
+static bool configurePm(const ProfileConfig& p) {
+    dfsActive = false;
+    lightSleepActive = false;
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32s3_t cfg;
+    cfg.max_freq_mhz = p.maxMhz;
+    cfg.min_freq_mhz = p.minMhz;
+    cfg.light_sleep_enable = p.lightSleep;
+    esp_err_t err = esp_pm_configure(&cfg);
+    if (err == ESP_ERR_NOT_SUPPORTED && p.lightSleep) {
+        // No tickless idle in this SDK build: keep the frequency scaling
+        cfg.light_sleep_enable = false;
+        err = esp_pm_configure(&cfg);
+    }
+    if (err == ESP_OK) {
+        dfsActive = p.maxMhz != p.minMhz;
+        lightSleepActive = cfg.light_sleep_enable;
+        return true;
+    }
+    logError("[Power] esp_pm_configure failed: %s\n", esp_err_to_name(err));
+#endif
+    return false;
+}
+
+static void armImuWakeup(bool on) {
+    if (on && imuSamplerRunning() && (imuSamplerMode() == IMU_ACQ_REGISTER || imuSamplerMode() == IMU_ACQ_FIFO)) {
+        // The register and FIFO modes own the pin with an edge interrupt; a
+        // level wakeup would override its trigger type.
+        logWarn("[Power] %s sampling active - IMU wakeup not armed\n", imuSamplerModeName(imuSamplerMode()));
+        on = false;
+    }
+    if (on) {
+        gpio_wakeup_enable((gpio_num_t)IMU_INT_PIN, GPIO_INTR_HIGH_LEVEL);
+        esp_sleep_enable_gpio_wakeup();
+    } else {
+        gpio_wakeup_disable((gpio_num_t)IMU_INT_PIN);
+    }
+}
+
+static void requestLink(const ProfileConfig& p) {
+    if (bleStreamConnected()) {
+        bleStreamRequestConnParams(p.connMin, p.connMax, p.latency, p.timeout);
+    }
+}
+
+void powerSetProfile(PowerProfile profile) {
+    const ProfileConfig& p = profiles[profile];
+    current = profile;
+
+    if (!configurePm(p)) {
+        // Without esp_pm the clock stays where we put it
+        setCpuFrequencyMhz(p.maxMhz);
+    }
+    armImuWakeup(lightSleepActive);
+
+    bleGattSetAdvInterval(p.advMin, p.advMax);
+    requestLink(p);
+
+    consolePrintf("[Power] Profile %s: CPU %lu MHz%s%s\n", p.name, (unsigned long)getCpuFrequencyMhz(),
+                  dfsActive ? ", DFS" : "", lightSleepActive ? ", auto light sleep" : "");
+}
+
+PowerProfile powerProfile() {
+    return current;
+}
+
+const char* powerProfileName(PowerProfile profile) {
+    return profiles[profile].name;
+}
+
+void powerOnConnect() {
+    requestLink(profiles[current]);
+}
+
+void powerOnSamplerChange() {
+    armImuWakeup(lightSleepActive);
+}
+
+static float activeMa(uint32_t mhz) {
+    return POWER_MODEL_BASE_MA + POWER_MODEL_MA_PER_MHZ * mhz;
+}
+
+void powerAccount(uint32_t busyUs) {
+    uint64_t now = (uint64_t)esp_timer_get_time();
+    if (lastUs == 0) {
+        lastUs = resetUs = windowStartUs = now;
+        return;
+    }
+    double dtS = (now - lastUs) / 1e6;
+    lastUs = now;
+    double busyS = busyUs / 1e6;
+    if (busyS > dtS) {
+        busyS = dtS;
+    }
+    busyTotalUs += busyUs;
+
+    const ProfileConfig& p = profiles[current];
+    float busyMa = activeMa(dfsActive ? p.maxMhz : getCpuFrequencyMhz());
+    float idleMa = lightSleepActive ? POWER_MODEL_SLEEP_MA
+                                    : activeMa(dfsActive ? p.minMhz : getCpuFrequencyMhz()) * POWER_MODEL_IDLE_FACTOR;
+    double cpu = busyS * busyMa + (dtS - busyS) * idleMa;
+
+    // Radio: connection events of every client at its negotiated interval
+    // (skipping the allowed latency while idle), advertising events while a
+    // slot is free, plus notifications.
+    double radio = 0;
+    BleStreamStats ble;
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        bleStreamGetStats(i, ble);
+        if (!ble.connected) {
+            continue;
+        }
+        uint16_t interval = ble.connInterval ? ble.connInterval : p.connMax;
+        double eventS = interval * 1.25e-3 * (1 + p.latency);
+        radio += dtS / eventS * POWER_MODEL_CONN_EVENT_UC / 1000.0;
+    }
+    if (bleStreamClientCount() < BLE_MAX_CLIENTS) {
+        double advS = (p.advMin + p.advMax) * 0.5 * 0.625e-3;
+        radio += dtS / advS * POWER_MODEL_ADV_EVENT_UC / 1000.0;
+    }
+    bleStreamGetStats(BLE_ALL_CLIENTS, ble);
+    uint32_t packets = ble.packets - lastPackets;
+    lastPackets = ble.packets;
+    if (packets < 0x80000000UL) {   // the stream resets its counter on enable
+        radio += packets * POWER_MODEL_NOTIFY_UC / 1000.0;
+    }
+
+    double imu = dtS * (imuSamplerRunning() ? POWER_MODEL_IMU_ACTIVE_MA : POWER_MODEL_IMU_IDLE_MA);
+
+    cpuCharge += cpu;
+    radioCharge += radio;
+    imuCharge += imu;
+    windowCharge += cpu + radio + imu;
+
+    if (now - windowStartUs >= (uint64_t)POWER_WINDOW_MS * 1000) {
+        windowMa = windowCharge / ((now - windowStartUs) / 1e6);
+        windowCharge = 0;
+        windowStartUs = now;
+    }
+}
+
+void powerGetStats(PowerStats& out) {
+    double elapsedS = (lastUs - resetUs) / 1e6;
+    double total = cpuCharge + radioCharge + imuCharge;
+
+    out.profile = current;
+    out.cpuMhz = getCpuFrequencyMhz();
+    out.dfsActive = dfsActive;
+    out.lightSleepActive = lightSleepActive;
+    out.avgMa = elapsedS > 0 ? total / elapsedS : 0;
+    out.windowMa = windowMa;
+    out.cpuMah = cpuCharge / 3600.0;
+    out.radioMah = radioCharge / 3600.0;
+    out.imuMah = imuCharge / 3600.0;
+    out.totalMah = total / 3600.0;
+    out.totalMwh = out.totalMah * POWER_MODEL_SUPPLY_V;
+    out.elapsedMs = (uint32_t)(elapsedS * 1000);
+    out.busyPercent = elapsedS > 0 ? busyTotalUs / 1e4 / elapsedS : 0;
+}
+
+void powerResetStats() {
+    cpuCharge = radioCharge = imuCharge = windowCharge = 0;
+    windowMa = 0;
+    busyTotalUs = 0;
+    resetUs = windowStartUs = lastUs;
+}
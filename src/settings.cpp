@@ -0,0 +1,61 @@
+/*
+ * Saved node settings in NVS - see settings.h
+ */
+
+#include "settings.h"
+#include "i2c_bus.h"
+#include "power.h"
+#include "wifi_udp.h"
+#include "console.h"
+#include <Preferences.h>
+
+void settingsDefaults(Settings& out) {
+    memset(&out, 0, sizeof(out));
+    out.version = SETTINGS_VERSION;
+    out.acqMode = IMU_ACQ_REGISTER;
+    out.sensor = IMU_SENSOR_DEFAULTS;
+    out.dmpRateHz = IMU_DMP_DEFAULT_RATE_HZ;
+    out.i2cClockKhz = I2C_BUS_FAST_HZ / 1000;
+    out.powerProfile = POWER_PROFILE_THROUGHPUT;
+    out.wifiCoex = WIFI_COEX_BALANCE;
+}
+
+bool settingsLoad(Settings& out) {
+    Preferences prefs;
+    settingsDefaults(out);
+    if (!prefs.begin(SETTINGS_NAMESPACE, true)) {
+        return false;   // namespace not created yet: nothing was ever saved
+    }
+    Settings s;
+    size_t len = prefs.getBytesLength(SETTINGS_KEY);
+    bool ok = len == sizeof(s) && prefs.getBytes(SETTINGS_KEY, &s, sizeof(s)) == sizeof(s) &&
+              s.version == SETTINGS_VERSION && s.acqMode <= IMU_ACQ_DMP9 &&
+              s.powerProfile <= POWER_PROFILE_LOW && s.wifiCoex <= WIFI_COEX_BLE;
+    prefs.end();
+    if (ok) {
+        out = s;
+    } else if (len > 0) {
+        logWarn("[Settings] Saved settings ignored: other layout or invalid (%u bytes)\n", (unsigned)len);
+    }
+    return ok;
+}
+
+bool settingsSave(const Settings& s) {
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, false)) {
+        return false;
+    }
+    bool ok = prefs.putBytes(SETTINGS_KEY, &s, sizeof(s)) == sizeof(s);
+    prefs.end();
+    return ok;
+}
+
+bool settingsErase() {
+    Preferences prefs;
+    if (!prefs.begin(SETTINGS_NAMESPACE, false)) {
+        return false;
+    }
+    bool ok = !prefs.isKey(SETTINGS_KEY) || prefs.remove(SETTINGS_KEY);
+    prefs.end();
+    return ok;
+}
@@ -0,0 +1,303 @@
+/*
+ * On-device spectral features - see spectral.h
+ */
+
+#include "spectral.h"
+#include "ble_stream.h"
+#include "imu_sampler.h"
+#include "perf.h"
+#include "stream_frame.h"
+#include <esp_dsp.h>
+#include <esp_heap_caps.h>
+#include <math.h>
+
+#define N           SPECTRAL_FFT_SIZE
+#define HALF        (SPECTRAL_FFT_SIZE / 2)
+
+// Hann: sum(w) = N / 2, sum(w^2) = 3N / 8
+#define HANN_AMPLITUDE  (4.0f / N)                  // |X| of a tone -> its amplitude
+#define HANN_POWER      (16.0f / (3.0f * N * N))    // one-sided sum |X|^2 -> mean square
+
+struct Buffers {
+    float xy[2 * N];            // x + jy, then both spectra (dsps_cplx2reC_fc32)
+    float z[2 * N];
+    float window[N];
+    float power[3][HALF];       // running sum over the average
+    int16_t acc[3][N];          // accel history, circular
+};
+
+static Buffers* buf = nullptr;
+static bool enabled = false;
+static bool usbOut = false;
+static uint8_t average = 1;
+
+static uint32_t head = 0;       // samples written to the history
+static uint32_t lastUs = 0;
+static uint8_t summed = 0;      // windows in power[] and msSum[]
+static double msSum[3];
+static uint16_t seq = 0;
+
+static uint32_t windows = 0;
+static uint32_t packets = 0;
+static uint32_t bleSent = 0;
+static uint32_t bleSmallMtu = 0;
+static uint32_t usbSent = 0;
+static uint32_t usbDropped = 0;
+static uint32_t skipped = 0;
+static uint32_t computeUs = 0;
+static bool haveLast = false;
+static SpectralPacket last;
+static uint8_t frame[sizeof(SpectralPacket) + STREAM_FRAME_OVERHEAD];
+
+static void restart() {
+    head = 0;
+    summed = 0;
+    for (int a = 0; a < 3; a++) {
+        msSum[a] = 0;
+        memset(buf->power[a], 0, sizeof(buf->power[a]));
+    }
+}
+
+static bool allocate() {
+    if (buf) {
+        return true;
+    }
+    // esp-dsp's optimised kernels want 16-byte aligned data
+    buf = (Buffers*)heap_caps_aligned_alloc(16, sizeof(Buffers), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!buf) {
+        return false;
+    }
+    // Allocates the shared twiddle table on the first call
+    if (dsps_fft2r_init_fc32(nullptr, N) != ESP_OK) {
+        heap_caps_free(buf);
+        buf = nullptr;
+        return false;
+    }
+    dsps_wind_hann_f32(buf->window, N);
+    return true;
+}
+
+bool spectralSetEnabled(bool on, bool usb) {
+    if (on && !allocate()) {
+        return false;
+    }
+    if (on && !enabled) {
+        restart();
+        seq = 0;
+        windows = 0;
+        packets = 0;
+        bleSent = 0;
+        bleSmallMtu = 0;
+        usbSent = 0;
+        usbDropped = 0;
+        skipped = 0;
+        haveLast = false;
+    }
+    enabled = on;
+    usbOut = on && usb;
+    return true;
+}
+
+bool spectralEnabled() {
+    return enabled;
+}
+
+bool spectralSetAverage(uint8_t n) {
+    if (n < 1 || n > SPECTRAL_MAX_AVERAGE) {
+        return false;
+    }
+    average = n;
+    if (buf) {
+        restart();
+    }
+    return true;
+}
+
+static int16_t levelCode(float mg) {
+    if (!(mg > 0)) {
+        return SPECTRAL_LEVEL_FLOOR;
+    }
+    float v = 2000.0f * log10f(mg);
+    return v >= INT16_MAX ? INT16_MAX : v <= INT16_MIN + 1 ? INT16_MIN + 1 : (int16_t)lroundf(v);
+}
+
+// Accumulates the power spectra of the window ending at the newest sample
+static void transform() {
+    float mean[3];
+    for (int a = 0; a < 3; a++) {
+        int32_t sum = 0;
+        for (int n = 0; n < N; n++) {
+            sum += buf->acc[a][n];
+        }
+        mean[a] = (float)sum / N;
+    }
+
+    float ms[3] = { 0, 0, 0 };
+    for (int n = 0; n < N; n++) {
+        int i = (head + n) & (N - 1);   // oldest first
+        float w = buf->window[n];
+        float x = buf->acc[0][i] - mean[0];
+        float y = buf->acc[1][i] - mean[1];
+        float z = buf->acc[2][i] - mean[2];
+        ms[0] += x * x;
+        ms[1] += y * y;
+        ms[2] += z * z;
+        buf->xy[2 * n] = x * w;
+        buf->xy[2 * n + 1] = y * w;
+        buf->z[2 * n] = z * w;
+        buf->z[2 * n + 1] = 0;
+    }
+
+    dsps_fft2r_fc32(buf->xy, N);
+    dsps_bit_rev_fc32(buf->xy, N);
+    dsps_cplx2reC_fc32(buf->xy, N);
+    dsps_fft2r_fc32(buf->z, N);
+    dsps_bit_rev_fc32(buf->z, N);
+
+    // x in bins 0..N/2 of xy, y from bin N/2 on
+    const float* spectra[3] = { buf->xy, buf->xy + N, buf->z };
+    for (int a = 0; a < 3; a++) {
+        const float* X = spectra[a];
+        float* p = buf->power[a];
+        for (int k = 0; k < HALF; k++) {
+            p[k] += X[2 * k] * X[2 * k] + X[2 * k + 1] * X[2 * k + 1];
+        }
+        msSum[a] += ms[a] / N;
+    }
+    windows++;
+}
+
+static void reduce(SpectralAxis& out, const float* p, double msTotal, float scale, float mgPerLsb) {
+    out.rms = levelCode(sqrtf((float)msTotal * scale) * mgPerLsb);
+
+    int peak = SPECTRAL_MIN_BIN;
+    for (int k = SPECTRAL_MIN_BIN + 1; k < HALF; k++) {
+        if (p[k] > p[peak]) {
+            peak = k;
+        }
+    }
+    // Gaussian interpolation: a parabola through the log power of the peak
+    // and its neighbours, which the Hann main lobe of a tone nearly is. Its
+    // vertex also undoes most of the scalloping loss between bins.
+    float delta = 0;
+    float top = p[peak];
+    if (peak + 1 < HALF && p[peak - 1] > 0 && p[peak] > 0 && p[peak + 1] > 0) {
+        float l = logf(p[peak - 1]);
+        float c = logf(p[peak]);
+        float r = logf(p[peak + 1]);
+        float d = l - 2 * c + r;
+        if (d < 0) {
+            delta = 0.5f * (l - r) / d;
+            top = expf(c - 0.25f * delta * (l - r));
+        }
+    }
+    float hz = (peak + delta) * imuSamplerRateHz() / N;
+    out.peakCentiHz = (uint16_t)lroundf(hz * 100.0f);
+    out.peak = levelCode(sqrtf(top * scale) * HANN_AMPLITUDE * mgPerLsb);
+
+    for (int b = 0; b < SPECTRAL_BANDS; b++) {
+        int lo = HALF >> (SPECTRAL_BANDS - b);
+        int hi = HALF >> (SPECTRAL_BANDS - 1 - b);
+        float sum = 0;
+        for (int k = lo; k < hi; k++) {
+            sum += p[k];
+        }
+        out.band[b] = levelCode(sqrtf(sum * scale * HANN_POWER) * mgPerLsb);
+    }
+}
+
+static void send(const SpectralPacket& pkt) {
+    const uint8_t* data = (const uint8_t*)&pkt;
+    for (int i = 0; i < BLE_MAX_CLIENTS; i++) {
+        if (!bleStreamClientConnected(i)) {
+            continue;
+        }
+        BleStreamStats st;
+        bleStreamGetStats(i, st);
+        if (st.mtu < sizeof(pkt) + 3) {
+            bleSmallMtu++;
+        } else if (bleStreamNotify(i, BLE_CHAR_SPECTRUM, data, sizeof(pkt))) {
+            bleSent++;
+        }
+    }
+    if (usbOut) {
+        size_t len = streamFrameEncode(data, sizeof(pkt), frame, sizeof(frame));
+        if ((size_t)Serial.availableForWrite() < len) {
+            usbDropped++;
+        } else {
+            Serial.write(frame, len);
+            usbSent++;
+        }
+    }
+}
+
+static void emit() {
+    ICM_20948_fss_t fss = imuSamplerFullScale();
+    float mgPerLsb = imuAccelMg(1, fss.a);
+    float scale = 1.0f / summed;
+
+    SpectralPacket pkt;
+    pkt.hdr.type = STREAM_PKT_SPECTRUM;
+    pkt.hdr.bands = SPECTRAL_BANDS;
+    pkt.hdr.seq = seq++;
+    pkt.hdr.endUs = lastUs;
+    pkt.hdr.rateHz = imuSamplerRateHz();
+    pkt.hdr.fftLog2 = SPECTRAL_FFT_LOG2;
+    pkt.hdr.windows = summed;
+    for (int a = 0; a < 3; a++) {
+        reduce(pkt.axis[a], buf->power[a], msSum[a], scale, mgPerLsb);
+        msSum[a] = 0;
+        memset(buf->power[a], 0, sizeof(buf->power[a]));
+    }
+    summed = 0;
+    packets++;
+    last = pkt;
+    haveLast = true;
+    send(pkt);
+}
+
+void spectralFeed(const ImuSample& s) {
+    if (!enabled) {
+        return;
+    }
+    if (s.kind != IMU_SAMPLE_AGMT) {
+        skipped++;
+        return;
+    }
+    int i = head & (N - 1);
+    buf->acc[0][i] = s.acc[0];
+    buf->acc[1][i] = s.acc[1];
+    buf->acc[2][i] = s.acc[2];
+    head++;
+    lastUs = s.timestampUs;
+    if (head < N || (head & (SPECTRAL_HOP - 1)) != 0) {
+        return;
+    }
+
+    uint32_t start = perfCycles();
+    transform();
+    if (++summed >= average) {
+        emit();
+    }
+    perfRecordSince(PERF_SPECTRAL_WINDOW, start);
+    computeUs = (perfCycles() - start) / getCpuFrequencyMhz();
+}
+
+void spectralGetStatus(SpectralStatus& out) {
+    out.allocated = buf != nullptr;
+    out.enabled = enabled;
+    out.usb = usbOut;
+    out.average = average;
+    out.windows = windows;
+    out.packets = packets;
+    out.bleSent = bleSent;
+    out.bleSmallMtu = bleSmallMtu;
+    out.usbSent = usbSent;
+    out.usbDropped = usbDropped;
+    out.skipped = skipped;
+    out.computeUs = computeUs;
+    out.haveLast = haveLast;
+    if (haveLast) {
+        out.last = last;
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ * Binary IMU streaming over native USB CDC - see usb_stream.h
+ */
+
+#include "usb_stream.h"
+#include "stream_packet.h"
+#include "stream_frame.h"
+#include "perf.h"
+#include <esp_timer.h>
+
+#define USB_STREAM_PACKET_BYTES (sizeof(StreamPacketHeader) + USB_STREAM_PACKET_SAMPLES * sizeof(StreamSampleRecord))
+
+static bool enabled = false;
+
+static uint8_t staging[USB_STREAM_PACKET_BYTES];
+static StreamPacker packer;
+static bool packerReady = false;
+static unsigned long packetStartMs = 0;
+
+static uint8_t txBuf[USB_STREAM_TX_BYTES];
+static size_t txLen = 0;
+static uint32_t txFrames = 0;          // frames currently in txBuf
+static uint32_t txSamples = 0;         // samples currently in txBuf
+static unsigned long txOldestMs = 0;
+static uint32_t txOldestSampleUs = 0;  // timestamp of the first sample in txBuf
+
+static UsbStreamStats stats;
+
+bool usbStreamSetEnabled(bool on) {
+    if (!packerReady) {
+        packer.begin(staging, sizeof(staging));
+        packerReady = true;
+    }
+    if (on && !enabled) {
+        packer.resetSequence();
+        txLen = 0;
+        txFrames = 0;
+        txSamples = 0;
+        memset(&stats, 0, sizeof(stats));
+    }
+    enabled = on;
+    return true;
+}
+
+bool usbStreamEnabled() {
+    return enabled;
+}
+
+static void commitPacket() {
+    if (packer.empty()) {
+        return;
+    }
+    size_t frameLen = packer.length() + STREAM_FRAME_OVERHEAD;
+    if (txLen + frameLen > sizeof(txBuf)) {
+        stats.droppedFrames++;
+        stats.droppedSamples += packer.count();
+    } else {
+        if (txLen == 0) {
+            txOldestMs = millis();
+            txOldestSampleUs = packer.firstTimestampUs();
+        }
+        txLen += streamFrameEncode(packer.data(), packer.length(), txBuf + txLen, sizeof(txBuf) - txLen);
+        txFrames++;
+        txSamples += packer.count();
+    }
+    packer.next();
+}
+
+void usbStreamFeed(const ImuSample& s) {
+    if (!enabled) {
+        return;
+    }
+    if (packer.empty()) {
+        packetStartMs = millis();
+    }
+    if (!packer.add(s)) {
+        commitPacket();
+        packetStartMs = millis();
+        packer.add(s);
+    }
+    if (packer.count() >= USB_STREAM_PACKET_SAMPLES) {
+        commitPacket();
+    }
+}
+
+void usbStreamService() {
+    if (!enabled) {
+        return;
+    }
+
+    // Bound latency at low rates: close a partial packet once it is stale
+    if (!packer.empty() && millis() - packetStartMs >= USB_STREAM_FLUSH_MS) {
+        commitPacket();
+    }
+    if (txLen == 0) {
+        return;
+    }
+    if (txLen < USB_STREAM_WRITE_THRESHOLD && millis() - txOldestMs < USB_STREAM_FLUSH_MS) {
+        return;
+    }
+
+    // Only hand the driver whole batches it can take without blocking, so a
+    // frame is never split around text printed from elsewhere.
+    if ((size_t)Serial.availableForWrite() < txLen) {
+        if (txLen + USB_STREAM_PACKET_BYTES + STREAM_FRAME_OVERHEAD > sizeof(txBuf)) {
+            // Host is not draining; drop the batch rather than stall the pipeline
+            stats.droppedFrames += txFrames;
+            stats.droppedSamples += txSamples;
+            txLen = 0;
+            txFrames = 0;
+            txSamples = 0;
+        }
+        return;
+    }
+
+    Serial.write(txBuf, txLen);
+    perfRecord(PERF_USB_SAMPLE_TO_TX, (uint32_t)esp_timer_get_time() - txOldestSampleUs);
+    stats.writes++;
+    stats.bytes += txLen;
+    stats.frames += txFrames;
+    stats.samples += txSamples;
+    txLen = 0;
+    txFrames = 0;
+    txSamples = 0;
+}
+
+void usbStreamSetDelta(bool on) {
+    packer.setDelta(on);
+}
+
+void usbStreamGetStats(UsbStreamStats& out) {
+    out = stats;
+    out.delta = packer.delta();
+}
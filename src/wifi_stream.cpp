@@ -0,0 +1,138 @@
+/*
+ * Binary IMU streaming over Wi-Fi UDP - see wifi_stream.h
+ */
+
+#include "wifi_stream.h"
+#include "wifi_udp.h"
+#include "stream_packet.h"
+#include "perf.h"
+#include <esp_timer.h>
+#include <lwip/pbuf.h>
+
+static bool enabled = false;
+static uint32_t targetIp = 0;
+static uint16_t targetPort = 0;
+
+static StreamPacker packer;
+static struct pbuf* packet = nullptr;  // datagram the packer is filling
+static unsigned long packetStartMs = 0;
+
+static WifiStreamStats stats;
+
+// Points the packer at a fresh datagram
+static bool openPacket() {
+    packet = pbuf_alloc(PBUF_TRANSPORT, WIFI_STREAM_MAX_DATAGRAM, PBUF_RAM);
+    if (!packet) {
+        stats.allocFailures++;
+        return false;
+    }
+    packer.setBuffer((uint8_t*)packet->payload, WIFI_STREAM_MAX_DATAGRAM);
+    packetStartMs = millis();
+    return true;
+}
+
+static void commitPacket() {
+    if (!packet || packer.empty()) {
+        return;
+    }
+    size_t len = packer.length();
+    size_t samples = packer.count();
+    uint32_t firstUs = packer.firstTimestampUs();
+    pbuf_realloc(packet, len);
+    // wifiUdpSend() owns the pbuf from here, sent or not
+    if (wifiUdpSend(WIFI_UDP_STREAM, packet, targetIp, targetPort)) {
+        perfRecord(PERF_WIFI_SAMPLE_TO_TX, (uint32_t)esp_timer_get_time() - firstUs);
+        stats.packets++;
+        stats.bytes += len;
+        stats.samples += samples;
+    } else {
+        stats.droppedPackets++;
+        stats.droppedSamples += samples;
+    }
+    packet = nullptr;
+    packer.next();
+    packer.setBuffer(nullptr, 0);
+}
+
+static void discardPacket() {
+    if (packet) {
+        stats.droppedSamples += packer.count();
+        pbuf_free(packet);
+        packet = nullptr;
+    }
+    packer.setBuffer(nullptr, 0);
+}
+
+bool wifiStreamSetEnabled(bool on) {
+    if (on && targetIp == 0) {
+        return false;
+    }
+    if (on && !enabled) {
+        packer.resetSequence();
+        memset(&stats, 0, sizeof(stats));
+    }
+    if (!on) {
+        discardPacket();
+    }
+    enabled = on;
+    return true;
+}
+
+bool wifiStreamEnabled() {
+    return enabled;
+}
+
+void wifiStreamSetTarget(uint32_t ip, uint16_t port) {
+    targetIp = ip;
+    targetPort = port;
+}
+
+void wifiStreamFeed(const ImuSample& s) {
+    if (!enabled) {
+        return;
+    }
+    if (!wifiConnected()) {
+        stats.droppedSamples++;
+        return;
+    }
+    if (!packet && !openPacket()) {
+        stats.droppedSamples++;
+        return;
+    }
+    if (!packer.add(s)) {
+        commitPacket();
+        if (!openPacket()) {
+            stats.droppedSamples++;
+            return;
+        }
+        packer.add(s);
+    }
+    if (packer.count() >= WIFI_STREAM_PACKET_SAMPLES) {
+        commitPacket();
+    }
+}
+
+void wifiStreamService() {
+    if (!enabled) {
+        return;
+    }
+    if (!wifiConnected()) {
+        discardPacket();
+        return;
+    }
+    // Bound latency at low rates: close a partial packet once it is stale
+    if (packet && !packer.empty() && millis() - packetStartMs >= WIFI_STREAM_FLUSH_MS) {
+        commitPacket();
+    }
+}
+
+void wifiStreamSetDelta(bool on) {
+    packer.setDelta(on);
+}
+
+void wifiStreamGetStats(WifiStreamStats& out) {
+    out = stats;
+    out.delta = packer.delta();
+    out.targetIp = targetIp;
+    out.targetPort = targetPort;
+}
@@ -0,0 +1,287 @@
+/*
+ * Wi-Fi station and UDP link - see wifi_udp.h
+ */
+
+#include "wifi_udp.h"
+#include "console.h"
+#include "spsc_ring.h"
+#include <WiFi.h>
+#include <esp_coexist.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/queue.h>
+#include <lwip/pbuf.h>
+#include <lwip/tcpip.h>
+#include <lwip/udp.h>
+#include <string.h>
+
+struct WifiDatagram {
+    struct pbuf* p;
+    uint32_t ip;
+    uint16_t port;
+};
+
+struct WifiCommand {
+    uint32_t receivedUs;
+    uint32_t ip;
+    uint16_t port;
+    uint16_t len;
+    char data[CMD_LINE_MAX];
+};
+
+static WifiCommandHandler handler = nullptr;
+static EventGroupHandle_t readyEvents = nullptr;
+static EventBits_t readyBit = 0;
+
+static QueueHandle_t queue = nullptr;
+static StaticQueue_t queueState;
+static uint8_t queueStorage[WIFI_CMD_QUEUE_DEPTH * sizeof(WifiCommand)];
+
+// Created on the tcpip thread and kept for the life of the firmware
+static struct udp_pcb* volatile pcb = nullptr;
+static SpscRing<WifiDatagram, WIFI_UDP_QUEUE_DEPTH> outbox[WIFI_UDP_SENDER_COUNT];
+
+static bool started = false;
+static volatile bool linkUp = false;
+static uint8_t coex = WIFI_COEX_BALANCE;
+static bool maxPowerSave = false;
+
+static bool running = false;            // inside wifiCommandService()
+static uint32_t currentIp = 0;
+static uint16_t currentPort = 0;
+
+static volatile uint32_t commands = 0;
+static volatile uint32_t commandsDropped = 0;
+static volatile uint32_t sent = 0;
+static volatile uint32_t sendErrors = 0;
+static volatile uint32_t queueFull = 0;
+
+static const char* const coexNames[] = { "balance", "wifi", "ble" };
+
+// tcpip thread: one datagram is one command line
+static void onReceive(void* arg, struct udp_pcb* socket, struct pbuf* p, const ip_addr_t* addr, u16_t port) {
+    static WifiCommand cmd;     // keeps the tcpip thread's stack small
+
+    if (!p) {
+        return;
+    }
+    if (!IP_IS_V4(addr) || !queue) {
+        commandsDropped++;
+        pbuf_free(p);
+        return;
+    }
+    cmd.receivedUs = (uint32_t)esp_timer_get_time();
+    cmd.ip = ip4_addr_get_u32(ip_2_ip4(addr));
+    cmd.port = port;
+    cmd.len = pbuf_copy_partial(p, cmd.data, p->tot_len < sizeof(cmd.data) ? p->tot_len : sizeof(cmd.data), 0);
+    pbuf_free(p);
+
+    if (xQueueSend(queue, &cmd, 0) != pdTRUE) {
+        commandsDropped++;
+        return;
+    }
+    commands++;
+    if (readyEvents) {
+        xEventGroupSetBits(readyEvents, readyBit);
+    }
+}
+
+// tcpip thread: sends everything queued. A callback that finds nothing
+// was posted for datagrams an earlier one already sent.
+static void flushOutbox(void* ctx) {
+    WifiDatagram d;
+    for (int i = 0; i < WIFI_UDP_SENDER_COUNT; i++) {
+        while (outbox[i].pop(d)) {
+            ip_addr_t dst;
+            ip_addr_set_ip4_u32(&dst, d.ip);
+            if (udp_sendto(pcb, d.p, &dst, d.port) == ERR_OK) {
+                sent++;
+            } else {
+                sendErrors++;
+            }
+            pbuf_free(d.p);
+        }
+    }
+}
+
+// tcpip thread, through tcpip_api_call()
+static err_t openSocket(struct tcpip_api_call_data* call) {
+    struct udp_pcb* socket = udp_new();
+    if (!socket) {
+        return ERR_MEM;
+    }
+    err_t err = udp_bind(socket, IP_ANY_TYPE, WIFI_UDP_PORT);
+    if (err != ERR_OK) {
+        udp_remove(socket);
+        return err;
+    }
+    udp_recv(socket, onReceive, nullptr);
+    pcb = socket;
+    return ERR_OK;
+}
+
+static void onWifiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+    if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+        linkUp = true;
+        logInfo("[WiFi] Connected, %s, commands on UDP port %d\n", WiFi.localIP().toString().c_str(), WIFI_UDP_PORT);
+    } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+        if (linkUp) {
+            logInfo("[WiFi] Disconnected (reason %u)\n", info.wifi_sta_disconnected.reason);
+        }
+        linkUp = false;
+    }
+}
+
+static void applyRadio() {
+    static const esp_coex_prefer_t prefs[] = { ESP_COEX_PREFER_BALANCE, ESP_COEX_PREFER_WIFI, ESP_COEX_PREFER_BT };
+    esp_coex_preference_set(prefs[coex]);
+    // With BLE up the driver needs modem sleep; WIFI_PS_NONE is not an option
+    esp_wifi_set_ps(maxPowerSave ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+}
+
+bool wifiUdpBegin(WifiCommandHandler fn, EventGroupHandle_t events, EventBits_t bit) {
+    if (queue) {
+        return true;
+    }
+    handler = fn;
+    readyEvents = events;
+    readyBit = bit;
+    queue = xQueueCreateStatic(WIFI_CMD_QUEUE_DEPTH, sizeof(WifiCommand), queueStorage, &queueState);
+    WiFi.onEvent(onWifiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    WiFi.onEvent(onWifiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+    return queue != nullptr;
+}
+
+bool wifiConnect(const char* ssid, const char* password) {
+    // Starting the station also brings up lwIP's tcpip thread
+    if (!WiFi.mode(WIFI_STA)) {
+        return false;
+    }
+    started = true;
+    applyRadio();
+    if (!pcb) {
+        struct tcpip_api_call_data call;
+        if (tcpip_api_call(openSocket, &call) != ERR_OK) {
+            logError("[WiFi] ✗ UDP port %d could not be opened\n", WIFI_UDP_PORT);
+            return false;
+        }
+    }
+    WiFi.setAutoReconnect(true);
+    wl_status_t st = ssid ? WiFi.begin(ssid, password) : WiFi.begin();
+    return st != WL_CONNECT_FAILED;
+}
+
+void wifiDisconnect() {
+    WiFi.disconnect(true);
+    started = false;
+    linkUp = false;
+}
+
+bool wifiConnected() {
+    return linkUp;
+}
+
+bool wifiSetCoex(WifiCoex pref) {
+    if (pref > WIFI_COEX_BLE) {
+        return false;
+    }
+    coex = pref;
+    if (started) {
+        applyRadio();
+    }
+    return true;
+}
+
+bool wifiSetMaxPowerSave(bool on) {
+    maxPowerSave = on;
+    if (started) {
+        applyRadio();
+    }
+    return true;
+}
+
+const char* wifiCoexName(uint8_t pref) {
+    return pref <= WIFI_COEX_BLE ? coexNames[pref] : "?";
+}
+
+bool wifiUdpSend(WifiUdpSender sender, struct pbuf* p, uint32_t ip, uint16_t port) {
+    WifiDatagram d = { p, ip, port };
+    if (!pcb || !outbox[sender].push(d)) {
+        queueFull++;
+        pbuf_free(p);
+        return false;
+    }
+    // If the tcpip thread's mailbox is full the datagram stays queued and
+    // goes out with the next one
+    tcpip_try_callback(flushOutbox, nullptr);
+    return true;
+}
+
+static void sendReply(const CmdReply& reply, uint32_t ip, uint16_t port) {
+    size_t len = reply.length();
+    struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, len + 1, PBUF_RAM);
+    if (!p) {
+        queueFull++;
+        return;
+    }
+    memcpy(p->payload, reply.c_str(), len);
+    ((char*)p->payload)[len] = '\n';
+    wifiUdpSend(WIFI_UDP_REPLY, p, ip, port);
+}
+
+void wifiCommandService() {
+    // Static so the caller's stack only has to hold the handlers themselves
+    static WifiCommand cmd;
+    static char replyBuf[CMD_REPLY_MAX];
+
+    if (!queue) {
+        return;
+    }
+    while (xQueueReceive(queue, &cmd, 0) == pdTRUE) {
+        CmdSpan input = cmdTrim(CmdSpan{ cmd.data, cmd.len });
+        if (input.len == 0) {
+            continue;
+        }
+        logInfo("[WiFi] Received: %.*s\n", (int)input.len, input.ptr);
+
+        CmdReply reply(replyBuf, sizeof(replyBuf));
+        running = true;
+        currentIp = cmd.ip;
+        currentPort = cmd.port;
+        handler(input, reply);
+        running = false;
+
+        if (!reply.empty()) {
+            sendReply(reply, cmd.ip, cmd.port);
+        }
+    }
+}
+
+bool wifiCommandSource(uint32_t& ip, uint16_t& port) {
+    if (!running) {
+        return false;
+    }
+    ip = currentIp;
+    port = currentPort;
+    return true;
+}
+
+void wifiGetStatus(WifiStatus& out) {
+    memset(&out, 0, sizeof(out));
+    out.started = started;
+    out.connected = linkUp;
+    if (linkUp) {
+        String ssid = WiFi.SSID();
+        strncpy(out.ssid, ssid.c_str(), sizeof(out.ssid) - 1);
+        out.ip = WiFi.localIP();
+        out.rssi = WiFi.RSSI();
+        out.channel = WiFi.channel();
+    }
+    out.coex = coex;
+    out.maxPowerSave = maxPowerSave;
+    out.commands = commands;
+    out.commandsDropped = commandsDropped;
+    out.sent = sent;
+    out.sendErrors = sendErrors;
+    out.queueFull = queueFull;
+}
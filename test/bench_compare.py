@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""
+Pipeline Benchmark Comparison
+
+Reads the output of the test_bench suite, picks out its 'BENCH {...}' lines
+and either stores them as a baseline or checks them against one. A stage
+fails when it got slower by more than the tolerance, puts more bytes per
+item on the wire, or allocates where it did not before. Baselines are kept
+per target, so one file can hold the native and the board figures.
+
+Examples:
+    pio test -e native -f test_bench -v | python test/bench_compare.py --save bench_baseline.json
+    pio test -e native -f test_bench -v | python test/bench_compare.py --baseline bench_baseline.json
+    python test/bench_compare.py run.txt --baseline bench_baseline.json --tolerance 0.25
+
+Exit status: 0 if nothing regressed, 1 otherwise, 2 if the input has no results.
+
+Requirements: none beyond the standard library.
+"""
+
+import argparse
+import json
+import re
+import sys
+
+BENCH_LINE = re.compile(r'BENCH (\{.*\})')
+BYTES_SLACK = 0.005     # wire sizes are deterministic; allow only rounding
+
+
+def read_results(stream):
+    results = {}
+    for line in stream:
+        match = BENCH_LINE.search(line)
+        if match:
+            r = json.loads(match.group(1))
+            results[f"{r['target']}/{r['bench']}"] = r
+    return results
+
+
+def compare(results, baseline, tolerance):
+    regressions = 0
+    print(f"{'stage':<32} {'ns/item':>10} {'base':>10} {'change':>8} {'B/item':>8} {'allocs':>6}")
+    for key, r in sorted(results.items()):
+        base = baseline.get(key)
+        problems = []
+        change = ''
+        if base:
+            ratio = r['ns_per_item'] / base['ns_per_item'] - 1 if base['ns_per_item'] else 0
+            change = f"{ratio * 100:+.0f}%"
+            if ratio > tolerance:
+                problems.append(f"slower by {ratio * 100:.0f}%")
+            if r['bytes_per_item'] is not None and base['bytes_per_item'] is not None and \
+                    r['bytes_per_item'] > base['bytes_per_item'] * (1 + BYTES_SLACK):
+                problems.append(f"{r['bytes_per_item']} bytes/item, was {base['bytes_per_item']}")
+            if r['allocs'] > base['allocs']:
+                problems.append(f"{r['allocs']} allocations, was {base['allocs']}")
+        bytes_per_item = '-' if r['bytes_per_item'] is None else f"{r['bytes_per_item']:.2f}"
+        base_ns = f"{base['ns_per_item']:.1f}" if base else 'new'
+        print(f"{key:<32} {r['ns_per_item']:>10.1f} {base_ns:>10} {change:>8} {bytes_per_item:>8} "
+              f"{r['allocs']:>6}")
+        for p in problems:
+            print(f"  REGRESSION: {p}")
+        regressions += len(problems)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare pipeline benchmark results with a baseline")
+    parser.add_argument('input', nargs='?', help="test output file (default: stdin)")
+    parser.add_argument('--baseline', help="baseline JSON to compare against")
+    parser.add_argument('--save', metavar='FILE', help="merge these results into a baseline JSON")
+    parser.add_argument('--tolerance', type=float, default=0.15, help="allowed slowdown, 0.15 = 15%%")
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input) as f:
+            results = read_results(f)
+    else:
+        results = read_results(sys.stdin)
+    if not results:
+        print("No BENCH lines in the input (run the test_bench suite with -v)")
+        return 2
+
+    status = 0
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        regressions = compare(results, baseline, args.tolerance)
+        print(f"{len(results)} stages, {regressions} regressions")
+        status = 1 if regressions else 0
+    if args.save:
+        try:
+            with open(args.save) as f:
+                saved = json.load(f)
+        except FileNotFoundError:
+            saved = {}
+        saved.update(results)
+        with open(args.save, 'w') as f:
+            json.dump(saved, f, indent=2, sort_keys=True)
+        print(f"{len(results)} results saved to {args.save}")
+    if not args.baseline and not args.save:
+        json.dump(list(results.values()), sys.stdout, indent=2)
+        print()
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main())
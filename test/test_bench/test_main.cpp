@@ -0,0 +1,371 @@
+/*
+ * Throughput benchmarks for the pipeline stages (lib/imu_pipeline)
+ *
+ * Each stage runs over the same synthetic AGMT recording (1 g on Z, a slow
+ * swing and sensor-like noise) and prints one machine-readable line:
+ *
+ *   BENCH {"bench":"packet_delta","target":"native","item":"sample",
+ *          "items":200000,"ns_per_item":16.3,"bytes_per_item":12.97,
+ *          "allocs":0,"heap_delta":0}
+ *
+ * bytes_per_item is what a stage puts on the wire (null where it emits
+ * samples), allocs counts operator new calls during the run and heap_delta
+ * the bytes missing from the heap afterwards (target only, 0 on native).
+ * test/bench_compare.py checks these lines against a saved baseline.
+ *
+ * The tests themselves fail on any allocation, on a wire size above its
+ * bound and, on the board, on a stage slower than its BENCH_BUDGET_NS: a
+ * budget is a few times the stage's expected cost, far enough below the
+ * 889 us sample period that every stream can run at once.
+ */
+
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "cmd_dispatch.h"
+#include "imu_dsp.h"
+#include "imu_trigger.h"
+#include "stream_frame.h"
+#include "stream_packet.h"
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#define BENCH_TARGET        "esp32s3"
+#define BENCH_SAMPLES       20000
+static int64_t nowNs() { return esp_timer_get_time() * 1000; }
+static size_t heapFree() { return heap_caps_get_free_size(MALLOC_CAP_8BIT); }
+#else
+#include <chrono>
+#define BENCH_TARGET        "native"
+#define BENCH_SAMPLES       200000
+static int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static size_t heapFree() { return 0; }
+#endif
+
+#define BENCH_RECORDING     1024    // distinct samples, replayed
+#define BENCH_PERIOD_US     889     // 1125 Hz
+#define BENCH_BLE_PAYLOAD   244     // BLE_STREAM_MAX_PAYLOAD
+#define BENCH_USB_SAMPLES   32      // USB_STREAM_PACKET_SAMPLES
+
+// Per-item budgets on the board at 240 MHz, ns
+#define BENCH_BUDGET_NS_PACKET      3000
+#define BENCH_BUDGET_NS_FRAME       6000
+#define BENCH_BUDGET_NS_DSP         8000
+#define BENCH_BUDGET_NS_FIR         40000
+#define BENCH_BUDGET_NS_TRIGGER     5000
+#define BENCH_BUDGET_NS_COMMAND     20000
+
+static volatile uint32_t allocs = 0;
+
+void* operator new(size_t n) {
+    allocs++;
+    void* p = malloc(n ? n : 1);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void* operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+#endif
+
+static ImuSample recording[BENCH_RECORDING];
+static ImuTrigger trigger;      // 12 KB of history: not on the stack
+
+static void makeRecording() {
+    uint32_t noise = 12345;
+    for (int i = 0; i < BENCH_RECORDING; i++) {
+        ImuSample& s = recording[i];
+        memset(&s, 0, sizeof(s));
+        s.timestampUs = (uint32_t)i * BENCH_PERIOD_US;
+        s.kind = IMU_SAMPLE_AGMT;
+        float swing = sinf(2.0f * (float)M_PI * i / BENCH_RECORDING);
+        for (int c = 0; c < 10; c++) {
+            noise = noise * 1664525u + 1013904223u;
+            int16_t n = (int16_t)((int32_t)(noise >> 24) % 17 - 8);   // +-8 LSB
+            int16_t v = c < 3 ? (int16_t)(2000 * swing) : c < 6 ? (int16_t)(300 * swing) : (int16_t)(150 + c);
+            (&s.acc[0])[c] = (int16_t)(v + n);
+        }
+        s.acc[2] = (int16_t)(16384 + s.acc[2] / 4);
+        s.tmp = 2100;
+    }
+}
+
+// Sample i of the replayed recording, with a timestamp that keeps increasing
+static inline const ImuSample& sampleAt(uint32_t i, ImuSample& scratch) {
+    scratch = recording[i % BENCH_RECORDING];
+    scratch.timestampUs = i * BENCH_PERIOD_US;
+    return scratch;
+}
+
+struct BenchRun {
+    const char* item;
+    uint32_t items;
+    int64_t ns;
+    int64_t bytes;          // < 0: not a wire format
+    uint32_t allocs;
+    long heapDelta;
+};
+
+static void startRun(BenchRun& run, const char* item, uint32_t items, int64_t& startNs, size_t& heapBefore) {
+    run.item = item;
+    run.items = items;
+    run.bytes = -1;
+    heapBefore = heapFree();
+    allocs = 0;
+    startNs = nowNs();
+}
+
+static void endRun(BenchRun& run, int64_t startNs, size_t heapBefore) {
+    run.ns = nowNs() - startNs;
+    run.allocs = allocs;
+    run.heapDelta = (long)heapBefore - (long)heapFree();
+}
+
+static void report(const char* name, const BenchRun& run, int budgetNs) {
+    char bytes[24];
+    double nsPerItem = (double)run.ns / run.items;
+    if (run.bytes < 0) {
+        snprintf(bytes, sizeof(bytes), "null");
+    } else {
+        snprintf(bytes, sizeof(bytes), "%.2f", (double)run.bytes / run.items);
+    }
+    char line[256];
+    snprintf(line, sizeof(line),
+             "BENCH {\"bench\":\"%s\",\"target\":\"%s\",\"item\":\"%s\",\"items\":%lu,\"ns_per_item\":%.1f,"
+             "\"bytes_per_item\":%s,\"allocs\":%lu,\"heap_delta\":%ld}",
+             name, BENCH_TARGET, run.item, (unsigned long)run.items, nsPerItem, bytes,
+             (unsigned long)run.allocs, run.heapDelta);
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, run.allocs, "stage allocated on the heap");
+    TEST_ASSERT_EQUAL_MESSAGE(0, run.heapDelta, "stage left the heap smaller");
+#ifdef ARDUINO
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(budgetNs, (int)nsPerItem, "stage over its time budget");
+#else
+    (void)budgetNs;     // host timings vary too much to gate on
+#endif
+}
+
+static BenchRun benchPacker(bool delta, size_t maxBytes) {
+    static uint8_t buf[STREAM_FRAME_MAX_PACKET];
+    StreamPacker packer;
+    packer.begin(buf, maxBytes);
+    packer.setDelta(delta);
+    ImuSample s;
+    BenchRun run;
+    int64_t t0;
+    size_t heap;
+    int64_t bytes = 0;
+    startRun(run, "sample", BENCH_SAMPLES, t0, heap);
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        if (!packer.add(sampleAt(i, s))) {
+            bytes += packer.length();
+            packer.next();
+            packer.add(s);
+        }
+    }
+    bytes += packer.length();
+    endRun(run, t0, heap);
+    run.bytes = bytes;
+    return run;
+}
+
+void test_packet_raw() {
+    BenchRun run = benchPacker(false, BENCH_BLE_PAYLOAD);
+    report("packet_raw", run, BENCH_BUDGET_NS_PACKET);
+    // 22-byte records plus an 8-byte header per 10 samples
+    TEST_ASSERT_LESS_OR_EQUAL(run.items * 23, run.bytes);
+}
+
+void test_packet_delta() {
+    BenchRun run = benchPacker(true, BENCH_BLE_PAYLOAD);
+    report("packet_delta", run, BENCH_BUDGET_NS_PACKET);
+    // Lossless delta coding must stay well under the raw record size
+    TEST_ASSERT_LESS_OR_EQUAL(run.items * 18, run.bytes);
+}
+
+// USB path: 32-sample packets, each wrapped in a frame
+void test_usb_frame() {
+    static uint8_t packet[STREAM_FRAME_MAX_PACKET];
+    static uint8_t frame[STREAM_FRAME_MAX_PACKET + STREAM_FRAME_OVERHEAD];
+    StreamPacker packer;
+    packer.begin(packet, sizeof(packet));
+    ImuSample s;
+    BenchRun run;
+    int64_t t0;
+    size_t heap;
+    int64_t bytes = 0;
+    startRun(run, "sample", BENCH_SAMPLES, t0, heap);
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        packer.add(sampleAt(i, s));
+        if (packer.count() >= BENCH_USB_SAMPLES) {
+            bytes += streamFrameEncode(packer.data(), packer.length(), frame, sizeof(frame));
+            packer.next();
+        }
+    }
+    endRun(run, t0, heap);
+    run.bytes = bytes;
+    report("usb_frame", run, BENCH_BUDGET_NS_FRAME);
+    TEST_ASSERT_LESS_OR_EQUAL(run.items * 23, run.bytes);
+}
+
+static BenchRun benchDsp(const DspConfig& cfg) {
+    static ImuDsp dsp;
+    TEST_ASSERT_TRUE(dsp.configure(cfg, 1000000 / BENCH_PERIOD_US));
+    dsp.reset();
+    ImuSample s, out;
+    uint32_t emitted = 0;
+    BenchRun run;
+    int64_t t0;
+    size_t heap;
+    startRun(run, "sample", BENCH_SAMPLES, t0, heap);
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        emitted += dsp.process(sampleAt(i, s), out);
+    }
+    endRun(run, t0, heap);
+    TEST_ASSERT_EQUAL_UINT32(BENCH_SAMPLES / cfg.decimation, emitted);
+    return run;
+}
+
+void test_dsp_iir() {
+    DspConfig cfg = { DSP_FILTER_IIR, 100, 0, 1, DSP_WINDOW_LAST };
+    report("dsp_iir", benchDsp(cfg), BENCH_BUDGET_NS_DSP);
+}
+
+void test_dsp_fir() {
+    DspConfig cfg = { DSP_FILTER_FIR, 50, DSP_FIR_DEFAULT_TAPS, 4, DSP_WINDOW_LAST };
+    report("dsp_fir31_dec4", benchDsp(cfg), BENCH_BUDGET_NS_FIR);
+}
+
+void test_dsp_mean() {
+    DspConfig cfg = { DSP_FILTER_NONE, 0, 0, 8, DSP_WINDOW_MEAN };
+    report("dsp_mean_dec8", benchDsp(cfg), BENCH_BUDGET_NS_DSP);
+}
+
+void test_trigger_level_rms() {
+    TriggerConfig cfg = { true, 250, 0, 50, 100, 0, 200, 500 };
+    TEST_ASSERT_TRUE(trigger.configure(cfg, 1000000 / BENCH_PERIOD_US));
+    trigger.setFullScale(0, 0);
+    ImuSample s, out;
+    BenchRun run;
+    int64_t t0;
+    size_t heap;
+    startRun(run, "sample", BENCH_SAMPLES, t0, heap);
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        trigger.feed(sampleAt(i, s));
+        while (trigger.pop(out)) {
+        }
+    }
+    endRun(run, t0, heap);
+    report("trigger_level_rms", run, BENCH_BUDGET_NS_TRIGGER);
+}
+
+static void benchHandler(CmdSpan args, bool, CmdReply& reply) {
+    long n = 0;
+    cmdParseInt(cmdNextWord(args), n);
+    reply.printf("ok %ld", n);
+}
+
+// The firmware's command names, so lookups see a realistic table
+static constexpr CmdEntry benchCommands[] = {
+    CMD_ENTRY("h", benchHandler), CMD_ENTRY("s", benchHandler), CMD_ENTRY("t", benchHandler),
+    CMD_ENTRY("r", benchHandler), CMD_ENTRY("c", benchHandler), CMD_ENTRY("m", benchHandler),
+    CMD_ENTRY("i", benchHandler), CMD_ENTRY("scan", benchHandler), CMD_ENTRY("i2c", benchHandler),
+    CMD_ENTRY("sample", benchHandler), CMD_ENTRY("dmp", benchHandler), CMD_ENTRY("bstream", benchHandler),
+    CMD_ENTRY("ustream", benchHandler), CMD_ENTRY("wifi", benchHandler), CMD_ENTRY("wstream", benchHandler),
+    CMD_ENTRY("power", benchHandler), CMD_ENTRY("cfg", benchHandler), CMD_ENTRY("perf", benchHandler),
+    CMD_ENTRY("bench", benchHandler), CMD_ENTRY("ping", benchHandler), CMD_ENTRY("sync", benchHandler),
+    CMD_ENTRY("dsp", benchHandler), CMD_ENTRY("trig", benchHandler), CMD_ENTRY("spec", benchHandler),
+    CMD_ENTRY("cap", benchHandler), CMD_ENTRY("boot", benchHandler), CMD_ENTRY("log", benchHandler),
+    CMD_ENTRY("flog", benchHandler),
+};
+static constexpr size_t benchCommandCount = sizeof(benchCommands) / sizeof(benchCommands[0]);
+static_assert(cmdHashesUnique(benchCommands, benchCommandCount), "command hash collision");
+
+// Bytes to a dispatched command and its reply, as the USB console does it
+void test_command_dispatch() {
+    static const char* const lines[] = { "ping 42\n", "dsp ble 4 mean\n", "sample rate 500\n", "flog list\n",
+                                         "unknown command\n" };
+    const uint32_t count = BENCH_SAMPLES / 10;
+    CmdLineBuffer input;
+    char buf[CMD_REPLY_MAX];
+    uint32_t found = 0;
+    BenchRun run;
+    int64_t t0;
+    size_t heap;
+    startRun(run, "command", count, t0, heap);
+    for (uint32_t i = 0; i < count; i++) {
+        CmdSpan line, args;
+        for (const char* c = lines[i % 5]; *c; c++) {
+            if (input.feed(*c, line)) {
+                const CmdEntry* e = cmdFind(benchCommands, benchCommandCount, line, args);
+                if (e) {
+                    CmdReply reply(buf, sizeof(buf));
+                    e->handler(args, false, reply);
+                    found++;
+                }
+            }
+        }
+    }
+    endRun(run, t0, heap);
+    TEST_ASSERT_EQUAL_UINT32(count - count / 5, found);
+    report("command_dispatch", run, BENCH_BUDGET_NS_COMMAND);
+}
+
+static int runBenchmarks() {
+    makeRecording();
+    UNITY_BEGIN();
+    RUN_TEST(test_packet_raw);
+    RUN_TEST(test_packet_delta);
+    RUN_TEST(test_usb_frame);
+    RUN_TEST(test_dsp_iir);
+    RUN_TEST(test_dsp_fir);
+    RUN_TEST(test_dsp_mean);
+    RUN_TEST(test_trigger_level_rms);
+    RUN_TEST(test_command_dispatch);
+    return UNITY_END();
+}
+
+void setUp() {}
+void tearDown() {}
+
+#ifdef ARDUINO
+void setup() {
+    delay(2000);    // let the test runner open the port
+    runBenchmarks();
+}
+
+void loop() {}
+#else
+int main() {
+    return runBenchmarks();
+}
+#endif
@@ -0,0 +1,330 @@
+/*
+ * Regression tests for the hardware-independent pipeline modules
+ * (lib/imu_pipeline): command parsing, stream packets and their delta
+ * coding, USB framing, the DSP stage and the trigger. Run on the host with
+ * `pio test -e native -f test_pipeline`, or on the board with the firmware
+ * environments.
+ */
+
+#include <unity.h>
+#include <string.h>
+#include "cmd_dispatch.h"
+#include "imu_dsp.h"
+#include "imu_trigger.h"
+#include "stream_frame.h"
+#include "stream_packet.h"
+
+static ImuSample agmt(uint32_t us, int16_t ax, int16_t ay, int16_t az) {
+    ImuSample s;
+    memset(&s, 0, sizeof(s));
+    s.timestampUs = us;
+    s.kind = IMU_SAMPLE_AGMT;
+    s.acc[0] = ax;
+    s.acc[1] = ay;
+    s.acc[2] = az;
+    for (int i = 0; i < 3; i++) {
+        s.gyr[i] = (int16_t)(ax - 3 * i);
+        s.mag[i] = (int16_t)(-ay + 100 * i);
+    }
+    s.tmp = 1234;
+    return s;
+}
+
+// Reference decoder for one AGMT packet, as the host does it (gui/stream_pipeline.py)
+static size_t getVarint(const uint8_t* p, uint64_t& v) {
+    size_t n = 0;
+    int shift = 0;
+    v = 0;
+    do {
+        v |= (uint64_t)(p[n] & 0x7F) << shift;
+        shift += 7;
+    } while (p[n++] & 0x80);
+    return n;
+}
+
+static size_t decodePacket(const uint8_t* buf, size_t len, ImuSample* out, size_t maxOut) {
+    StreamPacketHeader hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    TEST_ASSERT_EQUAL_UINT8(STREAM_PKT_AGMT, hdr.type & ~STREAM_PKT_DELTA);
+    const uint8_t* p = buf + sizeof(hdr);
+    int32_t prev[10] = { 0 };
+    uint32_t us = hdr.t0Us;
+    for (size_t r = 0; r < hdr.count && r < maxOut; r++) {
+        int32_t v[10];
+        if (hdr.type & STREAM_PKT_DELTA) {
+            uint64_t dt, z;
+            p += getVarint(p, dt);
+            us += (uint32_t)dt;
+            for (int i = 0; i < 10; i++) {
+                p += getVarint(p, z);
+                v[i] = prev[i] + (int32_t)((z >> 1) ^ (~(z & 1) + 1));
+                prev[i] = v[i];
+            }
+        } else {
+            StreamSampleRecord rec;
+            memcpy(&rec, p, sizeof(rec));
+            p += sizeof(rec);
+            us += rec.dtUs;
+            for (int i = 0; i < 3; i++) {
+                v[i] = rec.acc[i];
+                v[3 + i] = rec.gyr[i];
+                v[6 + i] = rec.mag[i];
+            }
+            v[9] = rec.tmp;
+        }
+        ImuSample& s = out[r];
+        memset(&s, 0, sizeof(s));
+        s.timestampUs = us;
+        for (int i = 0; i < 3; i++) {
+            s.acc[i] = (int16_t)v[i];
+            s.gyr[i] = (int16_t)v[3 + i];
+            s.mag[i] = (int16_t)v[6 + i];
+        }
+        s.tmp = (int16_t)v[9];
+    }
+    TEST_ASSERT_EQUAL_size_t(len, (size_t)(p - buf));
+    return hdr.count;
+}
+
+static void assertSameAgmt(const ImuSample& a, const ImuSample& b) {
+    TEST_ASSERT_EQUAL_UINT32(a.timestampUs, b.timestampUs);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(a.acc, b.acc, 3);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(a.gyr, b.gyr, 3);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(a.mag, b.mag, 3);
+    TEST_ASSERT_EQUAL_INT16(a.tmp, b.tmp);
+}
+
+// --- Command parsing ---------------------------------------------------------
+
+static int handled = 0;
+static void cmdOne(CmdSpan, bool, CmdReply&) { handled = 1; }
+static void cmdTwo(CmdSpan, bool, CmdReply&) { handled = 2; }
+
+static constexpr CmdEntry table[] = {
+    CMD_ENTRY("sample", cmdOne),
+    CMD_ENTRY("s", cmdTwo),
+};
+static_assert(cmdHashesUnique(table, 2), "test table hashes");
+
+void test_cmd_words() {
+    CmdSpan rest = cmdSpan("  dsp  ble 4 mean  ");
+    TEST_ASSERT_TRUE(cmdEquals(cmdNextWord(rest), "dsp"));
+    TEST_ASSERT_TRUE(cmdEquals(cmdNextWord(rest), "ble"));
+    long n = 0;
+    TEST_ASSERT_TRUE(cmdParseInt(cmdNextWord(rest), n));
+    TEST_ASSERT_EQUAL(4, n);
+    TEST_ASSERT_TRUE(cmdEquals(rest, "mean"));
+    TEST_ASSERT_FALSE(cmdParseInt(cmdSpan("12x"), n));
+}
+
+void test_cmd_find() {
+    char buf[CMD_REPLY_MAX];
+    CmdReply reply(buf, sizeof(buf));
+    CmdSpan args;
+    const CmdEntry* e = cmdFind(table, 2, cmdSpan("sample rate 500"), args);
+    TEST_ASSERT_NOT_NULL(e);
+    e->handler(args, false, reply);
+    TEST_ASSERT_EQUAL(1, handled);
+    TEST_ASSERT_TRUE(cmdEquals(args, "rate 500"));
+    TEST_ASSERT_NOT_NULL(cmdFind(table, 2, cmdSpan("s"), args));
+    TEST_ASSERT_NULL(cmdFind(table, 2, cmdSpan("samples"), args));
+}
+
+void test_cmd_line_buffer_drops_overlong() {
+    CmdLineBuffer lines;
+    CmdSpan line;
+    for (int i = 0; i < CMD_LINE_MAX + 10; i++) {
+        TEST_ASSERT_FALSE(lines.feed('x', line));
+    }
+    TEST_ASSERT_FALSE(lines.feed('\n', line));
+    TEST_ASSERT_EQUAL_UINT32(1, lines.droppedLines());
+    const char* next = "ping\n";
+    bool done = false;
+    for (const char* c = next; *c; c++) {
+        done = lines.feed(*c, line);
+    }
+    TEST_ASSERT_TRUE(done);
+    TEST_ASSERT_TRUE(cmdEquals(line, "ping"));
+}
+
+void test_cmd_reply_truncates() {
+    char buf[8];
+    CmdReply reply(buf, sizeof(buf));
+    reply.printf("%s", "0123456789");
+    TEST_ASSERT_EQUAL_size_t(sizeof(buf) - 1, reply.length());
+    TEST_ASSERT_EQUAL_STRING("0123456", reply.c_str());
+}
+
+// --- Stream packets and framing ----------------------------------------------
+
+void test_packet_raw_layout() {
+    uint8_t buf[STREAM_FRAME_MAX_PACKET];
+    StreamPacker packer;
+    packer.begin(buf, sizeof(buf));
+    TEST_ASSERT_TRUE(packer.add(agmt(1000, 1, 2, 16384)));
+    TEST_ASSERT_TRUE(packer.add(agmt(1889, 3, 4, 16380)));
+    TEST_ASSERT_EQUAL_size_t(sizeof(StreamPacketHeader) + 2 * sizeof(StreamSampleRecord), packer.length());
+
+    StreamPacketHeader hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    TEST_ASSERT_EQUAL_UINT8(STREAM_PKT_AGMT, hdr.type);
+    TEST_ASSERT_EQUAL_UINT8(2, hdr.count);
+    TEST_ASSERT_EQUAL_UINT32(1000, hdr.t0Us);
+    StreamSampleRecord rec;
+    memcpy(&rec, buf + sizeof(hdr) + sizeof(rec), sizeof(rec));
+    TEST_ASSERT_EQUAL_UINT16(889, rec.dtUs);
+    TEST_ASSERT_EQUAL_INT16(16380, rec.acc[2]);
+}
+
+void test_packet_delta_round_trip() {
+    uint8_t buf[STREAM_FRAME_MAX_PACKET];
+    StreamPacker packer;
+    packer.begin(buf, sizeof(buf));
+    packer.setDelta(true);
+    ImuSample in[40], out[40];
+    for (int i = 0; i < 40; i++) {
+        // Full-range steps exercise the longest varints
+        int16_t big = i % 2 ? INT16_MAX : INT16_MIN;
+        in[i] = agmt(5000 + 889 * i, (int16_t)(i * 7), big, (int16_t)(16384 - i));
+        TEST_ASSERT_TRUE(packer.add(in[i]));
+    }
+    TEST_ASSERT_EQUAL_UINT8(STREAM_PKT_AGMT | STREAM_PKT_DELTA, buf[0]);
+    TEST_ASSERT_EQUAL_size_t(40, decodePacket(buf, packer.length(), out, 40));
+    for (int i = 0; i < 40; i++) {
+        assertSameAgmt(in[i], out[i]);
+    }
+}
+
+void test_packet_closes_on_gap_and_size() {
+    uint8_t buf[64];
+    StreamPacker packer;
+    packer.begin(buf, sizeof(buf));
+    TEST_ASSERT_TRUE(packer.add(agmt(0, 0, 0, 0)));
+    TEST_ASSERT_FALSE(packer.add(agmt(0x10000, 0, 0, 0)));    // dt does not fit 16 bits
+    packer.next();
+    TEST_ASSERT_TRUE(packer.add(agmt(0x10000, 0, 0, 0)));
+    TEST_ASSERT_TRUE(packer.add(agmt(0x10001, 0, 0, 0)));
+    TEST_ASSERT_FALSE(packer.add(agmt(0x10002, 0, 0, 0)));    // 8 + 3 x 22 > 64
+    TEST_ASSERT_EQUAL_UINT16(1, buf[2] | buf[3] << 8);
+}
+
+void test_frame_crc_and_layout() {
+    const uint8_t check[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, crc16Ccitt(check, sizeof(check)));
+
+    uint8_t frame[sizeof(check) + STREAM_FRAME_OVERHEAD];
+    TEST_ASSERT_EQUAL_size_t(sizeof(frame), streamFrameEncode(check, sizeof(check), frame, sizeof(frame)));
+    TEST_ASSERT_EQUAL_HEX8(STREAM_FRAME_SYNC0, frame[0]);
+    TEST_ASSERT_EQUAL_HEX8(STREAM_FRAME_SYNC1, frame[1]);
+    TEST_ASSERT_EQUAL_UINT16(sizeof(check), frame[2] | frame[3] << 8);
+    TEST_ASSERT_EQUAL_MEMORY(check, frame + 4, sizeof(check));
+    uint16_t crc = crc16Ccitt(frame + 2, 2 + sizeof(check));
+    TEST_ASSERT_EQUAL_UINT16(crc, frame[4 + sizeof(check)] | frame[5 + sizeof(check)] << 8);
+    TEST_ASSERT_EQUAL_size_t(0, streamFrameEncode(check, sizeof(check), frame, sizeof(frame) - 1));
+}
+
+// --- DSP ---------------------------------------------------------------------
+
+void test_dsp_rejects_cutoff_above_nyquist() {
+    ImuDsp dsp;
+    DspConfig cfg = { DSP_FILTER_IIR, 600, 0, 1, DSP_WINDOW_LAST };
+    TEST_ASSERT_FALSE(dsp.configure(cfg, 1125));
+    cfg.cutoffHz = 100;
+    TEST_ASSERT_TRUE(dsp.configure(cfg, 1125));
+    TEST_ASSERT_FALSE(dsp.configure(cfg, 150));
+    TEST_ASSERT_EQUAL_UINT16(100, dsp.config().cutoffHz);
+}
+
+void test_dsp_mean_decimation() {
+    ImuDsp dsp;
+    DspConfig cfg = { DSP_FILTER_NONE, 0, 0, 4, DSP_WINDOW_MEAN };
+    TEST_ASSERT_TRUE(dsp.configure(cfg, 1125));
+    ImuSample out;
+    int emitted = 0;
+    for (int i = 0; i < 8; i++) {
+        if (dsp.process(agmt(100 * i, (int16_t)(10 * i), 0, 0), out)) {
+            emitted++;
+            TEST_ASSERT_EQUAL_UINT32(100 * i, out.timestampUs);
+            TEST_ASSERT_EQUAL_INT16(i == 3 ? 15 : 55, out.acc[0]);
+        }
+    }
+    TEST_ASSERT_EQUAL(2, emitted);
+}
+
+void test_dsp_lowpass_passes_dc() {
+    DspFilter filters[] = { DSP_FILTER_IIR, DSP_FILTER_FIR };
+    for (DspFilter f : filters) {
+        ImuDsp dsp;
+        DspConfig cfg = { f, 50, DSP_FIR_DEFAULT_TAPS, 1, DSP_WINDOW_LAST };
+        TEST_ASSERT_TRUE(dsp.configure(cfg, 1125));
+        ImuSample out;
+        for (int i = 0; i < 500; i++) {
+            TEST_ASSERT_TRUE(dsp.process(agmt(889 * i, 1000, -2000, 16384), out));
+        }
+        TEST_ASSERT_INT16_WITHIN(2, 1000, out.acc[0]);
+        TEST_ASSERT_INT16_WITHIN(2, -2000, out.acc[1]);
+        TEST_ASSERT_INT16_WITHIN(4, 16384, out.acc[2]);
+    }
+}
+
+// --- Trigger -----------------------------------------------------------------
+
+static ImuTrigger trigger;      // 12 KB of history: not on the stack
+
+void test_trigger_releases_history_on_event() {
+    TriggerConfig cfg = { true, 250, 0, 0, 100, 0, 10, 10 };
+    TEST_ASSERT_TRUE(trigger.configure(cfg, 1000));
+    trigger.setFullScale(0, 0);
+    ImuSample out;
+    uint32_t us = 0;
+    for (int i = 0; i < 100; i++, us += 1000) {
+        trigger.feed(agmt(us, 0, 0, 16384));        // resting, 1 g
+        TEST_ASSERT_FALSE(trigger.pop(out));
+    }
+    trigger.feed(agmt(us, 16384, 0, 16384));        // 1.41 g
+    int released = 0;
+    while (trigger.pop(out)) {
+        released++;
+    }
+    TEST_ASSERT_GREATER_THAN(0, released);
+    TriggerStats st;
+    trigger.getStats(st);
+    TEST_ASSERT_EQUAL_UINT32(1, st.events);
+    TEST_ASSERT_EQUAL_UINT8(TRIGGER_SRC_LEVEL, st.lastSources);
+    TEST_ASSERT_FALSE(ImuTrigger::valid(cfg, 0));
+}
+
+static int runTests() {
+    UNITY_BEGIN();
+    RUN_TEST(test_cmd_words);
+    RUN_TEST(test_cmd_find);
+    RUN_TEST(test_cmd_line_buffer_drops_overlong);
+    RUN_TEST(test_cmd_reply_truncates);
+    RUN_TEST(test_packet_raw_layout);
+    RUN_TEST(test_packet_delta_round_trip);
+    RUN_TEST(test_packet_closes_on_gap_and_size);
+    RUN_TEST(test_frame_crc_and_layout);
+    RUN_TEST(test_dsp_rejects_cutoff_above_nyquist);
+    RUN_TEST(test_dsp_mean_decimation);
+    RUN_TEST(test_dsp_lowpass_passes_dc);
+    RUN_TEST(test_trigger_releases_history_on_event);
+    return UNITY_END();
+}
+
+void setUp() {}
+void tearDown() {}
+
+#ifdef ARDUINO
+#include <Arduino.h>
+
+void setup() {
+    delay(2000);    // let the test runner open the port
+    runTests();
+}
+
+void loop() {}
+#else
+int main() {
+    return runTests();
+}
+#endif